@@ -0,0 +1,455 @@
+/*
+ * A self-contained load test of HttpProxy: everything runs in this process, on loopback.
+ *
+ *   load clients --HTTP--> HttpProxy --SOCKS5--> Socks5StandIn --TCP--> EchoServer (CONNECT tunnels)
+ *                                                                   \--> HttpServer (plain HTTP requests)
+ *
+ * Every client keeps one connection open for the whole run and does one request (plain HTTP) or one
+ * round trip of payloadSize bytes (tunnel) after the other, measuring the latency of each.
+ */
+
+#include "QvPlugin/Socksify/HttpParser.hpp"
+#include "QvPlugin/Socksify/HttpProxy.hpp"
+#include "QvPlugin/Socksify/SocketStream.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QTimer>
+#include <QtEndian>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <QFile>
+#include <unistd.h>
+#endif
+
+using namespace Qv2rayPlugin::Utils;
+
+struct BenchmarkOptions
+{
+    int clients = 200;
+    int durationSec = 10;
+    // Share of the clients using a CONNECT tunnel, the others send plain HTTP requests.
+    double tunnelRatio = 0.5;
+    int payloadSize = 16 * 1024;
+    int responseSize = 16 * 1024;
+    int workers = 0;
+    bool reusePort = false;
+    bool ioUring = false;
+    bool fair = false;
+};
+
+struct BenchmarkResults
+{
+    quint64 requests = 0;
+    quint64 bytes = 0;
+    quint64 errors = 0;
+    std::vector<qint64> latencies;
+};
+
+static qint64 ResidentSetSize()
+{
+#ifdef Q_OS_LINUX
+    QFile statm(QStringLiteral("/proc/self/statm"));
+    if (!statm.open(QIODevice::ReadOnly))
+        return -1;
+    const auto fields = statm.readAll().split(' ');
+    return fields.size() > 1 ? fields[1].toLongLong() * ::sysconf(_SC_PAGESIZE) : -1;
+#else
+    return -1;
+#endif
+}
+
+// Writes back everything it receives, the target of the CONNECT tunnels.
+class EchoServer : public QTcpServer
+{
+    Q_OBJECT
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket]() { socket->write(socket->readAll()); });
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    }
+};
+
+// Answers every request with a keep-alive response of a fixed size, the target of the plain HTTP requests.
+class HttpServer : public QTcpServer
+{
+    Q_OBJECT
+  public:
+    explicit HttpServer(int responseSize)
+    {
+        response = "HTTP/1.1 200 OK\r\nContent-Length: " + QByteArray::number(responseSize) + "\r\n\r\n";
+        response.append(QByteArray(responseSize, 'x'));
+    }
+
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        const auto parser = std::make_shared<HttpMessageParser>(HttpMessageParser::Request);
+        const auto buffer = std::make_shared<QByteArray>();
+        connect(socket, &QTcpSocket::readyRead, socket, [this, socket, parser, buffer]() {
+            buffer->append(socket->readAll());
+            qsizetype pos = 0;
+            while (true)
+            {
+                const auto result = parser->parse(QByteArrayView(*buffer).sliced(pos));
+                pos += result.consumed;
+                if (result.event == HttpMessageParser::MessageComplete)
+                    socket->write(response);
+                else if (result.event == HttpMessageParser::Error)
+                    return socket->abort();
+                else if (result.event == HttpMessageParser::NeedMoreData)
+                    break;
+            }
+            buffer->remove(0, pos);
+        });
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    }
+
+  private:
+    QByteArray response;
+};
+
+// The smallest SOCKS5 server HttpProxy can talk to: no authentication, CONNECT only.
+class Socks5StandIn : public QTcpServer
+{
+    Q_OBJECT
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        const auto buffer = std::make_shared<QByteArray>();
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket, buffer]() {
+            buffer->append(socket->readAll());
+            // Greeting: 05 01 00, then the request: 05 01 00 ATYP ADDR PORT
+            if (buffer->size() < 3 + 5)
+                return;
+            const auto request = QByteArrayView(*buffer).sliced(3);
+            qsizetype addressSize = 0;
+            switch (request[3])
+            {
+                case '\x01': addressSize = 4; break;
+                case '\x04': addressSize = 16; break;
+                case '\x03': addressSize = 1 + quint8(request[4]); break;
+                default: return socket->abort();
+            }
+            if (request.size() < 4 + addressSize + 2)
+                return;
+
+            QString host;
+            if (request[3] == '\x01')
+                host = QHostAddress(qFromBigEndian<quint32>(request.data() + 4)).toString();
+            else if (request[3] == '\x04')
+                host = QHostAddress(reinterpret_cast<const quint8 *>(request.data() + 4)).toString();
+            else
+                host = QString::fromLatin1(request.sliced(5, addressSize - 1));
+            const auto port = qFromBigEndian<quint16>(request.data() + 4 + addressSize);
+
+            // Whatever follows the request has been pipelined by the client and belongs to the target.
+            const auto payload = request.sliced(4 + addressSize + 2).toByteArray();
+            buffer->clear();
+            QObject::disconnect(socket, &QTcpSocket::readyRead, nullptr, nullptr);
+
+            const auto target = new QTcpSocket(socket);
+            connect(target, &QTcpSocket::connected, socket, [socket, target, payload]() {
+                socket->write("\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                target->write(payload);
+                const auto stream = new SocketStream(socket, target, socket);
+                stream->setZeroCopyEnabled(true);
+                connect(stream, &SocketStream::finished, socket, &QTcpSocket::deleteLater);
+            });
+            connect(target, &QAbstractSocket::errorOccurred, socket, [socket]() {
+                socket->write("\x05\x05\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                socket->disconnectFromHost();
+            });
+            target->connectToHost(host, port);
+        });
+    }
+};
+
+// One client connection, doing one request or round trip after the other until stopped.
+class LoadClient : public QObject
+{
+    Q_OBJECT
+  public:
+    LoadClient(bool tunnel, quint16 proxyPort, quint16 targetPort, const BenchmarkOptions &options, BenchmarkResults &results, QObject *parent)
+        : QObject(parent), tunnel(tunnel), proxyPort(proxyPort), targetPort(targetPort), options(options), results(results)
+    {
+        const auto target = "127.0.0.1:" + QByteArray::number(targetPort);
+        if (tunnel)
+        {
+            request = QByteArray(options.payloadSize, 'p');
+            connectRequest = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+        }
+        else
+            request = "GET http://" + target + "/ HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+    }
+
+    void start()
+    {
+        socket = new QTcpSocket(this);
+        connect(socket, &QTcpSocket::readyRead, this, &LoadClient::onReadyRead);
+        connect(socket, &QAbstractSocket::errorOccurred, this, &LoadClient::onError);
+        connect(socket, &QTcpSocket::connected, this, [this]() {
+            if (tunnel)
+                socket->write(connectRequest);
+            else
+                sendRequest();
+        });
+        established = !tunnel;
+        buffer.clear();
+        parser.reset();
+        socket->connectToHost(QHostAddress::LocalHost, proxyPort);
+    }
+
+    void stop()
+    {
+        stopped = true;
+        socket->disconnect(this);
+        socket->abort();
+    }
+
+    bool isEstablished() const
+    {
+        return established && socket->state() == QAbstractSocket::ConnectedState;
+    }
+
+  private:
+    void sendRequest()
+    {
+        if (stopped)
+            return;
+        received = 0;
+        requestTimer.start();
+        socket->write(request);
+    }
+
+    void completeRequest()
+    {
+        results.requests++;
+        results.latencies.push_back(requestTimer.nsecsElapsed());
+        sendRequest();
+    }
+
+  private slots:
+    void onReadyRead()
+    {
+        const auto data = socket->readAll();
+        results.bytes += data.size();
+        if (!established)
+        {
+            // The "200 Connection established" response of the CONNECT request
+            buffer.append(data);
+            if (!buffer.contains("\r\n\r\n"))
+                return;
+            established = true;
+            buffer.clear();
+            return sendRequest();
+        }
+
+        if (tunnel)
+        {
+            received += data.size();
+            if (received >= options.payloadSize)
+                completeRequest();
+            return;
+        }
+
+        buffer.append(data);
+        qsizetype pos = 0;
+        while (true)
+        {
+            const auto result = parser.parse(QByteArrayView(buffer).sliced(pos));
+            pos += result.consumed;
+            if (result.event == HttpMessageParser::MessageComplete)
+                completeRequest();
+            else if (result.event == HttpMessageParser::Error)
+                return onError();
+            else if (result.event == HttpMessageParser::NeedMoreData)
+                break;
+        }
+        buffer.remove(0, pos);
+    }
+
+    void onError()
+    {
+        if (stopped)
+            return;
+        results.errors++;
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+        start();
+    }
+
+  private:
+    const bool tunnel;
+    const quint16 proxyPort;
+    const quint16 targetPort;
+    const BenchmarkOptions &options;
+    BenchmarkResults &results;
+    QByteArray request;
+    QByteArray connectRequest;
+    QTcpSocket *socket = nullptr;
+    QByteArray buffer;
+    HttpMessageParser parser{ HttpMessageParser::Response };
+    QElapsedTimer requestTimer;
+    qint64 received = 0;
+    bool established = false;
+    bool stopped = false;
+};
+
+class Benchmark : public QObject
+{
+    Q_OBJECT
+  public:
+    explicit Benchmark(const BenchmarkOptions &options) : options(options), httpServer(options.responseSize){};
+
+    bool start()
+    {
+        const QHostAddress loopback(QHostAddress::LocalHost);
+        if (!echoServer.listen(loopback) || !httpServer.listen(loopback) || !socks.listen(loopback))
+            return false;
+
+        proxy.setWorkerThreads(options.workers, HttpProxy::LeastLoaded, options.reusePort);
+        proxy.setStatisticsInterval(0);
+        proxy.setIoUringRelay(options.ioUring);
+        proxy.setTunnelShaping(options.fair);
+        if (!proxy.httpListen(loopback, 0, socks.serverPort()))
+            return false;
+
+        baselineRss = ResidentSetSize();
+        results.latencies.reserve(1 << 20);
+        const auto tunnels = int(options.clients * options.tunnelRatio);
+        for (auto i = 0; i < options.clients; i++)
+        {
+            const bool tunnel = i < tunnels;
+            const auto client = new LoadClient(tunnel, proxy.serverPort(), tunnel ? echoServer.serverPort() : httpServer.serverPort(), options, results, this);
+            clients.append(client);
+            client->start();
+        }
+
+        // Memory is sampled once every connection is up, before the measured period starts.
+        const auto rampUp = new QTimer(this);
+        rampUp->setInterval(50);
+        connect(rampUp, &QTimer::timeout, this, [this, rampUp]() {
+            if (!std::all_of(clients.cbegin(), clients.cend(), [](const LoadClient *c) { return c->isEstablished(); }) && rampTimer.elapsed() < 10000)
+                return;
+            rampUp->stop();
+            loadedRss = ResidentSetSize();
+            established = std::count_if(clients.cbegin(), clients.cend(), [](const LoadClient *c) { return c->isEstablished(); });
+            results = {};
+            results.latencies.reserve(1 << 20);
+            runTimer.start();
+            QTimer::singleShot(options.durationSec * 1000, this, &Benchmark::finish);
+        });
+        rampTimer.start();
+        rampUp->start();
+        return true;
+    }
+
+  private:
+    static double Percentile(const std::vector<qint64> &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        const auto index = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+        return sorted[index] / 1e6;
+    }
+
+    void finish()
+    {
+        const auto seconds = runTimer.nsecsElapsed() / 1e9;
+        for (const auto client : std::as_const(clients))
+            client->stop();
+
+        auto latencies = std::move(results.latencies);
+        std::sort(latencies.begin(), latencies.end());
+
+        QTextStream out(stdout);
+        out << "clients:        " << options.clients << " (" << established << " established, tunnel ratio " << options.tunnelRatio << ")\n";
+        out << "workers:        " << options.workers << (options.reusePort ? " (SO_REUSEPORT)" : "") << "\n";
+        out << "tunnel relay:   " << (options.fair ? "fair scheduling" : options.ioUring ? "io_uring if available" : "splice") << "\n";
+        out << "duration:       " << seconds << " s\n";
+        out << "requests/s:     " << results.requests / seconds << "\n";
+        out << "MB/s:           " << results.bytes / seconds / (1024 * 1024) << "\n";
+        out << "latency p50:    " << Percentile(latencies, 0.50) << " ms\n";
+        out << "latency p99:    " << Percentile(latencies, 0.99) << " ms\n";
+        out << "latency p999:   " << Percentile(latencies, 0.999) << " ms\n";
+        out << "errors:         " << results.errors << "\n";
+        if (baselineRss >= 0 && established > 0)
+            out << "RSS/1k conns:   " << (loadedRss - baselineRss) * 1000.0 / established / (1024 * 1024) << " MiB (whole process, both ends)\n";
+        out.flush();
+        QCoreApplication::quit();
+    }
+
+  private:
+    const BenchmarkOptions options;
+    BenchmarkResults results;
+    EchoServer echoServer;
+    HttpServer httpServer;
+    Socks5StandIn socks;
+    HttpProxy proxy;
+    QList<LoadClient *> clients;
+    QElapsedTimer rampTimer;
+    QElapsedTimer runTimer;
+    qint64 baselineRss = -1;
+    qint64 loadedRss = -1;
+    qsizetype established = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("HttpProxyBenchmark"));
+
+    BenchmarkOptions options;
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    const QCommandLineOption clients(QStringLiteral("clients"), QStringLiteral("Concurrent client connections."), QStringLiteral("n"), QString::number(options.clients));
+    const QCommandLineOption duration(QStringLiteral("duration"), QStringLiteral("Measured period in seconds."), QStringLiteral("s"), QString::number(options.durationSec));
+    const QCommandLineOption tunnelRatio(QStringLiteral("tunnel-ratio"), QStringLiteral("Share of CONNECT tunnel clients, 0 to 1."), QStringLiteral("r"),
+                                         QString::number(options.tunnelRatio));
+    const QCommandLineOption payload(QStringLiteral("payload"), QStringLiteral("Bytes per tunnel round trip."), QStringLiteral("bytes"), QString::number(options.payloadSize));
+    const QCommandLineOption response(QStringLiteral("response"), QStringLiteral("Body size of the HTTP responses."), QStringLiteral("bytes"),
+                                      QString::number(options.responseSize));
+    const QCommandLineOption workers(QStringLiteral("workers"), QStringLiteral("HttpProxy worker threads."), QStringLiteral("n"), QString::number(options.workers));
+    const QCommandLineOption reusePort(QStringLiteral("reuse-port"), QStringLiteral("Shard the listener with SO_REUSEPORT."));
+    const QCommandLineOption ioUring(QStringLiteral("io-uring"), QStringLiteral("Relay tunnels through io_uring when the kernel supports it."));
+    const QCommandLineOption fair(QStringLiteral("fair"), QStringLiteral("Schedule tunnels fairly, without splice or io_uring."));
+    parser.addOptions({ clients, duration, tunnelRatio, payload, response, workers, reusePort, ioUring, fair });
+    parser.process(app);
+
+    options.clients = parser.value(clients).toInt();
+    options.durationSec = parser.value(duration).toInt();
+    options.tunnelRatio = qBound(0.0, parser.value(tunnelRatio).toDouble(), 1.0);
+    options.payloadSize = qMax(1, parser.value(payload).toInt());
+    options.responseSize = qMax(0, parser.value(response).toInt());
+    options.workers = qMax(0, parser.value(workers).toInt());
+    options.reusePort = parser.isSet(reusePort);
+    options.ioUring = parser.isSet(ioUring);
+    options.fair = parser.isSet(fair);
+
+    Benchmark benchmark(options);
+    if (!benchmark.start())
+    {
+        QTextStream(stderr) << "Cannot listen on loopback\n";
+        return 1;
+    }
+    return app.exec();
+}
+
+#include "HttpProxyBenchmark.moc"
@@ -0,0 +1,262 @@
+/*
+ * A microbenchmark of QJS_JSON decoding: builds a ProfileContent the size of a large subscription group
+ * (outbounds with stream settings, a few inbounds, routing rules with domain and IP lists), then measures
+ * ProfileContent::loadJson on its JSON. Built twice, as JsonBenchmark with the field tables and as
+ * JsonBenchmarkLegacy with QJS_LEGACY_LOADJSON, the decoder looking every declared field up, to compare both.
+ * The profile is also loaded from its text, once through QJsonDocument and loadJson and once with the pull parser
+ * of JsonStructHelper::ReadJson.
+ * Then measures saving a list of connections through toJson and QJsonDocument against JsonStructHelper::WriteJson,
+ * which must give the same bytes.
+ * Last, the profile text, indented and compact, and any JSON files given are parsed by QJsonDocument, by JsonReader
+ * into a QJsonValue and by JsonReader skipping everything, in GB/s, with the JsonScanner level picked by --scanner.
+ * At the end, the list of connections is loaded back as a cold start would, from compact JSON through QJsonDocument,
+ * from the same text with ReadJson and from JsonStructHelper::ToCbor with FromCbor.
+ */
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QRandomGenerator>
+#include <QTextStream>
+#include <QUuid>
+#include <functional>
+
+using namespace Qv2rayPlugin;
+
+static ProfileContent MakeProfile(int outbounds, int rules, QRandomGenerator &random)
+{
+    ProfileContent profile;
+    profile.inbounds << InboundObject::Create(QStringLiteral("http"), QStringLiteral("http"), QStringLiteral("127.0.0.1"), 8889)
+                     << InboundObject::Create(QStringLiteral("socks"), QStringLiteral("socks"), QStringLiteral("127.0.0.1"), 1089,
+                                              IOProtocolSettings{ QJsonObject{ { QStringLiteral("udp"), true } } });
+
+    for (int i = 0; i < outbounds; i++)
+    {
+        IOConnectionSettings settings;
+        settings.protocol = QStringLiteral("vmess");
+        settings.address = QStringLiteral("node%1.example.com").arg(i);
+        settings.port = 443;
+        settings.protocolSettings = IOProtocolSettings{ QJsonObject{ { QStringLiteral("id"), QUuid::createUuid().toString(QUuid::WithoutBraces) },
+                                                                     { QStringLiteral("alterId"), 0 },
+                                                                     { QStringLiteral("security"), QStringLiteral("auto") } } };
+        settings.streamSettings = IOStreamSettings{ QJsonObject{
+            { QStringLiteral("network"), QStringLiteral("ws") },
+            { QStringLiteral("security"), QStringLiteral("tls") },
+            { QStringLiteral("wsSettings"), QJsonObject{ { QStringLiteral("path"), QStringLiteral("/ray") } } },
+            { QStringLiteral("tlsSettings"), QJsonObject{ { QStringLiteral("serverName"), settings.address } } } } };
+        OutboundObject outbound(settings);
+        outbound.name = QStringLiteral("Node %1").arg(i);
+        profile.outbounds << outbound;
+    }
+
+    for (int i = 0; i < rules; i++)
+    {
+        RuleObject rule;
+        rule.name = QStringLiteral("rule %1").arg(i);
+        rule.outboundTag = i % 2 ? QStringLiteral("direct") : QStringLiteral("Node %1").arg(random.bounded(qMax(1, outbounds)));
+        for (int k = 0; k < 20; k++)
+            rule.targetDomains << QStringLiteral("domain:site%1.com").arg(random.bounded(100000));
+        for (int k = 0; k < 10; k++)
+            rule.targetIPs << QStringLiteral("%1.%2.0.0/16").arg(random.bounded(224)).arg(random.bounded(256));
+        rule.targetPort = 443;
+        rule.networks << QStringLiteral("tcp") << QStringLiteral("udp");
+        profile.routing.rules << rule;
+    }
+    return profile;
+}
+
+static QList<ConnectionObject> MakeConnections(int count, QRandomGenerator &random)
+{
+    QList<ConnectionObject> connections;
+    connections.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        ConnectionObject connection;
+        connection.name = QStringLiteral("Node %1 \u00b7 HK").arg(i);
+        connection.latency = random.bounded(500);
+        connection.statistics.proxyUp = random.generate64() >> 24;
+        connection.statistics.proxyDown = random.generate64() >> 20;
+        if (i % 3 == 0)
+            connection.tags << QStringLiteral("fast") << QStringLiteral("hk");
+        connections << connection;
+    }
+    return connections;
+}
+
+// Runs per second of run.
+static double Rate(const std::function<void()> &run, qint64 limit)
+{
+    qint64 runs = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < limit)
+    {
+        run();
+        runs++;
+    }
+    return runs / (timer.nsecsElapsed() / 1e9);
+}
+
+// Bytes per second of write, and its last output.
+static double Throughput(const std::function<QByteArray()> &write, qint64 limit, QByteArray &output)
+{
+    qint64 bytes = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < limit)
+    {
+        output = write();
+        bytes += output.size();
+    }
+    return bytes / (timer.nsecsElapsed() / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("JsonBenchmark"));
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    const QCommandLineOption outbounds(QStringLiteral("outbounds"), QStringLiteral("Outbounds in the profile."), QStringLiteral("n"), QStringLiteral("200"));
+    const QCommandLineOption rules(QStringLiteral("rules"), QStringLiteral("Routing rules in the profile."), QStringLiteral("n"), QStringLiteral("50"));
+    const QCommandLineOption duration(QStringLiteral("duration"), QStringLiteral("Measured seconds."), QStringLiteral("seconds"), QStringLiteral("3"));
+    const QCommandLineOption connections(QStringLiteral("connections"), QStringLiteral("Connections saved."), QStringLiteral("n"), QStringLiteral("100000"));
+    const QCommandLineOption scanner(QStringLiteral("scanner"), QStringLiteral("JsonScanner level: scalar, sse42 or avx2."), QStringLiteral("level"), QStringLiteral("avx2"));
+    parser.addOptions({ outbounds, rules, duration, connections, scanner });
+    parser.addPositionalArgument(QStringLiteral("corpus"), QStringLiteral("JSON files parsed besides the profile."), QStringLiteral("[corpus...]"));
+    parser.process(app);
+
+    const QStringList levels{ QStringLiteral("scalar"), QStringLiteral("sse42"), QStringLiteral("avx2") };
+    JsonScanner::Use(JsonScanner::Level(qMax<qsizetype>(0, levels.indexOf(parser.value(scanner)))));
+
+    QRandomGenerator random(42);
+    const auto source = MakeProfile(parser.value(outbounds).toInt(), parser.value(rules).toInt(), random);
+    const auto json = source.toJson();
+    const auto text = QJsonDocument(json).toJson(QJsonDocument::Compact);
+    const auto bytes = text.size();
+
+    // Both decoders must give back the profile they were given, the writer the bytes of QJsonDocument.
+    const auto roundTrip = ProfileContent::fromJson(json).toJson() == json;
+    ProfileContent pulled;
+    const auto pullTrip = JsonStructHelper::ReadJson(text, pulled) && pulled.toJson() == json;
+    auto identical = true;
+    for (const auto format : { QJsonDocument::Compact, QJsonDocument::Indented })
+        identical = identical && JsonStructHelper::WriteJson(source, format) == QJsonDocument(json).toJson(format);
+
+    const auto limit = qint64(parser.value(duration).toDouble() * 1e9);
+    qint64 loads = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < limit)
+    {
+        ProfileContent profile;
+        profile.loadJson(json);
+        loads++;
+    }
+    const auto seconds = timer.nsecsElapsed() / 1e9;
+
+    const auto domReads = Rate([&]() { ProfileContent profile; profile.loadJson(QJsonDocument::fromJson(text).object()); }, limit);
+    const auto pullReads = Rate([&]() { ProfileContent profile; JsonStructHelper::ReadJson(text, profile); }, limit);
+
+    const auto list = MakeConnections(parser.value(connections).toInt(), random);
+    QByteArray domOutput, writerOutput;
+    const auto domSpeed = Throughput([&]() { return QJsonDocument(JsonStructHelper::Serialize(list).toArray()).toJson(QJsonDocument::Compact); }, limit, domOutput);
+    const auto writerSpeed = Throughput([&]() { return JsonStructHelper::WriteJson(list, QJsonDocument::Compact); }, limit, writerOutput);
+    identical = identical && domOutput == writerOutput;
+
+    QList<QPair<QString, QByteArray>> corpora{ { QStringLiteral("profile"), text }, { QStringLiteral("indented profile"), QJsonDocument(json).toJson() } };
+    for (const auto &path : parser.positionalArguments())
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            return 1;
+        corpora.append({ QFileInfo(path).fileName(), file.readAll() });
+    }
+
+    QStringList corpusLines;
+    auto agreed = true;
+    for (const auto &entry : corpora)
+    {
+        const auto &corpus = entry.second;
+        // Both parsers must accept or reject the text alike, and agree on every value.
+        QJsonParseError error;
+        const auto document = QJsonDocument::fromJson(corpus, &error);
+        JsonReader reader(corpus);
+        const auto value = reader.readValue();
+        const auto accepted = reader.finish();
+        const auto same = accepted == (error.error == QJsonParseError::NoError) &&
+                          (!accepted || value == (document.isArray() ? QJsonValue(document.array()) : QJsonValue(document.object())));
+        agreed = agreed && same;
+
+        const auto gigabytes = corpus.size() / 1e9;
+        const auto domRate = Rate([&]() { QJsonDocument::fromJson(corpus); }, limit);
+        const auto pullRate = Rate([&]() {
+            JsonReader r(corpus);
+            r.readValue();
+            r.finish();
+        }, limit);
+        const auto scanRate = Rate([&]() {
+            JsonReader r(corpus);
+            r.skipValue();
+            r.finish();
+        }, limit);
+        corpusLines << QStringLiteral("%1: %2 KiB, QJsonDocument %3 GB/s, JsonReader %4 GB/s, skipping %5 GB/s, %6")
+                           .arg(entry.first)
+                           .arg(corpus.size() / 1024)
+                           .arg(domRate * gigabytes, 0, 'f', 3)
+                           .arg(pullRate * gigabytes, 0, 'f', 3)
+                           .arg(scanRate * gigabytes, 0, 'f', 3)
+                           .arg(same ? QStringLiteral("same values") : QStringLiteral("MISMATCH"));
+    }
+
+    const auto listJson = JsonStructHelper::Serialize(list);
+    const auto listText = JsonStructHelper::WriteJson(list, QJsonDocument::Compact);
+    const auto listCbor = JsonStructHelper::ToCbor(list);
+    // Every loader must give back the list it was saved from.
+    auto reloaded = true;
+    const auto load = [&](const std::function<void(QList<ConnectionObject> &)> &read) {
+        QList<ConnectionObject> loaded;
+        read(loaded);
+        reloaded = reloaded && JsonStructHelper::Serialize(loaded) == listJson;
+        return Rate([&]() {
+            QList<ConnectionObject> l;
+            read(l);
+        }, limit);
+    };
+    const auto domLoads = load([&](QList<ConnectionObject> &l) { JsonStructHelper::Deserialize(l, QJsonDocument::fromJson(listText).array()); });
+    const auto pullLoads = load([&](QList<ConnectionObject> &l) { JsonStructHelper::ReadJson(listText, l); });
+    const auto cborLoads = load([&](QList<ConnectionObject> &l) { JsonStructHelper::FromCbor(listCbor, l); });
+
+    QTextStream out(stdout);
+#ifdef QJS_LEGACY_LOADJSON
+    out << "decoder:        field lookups\n";
+#else
+    out << "decoder:        field tables\n";
+#endif
+    out << "profile:        " << bytes / 1024 << " KiB of JSON\n";
+    out << "loads/s:        " << loads / seconds << "\n";
+    out << "MiB/s:          " << loads * bytes / seconds / (1024 * 1024) << "\n";
+    out << "round trip:     " << (roundTrip ? "ok" : "MISMATCH") << "\n";
+    out << "DOM reads/s:    " << domReads << "\n";
+    out << "pull reads/s:   " << pullReads << "\n";
+    out << "pull trip:      " << (pullTrip ? "ok" : "MISMATCH") << "\n";
+    out << "connections:    " << list.size() << ", " << domOutput.size() / 1024 << " KiB of JSON\n";
+    out << "DOM MiB/s:      " << domSpeed / (1024 * 1024) << "\n";
+    out << "writer MiB/s:   " << writerSpeed / (1024 * 1024) << "\n";
+    out << "same output:    " << (identical ? "ok" : "MISMATCH") << "\n";
+    out << "scanner:        " << levels[JsonScanner::Current()] << "\n";
+    for (const auto &line : corpusLines)
+        out << line << "\n";
+    out << "database:       " << listText.size() / 1024 << " KiB of JSON, " << listCbor.size() / 1024 << " KiB of CBOR\n";
+    out << "DOM loads/s:    " << domLoads << "\n";
+    out << "pull loads/s:   " << pullLoads << "\n";
+    out << "CBOR loads/s:   " << cborLoads << "\n";
+    out << "reloaded:       " << (reloaded ? "ok" : "MISMATCH") << "\n";
+    return roundTrip && pullTrip && identical && agreed && reloaded ? 0 : 1;
+}
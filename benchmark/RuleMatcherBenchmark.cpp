@@ -0,0 +1,209 @@
+/*
+ * A microbenchmark of RuleMatcher: builds a RoutingObject with the requested number of domain and IP entries,
+ * then measures lookups per second on a mix of matching and non-matching domains and addresses.
+ * A sample of the lookups is checked against a plain linear evaluation of the same rules.
+ * With --mapped, the entries are moved into RuleSetFiles first and looked up in the mapped files. With --optimize,
+ * RoutingOptimizer shrinks the rules first and the lookups are checked by outbound instead of by rule.
+ */
+
+#include "QvPlugin/Utils/RoutingOptimizer.hpp"
+#include "QvPlugin/Utils/RuleMatcher.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <algorithm>
+#include <vector>
+
+using namespace Qv2rayPlugin;
+using namespace Qv2rayPlugin::Utils;
+
+static QString RandomLabel(QRandomGenerator &random)
+{
+    QString label;
+    const auto size = 3 + random.bounded(8);
+    for (int i = 0; i < size; i++)
+        label.append(QChar(u'a' + random.bounded(26)));
+    return label;
+}
+
+static QString RandomDomain(QRandomGenerator &random)
+{
+    static const QStringList tlds{ QStringLiteral("com"), QStringLiteral("net"), QStringLiteral("org"), QStringLiteral("cn"), QStringLiteral("io") };
+    return RandomLabel(random) + u'.' + tlds[random.bounded(tlds.size())];
+}
+
+static QString RandomAddress(QRandomGenerator &random)
+{
+    return QHostAddress(random.generate()).toString();
+}
+
+struct RuleSet
+{
+    RoutingObject routing;
+    QStringList domains;
+    QStringList addresses;
+};
+
+// Half of the entries are domain: suffixes, a fifth full: names, a twentieth keywords, the rest IPv4 subnets.
+static RuleSet MakeRuleSet(int entries, QRandomGenerator &random)
+{
+    RuleSet set;
+    RuleObject suffixes, fulls, keywords, subnets, smtp;
+    suffixes.outboundTag = QStringLiteral("direct");
+    fulls.outboundTag = QStringLiteral("proxy");
+    keywords.outboundTag = QStringLiteral("block");
+    subnets.outboundTag = QStringLiteral("direct");
+    smtp.outboundTag = QStringLiteral("block");
+    smtp.targetPort = 25;
+
+    for (int i = 0; i < entries / 2; i++)
+    {
+        set.domains.append(RandomDomain(random));
+        suffixes.targetDomains.append(QStringLiteral("domain:") + set.domains.last());
+    }
+    for (int i = 0; i < entries / 5; i++)
+    {
+        set.domains.append(RandomDomain(random));
+        fulls.targetDomains.append(QStringLiteral("full:") + set.domains.last());
+    }
+    for (int i = 0; i < entries / 20; i++)
+        keywords.targetDomains.append(QStringLiteral("keyword:") + RandomLabel(random) + RandomLabel(random));
+    for (int i = suffixes.targetDomains.size() + fulls.targetDomains.size() + keywords.targetDomains.size(); i < entries; i++)
+    {
+        set.addresses.append(RandomAddress(random));
+        subnets.targetIPs.append(set.addresses.last() + u'/' + QString::number(16 + random.bounded(17)));
+    }
+    set.routing.rules = { smtp, keywords, fulls, suffixes, subnets };
+    return set;
+}
+
+static RuleMatcher::Query RandomQuery(const RuleSet &set, QRandomGenerator &random)
+{
+    RuleMatcher::Query query;
+    query.targetPort = random.bounded(50) == 0 ? 25 : 443;
+    const auto kind = random.bounded(10);
+    if (kind < 3)
+        query.targetAddress = QHostAddress(kind == 0 || set.addresses.isEmpty() ? RandomAddress(random) : set.addresses[random.bounded(set.addresses.size())]);
+    else if (kind < 7 && !set.domains.isEmpty())
+        query.domain = RandomLabel(random) + u'.' + set.domains[random.bounded(set.domains.size())];
+    else
+        query.domain = RandomDomain(random);
+    return query;
+}
+
+// The rules evaluated one entry after the other, for the kinds of entries MakeRuleSet creates.
+static int LinearMatch(const RoutingObject &routing, const RuleMatcher::Query &query)
+{
+    const auto domain = query.domain.toLower();
+    for (int i = 0; i < routing.rules.size(); i++)
+    {
+        const auto &rule = routing.rules[i];
+        if ((rule.targetPort.from || rule.targetPort.to) && (query.targetPort < rule.targetPort.from || query.targetPort > rule.targetPort.to))
+            continue;
+        if (!rule.targetDomains.isEmpty())
+        {
+            const auto matched = !domain.isEmpty() && std::any_of(rule.targetDomains.cbegin(), rule.targetDomains.cend(), [&](const QString &entry) {
+                const auto value = entry.mid(entry.indexOf(u':') + 1);
+                if (entry.startsWith(QStringLiteral("full:")))
+                    return domain == value;
+                if (entry.startsWith(QStringLiteral("keyword:")))
+                    return domain.contains(value);
+                return domain == value || domain.endsWith(u'.' + value);
+            });
+            if (!matched)
+                continue;
+        }
+        if (!rule.targetIPs.isEmpty())
+        {
+            const auto matched = !query.targetAddress.isNull() && std::any_of(rule.targetIPs.cbegin(), rule.targetIPs.cend(), [&](const QString &entry) {
+                return query.targetAddress.isInSubnet(QHostAddress::parseSubnet(entry));
+            });
+            if (!matched)
+                continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("RuleMatcherBenchmark"));
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    const QCommandLineOption entries(QStringLiteral("entries"), QStringLiteral("Domain and IP entries in the rule set."), QStringLiteral("n"), QStringLiteral("100000"));
+    const QCommandLineOption lookups(QStringLiteral("lookups"), QStringLiteral("Measured lookups."), QStringLiteral("n"), QStringLiteral("1000000"));
+    const QCommandLineOption verify(QStringLiteral("verify"), QStringLiteral("Lookups checked against a linear evaluation."), QStringLiteral("n"), QStringLiteral("1000"));
+    const QCommandLineOption mapped(QStringLiteral("mapped"), QStringLiteral("Look the entries up in mapped rule set files."));
+    const QCommandLineOption optimize(QStringLiteral("optimize"), QStringLiteral("Optimize the rules before compiling them."));
+    parser.addOptions({ entries, lookups, verify, mapped, optimize });
+    parser.process(app);
+
+    QRandomGenerator random(42);
+    const auto set = MakeRuleSet(qMax(1, parser.value(entries).toInt()), random);
+
+    QElapsedTimer timer;
+    timer.start();
+    auto routing = set.routing;
+    const auto report = parser.isSet(optimize) ? RoutingOptimizer::Optimize(routing) : RoutingOptimizer::Report();
+    const auto optimizeTime = timer.nsecsElapsed() / 1e6;
+
+    timer.restart();
+    const QTemporaryDir directory;
+    qint64 fileSize = 0;
+    for (int i = 0; parser.isSet(mapped) && i < routing.rules.size(); i++)
+    {
+        const auto path = directory.filePath(QStringLiteral("rule%1.qvrs").arg(i));
+        if (!RuleSetFile::Convert(routing.rules[i], path))
+            return 1;
+        fileSize += QFileInfo(path).size();
+    }
+    const auto convertTime = timer.nsecsElapsed() / 1e6;
+
+    timer.restart();
+    const RuleMatcher matcher(routing);
+    const auto buildTime = timer.nsecsElapsed() / 1e6;
+
+    const auto queryCount = qMax(1, parser.value(lookups).toInt());
+    std::vector<RuleMatcher::Query> queries;
+    queries.reserve(4096);
+    for (int i = 0; i < 4096; i++)
+        queries.push_back(RandomQuery(set, random));
+
+    int matched = 0;
+    timer.restart();
+    for (int i = 0; i < queryCount; i++)
+        matched += matcher.match(queries[i % queries.size()]).rule >= 0;
+    const auto seconds = timer.nsecsElapsed() / 1e9;
+
+    int mismatches = 0;
+    const auto verifyCount = qMin<qsizetype>(parser.value(verify).toInt(), queries.size());
+    for (int i = 0; i < verifyCount; i++)
+    {
+        const auto expected = LinearMatch(set.routing, queries[i]);
+        const auto result = matcher.match(queries[i]);
+        if (parser.isSet(optimize))
+            mismatches += result.outboundTag != (expected < 0 ? QString() : set.routing.rules[expected].outboundTag);
+        else
+            mismatches += result.rule != expected;
+    }
+
+    QTextStream out(stdout);
+    out << "entries:        " << parser.value(entries) << " in " << set.routing.rules.size() << " rules\n";
+    if (parser.isSet(optimize))
+        out << "optimized:      " << report.toString() << " in " << optimizeTime << " ms\n";
+    if (parser.isSet(mapped))
+        out << "rule set files: " << fileSize / 1024 << " KiB, written in " << convertTime << " ms\n";
+    out << "build time:     " << buildTime << " ms\n";
+    out << "lookups/s:      " << queryCount / seconds << "\n";
+    out << "ns/lookup:      " << seconds * 1e9 / queryCount << "\n";
+    out << "matched:        " << 100.0 * matched / queryCount << " %\n";
+    out << "mismatches:     " << mismatches << " of " << verifyCount << " verified\n";
+    return mismatches == 0 ? 0 : 1;
+}
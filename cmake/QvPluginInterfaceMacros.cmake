@@ -29,7 +29,7 @@ endif()
 
 function(qv2ray_add_plugin TARGET_NAME)
     set(Stable_PluginInterface_VERSION 5)
-    set(options GUI Quick Widgets NO_INSTALL NO_RPATH HTTP_TO_SOCKS STATIC DEV_INTERFACE DEBUGGING_EXECUTABLE)
+    set(options GUI Quick Widgets NO_INSTALL NO_RPATH HTTP_TO_SOCKS RESOLVER STATIC DEV_INTERFACE DEBUGGING_EXECUTABLE)
     set(oneValueArgs INSTALL_PREFIX_LINUX INSTALL_PREFIX_WINDOWS INSTALL_PREFIX_MACOS INSTALL_PREFIX_ANDROID CLASS_NAME INTERFACE_VERSION)
     set(multiValueArgs EXTRA_DEPENDENCY_DIRS_WINDOWS)
     cmake_parse_arguments(QVPLUGIN "${options}" "${oneValueArgs}" "${multiValueArgs}" ${ARGN})
@@ -59,6 +59,10 @@ function(qv2ray_add_plugin TARGET_NAME)
         set(QVPLUGIN_HTTP_TO_SOCKS FALSE)
     endif()
 
+    if(NOT DEFINED QVPLUGIN_RESOLVER)
+        set(QVPLUGIN_RESOLVER FALSE)
+    endif()
+
     if(NOT DEFINED QVPLUGIN_NO_RPATH)
         set(QVPLUGIN_NO_RPATH FALSE)
     endif()
@@ -150,11 +154,22 @@ function(qv2ray_add_plugin TARGET_NAME)
     find_package(Qt6 COMPONENTS Core Network REQUIRED)
     target_link_libraries(${TARGET_NAME} PRIVATE Qt::Core Qt::Network Qv2ray::QvPluginInterface)
 
+    if(QVPLUGIN_RESOLVER)
+        target_sources(${TARGET_NAME} PRIVATE ${QvPluginInterface_Prefix}/QvPlugin/Utils/DnsResolver.hpp)
+    endif()
+
     if(QVPLUGIN_HTTP_TO_SOCKS)
         target_sources(${TARGET_NAME}
             PRIVATE
             ${QvPluginInterface_Prefix}/QvPlugin/Socksify/HttpProxy.hpp
-            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/SocketStream.hpp)
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/HttpProxyWorker.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/IoUringRelay.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/SocketStream.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/Socks5Client.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/SpliceRelay.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/TrafficShaper.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/UdpRelay.hpp
+            ${QvPluginInterface_Prefix}/QvPlugin/Socksify/UpstreamPool.hpp)
     endif()
 
     if(QVPLUGIN_GUI)
@@ -253,6 +268,7 @@ endforeach()
     message(STATUS "   Use QtQuick: ${QVPLUGIN_Quick}")
     message(STATUS "     Use QtGui: ${QVPLUGIN_GUI}")
     message(STATUS "    HTTP2SOCKS: ${QVPLUGIN_HTTP_TO_SOCKS}")
+    message(STATUS "  DNS Resolver: ${QVPLUGIN_RESOLVER}")
     message(STATUS "    No Install: ${QVPLUGIN_NO_INSTALL}")
     message(STATUS "No macOS RPath: ${QVPLUGIN_NO_RPATH}")
     message(STATUS " Global Prefix: ${CMAKE_INSTALL_PREFIX}")
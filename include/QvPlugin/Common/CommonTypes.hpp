@@ -297,6 +297,14 @@ namespace Qv2rayPlugin::Common::_base_types
             profile.loadJson(o);
             return profile;
         };
+        static auto fromJson(const QByteArray &json, QJsonParseError *error = nullptr)
+        {
+            // A document that fails to parse must not leave a half-read profile behind.
+            ProfileContent profile;
+            if (!JsonStructHelper::ReadJson(json, profile, error))
+                return ProfileContent{};
+            return profile;
+        };
         QJS_JSON(F(defaultKernel, inbounds, outbounds, routing, extraOptions))
     };
 
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <QHash>
+#include <QHostAddress>
+#include <QMutex>
+#include <atomic>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Connection caps of a HttpProxy, shared by all its workers and safe to use from any thread.
+         * The global cap is a single atomic counter, the per-client cap takes a lock only when it is enabled.
+         * Also counts the connections refused or closed by each policy.
+         */
+        class AdmissionControl
+        {
+          public:
+            enum Reason
+            {
+                RejectedGlobalLimit,
+                RejectedClientLimit,
+                ReapedHeaderTimeout,
+                ReapedKeepAliveTimeout,
+                ReapedUpstreamTimeout,
+                ReapedTunnelIdle,
+                ReapedDrainDeadline,
+                AcceptPaused,
+                ReasonCount
+            };
+
+            struct Statistics
+            {
+                int active = 0;
+                quint64 rejectedGlobalLimit = 0;
+                quint64 rejectedClientLimit = 0;
+                quint64 reapedHeaderTimeout = 0;
+                quint64 reapedKeepAliveTimeout = 0;
+                quint64 reapedUpstreamTimeout = 0;
+                quint64 reapedTunnelIdle = 0;
+                // Connections of a previous configuration still open at the drain deadline, see HttpProxy::reconfigure
+                quint64 reapedDrainDeadline = 0;
+                // How many times accepting has been paused because the global cap was reached.
+                quint64 acceptPaused = 0;
+            };
+
+            AdmissionControl() = default;
+            AdmissionControl(const AdmissionControl &) = delete;
+
+            // 0 means unlimited.
+            void setLimits(int maxConnections, int maxConnectionsPerClient)
+            {
+                this->maxConnections.store(maxConnections, std::memory_order_relaxed);
+                this->maxConnectionsPerClient.store(maxConnectionsPerClient, std::memory_order_relaxed);
+            }
+
+            // Takes a slot of the global cap, false if the cap is reached.
+            bool acquire()
+            {
+                const auto limit = maxConnections.load(std::memory_order_relaxed);
+                if (active.fetch_add(1, std::memory_order_relaxed) < limit || limit <= 0)
+                    return true;
+                active.fetch_sub(1, std::memory_order_relaxed);
+                count(RejectedGlobalLimit);
+                return false;
+            }
+
+            void release()
+            {
+                active.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            bool isFull() const
+            {
+                const auto limit = maxConnections.load(std::memory_order_relaxed);
+                return limit > 0 && active.load(std::memory_order_relaxed) >= limit;
+            }
+
+            /*
+             * Takes a slot of the per-client cap of address. Sets acquired to whether releaseClient must be called,
+             * which is not the case when the per-client cap is disabled.
+             */
+            bool acquireClient(const QHostAddress &address, bool &acquired)
+            {
+                acquired = false;
+                const auto limit = maxConnectionsPerClient.load(std::memory_order_relaxed);
+                if (limit <= 0)
+                    return true;
+
+                const QMutexLocker locker(&clientsLock);
+                // A rejected address always has an entry already, operator[] only inserts one that is taken right away.
+                auto &n = clients[address];
+                if (n >= limit)
+                {
+                    count(RejectedClientLimit);
+                    return false;
+                }
+                n++;
+                acquired = true;
+                return true;
+            }
+
+            void releaseClient(const QHostAddress &address)
+            {
+                const QMutexLocker locker(&clientsLock);
+                const auto it = clients.find(address);
+                if (it != clients.end() && --it.value() <= 0)
+                    clients.erase(it);
+            }
+
+            void count(Reason reason)
+            {
+                counters[reason].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            Statistics statistics() const
+            {
+                const auto get = [this](Reason r) { return counters[r].load(std::memory_order_relaxed); };
+                Statistics s;
+                s.active = active.load(std::memory_order_relaxed);
+                s.rejectedGlobalLimit = get(RejectedGlobalLimit);
+                s.rejectedClientLimit = get(RejectedClientLimit);
+                s.reapedHeaderTimeout = get(ReapedHeaderTimeout);
+                s.reapedKeepAliveTimeout = get(ReapedKeepAliveTimeout);
+                s.reapedUpstreamTimeout = get(ReapedUpstreamTimeout);
+                s.reapedTunnelIdle = get(ReapedTunnelIdle);
+                s.reapedDrainDeadline = get(ReapedDrainDeadline);
+                s.acceptPaused = get(AcceptPaused);
+                return s;
+            }
+
+          private:
+            std::atomic<int> maxConnections{ 0 };
+            std::atomic<int> maxConnectionsPerClient{ 0 };
+            std::atomic<int> active{ 0 };
+            std::atomic<quint64> counters[ReasonCount] = {};
+            QMutex clientsLock;
+            QHash<QHostAddress, int> clients;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
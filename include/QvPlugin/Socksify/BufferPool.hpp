@@ -0,0 +1,122 @@
+#pragma once
+
+#include <QByteArray>
+#include <QIODevice>
+#include <atomic>
+#include <vector>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Fixed-size relay buffers recycled per thread, so that relaying does not allocate a new QByteArray
+         * sized to whatever happens to be pending on every read. Every thread has its own pool, no locking
+         * is involved, and at most MaxPooled() idle chunks are kept per thread.
+         */
+        class BufferPool
+        {
+          public:
+            static constexpr qsizetype ChunkSize = 16 * 1024;
+
+            struct Statistics
+            {
+                // Chunks handed out from the pool, and chunks that had to be allocated.
+                quint64 hits = 0;
+                quint64 misses = 0;
+                // Chunks freed because the pool of their thread was full.
+                quint64 dropped = 0;
+            };
+
+            // A chunk borrowed from the pool of the current thread, returned to it when destroyed.
+            class Chunk
+            {
+              public:
+                Chunk() : buffer(Local().take()){};
+                ~Chunk()
+                {
+                    Local().give(std::move(buffer));
+                }
+                Chunk(const Chunk &) = delete;
+                Chunk &operator=(const Chunk &) = delete;
+
+                char *data()
+                {
+                    return buffer.data();
+                }
+                const char *constData() const
+                {
+                    return buffer.constData();
+                }
+
+                // Reads at most min(maxSize, ChunkSize) bytes from device into the chunk.
+                qint64 readFrom(QIODevice *device, qint64 maxSize = ChunkSize)
+                {
+                    return device->read(buffer.data(), qMin<qint64>(maxSize, ChunkSize));
+                }
+
+              private:
+                QByteArray buffer;
+            };
+
+            // Bounds the number of idle chunks kept by every thread, 0 disables recycling.
+            static void SetMaxPooled(int count)
+            {
+                maxPooled.store(count, std::memory_order_relaxed);
+            }
+
+            static int MaxPooled()
+            {
+                return maxPooled.load(std::memory_order_relaxed);
+            }
+
+            // Totals of all threads.
+            static Statistics GlobalStatistics()
+            {
+                Statistics s;
+                s.hits = hits.load(std::memory_order_relaxed);
+                s.misses = misses.load(std::memory_order_relaxed);
+                s.dropped = dropped.load(std::memory_order_relaxed);
+                return s;
+            }
+
+          private:
+            static BufferPool &Local()
+            {
+                static thread_local BufferPool pool;
+                return pool;
+            }
+
+            QByteArray take()
+            {
+                if (free.empty())
+                {
+                    misses.fetch_add(1, std::memory_order_relaxed);
+                    return QByteArray(ChunkSize, Qt::Uninitialized);
+                }
+                hits.fetch_add(1, std::memory_order_relaxed);
+                auto buffer = std::move(free.back());
+                free.pop_back();
+                return buffer;
+            }
+
+            void give(QByteArray &&buffer)
+            {
+                // A chunk shared with someone else (or resized) would be detached on the next write, drop it.
+                if (buffer.size() != ChunkSize || !buffer.isDetached() || free.size() >= size_t(MaxPooled()))
+                {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                free.push_back(std::move(buffer));
+            }
+
+          private:
+            std::vector<QByteArray> free;
+            static inline std::atomic<int> maxPooled{ 64 };
+            static inline std::atomic<quint64> hits{ 0 };
+            static inline std::atomic<quint64> misses{ 0 };
+            static inline std::atomic<quint64> dropped{ 0 };
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
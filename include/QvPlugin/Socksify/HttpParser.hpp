@@ -0,0 +1,555 @@
+#pragma once
+
+#include <QByteArrayView>
+#include <QVarLengthArray>
+#include <cstring>
+#include <utility>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        struct HttpHeaderField
+        {
+            QByteArrayView name;
+            QByteArrayView value;
+            // The raw header line, including its line terminator
+            QByteArrayView line;
+        };
+
+        ///
+        /// \brief All views point into the buffer passed to HttpMessageParser::parse, they stay valid as long as
+        /// the caller does not modify that buffer.
+        ///
+        struct HttpMessageHead
+        {
+            // Request line
+            QByteArrayView method;
+            QByteArrayView target;
+            // Status line
+            int statusCode = 0;
+            QByteArrayView reason;
+
+            QByteArrayView version;
+            // The start line, including its line terminator
+            QByteArrayView startLine;
+            QVarLengthArray<HttpHeaderField, 32> headers;
+
+            // Total size of the head, including the empty line
+            qsizetype size = 0;
+            qint64 contentLength = -1;
+            bool chunked = false;
+            bool keepAlive = false;
+
+            QByteArrayView header(QByteArrayView name) const
+            {
+                for (const auto &h : headers)
+                    if (EqualsIgnoreCase(h.name, name))
+                        return h.value;
+                return {};
+            }
+
+            static bool EqualsIgnoreCase(QByteArrayView a, QByteArrayView b)
+            {
+                return a.size() == b.size() && qstrnicmp(a.data(), a.size(), b.data(), b.size()) == 0;
+            }
+
+            // Whether a comma separated header value contains the given token, e.g. "Connection: Upgrade, close"
+            static bool HasToken(QByteArrayView value, QByteArrayView token)
+            {
+                qsizetype begin = 0;
+                while (begin <= value.size())
+                {
+                    auto end = begin;
+                    while (end < value.size() && value[end] != ',')
+                        end++;
+                    if (EqualsIgnoreCase(Trimmed(value.sliced(begin, end - begin)), token))
+                        return true;
+                    begin = end + 1;
+                }
+                return false;
+            }
+
+            static QByteArrayView Trimmed(QByteArrayView v)
+            {
+                while (!v.isEmpty() && (v.front() == ' ' || v.front() == '\t'))
+                    v = v.sliced(1);
+                while (!v.isEmpty() && (v.back() == ' ' || v.back() == '\t' || v.back() == '\r'))
+                    v.chop(1);
+                return v;
+            }
+        };
+
+        ///
+        /// \brief An incremental HTTP/1.x message parser.
+        /// The caller keeps the unconsumed bytes in its own buffer and repeatedly calls parse() with them,
+        /// dropping Result::consumed bytes from the front after each call. Partial heads are not re-scanned
+        /// from the beginning when more data arrives. Bodies are reported as they appear on the wire,
+        /// including the chunk framing of chunked bodies, so that they can be forwarded unchanged.
+        ///
+        class HttpMessageParser
+        {
+          public:
+            enum Mode
+            {
+                Request,
+                Response
+            };
+
+            enum Event
+            {
+                NeedMoreData,
+                HeadComplete,
+                Body,
+                MessageComplete,
+                Error
+            };
+
+            struct Result
+            {
+                Event event = NeedMoreData;
+                // Always drop these bytes from the input, even when more data is needed.
+                qsizetype consumed = 0;
+                QByteArrayView data;
+            };
+
+            explicit HttpMessageParser(Mode mode = Request) : m_mode(mode){};
+
+            void setMaxHeadSize(qsizetype size)
+            {
+                m_maxHeadSize = size;
+            }
+
+            // Responses to HEAD requests never have a body, the response parser cannot know that by itself.
+            void setNextResponseHasNoBody()
+            {
+                m_nextNoBody = true;
+            }
+
+            const HttpMessageHead &head() const
+            {
+                return m_head;
+            }
+
+            // Whether the parser is waiting for the first byte of a message.
+            bool isIdle() const
+            {
+                return m_state == State::Head && m_scanned == 0;
+            }
+
+            // Whether the parser is waiting for (the rest of) a message head.
+            bool isReadingHead() const
+            {
+                return m_state == State::Head;
+            }
+
+            // Whether the current message is delimited by the connection being closed.
+            bool isReadingUntilClose() const
+            {
+                return m_state == State::UntilClose;
+            }
+
+            void reset()
+            {
+                m_state = State::Head;
+                m_scanned = 0;
+                m_nextNoBody = false;
+            }
+
+            Result parse(QByteArrayView input)
+            {
+                switch (m_state)
+                {
+                    case State::Head: return parseHead(input);
+                    case State::Identity:
+                    {
+                        const auto n = qMin<qint64>(m_remaining, input.size());
+                        m_remaining -= n;
+                        if (m_remaining == 0)
+                            m_state = State::Complete;
+                        return n == 0 ? Result{} : Result{ Body, qsizetype(n), input.first(n) };
+                    }
+                    case State::UntilClose: return input.isEmpty() ? Result{} : Result{ Body, input.size(), input };
+                    case State::Complete: m_state = State::Head; return { MessageComplete, 0, {} };
+                    case State::Failed: return { Error, 0, {} };
+                    default: return parseChunked(input);
+                }
+            }
+
+          private:
+            enum class State
+            {
+                Head,
+                Identity,
+                UntilClose,
+                ChunkSize,
+                ChunkExtension,
+                ChunkData,
+                ChunkDataCR,
+                ChunkDataLF,
+                Trailer,
+                Complete,
+                Failed
+            };
+
+            Result fail()
+            {
+                m_state = State::Failed;
+                return { Error, 0, {} };
+            }
+
+            Result parseHead(QByteArrayView input)
+            {
+                // Tolerate empty lines between pipelined messages, see RFC 7230 Section 3.5
+                qsizetype skipped = 0;
+                if (m_scanned == 0)
+                {
+                    while (skipped < input.size() && (input[skipped] == '\r' || input[skipped] == '\n'))
+                        skipped++;
+                    input = input.sliced(skipped);
+                }
+
+                // Only look at the bytes that arrived since the last call, minus the length of the terminator.
+                for (auto i = qMax<qsizetype>(3, m_scanned); i < input.size(); i++)
+                {
+                    const auto p = static_cast<const char *>(std::memchr(input.data() + i, '\n', input.size() - i));
+                    if (!p)
+                        break;
+                    i = p - input.data();
+                    if (input[i - 1] == '\r' && input[i - 2] == '\n' && input[i - 3] == '\r')
+                    {
+                        m_scanned = 0;
+                        auto result = parseHeadFields(input.first(i + 1));
+                        result.consumed += skipped;
+                        return result;
+                    }
+                }
+
+                m_scanned = input.size();
+                if (m_scanned > m_maxHeadSize)
+                    return fail();
+                return { NeedMoreData, skipped, {} };
+            }
+
+            Result parseHeadFields(QByteArrayView head)
+            {
+                m_head = HttpMessageHead{};
+                m_head.size = head.size();
+
+                qsizetype lineBegin = 0;
+                const auto nextLine = [&]() -> QByteArrayView {
+                    const auto p = static_cast<const char *>(std::memchr(head.data() + lineBegin, '\n', head.size() - lineBegin));
+                    const auto lineEnd = p - head.data() + 1;
+                    const auto line = head.sliced(lineBegin, lineEnd - lineBegin);
+                    lineBegin = lineEnd;
+                    return line;
+                };
+
+                m_head.startLine = nextLine();
+                const auto startLine = HttpMessageHead::Trimmed(m_head.startLine.chopped(1));
+                const auto sp1 = FindChar(startLine, ' ', 0);
+                const auto sp2 = sp1 < 0 ? -1 : FindChar(startLine, ' ', sp1 + 1);
+                if (sp1 <= 0)
+                    return fail();
+
+                if (m_mode == Request)
+                {
+                    if (sp2 < 0)
+                        return fail();
+                    m_head.method = startLine.first(sp1);
+                    m_head.target = startLine.sliced(sp1 + 1, sp2 - sp1 - 1);
+                    m_head.version = startLine.sliced(sp2 + 1);
+                }
+                else
+                {
+                    m_head.version = startLine.first(sp1);
+                    const auto code = startLine.sliced(sp1 + 1, (sp2 < 0 ? startLine.size() : sp2) - sp1 - 1);
+                    m_head.statusCode = int(ParseDecimal(code));
+                    m_head.reason = sp2 < 0 ? QByteArrayView{} : startLine.sliced(sp2 + 1);
+                    if (code.size() != 3 || m_head.statusCode < 100)
+                        return fail();
+                }
+
+                if (!m_head.version.startsWith("HTTP/1."))
+                    return fail();
+
+                while (lineBegin < head.size())
+                {
+                    const auto line = nextLine();
+                    const auto content = HttpMessageHead::Trimmed(line.chopped(1));
+                    if (content.isEmpty())
+                        break;
+                    const auto colon = FindChar(content, ':', 0);
+                    if (colon <= 0)
+                        return fail();
+                    m_head.headers.append({ content.first(colon), HttpMessageHead::Trimmed(content.sliced(colon + 1)), line });
+                }
+
+                const bool http11 = m_head.version == "HTTP/1.1";
+                m_head.keepAlive = http11;
+                for (const auto &h : m_head.headers)
+                {
+                    if (HttpMessageHead::EqualsIgnoreCase(h.name, "Connection") || HttpMessageHead::EqualsIgnoreCase(h.name, "Proxy-Connection"))
+                    {
+                        if (HttpMessageHead::HasToken(h.value, "close"))
+                            m_head.keepAlive = false;
+                        else if (HttpMessageHead::HasToken(h.value, "keep-alive"))
+                            m_head.keepAlive = true;
+                    }
+                    else if (HttpMessageHead::EqualsIgnoreCase(h.name, "Transfer-Encoding"))
+                        m_head.chunked = HttpMessageHead::HasToken(h.value, "chunked");
+                    else if (HttpMessageHead::EqualsIgnoreCase(h.name, "Content-Length"))
+                    {
+                        const auto length = ParseDecimal(h.value);
+                        if (length < 0 || (m_head.contentLength >= 0 && m_head.contentLength != length))
+                            return fail();
+                        m_head.contentLength = length;
+                    }
+                }
+
+                const bool noBody = std::exchange(m_nextNoBody, false) || (m_mode == Response && ((m_head.statusCode >= 100 && m_head.statusCode < 200) ||
+                                                                                                   m_head.statusCode == 204 || m_head.statusCode == 304));
+                if (noBody)
+                    m_state = State::Complete;
+                else if (m_head.chunked)
+                    m_state = State::ChunkSize, m_remaining = 0, m_chunkDigits = 0;
+                else if (m_head.contentLength > 0)
+                    m_state = State::Identity, m_remaining = m_head.contentLength;
+                else if (m_head.contentLength < 0 && m_mode == Response)
+                    m_state = State::UntilClose, m_head.keepAlive = false;
+                else
+                    m_state = State::Complete;
+
+                return { HeadComplete, head.size(), head };
+            }
+
+            Result parseChunked(QByteArrayView input)
+            {
+                qsizetype i = 0;
+                while (i < input.size() && m_state != State::Complete)
+                {
+                    const char c = input[i];
+                    switch (m_state)
+                    {
+                        case State::ChunkSize:
+                        {
+                            const int digit = HexDigit(c);
+                            if (digit >= 0)
+                            {
+                                if (++m_chunkDigits > 15)
+                                    return fail();
+                                m_remaining = m_remaining * 16 + digit;
+                            }
+                            else if (m_chunkDigits == 0)
+                                return fail();
+                            else if (c == '\n')
+                                m_state = m_remaining > 0 ? State::ChunkData : State::Trailer, m_lineLength = 0;
+                            else
+                                m_state = State::ChunkExtension;
+                            i++;
+                            break;
+                        }
+                        case State::ChunkExtension:
+                        {
+                            const auto p = static_cast<const char *>(std::memchr(input.data() + i, '\n', input.size() - i));
+                            if (!p)
+                                i = input.size();
+                            else
+                                i = p - input.data() + 1, m_state = m_remaining > 0 ? State::ChunkData : State::Trailer, m_lineLength = 0;
+                            break;
+                        }
+                        case State::ChunkData:
+                        {
+                            const auto n = qMin<qint64>(m_remaining, input.size() - i);
+                            i += n, m_remaining -= n;
+                            if (m_remaining == 0)
+                                m_state = State::ChunkDataCR;
+                            break;
+                        }
+                        case State::ChunkDataCR:
+                        {
+                            if (c == '\r')
+                            {
+                                m_state = State::ChunkDataLF, i++;
+                                break;
+                            }
+                            [[fallthrough]];
+                        }
+                        case State::ChunkDataLF:
+                        {
+                            if (c != '\n')
+                                return fail();
+                            m_state = State::ChunkSize, m_chunkDigits = 0, i++;
+                            break;
+                        }
+                        case State::Trailer:
+                        {
+                            if (c == '\n')
+                            {
+                                if (m_lineLength == 0)
+                                    m_state = State::Complete;
+                                m_lineLength = 0;
+                            }
+                            else if (c != '\r')
+                                m_lineLength++;
+                            i++;
+                            break;
+                        }
+                        default: Q_UNREACHABLE();
+                    }
+                }
+                return i == 0 ? Result{} : Result{ Body, i, input.first(i) };
+            }
+
+            static qsizetype FindChar(QByteArrayView v, char c, qsizetype from)
+            {
+                const auto p = from >= v.size() ? nullptr : static_cast<const char *>(std::memchr(v.data() + from, c, v.size() - from));
+                return p ? p - v.data() : -1;
+            }
+
+            static int HexDigit(char c)
+            {
+                if (c >= '0' && c <= '9')
+                    return c - '0';
+                if (c >= 'a' && c <= 'f')
+                    return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F')
+                    return c - 'A' + 10;
+                return -1;
+            }
+
+            static qint64 ParseDecimal(QByteArrayView v)
+            {
+                if (v.isEmpty() || v.size() > 18)
+                    return -1;
+                qint64 result = 0;
+                for (const char c : v)
+                {
+                    if (c < '0' || c > '9')
+                        return -1;
+                    result = result * 10 + (c - '0');
+                }
+                return result;
+            }
+
+          private:
+            Mode m_mode;
+            State m_state = State::Head;
+            HttpMessageHead m_head;
+            qsizetype m_scanned = 0;
+            qsizetype m_maxHeadSize = 64 * 1024;
+            qint64 m_remaining = 0;
+            int m_chunkDigits = 0;
+            int m_lineLength = 0;
+            bool m_nextNoBody = false;
+        };
+
+        ///
+        /// \brief The target of a proxied request, all views point into the request head.
+        ///
+        struct HttpRequestTarget
+        {
+            QByteArrayView host;
+            quint16 port = 0;
+            // The origin-form of the target, prefix it with a slash when needsLeadingSlash is set.
+            QByteArrayView path;
+            bool needsLeadingSlash = false;
+            bool valid = false;
+
+            static HttpRequestTarget Parse(const HttpMessageHead &head)
+            {
+                HttpRequestTarget t;
+                auto target = head.target;
+                if (head.method == "CONNECT")
+                {
+                    // authority-form: host:port
+                    t.parseAuthority(target, 443);
+                    return t;
+                }
+
+                if (target.startsWith("/"))
+                {
+                    // origin-form: the authority comes from the Host header
+                    t.path = target;
+                    t.parseAuthority(head.header("Host"), 80);
+                    return t;
+                }
+
+                const auto schemeEnd = FindSubstring(target, "://");
+                if (schemeEnd <= 0)
+                    return t;
+                const auto scheme = target.first(schemeEnd);
+                const quint16 defaultPort = HttpMessageHead::EqualsIgnoreCase(scheme, "https") ? 443 : 80;
+                target = target.sliced(schemeEnd + 3);
+
+                qsizetype authorityEnd = 0;
+                while (authorityEnd < target.size() && target[authorityEnd] != '/' && target[authorityEnd] != '?' && target[authorityEnd] != '#')
+                    authorityEnd++;
+                t.path = target.sliced(authorityEnd);
+                // The fragment belongs to the client, it is never part of the request sent upstream.
+                if (const auto fragment = FindSubstring(t.path, "#"); fragment >= 0)
+                    t.path = t.path.first(fragment);
+                t.needsLeadingSlash = !t.path.startsWith("/");
+                t.parseAuthority(target.first(authorityEnd), defaultPort);
+                return t;
+            }
+
+          private:
+            void parseAuthority(QByteArrayView authority, quint16 defaultPort)
+            {
+                // Drop userinfo, it must not be sent in the origin-form anyway.
+                for (auto i = authority.size() - 1; i >= 0; i--)
+                    if (authority[i] == '@')
+                    {
+                        authority = authority.sliced(i + 1);
+                        break;
+                    }
+
+                qsizetype portBegin = -1;
+                if (authority.startsWith("["))
+                {
+                    const auto close = FindSubstring(authority, "]");
+                    if (close < 0)
+                        return;
+                    host = authority.sliced(1, close - 1);
+                    if (close + 1 < authority.size())
+                    {
+                        if (authority[close + 1] != ':')
+                            return;
+                        portBegin = close + 2;
+                    }
+                }
+                else
+                {
+                    const auto colon = FindSubstring(authority, ":");
+                    host = colon < 0 ? authority : authority.first(colon);
+                    portBegin = colon < 0 ? -1 : colon + 1;
+                }
+
+                port = defaultPort;
+                if (portBegin >= 0)
+                {
+                    int value = 0;
+                    const auto portString = authority.sliced(portBegin);
+                    for (const char c : portString)
+                    {
+                        if (c < '0' || c > '9' || (value = value * 10 + (c - '0')) > 65535)
+                            return;
+                    }
+                    if (portString.isEmpty() || value == 0)
+                        return;
+                    port = quint16(value);
+                }
+                valid = !host.isEmpty();
+            }
+
+            static qsizetype FindSubstring(QByteArrayView haystack, QByteArrayView needle)
+            {
+                for (qsizetype i = 0; i + needle.size() <= haystack.size(); i++)
+                    if (std::memcmp(haystack.data() + i, needle.data(), needle.size()) == 0)
+                        return i;
+                return -1;
+            }
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
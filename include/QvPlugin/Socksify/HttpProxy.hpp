@@ -25,16 +25,18 @@
 
 #pragma once
 
-#include "SocketStream.hpp"
+#include "HttpProxyWorker.hpp"
+#include "QvPlugin/Common/CommonTypes.hpp"
 
-#include <QDebug>
-#include <QNetworkProxy>
-#include <QTcpServer>
-#include <QTcpSocket>
-#include <QUrl>
+#include <QThread>
+#include <QTimer>
+#include <algorithm>
 
-#ifndef FD_SETSIZE
-#define FD_SETSIZE 1024
+#ifdef Q_OS_LINUX
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #endif
 
 namespace Qv2rayPlugin
@@ -45,9 +47,42 @@ namespace Qv2rayPlugin
         {
             Q_OBJECT
           public:
-            HttpProxy() : QTcpServer()
+            enum WorkerSelection
+            {
+                LeastLoaded,
+                RoundRobin
+            };
+
+            // Client connections by configuration, see reconfigure
+            struct TransitionStatistics
+            {
+                int generation = 0;
+                // Accepted with the current configuration, and with a previous one.
+                int current = 0;
+                int draining = 0;
+            };
+
+            HttpProxy()
+                : QTcpServer(), localWorker(new HttpProxyWorker(&admission, this)), statisticsTimer(new QTimer(this)), resumeTimer(new QTimer(this))
             {
                 this->setMaxPendingConnections(FD_SETSIZE);
+                statisticsTimer->setInterval(1000);
+                connect(statisticsTimer, &QTimer::timeout, this, &HttpProxy::reportStatistics);
+                resumeTimer->setInterval(100);
+                connect(resumeTimer, &QTimer::timeout, this, &HttpProxy::resumeAcceptingIfPossible);
+            }
+
+            ~HttpProxy()
+            {
+                for (const auto &[thread, worker] : workers)
+                {
+                    // Workers own sockets living on their threads, they must be destroyed there.
+                    QMetaObject::invokeMethod(worker, [worker]() { delete worker; }, Qt::BlockingQueuedConnection);
+                    thread->quit();
+                    thread->wait();
+                    delete thread;
+                }
+                delete localWorker;
             }
 
             HttpProxy(const HttpProxy &) = delete;
@@ -58,139 +93,515 @@ namespace Qv2rayPlugin
              */
             bool httpListen(const QHostAddress &http_addr, uint16_t http_port, uint16_t socks_port)
             {
-                bool isAny = http_addr == QHostAddress::AnyIPv4 || http_addr == QHostAddress::AnyIPv6;
-                upstreamProxy = QNetworkProxy(QNetworkProxy::Socks5Proxy, isAny ? "127.0.0.1" : http_addr.toString(), socks_port);
-                return this->listen(http_addr, http_port);
+                settings.upstreamProxy = UpstreamProxy(http_addr, socks_port);
+                settings.upstreams.reset();
+                return startListening(http_addr, http_port);
             }
 
-          protected:
-            void incomingConnection(qintptr socketDescriptor)
+            /*
+             * Like httpListen, but spread the proxied connections over several SOCKS5 endpoints, e.g. one per kernel
+             * instance, choosing one for every new upstream connection with strategy. See UpstreamBalancer.
+             */
+            bool httpListen(const QHostAddress &http_addr, uint16_t http_port, const QList<UpstreamBalancer::Endpoint> &upstreams,
+                            UpstreamBalancer::Strategy strategy = UpstreamBalancer::LeastConnections)
+            {
+                if (upstreams.isEmpty())
+                    return false;
+                setUpstreams(upstreams, strategy);
+                return startListening(http_addr, http_port);
+            }
+
+            /*
+             * Switch a listening HttpProxy to another SOCKS5 port and/or listening address without dropping the
+             * connections already accepted: new requests go to the new upstream, existing tunnels and requests
+             * being served carry on with the previous one until they end by themselves. With a drainTimeoutMsec,
+             * the connections of previous configurations still open after that long are closed.
+             * The listener is only rebound if the address or port changes; if the new one cannot be bound, the
+             * previous one is restored and false is returned, the new upstream is used anyway.
+             */
+            bool reconfigure(const QHostAddress &http_addr, uint16_t http_port, uint16_t socks_port, int drainTimeoutMsec = 0)
+            {
+                settings.upstreamProxy = UpstreamProxy(http_addr, socks_port);
+                settings.upstreams.reset();
+                return reconfigureListener(http_addr, http_port, drainTimeoutMsec);
+            }
+
+            // Like reconfigure, with several upstream SOCKS5 endpoints, see the second httpListen.
+            bool reconfigure(const QHostAddress &http_addr, uint16_t http_port, const QList<UpstreamBalancer::Endpoint> &upstreams,
+                             UpstreamBalancer::Strategy strategy = UpstreamBalancer::LeastConnections, int drainTimeoutMsec = 0)
             {
-                QTcpSocket *socket = new QTcpSocket(this);
-                connect(socket, &QTcpSocket::readyRead, this, &HttpProxy::onSocketReadyRead);
-                connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
-                connect(socket, &QAbstractSocket::errorOccurred, this, &HttpProxy::onSocketError);
-                socket->setSocketDescriptor(socketDescriptor);
+                if (upstreams.isEmpty())
+                    return false;
+                setUpstreams(upstreams, strategy);
+                return reconfigureListener(http_addr, http_port, drainTimeoutMsec);
+            }
+
+            /*
+             * Passive health tracking of the upstream endpoints: one failing to connect maxFailures times in a row is
+             * left out for ejectTimeMsec milliseconds, see UpstreamBalancer. Applies to the current endpoints at once.
+             */
+            void setUpstreamHealthPolicy(int maxFailures, int ejectTimeMsec)
+            {
+                upstreamMaxFailures = maxFailures;
+                upstreamEjectTime = ejectTimeMsec;
+                if (settings.upstreams)
+                    settings.upstreams->setHealthPolicy(maxFailures, ejectTimeMsec);
+            }
+
+            // Connections and failures of every upstream endpoint, empty with a single SOCKS5 port.
+            QList<UpstreamBalancer::EndpointStatistics> upstreamStatistics() const
+            {
+                return settings.upstreams ? settings.upstreams->statistics() : QList<UpstreamBalancer::EndpointStatistics>{};
             }
 
           private:
-            QNetworkProxy upstreamProxy;
+            bool startListening(const QHostAddress &http_addr, uint16_t http_port)
+            {
+                startWorkers();
+                applySettings();
+                if (statisticsTimer->interval() > 0)
+                    statisticsTimer->start();
+                return listenOn(http_addr, http_port);
+            }
 
-          private slots:
-            void onSocketError(QAbstractSocket::SocketError err)
+            void setUpstreams(const QList<UpstreamBalancer::Endpoint> &upstreams, UpstreamBalancer::Strategy strategy)
             {
-                if (err != QAbstractSocket::RemoteHostClosedError)
+                settings.upstreams = std::make_shared<UpstreamBalancer>(upstreams, strategy);
+                settings.upstreams->setHealthPolicy(upstreamMaxFailures, upstreamEjectTime);
+                settings.upstreamProxy = settings.upstreams->proxy(0);
+            }
+
+            bool reconfigureListener(const QHostAddress &http_addr, uint16_t http_port, int drainTimeoutMsec)
+            {
+                settings.generation++;
+                applySettings();
+                if (drainTimeoutMsec > 0)
                 {
-                    QDebug(QtMsgType::QtWarningMsg) << "HTTP socket error: " << err;
+                    const auto generation = settings.generation;
+                    QTimer::singleShot(drainTimeoutMsec, this, [this, generation]() { closeConnectionsBefore(generation); });
                 }
-                sender()->deleteLater();
+
+                if (http_addr == serverAddress() && http_port == serverPort())
+                    return true;
+                const auto previousAddress = serverAddress();
+                const auto previousPort = serverPort();
+                stopListening();
+                if (listenOn(http_addr, http_port))
+                    return true;
+                listenOn(previousAddress, previousPort);
+                return false;
+            }
+
+          public:
+            // How many client connections are still served with a configuration older than the current one.
+            TransitionStatistics transitionStatistics() const
+            {
+                TransitionStatistics result;
+                result.generation = settings.generation;
+                for (const auto worker : allWorkers())
+                    for (const auto &c : worker->connectionStatistics())
+                        (c.generation < settings.generation ? result.draining : result.current)++;
+                return result;
+            }
+
+            /*
+             * Emit statisticsAvailable every msec milliseconds with the bytes relayed since the previous emission,
+             * the counters are only aggregated then, never per packet. An interval of 0 disables it.
+             */
+            void setStatisticsInterval(int msec)
+            {
+                statisticsTimer->setInterval(msec);
+                if (msec <= 0)
+                    statisticsTimer->stop();
+                else if (isListening())
+                    statisticsTimer->start();
             }
 
-            void onSocketReadyRead()
+            // All bytes relayed since the HttpProxy was created, as direct traffic when it bypassed the upstream proxy.
+            StatisticsObject trafficStatistics() const
             {
-                QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
-                QTcpSocket *proxySocket = nullptr;
+                StatisticsObject result;
+                for (const auto worker : allWorkers())
+                {
+                    // Direct bytes are counted after the total ones, read first they never exceed the total.
+                    const auto directUp = worker->directTraffic().upBytes(), directDown = worker->directTraffic().downBytes();
+                    result.directUp += directUp, result.directDown += directDown;
+                    result.proxyUp += worker->traffic().upBytes() - directUp;
+                    result.proxyDown += worker->traffic().downBytes() - directDown;
+                }
+                return result;
+            }
 
-                QByteArray reqData = socket->readAll();
-                int pos = reqData.indexOf("\r\n");
-                QByteArray reqLine = reqData.left(pos);
-                reqData.remove(0, pos + 2);
+            // The client connections alive right now, the heaviest ones first.
+            QList<ConnectionStatistics> connectionStatistics() const
+            {
+                QList<ConnectionStatistics> result;
+                for (const auto worker : allWorkers())
+                    result.append(worker->connectionStatistics());
+                std::sort(result.begin(), result.end(), [](const auto &a, const auto &b) { return a.up + a.down > b.up + b.down; });
+                return result;
+            }
 
-                QList<QByteArray> entries = reqLine.split(' ');
-                QByteArray method = entries.value(0);
-                QByteArray address = entries.value(1);
-                QByteArray version = entries.value(2);
+            /*
+             * Serve connections on workerCount threads, each running its own event loop, instead of the thread of
+             * the HttpProxy, which then only accepts connections and hands them to the workers.
+             * With reusePort (Linux only), every worker also listens on the address with SO_REUSEPORT so that the
+             * kernel spreads new connections between them without involving the accepting thread.
+             * Must be called before httpListen, a workerCount of 0 serves everything on the current thread.
+             */
+            void setWorkerThreads(int workerCount, WorkerSelection selection = LeastLoaded, bool reusePort = false)
+            {
+                Q_ASSERT_X(!isListening(), "HttpProxy", "setWorkerThreads must be called before httpListen");
+                this->workerCount = workerCount;
+                this->workerSelection = selection;
+                this->reusePort = reusePort;
+            }
 
-                QString host;
-                uint16_t port;
-                QString key;
+            /*
+             * Connect straight to the target of the requests that routing sends to the outbound tagged
+             * directOutboundTag, instead of going through the SOCKS5 upstream, see RoutingMatcher for which rules
+             * can be decided here. Applies to new requests, an empty RoutingObject (no rules) disables the bypass.
+             */
+            void setRouting(const RoutingObject &routing, const QString &directOutboundTag = QStringLiteral("direct"))
+            {
+                settings.routing = routing.rules.isEmpty() ? nullptr : std::make_shared<const RoutingMatcher>(routing, directOutboundTag);
+                applySettings();
+            }
 
-                if (method != "CONNECT")
+            // How many requests went direct and how many through the upstream proxy, since the HttpProxy was created.
+            RoutingMatcher::Statistics routingStatistics() const
+            {
+                RoutingMatcher::Statistics result;
+                for (const auto worker : allWorkers())
                 {
-                    QUrl url = QUrl::fromEncoded(address);
-                    if (!url.isValid())
-                    {
-                        QDebug(QtMsgType::QtCriticalMsg) << "Invalid URL: " << url;
-                        socket->disconnectFromHost();
-                        return;
-                    }
-                    host = url.host();
-                    port = url.port(80);
-                    QString req = url.path();
-                    if (url.hasQuery())
-                    {
-                        req.append('?').append(url.query());
-                    }
-                    reqLine = method + " " + req.toUtf8() + " " + version + "\r\n";
-                    reqData.prepend(reqLine);
-                    key = host + ':' + QString::number(port);
-                    proxySocket = socket->findChild<QTcpSocket *>(key);
-                    if (proxySocket)
-                    {
-                        proxySocket->write(reqData);
-                        return; // if we find an existing socket, then use it and return
-                    }
+                    const auto s = worker->routingStatistics();
+                    result.direct += s.direct, result.proxied += s.proxied;
                 }
+                return result;
+            }
+
+            /*
+             * Watermarks applied to every CONNECT tunnel, see SocketStream::setFlowControl
+             * A highWatermark of 0 disables flow control.
+             */
+            void setRelayWatermarks(qint64 highWatermark, qint64 lowWatermark = -1)
+            {
+                settings.relayHighWatermark = highWatermark;
+                settings.relayLowWatermark = lowWatermark;
+                applySettings();
+            }
+
+            /*
+             * Let CONNECT tunnels move data with splice(2) when both ends are plain TCP sockets (Linux only),
+             * see SocketStream::setZeroCopyEnabled
+             */
+            void setZeroCopyRelay(bool enabled)
+            {
+                settings.zeroCopyRelay = enabled;
+                applySettings();
+            }
+
+            /*
+             * Let CONNECT tunnels be relayed by the io_uring of their worker thread (Linux 6.0 and later), which
+             * batches the system calls of all the tunnels of a thread, see SocketStream::setIoUringEnabled
+             * Falls back to splice, or to the Qt path, where io_uring is unavailable.
+             */
+            void setIoUringRelay(bool enabled)
+            {
+                settings.ioUringRelay = enabled;
+                applySettings();
+            }
+
+            /*
+             * Shares the worker threads fairly between CONNECT tunnels (deficit round robin, see TrafficShaper), so a
+             * bulk download cannot delay the small flows of the same thread, and limits their speed in bytes per
+             * second, per tunnel direction and for all tunnels together. A limit of 0 means unlimited, and shaping is
+             * off when fairScheduling is false and both limits are 0. Changed limits apply to running tunnels at once,
+             * switching shaping on or off only to new tunnels. Shaped tunnels are never relayed by splice or io_uring.
+             */
+            void setTunnelShaping(bool fairScheduling, qint64 tunnelBytesPerSecond = 0, qint64 totalBytesPerSecond = 0)
+            {
+                settings.fairScheduling = fairScheduling;
+                settings.tunnelRateLimit = qMax<qint64>(0, tunnelBytesPerSecond);
+                if (totalBytesPerSecond <= 0)
+                    settings.totalRateLimit.reset();
                 else
                 {
-                    // CONNECT method
-                    /*
-                     * http://tools.ietf.org/html/draft-luotonen-ssl-tunneling-03
-                     * the first line would CONNECT HOST:PORT VERSION
-                     */
-                    QList<QByteArray> host_port_list = address.split(':');
-                    host = QString(host_port_list.first());
-                    port = host_port_list.last().toUShort();
+                    // Kept across changes, so the tokens of the bucket are not reset.
+                    if (!settings.totalRateLimit)
+                        settings.totalRateLimit = std::make_shared<SharedTokenBucket>();
+                    settings.totalRateLimit->setRate(totalBytesPerSecond);
                 }
+                applySettings();
+            }
+
+            /*
+             * Limits of the idle plain-HTTP upstream connections kept for reuse, see UpstreamPool
+             * Every worker has its own pool.
+             */
+            void setConnectionPoolLimits(int maxIdlePerKey, int maxIdle, int idleTimeoutMsec)
+            {
+                settings.poolMaxIdlePerKey = maxIdlePerKey;
+                settings.poolMaxIdle = maxIdle;
+                settings.poolIdleTimeout = idleTimeoutMsec;
+                applySettings();
+            }
+
+            /*
+             * Caps of concurrent client connections, globally and per client address, 0 means unlimited.
+             * Connections over a cap are closed as soon as they are accepted, unless pauseWhenFull is set: then
+             * reaching the global cap stops accepting, leaving new connections in the listen backlog until a
+             * slot is free again. With SO_REUSEPORT sharding the workers always close the excess connections.
+             */
+            void setConnectionLimits(int maxConnections, int maxConnectionsPerClient = 0, bool pauseWhenFull = false)
+            {
+                admission.setLimits(maxConnections, maxConnectionsPerClient);
+                this->pauseWhenFull = pauseWhenFull;
+            }
 
-                proxySocket = new QTcpSocket(socket);
-                proxySocket->setProxy(upstreamProxy);
-                if (method != "CONNECT")
+            /*
+             * Deadlines in milliseconds, 0 disables one:
+             * headerTimeout - to receive a complete request head (slowloris protection)
+             * keepAliveTimeout - between two requests of a keep-alive client connection
+             * upstreamTimeout - without any byte relayed while a request is being served, or a tunnel is being set up
+             * tunnelIdleTimeout - without any byte relayed through an established CONNECT tunnel
+             * They are checked once a second.
+             */
+            void setTimeouts(int headerTimeout, int keepAliveTimeout, int upstreamTimeout, int tunnelIdleTimeout)
+            {
+                settings.headerTimeout = headerTimeout;
+                settings.keepAliveTimeout = keepAliveTimeout;
+                settings.upstreamTimeout = upstreamTimeout;
+                settings.tunnelIdleTimeout = tunnelIdleTimeout;
+                applySettings();
+            }
+
+            // How many connections are open, and how many have been refused or closed by each policy.
+            AdmissionControl::Statistics admissionStatistics() const
+            {
+                return admission.statistics();
+            }
+
+            UpstreamPool::Statistics connectionPoolStatistics() const
+            {
+                UpstreamPool::Statistics result;
+                for (const auto worker : allWorkers())
                 {
-                    proxySocket->setObjectName(key);
-                    proxySocket->setProperty("reqData", reqData);
-                    connect(proxySocket, &QTcpSocket::connected, this, &HttpProxy::onProxySocketConnected);
-                    connect(proxySocket, &QTcpSocket::readyRead, this, &HttpProxy::onProxySocketReadyRead);
+                    const auto s = worker->connectionPool().statistics();
+                    result.hits += s.hits, result.misses += s.misses, result.evicted += s.evicted, result.rejected += s.rejected, result.idle += s.idle;
                 }
-                else
+                return result;
+            }
+
+          signals:
+            void statisticsAvailable(StatisticsObject);
+
+          protected:
+            void incomingConnection(qintptr socketDescriptor) override
+            {
+                if (!admission.acquire())
                 {
-                    connect(proxySocket, &QTcpSocket::connected, this, &HttpProxy::onProxySocketConnectedHttps);
+                    QTcpSocket rejected;
+                    rejected.setSocketDescriptor(socketDescriptor);
+                    rejected.abort();
+                    return;
                 }
-                connect(proxySocket, &QTcpSocket::disconnected, proxySocket, &QTcpSocket::deleteLater);
-                connect(socket, &QAbstractSocket::errorOccurred, this, &HttpProxy::onSocketError);
-                proxySocket->connectToHost(host, port);
+
+                if (pauseWhenFull && admission.isFull())
+                {
+                    pauseAccepting();
+                    admission.count(AdmissionControl::AcceptPaused);
+                    resumeTimer->start();
+                }
+                selectWorker()->dispatchConnection(socketDescriptor);
             }
 
-            void onProxySocketConnected()
+          private:
+            QList<const HttpProxyWorker *> allWorkers() const
             {
-                QTcpSocket *proxySocket = qobject_cast<QTcpSocket *>(sender());
-                QByteArray reqData = proxySocket->property("reqData").toByteArray();
-                proxySocket->write(reqData);
+                QList<const HttpProxyWorker *> result{ localWorker };
+                for (const auto &[thread, worker] : workers)
+                    result.append(worker);
+                return result;
             }
 
-            // this function is used for HTTPS transparent proxy
-            void onProxySocketConnectedHttps()
+            static QNetworkProxy UpstreamProxy(const QHostAddress &http_addr, uint16_t socks_port)
             {
-                QTcpSocket *proxySocket = qobject_cast<QTcpSocket *>(sender());
-                QTcpSocket *socket = qobject_cast<QTcpSocket *>(proxySocket->parent());
-                disconnect(socket, &QTcpSocket::readyRead, this, &HttpProxy::onSocketReadyRead);
+                bool isAny = http_addr == QHostAddress::AnyIPv4 || http_addr == QHostAddress::AnyIPv6;
+                return QNetworkProxy(QNetworkProxy::Socks5Proxy, isAny ? "127.0.0.1" : http_addr.toString(), socks_port);
+            }
 
-                /*
-                 * once it's connected
-                 * we use a light-weight SocketStream class to do the job
-                 */
-                auto stream = new SocketStream(socket, proxySocket, this);
-                connect(socket, &QTcpSocket::disconnected, stream, &SocketStream::deleteLater);
-                connect(proxySocket, &QTcpSocket::disconnected, stream, &SocketStream::deleteLater);
-                static const auto httpsHeader = "HTTP/1.0 200 Connection established\r\n\r\n";
-                socket->write(httpsHeader);
+            bool listenOn(const QHostAddress &address, quint16 port)
+            {
+                if (workers.isEmpty() || !reusePort)
+                    return this->listen(address, port);
+                return listenReusePort(address, port);
+            }
+
+            void stopListening()
+            {
+                this->close();
+                for (const auto &[thread, worker] : workers)
+                    QMetaObject::invokeMethod(worker, &HttpProxyWorker::stopListening, Qt::BlockingQueuedConnection);
+            }
+
+            void closeConnectionsBefore(int generation)
+            {
+                localWorker->closeConnectionsBefore(generation);
+                for (const auto &[thread, worker] : workers)
+                    QMetaObject::invokeMethod(worker, [worker, generation]() { worker->closeConnectionsBefore(generation); });
             }
-            void onProxySocketReadyRead()
+
+            void resumeAcceptingIfPossible()
             {
-                QTcpSocket *proxySocket = qobject_cast<QTcpSocket *>(sender());
-                QTcpSocket *socket = qobject_cast<QTcpSocket *>(proxySocket->parent());
-                socket->write(proxySocket->readAll());
+                if (admission.isFull())
+                    return;
+                resumeTimer->stop();
+                resumeAccepting();
             }
+
+            void reportStatistics()
+            {
+                const auto total = trafficStatistics();
+                StatisticsObject delta;
+                delta.directUp = total.directUp - lastReported.directUp;
+                delta.directDown = total.directDown - lastReported.directDown;
+                delta.proxyUp = total.proxyUp - lastReported.proxyUp;
+                delta.proxyDown = total.proxyDown - lastReported.proxyDown;
+                lastReported = total;
+                emit statisticsAvailable(delta);
+            }
+
+            HttpProxyWorker *selectWorker()
+            {
+                if (workers.isEmpty())
+                    return localWorker;
+
+                if (workerSelection == RoundRobin)
+                    return workers[nextWorker++ % workers.size()].second;
+
+                auto selected = workers.first().second;
+                for (const auto &[thread, worker] : workers)
+                    if (worker->load() < selected->load())
+                        selected = worker;
+                return selected;
+            }
+
+            void startWorkers()
+            {
+                while (workers.size() < workerCount)
+                {
+                    const auto thread = new QThread;
+                    thread->setObjectName(QStringLiteral("HttpProxyWorker %1").arg(workers.size()));
+                    const auto worker = new HttpProxyWorker(&admission);
+                    worker->moveToThread(thread);
+                    thread->start();
+                    workers.append({ thread, worker });
+                }
+            }
+
+            void applySettings()
+            {
+                localWorker->applySettings(settings);
+                for (const auto &[thread, worker] : workers)
+                    QMetaObject::invokeMethod(worker, [worker, s = settings]() { worker->applySettings(s); });
+            }
+
+            bool listenReusePort(const QHostAddress &address, quint16 port)
+            {
+#ifdef Q_OS_LINUX
+                // The first descriptor decides the port when an ephemeral one has been asked for.
+                const int fd = createReusePortListener(address, port);
+                if (fd < 0 || !this->setSocketDescriptor(fd))
+                {
+                    if (fd >= 0)
+                        ::close(fd);
+                    return false;
+                }
+                port = serverPort();
+
+                // A failed shard leaves nothing bound, the caller may retry without adding duplicate listeners.
+                for (const auto &[thread, worker] : workers)
+                {
+                    const int shard = createReusePortListener(address, port);
+                    bool listening = false;
+                    if (shard >= 0)
+                        QMetaObject::invokeMethod(
+                            worker, [worker, shard, &listening]() { listening = worker->listenOn(shard); }, Qt::BlockingQueuedConnection);
+                    if (!listening)
+                    {
+                        if (shard >= 0)
+                            ::close(shard);
+                        stopListening();
+                        return false;
+                    }
+                }
+                return true;
+#else
+                return this->listen(address, port);
+#endif
+            }
+
+#ifdef Q_OS_LINUX
+            static int createReusePortListener(const QHostAddress &address, quint16 port)
+            {
+                const bool ipv4 = address.protocol() == QAbstractSocket::IPv4Protocol;
+                const int fd = ::socket(ipv4 ? AF_INET : AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                    return -1;
+
+                const int one = 1;
+                const int v6only = address.protocol() == QAbstractSocket::IPv6Protocol ? 1 : 0;
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+                sockaddr_storage storage{};
+                socklen_t length;
+                if (ipv4)
+                {
+                    auto sin = reinterpret_cast<sockaddr_in *>(&storage);
+                    sin->sin_family = AF_INET;
+                    sin->sin_port = htons(port);
+                    sin->sin_addr.s_addr = htonl(address.toIPv4Address());
+                    length = sizeof(sockaddr_in);
+                }
+                else
+                {
+                    // QHostAddress::Any is dual-stack, like QTcpServer does it.
+                    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+                    auto sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+                    sin6->sin6_family = AF_INET6;
+                    sin6->sin6_port = htons(port);
+                    const auto ip6 = address.protocol() == QAbstractSocket::IPv6Protocol ? address.toIPv6Address() : Q_IPV6ADDR{};
+                    std::memcpy(&sin6->sin6_addr, &ip6, sizeof(ip6));
+                    sin6->sin6_scope_id = address.scopeId().toUInt();
+                    length = sizeof(sockaddr_in6);
+                }
+
+                if (::bind(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0 || ::listen(fd, SOMAXCONN) != 0)
+                {
+                    ::close(fd);
+                    return -1;
+                }
+                return fd;
+            }
+#endif
+
+          private:
+            HttpProxySettings settings;
+            AdmissionControl admission;
+            HttpProxyWorker *localWorker;
+            QTimer *statisticsTimer;
+            QTimer *resumeTimer;
+            bool pauseWhenFull = false;
+            int upstreamMaxFailures = 3;
+            int upstreamEjectTime = 30 * 1000;
+            StatisticsObject lastReported;
+            QList<QPair<QThread *, HttpProxyWorker *>> workers;
+            int workerCount = 0;
+            WorkerSelection workerSelection = LeastLoaded;
+            bool reusePort = false;
+            quint32 nextWorker = 0;
         };
     } // namespace Utils
 } // namespace Qv2rayPlugin
@@ -0,0 +1,882 @@
+#pragma once
+
+#include "AdmissionControl.hpp"
+#include "HttpParser.hpp"
+#include "RoutingMatcher.hpp"
+#include "Socks5Client.hpp"
+#include "SocketStream.hpp"
+#include "TrafficCounter.hpp"
+#include "UpstreamBalancer.hpp"
+#include "UpstreamPool.hpp"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QPointer>
+#include <QNetworkProxy>
+#include <QQueue>
+#include <QSet>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <atomic>
+#include <memory>
+
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 1024
+#endif
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        struct HttpProxySettings
+        {
+            QNetworkProxy upstreamProxy;
+            // Replaces upstreamProxy when several endpoints are used, see HttpProxy::httpListen
+            std::shared_ptr<UpstreamBalancer> upstreams;
+            // See SocketStream::setFlowControl, a highWatermark of 0 disables flow control.
+            qint64 relayHighWatermark = 512 * 1024;
+            qint64 relayLowWatermark = -1;
+            // See SocketStream::setZeroCopyEnabled
+            bool zeroCopyRelay = true;
+            // See SocketStream::setIoUringEnabled
+            bool ioUringRelay = false;
+            // See HttpProxy::setTunnelShaping, shaped tunnels never use splice or io_uring.
+            bool fairScheduling = false;
+            qint64 tunnelRateLimit = 0;
+            std::shared_ptr<SharedTokenBucket> totalRateLimit;
+            // See UpstreamPool
+            int poolIdleTimeout = 30 * 1000;
+            int poolMaxIdlePerKey = 8;
+            int poolMaxIdle = 256;
+            // Deadlines in milliseconds, 0 disables them, see HttpProxy::setTimeouts
+            int headerTimeout = 30 * 1000;
+            int keepAliveTimeout = 60 * 1000;
+            int upstreamTimeout = 120 * 1000;
+            int tunnelIdleTimeout = 0;
+            // Requests it sends to the direct outbound bypass the upstream proxy, see HttpProxy::setRouting
+            std::shared_ptr<const RoutingMatcher> routing;
+            // Incremented by every HttpProxy::reconfigure, connections remember the one they were accepted with.
+            int generation = 0;
+        };
+
+        class HttpProxySession;
+
+        /*
+         * Serves the client connections of a HttpProxy on the thread it lives in.
+         * Every connection, its upstream connections and tunnels stay on that thread for their whole life.
+         */
+        class HttpProxyWorker : public QObject
+        {
+            Q_OBJECT
+            friend class HttpProxySession;
+
+          public:
+            explicit HttpProxyWorker(AdmissionControl *admission, QObject *parent = nullptr) : QObject(parent), admission(admission), pool(this), shaper(this), reaper(this)
+            {
+                // Deadlines are checked by a single coarse timer, not by one timer per connection.
+                reaper.setInterval(1000);
+                connect(&reaper, &QTimer::timeout, this, &HttpProxyWorker::reapConnections);
+            }
+
+            ~HttpProxyWorker()
+            {
+                // Sessions return their upstream connections to the pool when destroyed, the pool must still exist then.
+                qDeleteAll(findChildren<QTcpSocket *>(QString(), Qt::FindDirectChildrenOnly));
+            }
+
+            HttpProxyWorker(const HttpProxyWorker &) = delete;
+
+            void applySettings(const HttpProxySettings &s)
+            {
+                // Idle connections to the previous upstream must not serve new requests.
+                if (s.generation != settings.generation)
+                    pool.clear();
+                settings = s;
+                pool.setIdleTimeout(s.poolIdleTimeout);
+                pool.setMaxIdlePerKey(s.poolMaxIdlePerKey);
+                pool.setMaxIdle(s.poolMaxIdle);
+                shaper.setFlowRate(s.tunnelRateLimit);
+                shaper.setSharedBucket(s.totalRateLimit);
+            }
+
+            // Number of client connections handed to this worker and not closed yet, safe to call from any thread.
+            int load() const
+            {
+                return activeConnections.load(std::memory_order_relaxed);
+            }
+
+            const UpstreamPool &connectionPool() const
+            {
+                return pool;
+            }
+
+            // Bytes relayed by all connections of this worker so far, safe to read from any thread.
+            const TrafficCounter &traffic() const
+            {
+                return totalTraffic;
+            }
+
+            // The part of traffic() that bypassed the upstream proxy.
+            const TrafficCounter &directTraffic() const
+            {
+                return totalDirectTraffic;
+            }
+
+            RoutingMatcher::Statistics routingStatistics() const
+            {
+                return routingCounters.statistics();
+            }
+
+            // Safe to call from any thread.
+            QList<ConnectionStatistics> connectionStatistics() const
+            {
+                QList<ConnectionStatistics> result;
+                const QMutexLocker locker(&connectionsLock);
+                result.reserve(connections.size());
+                for (const auto &c : connections)
+                    result.append({ c.client, c.target, c.tunnel, c.traffic->upBytes(), c.traffic->downBytes(), c.age.elapsed(), c.generation });
+                return result;
+            }
+
+            /*
+             * Hands a descriptor accepted on any thread over to this worker, safe to call from any thread.
+             * The caller must have taken a slot with AdmissionControl::acquire for it.
+             */
+            void dispatchConnection(qintptr socketDescriptor)
+            {
+                activeConnections++;
+                QMetaObject::invokeMethod(this, [this, socketDescriptor]() { acceptConnection(socketDescriptor); });
+            }
+
+            /*
+             * Accept connections from a listening descriptor owned by this worker, used for SO_REUSEPORT sharding
+             * where every worker listens on the same address and the kernel balances the connections.
+             */
+            bool listenOn(qintptr listeningDescriptor)
+            {
+                const auto shard = new QTcpServer(this);
+                shard->setMaxPendingConnections(FD_SETSIZE);
+                if (!shard->setSocketDescriptor(listeningDescriptor))
+                {
+                    delete shard;
+                    return false;
+                }
+                connect(shard, &QTcpServer::newConnection, this, [this, shard]() {
+                    while (const auto socket = shard->nextPendingConnection())
+                    {
+                        if (!admission->acquire())
+                        {
+                            socket->abort();
+                            delete socket;
+                            continue;
+                        }
+                        socket->setParent(this);
+                        activeConnections++;
+                        acceptSocket(socket);
+                    }
+                });
+                return true;
+            }
+
+            // Stops accepting on the descriptors given to listenOn, accepted connections are not affected.
+            void stopListening()
+            {
+                qDeleteAll(findChildren<QTcpServer *>(QString(), Qt::FindDirectChildrenOnly));
+            }
+
+            // Closes the connections accepted before the given generation of the settings.
+            void closeConnectionsBefore(int generation);
+
+          private:
+            struct TrackedConnection
+            {
+                QString client;
+                QString target;
+                bool tunnel = false;
+                const TrafficCounter *traffic = nullptr;
+                QElapsedTimer age;
+                int generation = 0;
+            };
+
+            void acceptSocket(QTcpSocket *socket);
+
+            // The registry is only touched when a connection starts, changes target or ends, never per packet.
+            void trackConnection(const QObject *key, const QString &client, const TrafficCounter *traffic)
+            {
+                TrackedConnection c{ client, {}, false, traffic, {}, settings.generation };
+                c.age.start();
+                const QMutexLocker locker(&connectionsLock);
+                connections.insert(key, c);
+            }
+
+            void updateConnection(const QObject *key, const QString &target, bool tunnel)
+            {
+                const QMutexLocker locker(&connectionsLock);
+                if (const auto it = connections.find(key); it != connections.end())
+                    it->target = target, it->tunnel = tunnel;
+            }
+
+            void untrackConnection(const QObject *key)
+            {
+                const QMutexLocker locker(&connectionsLock);
+                connections.remove(key);
+            }
+
+            void acceptConnection(qintptr socketDescriptor)
+            {
+                QTcpSocket *socket = new QTcpSocket(this);
+                if (!socket->setSocketDescriptor(socketDescriptor))
+                {
+                    delete socket;
+                    activeConnections--;
+                    admission->release();
+                    return;
+                }
+                acceptSocket(socket);
+            }
+
+            bool routeDirect(const QString &host, quint16 port)
+            {
+                if (!settings.routing)
+                    return false;
+                const bool direct = settings.routing->match(host, port) == RoutingMatcher::Direct;
+                (direct ? routingCounters.direct : routingCounters.proxied).fetch_add(1, std::memory_order_relaxed);
+                return direct;
+            }
+
+            // A non-empty poolKey allows reusing an idle connection from the pool.
+            QTcpSocket *connectUpstream(const QString &host, quint16 port, QObject *parent, bool direct, const QString &poolKey = {})
+            {
+                if (!poolKey.isEmpty())
+                    if (const auto pooled = pool.checkout(poolKey, parent); pooled)
+                    {
+                        if (const auto lease = upstreamLeases.value(pooled); lease)
+                            lease->resume();
+                        return pooled;
+                    }
+
+                QTcpSocket *proxySocket = new QTcpSocket(parent);
+                if (direct)
+                {
+                    proxySocket->setProxy(QNetworkProxy::NoProxy);
+                    proxySocket->connectToHost(host, port);
+                    return proxySocket;
+                }
+                auto upstream = settings.upstreamProxy;
+                int endpoint = -1;
+                if (const auto balancer = settings.upstreams; balancer)
+                {
+                    endpoint = balancer->acquire(host);
+                    upstream = balancer->proxy(endpoint);
+                    upstreamLeases.insert(proxySocket, std::make_shared<UpstreamBalancer::Lease>(balancer, endpoint));
+                    connect(proxySocket, &QObject::destroyed, this, [this, proxySocket]() { upstreamLeases.remove(proxySocket); });
+                }
+                // The request can be written right away, it is pipelined behind the SOCKS5 handshake.
+                if (upstream.type() == QNetworkProxy::Socks5Proxy && Socks5Client::ConnectToHost(proxySocket, upstream, host, port))
+                {
+                    if (endpoint >= 0)
+                        TrackUpstreamHealth(proxySocket, settings.upstreams, endpoint);
+                    return proxySocket;
+                }
+                proxySocket->setProxy(upstream);
+                proxySocket->connectToHost(host, port);
+                return proxySocket;
+            }
+
+            // Reports the outcome of the SOCKS5 negotiation of proxySocket to the balancer that picked its endpoint.
+            static void TrackUpstreamHealth(QTcpSocket *proxySocket, const std::shared_ptr<UpstreamBalancer> &balancer, int endpoint)
+            {
+                const auto socks = Socks5Client::Negotiator(proxySocket);
+                // Any well-formed reply shows the endpoint works, even if it refuses this target.
+                connect(socks, &Socks5Client::established, [balancer, endpoint]() { balancer->reportSuccess(endpoint); });
+                connect(socks, &Socks5Client::failed, [balancer, endpoint](quint8 reply) {
+                    if (reply == 0xFF)
+                        balancer->reportFailure(endpoint);
+                    else
+                        balancer->reportSuccess(endpoint);
+                });
+                // Only errors before the negotiation is over, the negotiator is gone afterwards.
+                connect(proxySocket, &QAbstractSocket::errorOccurred, socks, [balancer, endpoint]() { balancer->reportFailure(endpoint); });
+            }
+
+            // this function is used for HTTPS transparent proxy
+            SocketStream *startTunnel(QTcpSocket *socket, QTcpSocket *proxySocket, TrafficCounter *connectionTraffic, bool direct)
+            {
+                /*
+                 * once it's connected
+                 * we use a light-weight SocketStream class to do the job
+                 */
+                auto stream = new SocketStream(socket, proxySocket, this);
+                stream->setFlowControl(settings.relayHighWatermark, settings.relayLowWatermark);
+                stream->addTrafficCounter(connectionTraffic);
+                stream->addTrafficCounter(&totalTraffic);
+                if (direct)
+                    stream->addTrafficCounter(&totalDirectTraffic);
+                // proxySocket is a child of socket, deleting the latter releases both ends of the tunnel.
+                connect(stream, &SocketStream::finished, socket, &QTcpSocket::deleteLater);
+                connect(stream, &SocketStream::finished, stream, &SocketStream::deleteLater);
+                static const auto httpsHeader = "HTTP/1.0 200 Connection established\r\n\r\n";
+                socket->write(httpsHeader);
+                // Bytes that came along with the SOCKS5 reply, a server-first protocol may have sent them already.
+                if (proxySocket->bytesAvailable() > 0)
+                {
+                    const auto written = socket->write(proxySocket->readAll());
+                    connectionTraffic->addDown(written), totalTraffic.addDown(written);
+                    if (direct)
+                        totalDirectTraffic.addDown(written);
+                }
+                if (settings.fairScheduling || settings.tunnelRateLimit > 0 || settings.totalRateLimit)
+                    stream->setTrafficShaper(&shaper);
+                stream->setIoUringEnabled(settings.ioUringRelay);
+                stream->setZeroCopyEnabled(settings.zeroCopyRelay);
+                return stream;
+            }
+
+            void reapConnections();
+
+            // Connections idling in the pool do not count as active on their balancer endpoint.
+            void checkinUpstream(const QString &key, QTcpSocket *proxySocket)
+            {
+                if (const auto lease = upstreamLeases.value(proxySocket); lease)
+                    lease->suspend();
+                pool.checkin(key, proxySocket);
+            }
+
+          private:
+            HttpProxySettings settings;
+            AdmissionControl *admission;
+            // Balancer slots of the upstream connections, declared before the pool which may still hold some of them.
+            QHash<const QTcpSocket *, std::shared_ptr<UpstreamBalancer::Lease>> upstreamLeases;
+            UpstreamPool pool;
+            TrafficShaper shaper;
+            QTimer reaper;
+            QSet<HttpProxySession *> sessions;
+            std::atomic<int> activeConnections{ 0 };
+            TrafficCounter totalTraffic;
+            TrafficCounter totalDirectTraffic;
+            RoutingMatcher::Counters routingCounters;
+            mutable QMutex connectionsLock;
+            QHash<const QObject *, TrackedConnection> connections;
+
+          private slots:
+            void onSocketError(QAbstractSocket::SocketError err)
+            {
+                if (err != QAbstractSocket::RemoteHostClosedError)
+                {
+                    QDebug(QtMsgType::QtWarningMsg) << "HTTP socket error: " << err;
+                }
+                sender()->deleteLater();
+            }
+        };
+
+        /*
+         * The state of one client connection of HttpProxy.
+         * Requests are parsed incrementally, so they may arrive in any number of segments, and several requests
+         * (keep-alive or pipelined) can be served on the same client connection. Plain HTTP requests are rewritten
+         * to origin-form and forwarded with their bodies to an upstream connection to the target host,
+         * responses are relayed back as they are while their framing is tracked, so that an upstream connection
+         * can be returned to the HttpProxy connection pool once it has delivered all its responses.
+         */
+        class HttpProxySession : public QObject
+        {
+            Q_OBJECT
+          public:
+            HttpProxySession(HttpProxyWorker *worker, QTcpSocket *socket)
+                : QObject(socket), worker(worker), socket(socket), generation(worker->settings.generation)
+            {
+                connect(socket, &QTcpSocket::readyRead, this, &HttpProxySession::onSocketReadyRead);
+                worker->trackConnection(this, socket->peerAddress().toString() + u':' + QString::number(socket->peerPort()), &traffic);
+                worker->sessions.insert(this);
+                headTimer.start();
+                lastActivity.start();
+            }
+
+            ~HttpProxySession()
+            {
+                worker->sessions.remove(this);
+                worker->untrackConnection(this);
+                if (proxySocket && !tunnel)
+                    releaseProxySocket();
+            }
+
+            HttpProxySession(const HttpProxySession &) = delete;
+
+            // Called periodically by the worker, closes the connection if one of the deadlines has passed.
+            void checkTimeouts()
+            {
+                const auto &settings = worker->settings;
+                const auto expired = [this](int timeout) { return timeout > 0 && lastActivity.hasExpired(timeout); };
+                // Activity is observed through the byte counters, which costs nothing on the relay path.
+                if (const auto bytes = traffic.upBytes() + traffic.downBytes(); bytes != lastBytes)
+                    lastBytes = bytes, lastActivity.restart();
+
+                if (tunnel)
+                {
+                    if (!tunnelEstablished && expired(settings.upstreamTimeout))
+                        worker->admission->count(AdmissionControl::ReapedUpstreamTimeout), replyError("504 Gateway Timeout");
+                    else if (tunnelEstablished && stream && expired(settings.tunnelIdleTimeout))
+                        worker->admission->count(AdmissionControl::ReapedTunnelIdle), stream->close();
+                    return;
+                }
+
+                // A request head is awaited from the start of the connection, and whenever part of one has arrived.
+                const bool awaitingHead = !requestDeferred && parser.isReadingHead() && (!headReceived || !buffer.isEmpty());
+                if (!awaitingHead)
+                    headTimer.invalidate();
+                else if (!headTimer.isValid())
+                    headTimer.start();
+
+                if (headTimer.isValid() && settings.headerTimeout > 0 && headTimer.hasExpired(settings.headerTimeout))
+                {
+                    worker->admission->count(AdmissionControl::ReapedHeaderTimeout);
+                    return replyError("408 Request Timeout");
+                }
+
+                if (requestInFlight || upgraded || !pendingResponses.isEmpty() || !responseParser.isIdle())
+                {
+                    if (!expired(settings.upstreamTimeout))
+                        return;
+                    worker->admission->count(AdmissionControl::ReapedUpstreamTimeout);
+                    if (responseStarted)
+                        socket->abort();
+                    else
+                        replyError("504 Gateway Timeout");
+                    return;
+                }
+
+                if (!awaitingHead && expired(settings.keepAliveTimeout))
+                {
+                    worker->admission->count(AdmissionControl::ReapedKeepAliveTimeout);
+                    socket->disconnectFromHost();
+                }
+            }
+
+            int settingsGeneration() const
+            {
+                return generation;
+            }
+
+            // Closes the client connection and whatever is relayed for it, right away.
+            void close()
+            {
+                if (stream)
+                    stream->close();
+                else
+                    socket->abort();
+            }
+
+          private:
+            void countUp(qint64 bytes)
+            {
+                if (bytes <= 0)
+                    return;
+                traffic.addUp(bytes), worker->totalTraffic.addUp(bytes);
+                if (direct)
+                    worker->totalDirectTraffic.addUp(bytes);
+            }
+
+            void countDown(qint64 bytes)
+            {
+                if (bytes <= 0)
+                    return;
+                traffic.addDown(bytes), worker->totalTraffic.addDown(bytes);
+                if (direct)
+                    worker->totalDirectTraffic.addDown(bytes);
+            }
+
+            void processRequests()
+            {
+                qsizetype pos = 0;
+                bool stop = false;
+                while (!stop)
+                {
+                    const auto result = parser.parse(QByteArrayView(buffer).sliced(pos));
+                    pos += result.consumed;
+                    switch (result.event)
+                    {
+                        case HttpMessageParser::NeedMoreData: stop = true; break;
+                        case HttpMessageParser::HeadComplete:
+                        {
+                            stop = !startRequest(parser.head());
+                            if (requestDeferred)
+                            {
+                                // Parsed again from the buffer once the responses are in, see onProxySocketReadyRead.
+                                pos -= result.consumed;
+                                parser.reset();
+                            }
+                            break;
+                        }
+                        case HttpMessageParser::Body:
+                            if (proxySocket)
+                                countUp(proxySocket->write(result.data.data(), result.data.size()));
+                            break;
+                        case HttpMessageParser::MessageComplete: requestInFlight = false; break;
+                        case HttpMessageParser::Error: return replyError("400 Bad Request");
+                    }
+                }
+
+                if (tunnel)
+                {
+                    // Whatever follows the CONNECT request belongs to the tunnel.
+                    if (pos < buffer.size())
+                        countUp(proxySocket->write(buffer.constData() + pos, buffer.size() - pos));
+                    buffer.clear();
+                    return;
+                }
+                buffer.remove(0, pos);
+            }
+
+            bool startRequest(const HttpMessageHead &head)
+            {
+                const auto target = HttpRequestTarget::Parse(head);
+                if (!target.valid)
+                {
+                    QDebug(QtMsgType::QtCriticalMsg) << "Invalid request target: " << head.target;
+                    replyError("400 Bad Request");
+                    return false;
+                }
+
+                headReceived = true;
+                const auto host = QString::fromLatin1(target.host);
+                const auto key = host + u':' + QString::number(target.port);
+                if (head.method == "CONNECT")
+                {
+                    // Like a request for another target, a CONNECT after pipelined requests waits for their responses.
+                    if (proxySocket)
+                    {
+                        requestDeferred = !pendingResponses.isEmpty() || !responseParser.isIdle();
+                        if (requestDeferred)
+                            return false;
+                        releaseProxySocket();
+                    }
+                    tunnel = true;
+                    direct = worker->routeDirect(host, target.port);
+                    worker->updateConnection(this, key, true);
+                    proxySocket = worker->connectUpstream(host, target.port, socket, direct);
+                    if (const auto socks = Socks5Client::Negotiator(proxySocket); socks)
+                    {
+                        connect(socks, &Socks5Client::established, this, &HttpProxySession::onProxySocketConnectedHttps);
+                        connect(socks, &Socks5Client::failed, this, &HttpProxySession::onProxySocketNegotiationFailed);
+                    }
+                    else
+                        connect(proxySocket, &QTcpSocket::connected, this, &HttpProxySession::onProxySocketConnectedHttps);
+                    connect(proxySocket, &QAbstractSocket::errorOccurred, this, &HttpProxySession::onProxySocketError);
+                    return false;
+                }
+
+                // Direct and proxied connections to the same target must not be mixed up in the pool.
+                const bool requestDirect = worker->routeDirect(host, target.port);
+                const auto poolKey = requestDirect ? QStringLiteral("direct ") + key : key;
+
+                // A pipelined request for another target has to wait until every response of the current upstream
+                // connection has been relayed, the client expects them in the order of its requests.
+                if (proxySocket && proxyKey != poolKey)
+                {
+                    requestDeferred = !pendingResponses.isEmpty() || !responseParser.isIdle();
+                    if (requestDeferred)
+                        return false;
+                    releaseProxySocket();
+                }
+
+                if (!proxySocket)
+                {
+                    // Not a child of the client socket, so that it can outlive the client in the pool.
+                    direct = requestDirect;
+                    proxySocket = worker->connectUpstream(host, target.port, this, direct, poolKey);
+                    proxyGeneration = worker->settings.generation;
+                    proxyKey = poolKey;
+                    worker->updateConnection(this, key, false);
+                    connect(proxySocket, &QTcpSocket::readyRead, this, &HttpProxySession::onProxySocketReadyRead);
+                    connect(proxySocket, &QTcpSocket::disconnected, this, &HttpProxySession::onProxySocketDisconnected);
+                    connect(proxySocket, &QAbstractSocket::errorOccurred, this, &HttpProxySession::onProxySocketError);
+                    if (const auto socks = Socks5Client::Negotiator(proxySocket); socks)
+                        connect(socks, &Socks5Client::failed, this, &HttpProxySession::onProxySocketNegotiationFailed);
+                    responseParser.reset();
+                    responseBuffer.clear();
+                    pendingResponses.clear();
+                    responseKeepAlive = true;
+                    upgraded = false;
+                }
+
+                pendingResponses.enqueue(head.method == "HEAD");
+                if (pendingResponses.size() == 1 && pendingResponses.head() && responseParser.isIdle())
+                    responseParser.setNextResponseHasNoBody();
+                requestKeepAlive = head.keepAlive;
+                requestInFlight = true;
+                responseStarted = false;
+                writeRequestHead(head, target);
+                return true;
+            }
+
+            // Follow the response framing, only to know when the upstream connection becomes idle.
+            void trackResponses(QByteArrayView data)
+            {
+                if (upgraded)
+                    return;
+
+                if (!responseBuffer.isEmpty())
+                    responseBuffer.append(data);
+                const QByteArrayView input = responseBuffer.isEmpty() ? data : QByteArrayView(responseBuffer);
+
+                qsizetype pos = 0;
+                bool stop = false;
+                while (!stop)
+                {
+                    const auto result = responseParser.parse(input.sliced(pos));
+                    pos += result.consumed;
+                    switch (result.event)
+                    {
+                        case HttpMessageParser::NeedMoreData: stop = true; break;
+                        case HttpMessageParser::Body: break;
+                        case HttpMessageParser::HeadComplete:
+                        {
+                            lastStatusCode = responseParser.head().statusCode;
+                            responseKeepAlive = responseParser.head().keepAlive;
+                            // After "101 Switching Protocols" the connection no longer speaks HTTP/1.1
+                            stop = upgraded = lastStatusCode == 101;
+                            break;
+                        }
+                        case HttpMessageParser::MessageComplete:
+                        {
+                            // Interim responses (100 Continue) precede the final response of the same request.
+                            if (lastStatusCode < 200 || pendingResponses.isEmpty())
+                                break;
+                            pendingResponses.dequeue();
+                            if (!pendingResponses.isEmpty() && pendingResponses.head())
+                                responseParser.setNextResponseHasNoBody();
+                            break;
+                        }
+                        case HttpMessageParser::Error: stop = upgraded = true; break;
+                    }
+                }
+
+                // Only an incomplete response head is ever kept.
+                responseBuffer = upgraded || pos >= input.size() ? QByteArray{} : input.sliced(pos).toByteArray();
+            }
+
+            bool isProxySocketReusable() const
+            {
+                return !tunnel && !upgraded && !requestInFlight && pendingResponses.isEmpty() && responseParser.isIdle() && responseBuffer.isEmpty() &&
+                       requestKeepAlive && responseKeepAlive && proxySocket->state() == QAbstractSocket::ConnectedState;
+            }
+
+            // Write the request with its target in origin-form, piece by piece into the socket write buffer.
+            void writeRequestHead(const HttpMessageHead &head, const HttpRequestTarget &target)
+            {
+                const auto write = [this](QByteArrayView v) { countUp(proxySocket->write(v.data(), v.size())); };
+                write(head.method);
+                write(" ");
+                if (target.needsLeadingSlash)
+                    write("/");
+                write(target.path);
+                // " HTTP/1.1\r\n"
+                write(head.startLine.sliced(head.target.data() + head.target.size() - head.startLine.data()));
+                for (const auto &h : head.headers)
+                {
+                    // These are meant for us, not for the origin server.
+                    if (HttpMessageHead::EqualsIgnoreCase(h.name, "Proxy-Connection") || HttpMessageHead::EqualsIgnoreCase(h.name, "Proxy-Authorization"))
+                        continue;
+                    write(h.line);
+                }
+                write("\r\n");
+            }
+
+            void releaseProxySocket()
+            {
+                proxySocket->disconnect(this);
+                // A connection made before a reconfiguration may lead to the previous upstream.
+                if (isProxySocketReusable() && proxyGeneration == worker->settings.generation)
+                    worker->checkinUpstream(proxyKey, proxySocket);
+                else
+                {
+                    proxySocket->abort();
+                    proxySocket->deleteLater();
+                }
+                proxySocket = nullptr;
+            }
+
+            void replyError(const char *status)
+            {
+                disconnect(socket, &QTcpSocket::readyRead, this, &HttpProxySession::onSocketReadyRead);
+                buffer.clear();
+                socket->write("HTTP/1.1 ");
+                socket->write(status);
+                socket->write("\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+                socket->disconnectFromHost();
+            }
+
+          private slots:
+            void onSocketReadyRead()
+            {
+                if (tunnel)
+                {
+                    // The CONNECT request is waiting for the upstream connection.
+                    BufferPool::Chunk chunk;
+                    for (qint64 n; (n = chunk.readFrom(socket)) > 0;)
+                        countUp(proxySocket->write(chunk.constData(), n));
+                    return;
+                }
+
+                // Read straight into the request buffer, which keeps its capacity from one request to the next.
+                while (const auto available = socket->bytesAvailable())
+                {
+                    const auto size = buffer.size();
+                    buffer.resize(size + available);
+                    const auto n = socket->read(buffer.data() + size, available);
+                    buffer.resize(size + qMax<qint64>(0, n));
+                    if (n <= 0)
+                        break;
+                }
+                processRequests();
+            }
+
+            void onProxySocketConnectedHttps()
+            {
+                disconnect(socket, &QTcpSocket::readyRead, this, &HttpProxySession::onSocketReadyRead);
+                proxySocket->disconnect(this);
+                stream = worker->startTunnel(socket, proxySocket, &traffic, direct);
+                tunnelEstablished = true;
+            }
+
+            void onProxySocketReadyRead()
+            {
+                // The SOCKS5 replies are not part of the response.
+                if (Socks5Client::IsNegotiating(proxySocket))
+                    return;
+                responseStarted = true;
+                BufferPool::Chunk chunk;
+                for (qint64 n; (n = chunk.readFrom(proxySocket)) > 0;)
+                {
+                    countDown(socket->write(chunk.constData(), n));
+                    trackResponses(QByteArrayView(chunk.constData(), n));
+                }
+
+                if (requestDeferred && pendingResponses.isEmpty() && responseParser.isIdle())
+                {
+                    requestDeferred = false;
+                    processRequests();
+                }
+            }
+
+            void onProxySocketDisconnected()
+            {
+                const bool midResponse = upgraded || !pendingResponses.isEmpty() || !responseParser.isIdle();
+                proxySocket->deleteLater();
+                proxySocket = nullptr;
+
+                // An idle keep-alive connection closed by the server is replaced on the next request. Otherwise,
+                // e.g. for responses without a length, the end of the connection must be visible to the client.
+                if (!midResponse && responseKeepAlive)
+                    return;
+                disconnect(socket, &QTcpSocket::readyRead, this, &HttpProxySession::onSocketReadyRead);
+                socket->disconnectFromHost();
+            }
+
+            void onProxySocketNegotiationFailed(quint8 reply)
+            {
+                QDebug(QtMsgType::QtWarningMsg) << "SOCKS5 upstream refused the connection, reply: " << reply;
+                // The upstream socket is aborted right after, whatever the request was, nothing has been relayed yet.
+                proxySocket->disconnect(this);
+                proxySocket->deleteLater();
+                proxySocket = nullptr;
+                replyError("502 Bad Gateway");
+            }
+
+            void onProxySocketError(QAbstractSocket::SocketError err)
+            {
+                if (err == QAbstractSocket::RemoteHostClosedError)
+                    return;
+                QDebug(QtMsgType::QtWarningMsg) << "HTTP upstream socket error: " << err;
+                if (responseStarted)
+                    socket->disconnectFromHost();
+                else
+                    replyError("502 Bad Gateway");
+            }
+
+          private:
+            HttpProxyWorker *worker;
+            QTcpSocket *socket;
+            QTcpSocket *proxySocket = nullptr;
+            QString proxyKey;
+            const int generation;
+            int proxyGeneration = 0;
+            QByteArray buffer;
+            HttpMessageParser parser{ HttpMessageParser::Request };
+            bool tunnel = false;
+            // Whether the current upstream connection bypasses the upstream proxy.
+            bool direct = false;
+            bool responseStarted = false;
+            bool requestInFlight = false;
+            bool requestKeepAlive = true;
+            // Whether the request at the start of buffer waits for the responses of another upstream connection.
+            bool requestDeferred = false;
+
+            // Response tracking of the current upstream connection
+            HttpMessageParser responseParser{ HttpMessageParser::Response };
+            QByteArray responseBuffer;
+            // One entry per forwarded request without its final response yet, true for HEAD requests.
+            QQueue<bool> pendingResponses;
+            int lastStatusCode = 0;
+            bool responseKeepAlive = true;
+            bool upgraded = false;
+
+            TrafficCounter traffic;
+
+            // Deadlines, see checkTimeouts
+            QPointer<SocketStream> stream;
+            bool tunnelEstablished = false;
+            bool headReceived = false;
+            QElapsedTimer headTimer;
+            QElapsedTimer lastActivity;
+            quint64 lastBytes = 0;
+        };
+
+        inline void HttpProxyWorker::acceptSocket(QTcpSocket *socket)
+        {
+            const auto address = socket->peerAddress();
+            bool clientAcquired;
+            const bool admitted = admission->acquireClient(address, clientAcquired);
+            connect(socket, &QObject::destroyed, this, [this, address, clientAcquired]() {
+                activeConnections--;
+                admission->release();
+                if (clientAcquired)
+                    admission->releaseClient(address);
+            });
+            if (!admitted)
+            {
+                socket->abort();
+                socket->deleteLater();
+                return;
+            }
+
+            connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+            connect(socket, &QAbstractSocket::errorOccurred, this, &HttpProxyWorker::onSocketError);
+            new HttpProxySession(this, socket);
+            if (!reaper.isActive())
+                reaper.start();
+        }
+
+        inline void HttpProxyWorker::closeConnectionsBefore(int generation)
+        {
+            // Like for reapConnections, closing only schedules deletions.
+            for (const auto session : std::as_const(sessions))
+            {
+                if (session->settingsGeneration() >= generation)
+                    continue;
+                admission->count(AdmissionControl::ReapedDrainDeadline);
+                session->close();
+            }
+        }
+
+        inline void HttpProxyWorker::reapConnections()
+        {
+            // Closing a connection only schedules its deletion, the set cannot change while iterating.
+            for (const auto session : std::as_const(sessions))
+                session->checkTimeouts();
+            if (sessions.isEmpty())
+                reaper.stop();
+        }
+    } // namespace Utils
+} // namespace Qv2rayPlugin
@@ -0,0 +1,616 @@
+#pragma once
+
+#include "TrafficCounter.hpp"
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QtGlobal>
+
+#if defined(Q_OS_LINUX) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// Multishot receive is the newest feature used, its flag tells whether the kernel headers are recent enough.
+#if defined(Q_OS_LINUX) && defined(IORING_RECV_MULTISHOT)
+#define QVPLUGIN_HAS_IO_URING
+
+#include <QSocketNotifier>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        class IoUringRelay;
+
+        /*
+         * One io_uring per thread, shared by all the IoUringRelays of that thread.
+         * Submissions made while the event loop dispatches are collected and handed to the kernel with a single
+         * io_uring_enter once control returns to the event loop, completions are signalled through an eventfd
+         * watched by a QSocketNotifier, so the ring needs no thread of its own.
+         * Received data lands in a fixed arena of BufferCount buffers, registered with the ring (so writes use
+         * IORING_OP_WRITE_FIXED) and provided to it as a buffer group (so multishot receives pick their buffer
+         * when data arrives, instead of pinning one per idle connection).
+         * The raw system calls are used, there is no dependency on liburing.
+         */
+        class IoUringRing : public QObject
+        {
+            Q_OBJECT
+            friend class IoUringRelay;
+
+          public:
+            static constexpr unsigned Entries = 256;
+            static constexpr quint32 BufferCount = 256;
+            static constexpr quint32 BufferSize = 16 * 1024;
+
+            ~IoUringRing()
+            {
+                delete notifier;
+                if (eventFd >= 0)
+                    ::close(eventFd);
+                // Closing the ring cancels whatever is still in flight before the memory goes away.
+                if (ringFd >= 0)
+                    ::close(ringFd);
+                if (sqes)
+                    ::munmap(sqes, sqesSize);
+                if (ringMemory)
+                    ::munmap(ringMemory, ringSize);
+                if (arena)
+                    ::munmap(arena, size_t(BufferCount) * BufferSize);
+            }
+
+            IoUringRing(const IoUringRing &) = delete;
+
+            // The ring of the current thread, nullptr if io_uring or one of the features used is unavailable.
+            static IoUringRing *ForCurrentThread()
+            {
+                static thread_local bool tried = false;
+                static thread_local std::unique_ptr<IoUringRing> ring;
+                if (!tried)
+                {
+                    tried = true;
+                    ring.reset(new IoUringRing);
+                    if (!ring->initialize())
+                        ring.reset();
+                }
+                return ring.get();
+            }
+
+          private:
+            enum Operation
+            {
+                Receive,
+                Write,
+                Cancel,
+                ProvideBuffers
+            };
+
+            IoUringRing() = default;
+
+            static quint64 UserData(quint64 relay, Operation op, int direction, quint32 buffer = 0)
+            {
+                return relay << 16 | quint64(buffer) << 3 | quint64(direction) << 2 | op;
+            }
+
+            static bool KernelIsRecentEnough()
+            {
+                // Multishot receive cannot be probed for, it appeared in 6.0.
+                utsname name;
+                int major = 0, minor = 0;
+                return ::uname(&name) == 0 && std::sscanf(name.release, "%d.%d", &major, &minor) == 2 && major >= 6;
+            }
+
+            bool initialize()
+            {
+                if (!KernelIsRecentEnough())
+                    return false;
+
+                io_uring_params params;
+                std::memset(&params, 0, sizeof(params));
+                // Multishot receives post many completions per submission.
+                params.flags = IORING_SETUP_CQSIZE;
+                params.cq_entries = Entries * 8;
+                ringFd = int(::syscall(__NR_io_uring_setup, Entries, &params));
+                if (ringFd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+                    return false;
+                if (!probe({ IORING_OP_RECV, IORING_OP_WRITE_FIXED, IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL }))
+                    return false;
+
+                ringSize = qMax(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+                ringMemory = ::mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+                sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+                sqes = static_cast<io_uring_sqe *>(::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+                if (ringMemory == MAP_FAILED || sqes == MAP_FAILED)
+                {
+                    ringMemory = ringMemory == MAP_FAILED ? nullptr : ringMemory;
+                    sqes = sqes == MAP_FAILED ? nullptr : sqes;
+                    return false;
+                }
+                const auto base = static_cast<char *>(ringMemory);
+                sqHead = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+                sqTail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+                sqMask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+                sqArray = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+                sqEntries = params.sq_entries;
+                cqHead = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+                cqTail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+                cqMask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+                cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+                localSqTail = *sqTail;
+
+                const auto arenaSize = size_t(BufferCount) * BufferSize;
+                arena = static_cast<char *>(::mmap(nullptr, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+                if (arena == MAP_FAILED)
+                {
+                    arena = nullptr;
+                    return false;
+                }
+                const iovec registered{ arena, arenaSize };
+                if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &registered, 1) != 0)
+                    return false;
+
+                eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (eventFd < 0 || ::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) != 0)
+                    return false;
+
+                // Hand the whole arena to the kernel, and wait for it to be taken, before anything can use it.
+                const auto sqe = nextSqe();
+                sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+                sqe->fd = int(BufferCount);
+                sqe->addr = quint64(arena);
+                sqe->len = BufferSize;
+                sqe->off = 0;
+                sqe->buf_group = BufferGroup;
+                sqe->user_data = UserData(0, ProvideBuffers, 0);
+                if (!submit(1))
+                    return false;
+                const auto head = *cqHead;
+                if (__atomic_load_n(cqTail, __ATOMIC_ACQUIRE) == head || cqes[head & cqMask].res < 0)
+                    return false;
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+                notifier = new QSocketNotifier(eventFd, QSocketNotifier::Read);
+                connect(notifier, &QSocketNotifier::activated, this, &IoUringRing::onEventFd);
+                return true;
+            }
+
+            bool probe(std::initializer_list<int> operations)
+            {
+                constexpr int count = 256;
+                std::vector<char> memory(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+                const auto p = reinterpret_cast<io_uring_probe *>(memory.data());
+                if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, p, count) != 0)
+                    return false;
+                for (const auto op : operations)
+                    if (op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED))
+                        return false;
+                return true;
+            }
+
+            // A zeroed submission entry, queued but not yet visible to the kernel.
+            io_uring_sqe *nextSqe()
+            {
+                if (localSqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+                    flush();
+                const auto index = localSqTail & sqMask;
+                const auto sqe = &sqes[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sqArray[index] = index;
+                localSqTail++;
+                unsubmitted++;
+                if (!flushScheduled)
+                {
+                    // Everything queued until control returns to the event loop leaves with one system call.
+                    flushScheduled = true;
+                    QMetaObject::invokeMethod(this, &IoUringRing::flush, Qt::QueuedConnection);
+                }
+                return sqe;
+            }
+
+            // Publishes the queued entries, waiting for waitFor completions when asked to.
+            bool submit(unsigned waitFor = 0)
+            {
+                __atomic_store_n(sqTail, localSqTail, __ATOMIC_RELEASE);
+                while (unsubmitted > 0 || waitFor > 0)
+                {
+                    const auto n = ::syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    // The completion queue is full, make room and try again.
+                    if (n < 0 && (errno == EBUSY || errno == EAGAIN) && waitFor == 0)
+                    {
+                        processCompletions();
+                        continue;
+                    }
+                    if (n < 0)
+                        return false;
+                    unsubmitted -= unsigned(n);
+                    waitFor = 0;
+                }
+                return true;
+            }
+
+            void flush()
+            {
+                flushScheduled = false;
+                if (unsubmitted > 0 && !submit())
+                    qWarning("io_uring_enter failed: %s", std::strerror(errno));
+            }
+
+            char *buffer(quint32 id) const
+            {
+                return arena + size_t(id) * BufferSize;
+            }
+
+            // Gives a buffer back to the group, receives that ran out of buffers are restarted afterwards.
+            void recycle(quint32 id)
+            {
+                const auto sqe = nextSqe();
+                sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+                sqe->fd = 1;
+                sqe->addr = quint64(buffer(id));
+                sqe->len = BufferSize;
+                sqe->off = id;
+                sqe->buf_group = BufferGroup;
+                sqe->user_data = UserData(0, ProvideBuffers, 0);
+                recycled = true;
+            }
+
+            void submitReceive(quint64 relay, int direction, int fd)
+            {
+                const auto sqe = nextSqe();
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = fd;
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = BufferGroup;
+                sqe->user_data = UserData(relay, Receive, direction);
+            }
+
+            void submitWrite(quint64 relay, int direction, int fd, quint32 id, quint32 offset, quint32 length)
+            {
+                const auto sqe = nextSqe();
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->fd = fd;
+                sqe->addr = quint64(buffer(id) + offset);
+                sqe->len = length;
+                sqe->buf_index = 0;
+                sqe->user_data = UserData(relay, Write, direction, id);
+            }
+
+            void submitCancelReceive(quint64 relay, int direction)
+            {
+                const auto sqe = nextSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = UserData(relay, Receive, direction);
+                sqe->user_data = UserData(relay, Cancel, direction);
+            }
+
+            quint64 add(IoUringRelay *relay)
+            {
+                const auto id = nextRelayId++;
+                relays.insert(id, relay);
+                return id;
+            }
+
+            void remove(quint64 id)
+            {
+                relays.remove(id);
+            }
+
+            void waitForBuffers(quint64 relay, int direction)
+            {
+                starved.append({ relay, direction });
+            }
+
+            void processCompletions();
+
+            void onEventFd()
+            {
+                quint64 value;
+                while (::read(eventFd, &value, sizeof(value)) > 0)
+                    ;
+                processCompletions();
+                flush();
+            }
+
+          private:
+            static constexpr quint16 BufferGroup = 0;
+
+            int ringFd = -1;
+            int eventFd = -1;
+            QSocketNotifier *notifier = nullptr;
+            void *ringMemory = nullptr;
+            size_t ringSize = 0;
+            io_uring_sqe *sqes = nullptr;
+            size_t sqesSize = 0;
+            unsigned *sqHead = nullptr;
+            unsigned *sqTail = nullptr;
+            unsigned *sqArray = nullptr;
+            unsigned sqMask = 0;
+            unsigned sqEntries = 0;
+            unsigned localSqTail = 0;
+            unsigned unsubmitted = 0;
+            bool flushScheduled = false;
+            unsigned *cqHead = nullptr;
+            unsigned *cqTail = nullptr;
+            unsigned cqMask = 0;
+            io_uring_cqe *cqes = nullptr;
+            char *arena = nullptr;
+            bool recycled = false;
+            QList<QPair<quint64, int>> starved;
+            QHash<quint64, IoUringRelay *> relays;
+            quint64 nextRelayId = 1;
+        };
+
+        /*
+         * Moves data between two connected TCP descriptors through the io_uring of the current thread, the
+         * counterpart of SpliceRelay: the relay owns both descriptors, forwards half-closes with shutdown(SHUT_WR)
+         * and emits finished() once both directions are done or when either side fails.
+         * Each direction has one multishot receive armed and at most one write in flight, received buffers are
+         * written in order. A direction stops receiving once MaxQueuedBuffers are waiting for a slow peer, which
+         * pushes back through TCP like the watermarks of SocketStream.
+         * Relies on SIGPIPE being ignored, as it is once Qt has created a socket.
+         */
+        class IoUringRelay : public QObject
+        {
+            Q_OBJECT
+            friend class IoUringRing;
+
+          public:
+            static constexpr int MaxQueuedBuffers = 16;
+
+            IoUringRelay(IoUringRing *ring, int fdA, int fdB, QObject *parent = nullptr) : QObject(parent), m_ring(ring)
+            {
+                m_id = ring->add(this);
+                m_channels[0].from = m_channels[1].to = fdA;
+                m_channels[0].to = m_channels[1].from = fdB;
+                arm(0);
+                arm(1);
+            }
+
+            ~IoUringRelay()
+            {
+                m_ring->remove(m_id);
+                // Completions still to come are matched to no relay, the ring recycles their buffers.
+                for (auto &c : m_channels)
+                {
+                    for (auto i = c.writing ? 1 : 0; i < int(c.queue.size()); i++)
+                        m_ring->recycle(c.queue[i].buffer);
+                    if (c.receiving)
+                        m_ring->submitCancelReceive(m_id, &c == &m_channels[1]);
+                }
+                // Operations in flight hold their own reference to the sockets, shutdown ends them for sure.
+                for (const auto fd : { m_channels[0].from, m_channels[0].to })
+                {
+                    ::shutdown(fd, SHUT_RDWR);
+                    ::close(fd);
+                }
+            }
+
+            IoUringRelay(const IoUringRelay &) = delete;
+
+            // Bytes received from one side and not yet written to the other one.
+            qint64 pendingAtoB() const
+            {
+                return m_channels[0].pending;
+            }
+            qint64 pendingBtoA() const
+            {
+                return m_channels[1].pending;
+            }
+
+            void setTrafficCounters(const QList<TrafficCounter *> &counters)
+            {
+                m_counters = counters;
+            }
+
+          signals:
+            void finished();
+
+          private:
+            struct Segment
+            {
+                quint32 buffer;
+                quint32 offset;
+                quint32 length;
+            };
+
+            struct Channel
+            {
+                int from = -1;
+                int to = -1;
+                bool receiving = false;
+                // Receiving has been stopped on purpose, because too much is queued.
+                bool throttled = false;
+                bool writing = false;
+                bool eof = false;
+                bool shutdownSent = false;
+                std::deque<Segment> queue;
+                qint64 pending = 0;
+            };
+
+            void arm(int direction)
+            {
+                auto &c = m_channels[direction];
+                if (m_finished || c.receiving || c.eof)
+                    return;
+                c.receiving = true;
+                c.throttled = false;
+                m_ring->submitReceive(m_id, direction, c.from);
+            }
+
+            void onReceived(int direction, int result, quint32 flags)
+            {
+                auto &c = m_channels[direction];
+                const bool more = flags & IORING_CQE_F_MORE;
+                if (!more)
+                    c.receiving = false;
+
+                if (flags & IORING_CQE_F_BUFFER)
+                {
+                    const quint32 id = flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (m_finished || result <= 0)
+                        m_ring->recycle(id);
+                    else
+                    {
+                        c.queue.push_back({ id, 0, quint32(result) });
+                        c.pending += result;
+                        write(direction);
+                    }
+                }
+                if (m_finished)
+                    return;
+
+                if (result == 0)
+                {
+                    c.eof = true;
+                    return shutdownIfDone(direction);
+                }
+                if (result == -ENOBUFS)
+                    return m_ring->waitForBuffers(m_id, direction);
+                if (result < 0 && result != -ECANCELED)
+                    return fail();
+
+                if (!c.receiving)
+                    // Throttled, or ended by the kernel, which may happen at any time (e.g. on CQ overflow).
+                    resume(direction);
+                else if (c.queue.size() >= size_t(MaxQueuedBuffers) && !c.throttled)
+                {
+                    c.throttled = true;
+                    m_ring->submitCancelReceive(m_id, direction);
+                }
+            }
+
+            void resume(int direction)
+            {
+                if (m_channels[direction].queue.size() <= size_t(MaxQueuedBuffers / 2))
+                    arm(direction);
+            }
+
+            void onWritten(int direction, int result)
+            {
+                auto &c = m_channels[direction];
+                c.writing = false;
+                if (result < 0 || m_finished)
+                {
+                    // Nothing else can be written, the queued buffers wait for the destructor.
+                    if (!m_finished)
+                        fail();
+                    return;
+                }
+
+                auto &front = c.queue.front();
+                front.offset += result, front.length -= result;
+                c.pending -= result;
+                for (const auto counter : m_counters)
+                    direction == 0 ? counter->addUp(result) : counter->addDown(result);
+                if (front.length == 0)
+                {
+                    m_ring->recycle(front.buffer);
+                    c.queue.pop_front();
+                }
+
+                write(direction);
+                if (!c.receiving)
+                    resume(direction);
+                shutdownIfDone(direction);
+            }
+
+            void write(int direction)
+            {
+                auto &c = m_channels[direction];
+                if (c.writing || c.queue.empty())
+                    return;
+                c.writing = true;
+                const auto &front = c.queue.front();
+                m_ring->submitWrite(m_id, direction, c.to, front.buffer, front.offset, front.length);
+            }
+
+            void shutdownIfDone(int direction)
+            {
+                auto &c = m_channels[direction];
+                if (!c.eof || c.shutdownSent || !c.queue.empty())
+                    return;
+                ::shutdown(c.to, SHUT_WR);
+                c.shutdownSent = true;
+                if (m_channels[0].shutdownSent && m_channels[1].shutdownSent)
+                    finish();
+            }
+
+            void fail()
+            {
+                finish();
+            }
+
+            void finish()
+            {
+                if (m_finished)
+                    return;
+                m_finished = true;
+                emit finished();
+            }
+
+          private:
+            IoUringRing *m_ring;
+            quint64 m_id = 0;
+            // A to B, then B to A.
+            Channel m_channels[2];
+            QList<TrafficCounter *> m_counters;
+            bool m_finished = false;
+        };
+
+        inline void IoUringRing::processCompletions()
+        {
+            // The head is read again every time, handlers may submit, and submitting may process completions.
+            for (unsigned head; (head = *cqHead) != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);)
+            {
+                const auto cqe = cqes[head & cqMask];
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+                const auto op = Operation(cqe.user_data & 3);
+                const int direction = (cqe.user_data >> 2) & 1;
+                const auto relay = relays.value(cqe.user_data >> 16);
+                switch (op)
+                {
+                    case Receive:
+                        if (relay)
+                            relay->onReceived(direction, cqe.res, cqe.flags);
+                        else if (cqe.flags & IORING_CQE_F_BUFFER)
+                            recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                        break;
+                    case Write:
+                        if (relay)
+                            relay->onWritten(direction, cqe.res);
+                        else
+                            recycle((cqe.user_data >> 3) & 0x1FFF);
+                        break;
+                    case Cancel:
+                    case ProvideBuffers: break;
+                }
+            }
+
+            if (!recycled || starved.isEmpty())
+                return;
+            recycled = false;
+            for (const auto &[id, direction] : std::exchange(starved, {}))
+                if (const auto relay = relays.value(id); relay)
+                    relay->arm(direction);
+        }
+    } // namespace Utils
+} // namespace Qv2rayPlugin
+#endif
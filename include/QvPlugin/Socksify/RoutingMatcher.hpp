@@ -0,0 +1,84 @@
+#pragma once
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+#include "QvPlugin/Utils/RuleMatcher.hpp"
+
+#include <QHostAddress>
+#include <atomic>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Decides which requests of a HttpProxy may skip the SOCKS5 upstream, by evaluating the rules of a
+         * RoutingObject the way the core would, first matching rule wins, on the target of each request.
+         * Only targetDomains, targetIPs, targetPort and networks can be known here. A rule that depends on anything
+         * else (inbound tags, source, sniffed protocol, process, geosite/geoip lists other than geoip:private, or
+         * DNS resolution through a non-AsIs domainStrategy), or that carries options or extraSettings, might match
+         * or not, so the request is left to the upstream, which makes the real decision. A wrong Proxy answer only
+         * costs a hop, a wrong Direct one would bypass the user's routing, hence the bias. The rules are evaluated
+         * by a RuleMatcher.
+         * Immutable once built, safe to share between threads.
+         */
+        class RoutingMatcher
+        {
+          public:
+            enum Decision
+            {
+                Proxy,
+                Direct
+            };
+
+            struct Statistics
+            {
+                quint64 direct = 0;
+                quint64 proxied = 0;
+                double directRatio() const
+                {
+                    return direct + proxied == 0 ? 0 : double(direct) / double(direct + proxied);
+                }
+            };
+
+            // Relaxed counters of the decisions taken, one set per HttpProxyWorker.
+            struct Counters
+            {
+                std::atomic<quint64> direct{ 0 };
+                std::atomic<quint64> proxied{ 0 };
+                Statistics statistics() const
+                {
+                    return { direct.load(std::memory_order_relaxed), proxied.load(std::memory_order_relaxed) };
+                }
+            };
+
+            RoutingMatcher(const RoutingObject &routing, const QString &directOutboundTag) : rules(routing), directOutboundTag(directOutboundTag)
+            {
+                const auto strategy = routing.extraOptions.value(QStringLiteral("domainStrategy")).toString();
+                resolvesDomains = !strategy.isEmpty() && strategy != QStringLiteral("AsIs");
+            }
+
+            // host is a domain name or an IP literal, as found in the request target.
+            Decision match(const QString &host, quint16 port) const
+            {
+                RuleMatcher::Query query;
+                query.targetAddress = QHostAddress(host);
+                if (query.targetAddress.isNull())
+                    query.domain = host;
+                query.targetPort = port;
+                query.unknownFields = RuleMatcher::InboundTag | RuleMatcher::SourceIP | RuleMatcher::SourcePort | RuleMatcher::Protocol | RuleMatcher::Process;
+                // Unless the core resolves domains for routing, IP rules never see requests to a domain.
+                if (!query.domain.isEmpty() && resolvesDomains)
+                    query.unknownFields |= RuleMatcher::TargetIP;
+
+                // The default outbound is the proxy, and so is any rule that might match.
+                const auto result = rules.match(query);
+                return result.rule >= 0 && result.certain && result.outboundTag == directOutboundTag ? Direct : Proxy;
+            }
+
+          private:
+            RuleMatcher rules;
+            QString directOutboundTag;
+            bool resolvesDomains = false;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
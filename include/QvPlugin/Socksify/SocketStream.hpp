@@ -21,8 +21,16 @@
  */
 
 #pragma once
+#include "BufferPool.hpp"
+#include "IoUringRelay.hpp"
+#include "SpliceRelay.hpp"
+#include "TrafficCounter.hpp"
+#include "TrafficShaper.hpp"
+
 #include <QAbstractSocket>
+#include <QNetworkProxy>
 #include <QObject>
+#include <QPointer>
 
 namespace Qv2rayPlugin
 {
@@ -32,6 +40,21 @@ namespace Qv2rayPlugin
         {
             Q_OBJECT
           public:
+            struct BufferStatistics
+            {
+                // Bytes read from one side but not yet handed to the kernel on the other side.
+                qint64 pendingAtoB = 0;
+                qint64 pendingBtoA = 0;
+                qint64 peakPendingAtoB = 0;
+                qint64 peakPendingBtoA = 0;
+                // How many times reading from one side has been paused because the other side is slow.
+                quint64 pausedAtoB = 0;
+                quint64 pausedBtoA = 0;
+                // How many times it has been resumed once the other side drained to the low watermark.
+                quint64 resumedAtoB = 0;
+                quint64 resumedBtoA = 0;
+            };
+
             /*
              * A light-weight class dedicated to stream data between two sockets
              * all available data from socket a will be written to socket b
@@ -39,43 +62,434 @@ namespace Qv2rayPlugin
              */
             SocketStream(QAbstractSocket *a, QAbstractSocket *b, QObject *parent = 0) : QObject(parent), m_as(a), m_bs(b)
             {
+                m_atob.source = m_as, m_atob.sink = m_bs;
+                m_btoa.source = m_bs, m_btoa.sink = m_as;
+                m_counters.append(&m_traffic);
                 connect(m_as, &QAbstractSocket::readyRead, this, &SocketStream::onSocketAReadyRead);
                 connect(m_bs, &QAbstractSocket::readyRead, this, &SocketStream::onSocketBReadyRead);
+                connect(m_as, &QAbstractSocket::bytesWritten, this, &SocketStream::onSocketABytesWritten);
+                connect(m_bs, &QAbstractSocket::bytesWritten, this, &SocketStream::onSocketBBytesWritten);
+                connect(m_as, &QAbstractSocket::disconnected, this, &SocketStream::finished);
+                connect(m_bs, &QAbstractSocket::disconnected, this, &SocketStream::finished);
             }
 
             ~SocketStream()
             {
+                if (m_shaper)
+                {
+                    m_shaper->remove(&m_atob.flow);
+                    m_shaper->remove(&m_btoa.flow);
+                }
                 qDebug() << "Socket Stream DCtor";
             }
 
             SocketStream(const SocketStream &) = delete;
 
+            /*
+             * Enable flow-controlled relaying: reading from one socket stops as soon as the other socket
+             * has more than highWatermark bytes waiting to be written, and starts again once it drains
+             * to lowWatermark. The Qt read buffer of each socket is capped to one BufferPool chunk, so the
+             * memory used by one direction is bounded by highWatermark plus that chunk.
+             * A highWatermark of 0 restores the unlimited behaviour.
+             */
+            void setFlowControl(qint64 highWatermark, qint64 lowWatermark = -1)
+            {
+                m_highWatermark = qMax<qint64>(0, highWatermark);
+                m_lowWatermark = lowWatermark < 0 ? m_highWatermark / 2 : qMin(lowWatermark, m_highWatermark);
+                limitReadBuffers();
+                if (!isFlowControlled())
+                {
+                    m_atob.paused = m_btoa.paused = false;
+                    relay(m_atob);
+                    relay(m_btoa);
+                }
+            }
+
+            bool isFlowControlled() const
+            {
+                return m_highWatermark > 0;
+            }
+
+            /*
+             * Relay through shaper, a TrafficShaper living in the same thread, instead of as soon as data arrives:
+             * both directions are then scheduled fairly against the other streams of the shaper and limited by its
+             * token buckets. Shaped streams always take the readAll/write path, zero-copy relaying is not used, and
+             * read at most a chunk ahead from each socket even without flow control, as the shaper may hold data back.
+             * Must be called before any data is relayed, the shaper may be destroyed before the stream.
+             */
+            void setTrafficShaper(TrafficShaper *shaper)
+            {
+                if (isZeroCopy() || isIoUring())
+                    return;
+                m_shaper = shaper;
+                limitReadBuffers();
+                for (const auto d : { &m_atob, &m_btoa })
+                {
+                    d->flow.move = [this, d](qint64 budget) { return relayShaped(*d, budget); };
+                    d->flow.pending = [this, d]() {
+                        if (roomIn(*d) > 0)
+                            return d->source->bytesAvailable() > 0;
+                        // Paused, so that the sink draining activates the flow again.
+                        pause(*d);
+                        return false;
+                    };
+                    m_shaper->add(&d->flow);
+                    if (d->source->bytesAvailable() > 0)
+                        m_shaper->activate(&d->flow);
+                }
+            }
+
+            bool isShaped() const
+            {
+                return !m_shaper.isNull();
+            }
+
+            /*
+             * On Linux, when both sockets are plain TCP sockets (no TLS, no QNetworkProxy in between), hand the
+             * descriptors over to a SpliceRelay as soon as Qt has nothing buffered for either of them.
+             * From then on the QAbstractSockets are closed (without emitting signals) and finished() is the only
+             * notification about the end of the stream. Other sockets keep using the readAll/write path.
+             */
+            void setZeroCopyEnabled(bool enabled)
+            {
+                m_zeroCopyEnabled = enabled;
+                tryZeroCopy();
+            }
+
+            bool isZeroCopy() const
+            {
+#ifdef Q_OS_LINUX
+                return m_splice;
+#else
+                return false;
+#endif
+            }
+
+            /*
+             * Like setZeroCopyEnabled, but hand the descriptors over to an IoUringRelay on the io_uring of the
+             * current thread, which batches the system calls of all its tunnels. Preferred over splice when both
+             * are enabled, and ignored when io_uring cannot be used (other platforms, kernels before 6.0).
+             */
+            void setIoUringEnabled(bool enabled)
+            {
+                m_ioUringEnabled = enabled;
+                tryZeroCopy();
+            }
+
+            bool isIoUring() const
+            {
+#ifdef QVPLUGIN_HAS_IO_URING
+                return m_uring;
+#else
+                return false;
+#endif
+            }
+
+            /*
+             * Bytes relayed by this stream, from A to B as up and from B to A as down.
+             * Safe to read from any thread while the stream is alive.
+             */
+            const TrafficCounter &traffic() const
+            {
+                return m_traffic;
+            }
+
+            // Also count the relayed bytes into counter, which must outlive the stream.
+            void addTrafficCounter(TrafficCounter *counter)
+            {
+                m_counters.append(counter);
+#ifdef Q_OS_LINUX
+                if (m_splice)
+                    m_splice->setTrafficCounters(m_counters);
+#endif
+#ifdef QVPLUGIN_HAS_IO_URING
+                if (m_uring)
+                    m_uring->setTrafficCounters(m_counters);
+#endif
+            }
+
+            // Closes both sockets, or the zero-copy relay, right away and emits finished().
+            void close()
+            {
+#ifdef Q_OS_LINUX
+                delete m_splice;
+                m_splice = nullptr;
+#endif
+#ifdef QVPLUGIN_HAS_IO_URING
+                delete m_uring;
+                m_uring = nullptr;
+#endif
+                m_zeroCopyEnabled = m_ioUringEnabled = false;
+                for (const auto socket : { m_as, m_bs })
+                {
+                    const QSignalBlocker blocker(socket);
+                    socket->abort();
+                }
+                emit finished();
+            }
+
+            BufferStatistics bufferStatistics() const
+            {
+                BufferStatistics stats;
+                stats.pendingAtoB = pendingBytes(m_atob);
+                stats.pendingBtoA = pendingBytes(m_btoa);
+#ifdef Q_OS_LINUX
+                if (m_splice)
+                    stats.pendingAtoB = m_splice->pendingAtoB(), stats.pendingBtoA = m_splice->pendingBtoA();
+#endif
+#ifdef QVPLUGIN_HAS_IO_URING
+                if (m_uring)
+                    stats.pendingAtoB = m_uring->pendingAtoB(), stats.pendingBtoA = m_uring->pendingBtoA();
+#endif
+                stats.peakPendingAtoB = m_atob.peakPending;
+                stats.peakPendingBtoA = m_btoa.peakPending;
+                stats.pausedAtoB = m_atob.pauseCount;
+                stats.pausedBtoA = m_btoa.pauseCount;
+                stats.resumedAtoB = m_atob.resumeCount;
+                stats.resumedBtoA = m_btoa.resumeCount;
+                return stats;
+            }
+
+          signals:
+            // Emitted when either socket disconnects, or when the zero-copy relay has finished.
+            void finished();
+
           private:
-            QAbstractSocket *m_as;
-            QAbstractSocket *m_bs;
+            struct Direction
+            {
+                QAbstractSocket *source = nullptr;
+                QAbstractSocket *sink = nullptr;
+                bool paused = false;
+                qint64 peakPending = 0;
+                quint64 pauseCount = 0;
+                quint64 resumeCount = 0;
+                TrafficShaper::Flow flow;
+            };
 
-          private slots:
-            void onSocketAReadyRead()
+            static qint64 pendingBytes(const Direction &d)
             {
-                if (m_bs->isWritable())
+                return d.source->bytesAvailable() + d.sink->bytesToWrite();
+            }
+
+            void account(const Direction &d, qint64 bytes)
+            {
+                if (bytes <= 0)
+                    return;
+                for (const auto counter : m_counters)
+                    &d == &m_atob ? counter->addUp(bytes) : counter->addDown(bytes);
+            }
+
+            // Moves at most maxSize bytes through a recycled chunk, returns false once the source is drained.
+            bool relayChunk(Direction &d, BufferPool::Chunk &chunk, qint64 maxSize)
+            {
+                const auto n = chunk.readFrom(d.source, maxSize);
+                if (n <= 0)
+                    return false;
+                account(d, d.sink->write(chunk.constData(), n));
+                return true;
+            }
+
+            // Room left in the sink before reading has to pause.
+            qint64 roomIn(const Direction &d) const
+            {
+                if (!isFlowControlled())
+                    return std::numeric_limits<qint64>::max();
+                return m_highWatermark - d.sink->bytesToWrite();
+            }
+
+            // How much Qt may read ahead from each socket, unlimited unless the stream holds data back.
+            void limitReadBuffers()
+            {
+                const auto size = isFlowControlled() ? qMin<qint64>(m_highWatermark, BufferPool::ChunkSize) : m_shaper ? BufferPool::ChunkSize : 0;
+                m_as->setReadBufferSize(size);
+                m_bs->setReadBufferSize(size);
+            }
+
+            void pause(Direction &d)
+            {
+                if (!d.paused)
+                    d.paused = true, d.pauseCount++;
+            }
+
+            void relay(Direction &d)
+            {
+                if (isZeroCopy() || isIoUring())
+                    return;
+
+                if (!d.sink->isWritable())
                 {
-                    m_bs->write(m_as->readAll());
+                    qCritical("The %s socket is not writable", d.sink == m_bs ? "second" : "first");
+                    return;
                 }
-                else
+
+                if (m_shaper)
+                    return m_shaper->activate(&d.flow);
+
+                BufferPool::Chunk chunk;
+                if (!isFlowControlled())
+                {
+                    while (relayChunk(d, chunk, BufferPool::ChunkSize))
+                        ;
+                    d.peakPending = qMax(d.peakPending, d.sink->bytesToWrite());
+                    return tryZeroCopy();
+                }
+
+                while (d.source->bytesAvailable() > 0)
                 {
-                    qCritical("The second socket is not writable");
+                    const auto room = m_highWatermark - d.sink->bytesToWrite();
+                    if (room <= 0)
+                    {
+                        // The source keeps at most one chunk in its read buffer, then stops reading
+                        // from the kernel, which pushes back on the remote peer through TCP.
+                        pause(d);
+                        break;
+                    }
+                    if (!relayChunk(d, chunk, room))
+                        break;
                 }
+                d.peakPending = qMax(d.peakPending, pendingBytes(d));
+                tryZeroCopy();
             }
-            void onSocketBReadyRead()
+
+            // Called by the shaper, moves at most budget bytes and returns how many have been moved.
+            qint64 relayShaped(Direction &d, qint64 budget)
             {
-                if (m_as->isWritable())
+                if (!d.sink->isWritable())
+                    return 0;
+
+                BufferPool::Chunk chunk;
+                qint64 moved = 0;
+                while (moved < budget && d.source->bytesAvailable() > 0)
                 {
-                    m_as->write(m_bs->readAll());
+                    const auto room = roomIn(d);
+                    if (room <= 0)
+                    {
+                        pause(d);
+                        break;
+                    }
+                    const auto n = chunk.readFrom(d.source, qMin(budget - moved, room));
+                    if (n <= 0)
+                        break;
+                    account(d, d.sink->write(chunk.constData(), n));
+                    moved += n;
+                }
+                d.peakPending = qMax(d.peakPending, pendingBytes(d));
+                return moved;
+            }
+
+            void onSinkBytesWritten(Direction &d)
+            {
+                if (!d.paused || d.sink->bytesToWrite() > m_lowWatermark)
+                    return tryZeroCopy();
+                d.paused = false;
+                d.resumeCount++;
+                relay(d);
+            }
+
+            static bool isPlainTcpSocket(const QAbstractSocket *s)
+            {
+                if (s->socketType() != QAbstractSocket::TcpSocket || s->state() != QAbstractSocket::ConnectedState || s->inherits("QSslSocket"))
+                    return false;
+                const auto proxyType = s->proxy().type();
+                if (proxyType == QNetworkProxy::DefaultProxy)
+                    return QNetworkProxy::applicationProxy().type() == QNetworkProxy::NoProxy;
+                return proxyType == QNetworkProxy::NoProxy;
+            }
+
+            void tryZeroCopy()
+            {
+#ifdef Q_OS_LINUX
+                if (m_shaper || (!m_zeroCopyEnabled && !m_ioUringEnabled) || isZeroCopy() || isIoUring() || !isPlainTcpSocket(m_as) || !isPlainTcpSocket(m_bs))
+                    return;
+
+#ifdef QVPLUGIN_HAS_IO_URING
+                const auto ring = m_ioUringEnabled ? IoUringRing::ForCurrentThread() : nullptr;
+#else
+                const void *ring = nullptr;
+#endif
+                if (!ring && !m_zeroCopyEnabled)
+                    return;
+
+                // Anything Qt has already buffered must go through the Qt path first.
+                if (m_as->bytesAvailable() || m_bs->bytesAvailable() || m_as->bytesToWrite() || m_bs->bytesToWrite())
+                    return;
+
+                const int fdA = ::fcntl(m_as->socketDescriptor(), F_DUPFD_CLOEXEC, 0);
+                const int fdB = fdA < 0 ? -1 : ::fcntl(m_bs->socketDescriptor(), F_DUPFD_CLOEXEC, 0);
+                if (fdB < 0)
+                {
+                    if (fdA >= 0)
+                        ::close(fdA);
+                    return;
+                }
+
+#ifdef QVPLUGIN_HAS_IO_URING
+                if (ring)
+                {
+                    m_uring = new IoUringRelay(ring, fdA, fdB, this);
+                    m_uring->setTrafficCounters(m_counters);
+                    connect(m_uring, &IoUringRelay::finished, this, &SocketStream::finished);
                 }
                 else
+#endif
                 {
-                    qCritical("The first socket is not writable");
+                    const auto splice = new SpliceRelay(fdA, fdB, this);
+                    if (!splice->isValid())
+                    {
+                        delete splice;
+                        return;
+                    }
+                    splice->setTrafficCounters(m_counters);
+                    m_splice = splice;
+                    connect(m_splice, &SpliceRelay::finished, this, &SocketStream::finished);
                 }
+
+                // The duplicated descriptors keep both connections alive after Qt lets go of its own ones.
+                for (const auto socket : { m_as, m_bs })
+                {
+                    const QSignalBlocker blocker(socket);
+                    socket->abort();
+                }
+#endif
+            }
+
+          private:
+            QAbstractSocket *m_as;
+            QAbstractSocket *m_bs;
+            Direction m_atob;
+            Direction m_btoa;
+            TrafficCounter m_traffic;
+            QList<TrafficCounter *> m_counters;
+            qint64 m_highWatermark = 0;
+            qint64 m_lowWatermark = 0;
+            bool m_zeroCopyEnabled = false;
+            bool m_ioUringEnabled = false;
+            QPointer<TrafficShaper> m_shaper;
+#ifdef Q_OS_LINUX
+            SpliceRelay *m_splice = nullptr;
+#endif
+#ifdef QVPLUGIN_HAS_IO_URING
+            IoUringRelay *m_uring = nullptr;
+#endif
+
+          private slots:
+            void onSocketAReadyRead()
+            {
+                if (!m_atob.paused)
+                    relay(m_atob);
+            }
+            void onSocketBReadyRead()
+            {
+                if (!m_btoa.paused)
+                    relay(m_btoa);
+            }
+            void onSocketABytesWritten()
+            {
+                onSinkBytesWritten(m_btoa);
+            }
+            void onSocketBBytesWritten()
+            {
+                onSinkBytesWritten(m_atob);
             }
         };
     } // namespace Utils
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <QHostAddress>
+#include <QNetworkProxy>
+#include <QTcpSocket>
+#include <QUrl>
+#include <QtEndian>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * A SOCKS5 (RFC 1928) client negotiating on a plain QTcpSocket, used instead of QNetworkProxy::Socks5Proxy.
+         * The greeting, the optional username/password authentication (RFC 1929) and the CONNECT (or UDP ASSOCIATE)
+         * request are all written before the TCP connection is even established, and the caller may append its first
+         * payload bytes right away, so the whole handshake costs a single round trip instead of two or three.
+         * The replies are consumed from the socket as they arrive; the socket must not be read by anyone else until
+         * established() has been emitted, see IsNegotiating.
+         */
+        class Socks5Client : public QObject
+        {
+            Q_OBJECT
+          public:
+            /*
+             * Connects socket to the SOCKS5 server described by proxy and asks it for a connection to host:port.
+             * The returned negotiator is a child of the socket, it is detached from it once negotiation is over.
+             * Returns nullptr if the target cannot be expressed in a SOCKS5 request.
+             */
+            static Socks5Client *ConnectToHost(QTcpSocket *socket, const QNetworkProxy &proxy, const QString &host, quint16 port)
+            {
+                return Start(socket, proxy, Connect, EncodeAddress(host, port));
+            }
+
+            /*
+             * Asks the SOCKS5 server for a UDP association, socket then is its control connection: the association
+             * lasts as long as it stays open. The relay endpoint is reported by established().
+             */
+            static Socks5Client *Associate(QTcpSocket *socket, const QNetworkProxy &proxy)
+            {
+                // The client address is not known in advance, 0.0.0.0:0 lets the server accept any.
+                return Start(socket, proxy, UdpAssociate, QByteArray("\x01\x00\x00\x00\x00\x00\x00", 7));
+            }
+
+            /*
+             * The ATYP, DST.ADDR and DST.PORT fields addressing host:port, as used by requests and UDP datagrams.
+             * Returns an empty array if host cannot be expressed in them.
+             */
+            static QByteArray EncodeAddress(const QString &host, quint16 port)
+            {
+                QByteArray address;
+                const QHostAddress ip(host);
+                if (ip.protocol() == QAbstractSocket::IPv4Protocol)
+                {
+                    const auto ip4 = qToBigEndian(ip.toIPv4Address());
+                    address.append('\x01').append(reinterpret_cast<const char *>(&ip4), sizeof(ip4));
+                }
+                else if (ip.protocol() == QAbstractSocket::IPv6Protocol)
+                {
+                    const auto ip6 = ip.toIPv6Address();
+                    address.append('\x04').append(reinterpret_cast<const char *>(&ip6), sizeof(ip6));
+                }
+                else
+                {
+                    auto domain = QUrl::toAce(host);
+                    if (domain.isEmpty())
+                        domain = host.toUtf8();
+                    if (domain.isEmpty() || domain.size() > 255)
+                        return {};
+                    address.append('\x03').append(char(domain.size())).append(domain);
+                }
+                const auto bePort = qToBigEndian(port);
+                address.append(reinterpret_cast<const char *>(&bePort), sizeof(bePort));
+                return address;
+            }
+
+            // Size of the ATYP, ADDR and PORT fields at the start of data, 0 if data is too short or malformed.
+            static qsizetype AddressSize(QByteArrayView data)
+            {
+                if (data.size() < 2)
+                    return 0;
+                qsizetype size;
+                switch (data[0])
+                {
+                    case '\x01': size = 1 + 4 + 2; break;
+                    case '\x04': size = 1 + 16 + 2; break;
+                    case '\x03': size = 1 + 1 + quint8(data[1]) + 2; break;
+                    default: return 0;
+                }
+                return size <= data.size() ? size : 0;
+            }
+
+            // The negotiator of a socket still waiting for the SOCKS5 replies, or nullptr.
+            static Socks5Client *Negotiator(const QTcpSocket *socket)
+            {
+                return socket->findChild<Socks5Client *>(QString(), Qt::FindDirectChildrenOnly);
+            }
+
+            static bool IsNegotiating(const QTcpSocket *socket)
+            {
+                return Negotiator(socket) != nullptr;
+            }
+
+          signals:
+            // The bound address is the relay endpoint of a UDP association, null if the server sent a domain name.
+            void established(const QHostAddress &boundAddress, quint16 boundPort);
+            // reply is the REP field sent by the server, or 0xFF for a malformed or rejected negotiation.
+            void failed(quint8 reply);
+
+          private:
+            enum Command
+            {
+                Connect = 0x01,
+                UdpAssociate = 0x03,
+            };
+
+            enum State
+            {
+                MethodSelection,
+                Authentication,
+                ConnectReply,
+            };
+
+            Socks5Client(QTcpSocket *socket, bool authenticate) : QObject(socket), socket(socket), authenticate(authenticate)
+            {
+                connect(socket, &QTcpSocket::readyRead, this, &Socks5Client::onSocketReadyRead);
+            }
+
+            static Socks5Client *Start(QTcpSocket *socket, const QNetworkProxy &proxy, Command command, const QByteArray &address)
+            {
+                const auto request = BuildRequest(proxy, command, address);
+                if (request.isEmpty())
+                    return nullptr;
+
+                const auto client = new Socks5Client(socket, !proxy.user().isEmpty());
+                // Plain TCP to the SOCKS5 server, which also lets SocketStream splice the socket later on.
+                socket->setProxy(QNetworkProxy::NoProxy);
+                socket->connectToHost(proxy.hostName(), proxy.port());
+                socket->write(request);
+                return client;
+            }
+
+            static QByteArray BuildRequest(const QNetworkProxy &proxy, Command command, const QByteArray &address)
+            {
+                if (address.isEmpty())
+                    return {};
+
+                QByteArray request;
+                const auto user = proxy.user().toUtf8();
+                const auto password = proxy.password().toUtf8();
+                if (user.size() > 255 || password.size() > 255)
+                    return {};
+
+                // Offer a single method, so that the reply to the authentication can be predicted and pipelined.
+                if (user.isEmpty())
+                    request.append("\x05\x01\x00", 3);
+                else
+                {
+                    request.append("\x05\x01\x02\x01", 4);
+                    request.append(char(user.size())).append(user);
+                    request.append(char(password.size())).append(password);
+                }
+
+                request.append('\x05').append(char(command)).append('\x00').append(address);
+                return request;
+            }
+
+            // Size of the CONNECT reply, 0 if more bytes are needed to know it.
+            static qsizetype ConnectReplySize(const QByteArray &reply)
+            {
+                if (reply.size() < 5)
+                    return 0;
+                switch (reply[3])
+                {
+                    case '\x01': return 4 + 4 + 2;
+                    case '\x04': return 4 + 16 + 2;
+                    case '\x03': return 4 + 1 + quint8(reply[4]) + 2;
+                    default: return -1;
+                }
+            }
+
+            void detach()
+            {
+                socket->disconnect(this);
+                // Detach first, IsNegotiating must be false for whoever reacts to the signals.
+                setParent(nullptr);
+                deleteLater();
+            }
+
+            void succeed(QByteArrayView bound)
+            {
+                QHostAddress address;
+                if (bound[0] == '\x01')
+                    address = QHostAddress(qFromBigEndian<quint32>(bound.data() + 1));
+                else if (bound[0] == '\x04')
+                    address = QHostAddress(reinterpret_cast<const quint8 *>(bound.data() + 1));
+                const auto port = qFromBigEndian<quint16>(bound.data() + bound.size() - 2);
+                detach();
+                emit established(address, port);
+            }
+
+            void fail(quint8 reply)
+            {
+                detach();
+                emit failed(reply);
+                socket->abort();
+            }
+
+          private slots:
+            void onSocketReadyRead()
+            {
+                while (true)
+                {
+                    // Only ever read what belongs to the handshake, anything after it is payload for the caller.
+                    qsizetype expected = 2;
+                    if (state == ConnectReply)
+                    {
+                        expected = ConnectReplySize(reply);
+                        if (expected < 0)
+                            return fail(0xFF);
+                        if (expected == 0)
+                            expected = 5;
+                    }
+                    if (reply.size() < expected)
+                    {
+                        reply.append(socket->read(expected - reply.size()));
+                        if (reply.size() < expected)
+                            return;
+                        if (state == ConnectReply)
+                        {
+                            // Only now is ATYP known, an unknown one must not let the reply pass as complete.
+                            const auto size = ConnectReplySize(reply);
+                            if (size < 0)
+                                return fail(0xFF);
+                            if (size > reply.size())
+                                continue;
+                        }
+                    }
+
+                    switch (state)
+                    {
+                        case MethodSelection:
+                            if (reply[0] != '\x05' || reply[1] != (authenticate ? '\x02' : '\x00'))
+                                return fail(0xFF);
+                            state = authenticate ? Authentication : ConnectReply;
+                            break;
+                        case Authentication:
+                            if (reply[1] != '\x00')
+                                return fail(0xFF);
+                            state = ConnectReply;
+                            break;
+                        case ConnectReply:
+                            if (reply[0] != '\x05')
+                                return fail(0xFF);
+                            if (reply[1] != '\x00')
+                                return fail(quint8(reply[1]));
+                            return succeed(QByteArrayView(reply).sliced(3));
+                    }
+                    reply.clear();
+                }
+            }
+
+          private:
+            QTcpSocket *socket;
+            const bool authenticate;
+            State state = MethodSelection;
+            QByteArray reply;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
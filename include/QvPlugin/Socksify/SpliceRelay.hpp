@@ -0,0 +1,204 @@
+#pragma once
+
+#include "TrafficCounter.hpp"
+
+#include <QList>
+#include <QObject>
+#include <QtGlobal>
+
+#ifdef Q_OS_LINUX
+#include <QSocketNotifier>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Moves data between two connected TCP descriptors with splice(2), through one pipe per direction,
+         * so the payload never reaches user space. The relay owns both descriptors and closes them when destroyed.
+         * Half-closes are forwarded with shutdown(SHUT_WR), finished() is emitted once both directions are done
+         * or when either side fails.
+         */
+        class SpliceRelay : public QObject
+        {
+            Q_OBJECT
+          public:
+            SpliceRelay(int fdA, int fdB, QObject *parent = nullptr) : QObject(parent)
+            {
+                setupChannel(m_atob, fdA, fdB);
+                setupChannel(m_btoa, fdB, fdA);
+                m_fdA = fdA, m_fdB = fdB;
+                if (!isValid())
+                    return;
+                connect(m_atob.readNotifier, &QSocketNotifier::activated, this, [this] { pump(m_atob); });
+                connect(m_atob.writeNotifier, &QSocketNotifier::activated, this, [this] { pump(m_atob); });
+                connect(m_btoa.readNotifier, &QSocketNotifier::activated, this, [this] { pump(m_btoa); });
+                connect(m_btoa.writeNotifier, &QSocketNotifier::activated, this, [this] { pump(m_btoa); });
+            }
+
+            ~SpliceRelay()
+            {
+                closeChannel(m_atob);
+                closeChannel(m_btoa);
+                if (m_fdA >= 0)
+                    ::close(m_fdA);
+                if (m_fdB >= 0)
+                    ::close(m_fdB);
+            }
+
+            SpliceRelay(const SpliceRelay &) = delete;
+
+            bool isValid() const
+            {
+                return m_atob.pipe[0] >= 0 && m_btoa.pipe[0] >= 0;
+            }
+
+            // Bytes currently parked in the kernel pipe of each direction.
+            qint64 pendingAtoB() const
+            {
+                return m_atob.inPipe;
+            }
+            qint64 pendingBtoA() const
+            {
+                return m_btoa.inPipe;
+            }
+
+            // Bytes moved from A to B are added to the up counter of each of these, B to A to the down counter.
+            void setTrafficCounters(const QList<TrafficCounter *> &counters)
+            {
+                m_counters = counters;
+            }
+
+          signals:
+            void finished();
+
+          private:
+            // Upper bound of bytes moved per notification, so one busy tunnel cannot monopolise the event loop.
+            static constexpr qint64 MaxBytesPerPump = 1024 * 1024;
+            static constexpr size_t SpliceChunkSize = 64 * 1024;
+
+            struct Channel
+            {
+                int from = -1;
+                int to = -1;
+                int pipe[2] = { -1, -1 };
+                qint64 inPipe = 0;
+                bool eof = false;
+                bool shutdownSent = false;
+                QSocketNotifier *readNotifier = nullptr;
+                QSocketNotifier *writeNotifier = nullptr;
+            };
+
+            void setupChannel(Channel &c, int from, int to)
+            {
+                c.from = from, c.to = to;
+                if (::pipe2(c.pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+                {
+                    c.pipe[0] = c.pipe[1] = -1;
+                    return;
+                }
+                c.readNotifier = new QSocketNotifier(from, QSocketNotifier::Read, this);
+                c.writeNotifier = new QSocketNotifier(to, QSocketNotifier::Write, this);
+                c.writeNotifier->setEnabled(false);
+            }
+
+            static void closeChannel(Channel &c)
+            {
+                if (c.pipe[0] >= 0)
+                    ::close(c.pipe[0]), ::close(c.pipe[1]);
+                c.pipe[0] = c.pipe[1] = -1;
+            }
+
+            void pump(Channel &c)
+            {
+                if (m_finished)
+                    return;
+
+                qint64 moved = 0;
+                while (true)
+                {
+                    // Drain the pipe before reading more, the pipe is the only buffer of this direction.
+                    while (c.inPipe > 0)
+                    {
+                        const auto n = ::splice(c.pipe[0], nullptr, c.to, nullptr, c.inPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                        if (n > 0)
+                        {
+                            c.inPipe -= n, moved += n;
+                            for (const auto counter : m_counters)
+                                &c == &m_atob ? counter->addUp(n) : counter->addDown(n);
+                            continue;
+                        }
+                        if (n < 0 && errno == EINTR)
+                            continue;
+                        if (n < 0 && errno == EAGAIN)
+                        {
+                            c.readNotifier->setEnabled(false);
+                            c.writeNotifier->setEnabled(true);
+                            return;
+                        }
+                        return fail();
+                    }
+                    c.writeNotifier->setEnabled(false);
+
+                    if (c.eof)
+                    {
+                        if (!c.shutdownSent)
+                            ::shutdown(c.to, SHUT_WR), c.shutdownSent = true;
+                        if (m_atob.shutdownSent && m_btoa.shutdownSent)
+                            finish();
+                        return;
+                    }
+
+                    if (moved >= MaxBytesPerPump)
+                    {
+                        c.readNotifier->setEnabled(true);
+                        return;
+                    }
+
+                    const auto n = ::splice(c.from, nullptr, c.pipe[1], nullptr, SpliceChunkSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    if (n > 0)
+                        c.inPipe += n;
+                    else if (n == 0)
+                        c.eof = true, c.readNotifier->setEnabled(false);
+                    else if (errno == EINTR)
+                        continue;
+                    else if (errno == EAGAIN)
+                    {
+                        c.readNotifier->setEnabled(true);
+                        return;
+                    }
+                    else
+                        return fail();
+                }
+            }
+
+            void fail()
+            {
+                for (auto c : { &m_atob, &m_btoa })
+                    c->readNotifier->setEnabled(false), c->writeNotifier->setEnabled(false);
+                finish();
+            }
+
+            void finish()
+            {
+                if (m_finished)
+                    return;
+                m_finished = true;
+                emit finished();
+            }
+
+          private:
+            int m_fdA = -1;
+            int m_fdB = -1;
+            Channel m_atob;
+            Channel m_btoa;
+            QList<TrafficCounter *> m_counters;
+            bool m_finished = false;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QString>
+#include <atomic>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Byte counters updated on the relay path and read from any thread.
+         * Up is the direction from the local client to the upstream, down the other one.
+         * Relaxed atomics: the counters only need to be eventually accurate, not ordered with anything else.
+         */
+        struct TrafficCounter
+        {
+            std::atomic<quint64> up{ 0 };
+            std::atomic<quint64> down{ 0 };
+
+            void addUp(quint64 bytes)
+            {
+                up.fetch_add(bytes, std::memory_order_relaxed);
+            }
+            void addDown(quint64 bytes)
+            {
+                down.fetch_add(bytes, std::memory_order_relaxed);
+            }
+            quint64 upBytes() const
+            {
+                return up.load(std::memory_order_relaxed);
+            }
+            quint64 downBytes() const
+            {
+                return down.load(std::memory_order_relaxed);
+            }
+        };
+
+        // A snapshot of one client connection of HttpProxy, see HttpProxy::connectionStatistics
+        struct ConnectionStatistics
+        {
+            QString client;
+            // "host:port" of the last request, empty until the first request head has been received.
+            QString target;
+            bool tunnel = false;
+            quint64 up = 0;
+            quint64 down = 0;
+            qint64 ageMsec = 0;
+            // The HttpProxy configuration the connection was accepted with, see HttpProxy::reconfigure
+            int generation = 0;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
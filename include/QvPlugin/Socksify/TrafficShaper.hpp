@@ -0,0 +1,275 @@
+#pragma once
+
+#include "BufferPool.hpp"
+
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * A token bucket: rate bytes per second, up to burst bytes saved while idle. A rate of 0 means unlimited.
+         */
+        struct TokenBucket
+        {
+            static qint64 Now()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            // A burst of -1 allows 200ms worth of the rate, and never less than two relay chunks.
+            void setRate(qint64 bytesPerSecond, qint64 burstBytes = -1)
+            {
+                rate = qMax<qint64>(0, bytesPerSecond);
+                burst = burstBytes >= 0 ? burstBytes : qMax<qint64>(rate / 5, 2 * BufferPool::ChunkSize);
+                tokens = qMin(tokens, double(burst));
+            }
+
+            qint64 available(qint64 now)
+            {
+                if (rate == 0)
+                    return std::numeric_limits<qint64>::max();
+                if (lastRefill != 0)
+                    tokens = qMin(double(burst), tokens + double(now - lastRefill) * double(rate) / 1e9);
+                lastRefill = now;
+                return qint64(tokens);
+            }
+
+            void consume(qint64 bytes)
+            {
+                if (rate != 0)
+                    tokens -= double(bytes);
+            }
+
+            // Nanoseconds until bytes are available, 0 if they are already.
+            qint64 waitFor(qint64 bytes) const
+            {
+                if (rate == 0 || tokens >= double(bytes))
+                    return 0;
+                return qint64((double(bytes) - tokens) * 1e9 / double(rate));
+            }
+
+            qint64 rate = 0;
+            qint64 burst = 0;
+            double tokens = 0;
+            qint64 lastRefill = 0;
+        };
+
+        // A TokenBucket shared by the TrafficShapers of several threads.
+        class SharedTokenBucket
+        {
+          public:
+            void setRate(qint64 bytesPerSecond, qint64 burstBytes = -1)
+            {
+                const QMutexLocker locker(&lock);
+                bucket.setRate(bytesPerSecond, burstBytes);
+            }
+
+            qint64 rate() const
+            {
+                const QMutexLocker locker(&lock);
+                return bucket.rate;
+            }
+
+            // Takes up to wanted bytes, returns how many have been granted. Unused ones go back with giveBack.
+            qint64 take(qint64 now, qint64 wanted)
+            {
+                const QMutexLocker locker(&lock);
+                const auto granted = qMin(wanted, bucket.available(now));
+                bucket.consume(qMax<qint64>(0, granted));
+                return qMax<qint64>(0, granted);
+            }
+
+            void giveBack(qint64 bytes)
+            {
+                const QMutexLocker locker(&lock);
+                bucket.consume(-bytes);
+            }
+
+            qint64 waitFor(qint64 bytes) const
+            {
+                const QMutexLocker locker(&lock);
+                return bucket.waitFor(bytes);
+            }
+
+          private:
+            mutable QMutex lock;
+            TokenBucket bucket;
+        };
+
+        /*
+         * Shares the write opportunities of one thread between the flows (directions of SocketStreams) that have
+         * data to relay, with deficit round robin: every round, each active flow may move up to Quantum more bytes
+         * than it has used, so a bulk transfer cannot delay a small interactive flow by more than one round.
+         * Each flow can be limited by its own token bucket, all of them by a SharedTokenBucket, and the shaper
+         * goes back to the event loop after MaxBytesPerRun, so reads and new connections are not starved either.
+         */
+        class TrafficShaper : public QObject
+        {
+            Q_OBJECT
+          public:
+            static constexpr qint64 Quantum = BufferPool::ChunkSize;
+            static constexpr qint64 MaxBytesPerRun = 1024 * 1024;
+
+            struct Flow
+            {
+                // Moves at most budget bytes, returns how many have been moved.
+                std::function<qint64(qint64 budget)> move;
+                // Whether the flow has data it could move right now.
+                std::function<bool()> pending;
+                TokenBucket bucket;
+                qint64 deficit = 0;
+                bool queued = false;
+            };
+
+            explicit TrafficShaper(QObject *parent = nullptr) : QObject(parent), timer(this)
+            {
+                timer.setSingleShot(true);
+                timer.setTimerType(Qt::PreciseTimer);
+                connect(&timer, &QTimer::timeout, this, &TrafficShaper::run);
+            }
+
+            TrafficShaper(const TrafficShaper &) = delete;
+
+            // The limit of every flow, changed at once for the flows already registered. 0 means unlimited.
+            void setFlowRate(qint64 bytesPerSecond)
+            {
+                flowRate = bytesPerSecond;
+                for (const auto flow : std::as_const(flows))
+                    flow->bucket.setRate(flowRate);
+            }
+
+            void setSharedBucket(std::shared_ptr<SharedTokenBucket> bucket)
+            {
+                shared = std::move(bucket);
+            }
+
+            void add(Flow *flow)
+            {
+                flow->bucket.setRate(flowRate);
+                flows.append(flow);
+            }
+
+            void remove(Flow *flow)
+            {
+                flows.removeOne(flow);
+                active.removeOne(flow);
+            }
+
+            // Schedules flow, which has data to move.
+            void activate(Flow *flow)
+            {
+                if (!flow->queued)
+                {
+                    flow->queued = true;
+                    active.append(flow);
+                }
+                schedule();
+            }
+
+          private:
+            void schedule()
+            {
+                if (scheduled)
+                    return;
+                // Flows activated during the same event loop iteration are served together.
+                scheduled = true;
+                QMetaObject::invokeMethod(this, &TrafficShaper::run, Qt::QueuedConnection);
+            }
+
+            void run()
+            {
+                scheduled = false;
+                const auto now = TokenBucket::Now();
+                qint64 movedThisRun = 0;
+                qint64 wait = std::numeric_limits<qint64>::max();
+                QList<Flow *> limited;
+
+                while (!active.isEmpty())
+                {
+                    if (movedThisRun >= MaxBytesPerRun)
+                        break;
+
+                    const auto flow = active.takeFirst();
+                    flow->queued = false;
+                    if (!flow->pending())
+                    {
+                        // An idle flow does not keep credit, or it could burst past the others later on.
+                        flow->deficit = 0;
+                        continue;
+                    }
+
+                    const auto own = flow->bucket.available(now);
+                    if (own <= 0)
+                    {
+                        wait = qMin(wait, flow->bucket.waitFor(Quantum));
+                        limited.append(flow);
+                        continue;
+                    }
+
+                    flow->deficit = qMin(flow->deficit + Quantum, 2 * Quantum);
+                    auto budget = qMin(flow->deficit, own);
+                    if (shared)
+                    {
+                        budget = shared->take(now, budget);
+                        if (budget <= 0)
+                        {
+                            // Nothing left for anybody, try again when the shared bucket has refilled.
+                            wait = qMin(wait, shared->waitFor(Quantum));
+                            active.prepend(flow);
+                            flow->queued = true;
+                            break;
+                        }
+                    }
+
+                    const auto moved = qMax<qint64>(0, flow->move(budget));
+                    if (shared && moved < budget)
+                        shared->giveBack(budget - moved);
+                    flow->bucket.consume(moved);
+                    flow->deficit -= moved;
+                    movedThisRun += moved;
+
+                    // A flow stopped by its sink is activated again by the stream once the sink has drained.
+                    if (moved > 0 && flow->pending())
+                    {
+                        flow->queued = true;
+                        active.append(flow);
+                    }
+                    else
+                        flow->deficit = 0;
+                }
+
+                for (const auto flow : std::as_const(limited))
+                {
+                    if (flow->queued)
+                        continue;
+                    flow->queued = true;
+                    active.append(flow);
+                }
+
+                if (active.isEmpty())
+                    return;
+                if (wait == std::numeric_limits<qint64>::max())
+                    // Only the per-run bound stopped us.
+                    return schedule();
+                timer.start(int(qBound<qint64>(1, wait / 1000000, 1000)));
+            }
+
+          private:
+            QList<Flow *> flows;
+            QList<Flow *> active;
+            std::shared_ptr<SharedTokenBucket> shared;
+            qint64 flowRate = 0;
+            bool scheduled = false;
+            QTimer timer;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
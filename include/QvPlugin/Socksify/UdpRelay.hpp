@@ -0,0 +1,603 @@
+#pragma once
+
+#include "Socks5Client.hpp"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QNetworkProxy>
+#include <QTcpSocket>
+#include <QTimer>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <QSocketNotifier>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#else
+#include <QUdpSocket>
+#endif
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Forwards the datagrams received on a local UDP port through a SOCKS5 server, using UDP ASSOCIATE, and the
+         * replies back to their sender. Local datagrams either carry their own SOCKS5 UDP request header, so that
+         * every datagram names its destination as QUIC and DNS clients need, or go to a fixed target like a port
+         * forward. Every local sender gets its own association so that replies can be told apart; an association
+         * idle for longer than the idle timeout is closed.
+         * On Linux datagrams are moved in batches, one recvmmsg and one sendmmsg call for up to BatchSize datagrams,
+         * elsewhere one at a time through QUdpSocket.
+         */
+        class UdpRelay : public QObject
+        {
+            Q_OBJECT
+          public:
+            struct Statistics
+            {
+                quint64 datagramsUp = 0;
+                quint64 datagramsDown = 0;
+                quint64 bytesUp = 0;
+                quint64 bytesDown = 0;
+                // Datagrams lost because they were too large, malformed, fragmented, not sendable, or over a limit.
+                quint64 dropped = 0;
+                // Receive calls made, datagrams / receiveCalls is the average batch size.
+                quint64 receiveCalls = 0;
+                int sessions = 0;
+            };
+
+            static constexpr int BatchSize = 64;
+            // Larger datagrams are dropped, QUIC and DNS stay well below.
+            static constexpr qsizetype SlotSize = 8 * 1024;
+
+            explicit UdpRelay(QObject *parent = nullptr) : QObject(parent), buffers(BatchSize * SlotSize, Qt::Uninitialized), sweepTimer(this)
+            {
+                sweepTimer.setInterval(1000);
+                connect(&sweepTimer, &QTimer::timeout, this, &UdpRelay::expireSessions);
+            }
+
+            ~UdpRelay()
+            {
+                for (const auto session : sessions.values())
+                    closeSession(session, false);
+                closeEndpoint(local);
+            }
+
+            UdpRelay(const UdpRelay &) = delete;
+
+            /*
+             * Receive datagrams on address:port and send them through the SOCKS5 server described by proxy. Each
+             * datagram starts with the SOCKS5 UDP request header (RSV, FRAG, ATYP, DST.ADDR, DST.PORT) naming its
+             * destination, and replies come back with the header naming their source, as from a SOCKS5 server.
+             * Datagrams with a malformed header or a FRAG other than 0 are dropped. A port of 0 picks a free one,
+             * see localPort.
+             */
+            bool listen(const QHostAddress &address, quint16 port, const QNetworkProxy &proxy)
+            {
+                header.clear();
+                return open(address, port, proxy);
+            }
+
+            // Like listen above, but every datagram is plain payload sent to targetHost:targetPort.
+            bool listen(const QHostAddress &address, quint16 port, const QNetworkProxy &proxy, const QString &targetHost, quint16 targetPort)
+            {
+                // RSV RSV FRAG, then the target, the same for every datagram of this relay.
+                const auto target = Socks5Client::EncodeAddress(targetHost, targetPort);
+                if (target.isEmpty() || target.size() + 3 >= SlotSize)
+                    return false;
+                header = QByteArray(3, '\0') + target;
+                return open(address, port, proxy);
+            }
+
+            quint16 localPort() const
+            {
+                return local.port;
+            }
+
+            void setIdleTimeout(int msec)
+            {
+                idleTimeout = msec;
+            }
+
+            void setMaxSessions(int count)
+            {
+                maxSessions = count;
+            }
+
+            // Safe to call from any thread.
+            Statistics statistics() const
+            {
+                Statistics s;
+                s.datagramsUp = counters.datagramsUp.load(std::memory_order_relaxed);
+                s.datagramsDown = counters.datagramsDown.load(std::memory_order_relaxed);
+                s.bytesUp = counters.bytesUp.load(std::memory_order_relaxed);
+                s.bytesDown = counters.bytesDown.load(std::memory_order_relaxed);
+                s.dropped = counters.dropped.load(std::memory_order_relaxed);
+                s.receiveCalls = counters.receiveCalls.load(std::memory_order_relaxed);
+                s.sessions = counters.sessions.load(std::memory_order_relaxed);
+                return s;
+            }
+
+          private:
+            static constexpr size_t MaxPendingDatagrams = 32;
+
+            struct Endpoint
+            {
+                quint16 port = 0;
+#ifdef Q_OS_LINUX
+                int fd = -1;
+                QSocketNotifier *notifier = nullptr;
+#else
+                QUdpSocket *socket = nullptr;
+#endif
+            };
+
+            struct Session
+            {
+                QHostAddress clientAddress;
+                quint16 clientPort = 0;
+                // The association lives as long as this connection to the SOCKS5 server.
+                QTcpSocket *control = nullptr;
+                // Connected to the relay endpoint of the association once it is established.
+                Endpoint upstream;
+                bool established = false;
+                // Wrapped datagrams received before the association was established.
+                std::vector<QByteArray> pending;
+                QElapsedTimer lastActive;
+#ifdef Q_OS_LINUX
+                sockaddr_storage clientSockaddr;
+                socklen_t clientSockaddrLength = 0;
+#endif
+            };
+
+            struct Counters
+            {
+                std::atomic<quint64> datagramsUp{ 0 };
+                std::atomic<quint64> datagramsDown{ 0 };
+                std::atomic<quint64> bytesUp{ 0 };
+                std::atomic<quint64> bytesDown{ 0 };
+                std::atomic<quint64> dropped{ 0 };
+                std::atomic<quint64> receiveCalls{ 0 };
+                std::atomic<int> sessions{ 0 };
+            };
+
+            static void Add(std::atomic<quint64> &counter, quint64 value)
+            {
+                counter.fetch_add(value, std::memory_order_relaxed);
+            }
+
+            char *buffer(int i)
+            {
+                return buffers.data() + i * SlotSize;
+            }
+
+            // Size of the SOCKS5 UDP header in front of a datagram, 0 if it must be dropped.
+            static qsizetype UnwrappedOffset(QByteArrayView datagram)
+            {
+                // Fragmentation is optional for servers, and not worth reassembling for DNS or QUIC.
+                if (datagram.size() < 4 || datagram[2] != '\0')
+                    return 0;
+                const auto addressSize = Socks5Client::AddressSize(datagram.sliced(3));
+                return addressSize == 0 ? 0 : 3 + addressSize;
+            }
+
+            // Whether local datagrams carry their own SOCKS5 UDP header, which replies then keep.
+            bool keepsHeaders() const
+            {
+                return header.isEmpty();
+            }
+
+            bool open(const QHostAddress &address, quint16 port, const QNetworkProxy &proxy)
+            {
+                this->proxy = proxy;
+                if (!openEndpoint(local, address, port, {}, 0))
+                    return false;
+                setReadHandler(local, [this]() { onLocalReadyRead(); });
+                sweepTimer.start();
+                return true;
+            }
+
+#ifdef Q_OS_LINUX
+            static socklen_t ToSockaddr(const QHostAddress &address, quint16 port, sockaddr_storage &storage)
+            {
+                std::memset(&storage, 0, sizeof(storage));
+                if (address.protocol() == QAbstractSocket::IPv4Protocol)
+                {
+                    auto sin = reinterpret_cast<sockaddr_in *>(&storage);
+                    sin->sin_family = AF_INET;
+                    sin->sin_port = htons(port);
+                    sin->sin_addr.s_addr = htonl(address.toIPv4Address());
+                    return sizeof(sockaddr_in);
+                }
+                // QHostAddress::Any becomes a dual-stack IPv6 socket.
+                auto sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(port);
+                if (address.protocol() == QAbstractSocket::IPv6Protocol)
+                {
+                    const auto ip6 = address.toIPv6Address();
+                    std::memcpy(&sin6->sin6_addr, &ip6, sizeof(ip6));
+                    sin6->sin6_scope_id = address.scopeId().toUInt();
+                }
+                return sizeof(sockaddr_in6);
+            }
+
+            static quint16 SockaddrPort(const sockaddr_storage &storage)
+            {
+                if (storage.ss_family == AF_INET)
+                    return ntohs(reinterpret_cast<const sockaddr_in *>(&storage)->sin_port);
+                return ntohs(reinterpret_cast<const sockaddr_in6 *>(&storage)->sin6_port);
+            }
+
+            // Sends as much of the batch as the socket accepts, like UDP the rest is dropped.
+            int sendBatch(int fd, mmsghdr *messages, int count)
+            {
+                int sent = 0;
+                while (sent < count)
+                {
+                    const auto n = ::sendmmsg(fd, messages + sent, count - sent, MSG_DONTWAIT);
+                    if (n > 0)
+                        sent += n;
+                    else if (n < 0 && errno == EINTR)
+                        continue;
+                    else
+                        break;
+                }
+                Add(counters.dropped, count - sent);
+                return sent;
+            }
+#endif
+
+            bool openEndpoint(Endpoint &e, const QHostAddress &bindAddress, quint16 bindPort, const QHostAddress &peer, quint16 peerPort)
+            {
+#ifdef Q_OS_LINUX
+                sockaddr_storage storage;
+                const auto length = ToSockaddr(bindAddress, bindPort, storage);
+                e.fd = ::socket(storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (e.fd < 0)
+                    return false;
+                if (storage.ss_family == AF_INET6)
+                {
+                    const int v6only = bindAddress.protocol() == QAbstractSocket::IPv6Protocol ? 1 : 0;
+                    ::setsockopt(e.fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+                }
+                socklen_t boundLength = sizeof(storage);
+                if (::bind(e.fd, reinterpret_cast<sockaddr *>(&storage), length) != 0 ||
+                    ::getsockname(e.fd, reinterpret_cast<sockaddr *>(&storage), &boundLength) != 0)
+                {
+                    closeEndpoint(e);
+                    return false;
+                }
+                e.port = SockaddrPort(storage);
+                if (!peer.isNull())
+                {
+                    sockaddr_storage peerStorage;
+                    const auto peerLength = ToSockaddr(peer, peerPort, peerStorage);
+                    if (::connect(e.fd, reinterpret_cast<sockaddr *>(&peerStorage), peerLength) != 0)
+                    {
+                        closeEndpoint(e);
+                        return false;
+                    }
+                }
+                e.notifier = new QSocketNotifier(e.fd, QSocketNotifier::Read, this);
+#else
+                e.socket = new QUdpSocket(this);
+                if (!e.socket->bind(bindAddress, bindPort))
+                {
+                    closeEndpoint(e);
+                    return false;
+                }
+                e.port = e.socket->localPort();
+                if (!peer.isNull())
+                    e.socket->connectToHost(peer, peerPort);
+#endif
+                return true;
+            }
+
+            void closeEndpoint(Endpoint &e)
+            {
+#ifdef Q_OS_LINUX
+                delete e.notifier;
+                e.notifier = nullptr;
+                if (e.fd >= 0)
+                    ::close(e.fd);
+                e.fd = -1;
+#else
+                delete e.socket;
+                e.socket = nullptr;
+#endif
+            }
+
+            template<typename F>
+            void setReadHandler(Endpoint &e, F handler)
+            {
+#ifdef Q_OS_LINUX
+                connect(e.notifier, &QSocketNotifier::activated, this, handler);
+#else
+                connect(e.socket, &QUdpSocket::readyRead, this, handler);
+#endif
+            }
+
+            Session *findOrCreateSession(const QHostAddress &address, quint16 port)
+            {
+                const auto key = qMakePair(address, port);
+                if (const auto it = sessions.constFind(key); it != sessions.cend())
+                    return *it;
+                if (maxSessions > 0 && sessions.size() >= maxSessions)
+                    return nullptr;
+
+                const auto session = new Session;
+                session->clientAddress = address;
+                session->clientPort = port;
+                session->lastActive.start();
+                session->control = new QTcpSocket(this);
+                const auto negotiator = Socks5Client::Associate(session->control, proxy);
+                if (!negotiator)
+                {
+                    delete session->control;
+                    delete session;
+                    return nullptr;
+                }
+                connect(negotiator, &Socks5Client::established, session->control, [this, session](const QHostAddress &relay, quint16 relayPort) {
+                    startSession(session, relay, relayPort);
+                });
+                // Every connection to the control socket goes away with it, so a session is closed exactly once.
+                // A failed negotiation aborts the control connection, which ends the session like any other close.
+                connect(session->control, &QTcpSocket::disconnected, this, [this, session]() { closeSession(session); });
+                connect(session->control, &QAbstractSocket::errorOccurred, this, [this, session]() { closeSession(session); });
+                sessions.insert(key, session);
+                counters.sessions.store(sessions.size(), std::memory_order_relaxed);
+                return session;
+            }
+
+            void startSession(Session *session, QHostAddress relay, quint16 relayPort)
+            {
+                // Servers commonly answer 0.0.0.0, meaning the address the control connection reached.
+                if (relay.isNull() || relay == QHostAddress::AnyIPv4 || relay == QHostAddress::AnyIPv6)
+                    relay = session->control->peerAddress();
+
+                const auto any = relay.protocol() == QAbstractSocket::IPv4Protocol ? QHostAddress::AnyIPv4 : QHostAddress::AnyIPv6;
+                if (!openEndpoint(session->upstream, QHostAddress(any), 0, relay, relayPort))
+                    return closeSession(session);
+                setReadHandler(session->upstream, [this, session]() { onUpstreamReadyRead(session); });
+                session->established = true;
+
+                for (const auto &datagram : session->pending)
+                    sendUp(session, datagram.constData(), datagram.size());
+                session->pending.clear();
+            }
+
+            void closeSession(Session *session, bool scheduled = true)
+            {
+                sessions.remove(qMakePair(session->clientAddress, session->clientPort));
+                counters.sessions.store(sessions.size(), std::memory_order_relaxed);
+                session->control->disconnect(this);
+                session->control->abort();
+                if (scheduled)
+                    session->control->deleteLater();
+                else
+                    delete session->control;
+                closeEndpoint(session->upstream);
+                delete session;
+            }
+
+            void sendUp(Session *session, const char *datagram, qsizetype size)
+            {
+#ifdef Q_OS_LINUX
+                const auto n = ::send(session->upstream.fd, datagram, size, MSG_DONTWAIT);
+#else
+                const auto n = session->upstream.socket->write(datagram, size);
+#endif
+                if (n < 0)
+                    return Add(counters.dropped, 1);
+                Add(counters.datagramsUp, 1);
+                Add(counters.bytesUp, size - UnwrappedOffset(QByteArrayView(datagram, size)));
+            }
+
+            // A datagram has been received in buffer i, behind room for the header.
+            void forwardUp(Session *session, int i, qsizetype payloadSize)
+            {
+                std::memcpy(buffer(i), header.constData(), header.size());
+                session->lastActive.restart();
+                if (session->established)
+                    return sendUp(session, buffer(i), header.size() + payloadSize);
+                if (session->pending.size() >= MaxPendingDatagrams)
+                    return Add(counters.dropped, 1);
+                session->pending.emplace_back(buffer(i), header.size() + payloadSize);
+            }
+
+            void onLocalReadyRead()
+            {
+#ifdef Q_OS_LINUX
+                mmsghdr in[BatchSize], out[BatchSize];
+                iovec inVectors[BatchSize], outVectors[BatchSize];
+                sockaddr_storage senders[BatchSize];
+                while (true)
+                {
+                    std::memset(in, 0, sizeof(in));
+                    for (auto i = 0; i < BatchSize; i++)
+                    {
+                        inVectors[i] = { buffer(i) + header.size(), size_t(SlotSize - header.size()) };
+                        in[i].msg_hdr.msg_iov = &inVectors[i];
+                        in[i].msg_hdr.msg_iovlen = 1;
+                        in[i].msg_hdr.msg_name = &senders[i];
+                        in[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                    }
+                    const auto n = ::recvmmsg(local.fd, in, BatchSize, MSG_DONTWAIT, nullptr);
+                    if (n <= 0)
+                        break;
+                    Add(counters.receiveCalls, 1);
+
+                    // Consecutive datagrams of the same sender leave with a single sendmmsg.
+                    Session *run = nullptr;
+                    int count = 0;
+                    std::memset(out, 0, sizeof(out));
+                    for (auto i = 0; i < n; i++)
+                    {
+                        if ((in[i].msg_hdr.msg_flags & MSG_TRUNC) || (keepsHeaders() && UnwrappedOffset(QByteArrayView(buffer(i), in[i].msg_len)) == 0))
+                        {
+                            Add(counters.dropped, 1);
+                            continue;
+                        }
+                        const QHostAddress address(reinterpret_cast<const sockaddr *>(&senders[i]));
+                        const auto session = findOrCreateSession(address, SockaddrPort(senders[i]));
+                        if (!session)
+                        {
+                            Add(counters.dropped, 1);
+                            continue;
+                        }
+                        if (!session->established)
+                        {
+                            std::memcpy(&session->clientSockaddr, &senders[i], in[i].msg_hdr.msg_namelen);
+                            session->clientSockaddrLength = in[i].msg_hdr.msg_namelen;
+                            forwardUp(session, i, in[i].msg_len);
+                            continue;
+                        }
+
+                        if (session != run && count > 0)
+                            flushUp(run, out, count), count = 0;
+                        run = session;
+                        std::memcpy(buffer(i), header.constData(), header.size());
+                        session->lastActive.restart();
+                        outVectors[count] = { buffer(i), size_t(header.size() + in[i].msg_len) };
+                        out[count].msg_hdr.msg_iov = &outVectors[count];
+                        out[count].msg_hdr.msg_iovlen = 1;
+                        count++;
+                    }
+                    if (count > 0)
+                        flushUp(run, out, count);
+                    if (n < BatchSize)
+                        break;
+                }
+#else
+                while (local.socket->hasPendingDatagrams())
+                {
+                    QHostAddress address;
+                    quint16 port;
+                    const auto n = local.socket->readDatagram(buffer(0) + header.size(), SlotSize - header.size(), &address, &port);
+                    if (n < 0)
+                        break;
+                    if (keepsHeaders() && UnwrappedOffset(QByteArrayView(buffer(0), n)) == 0)
+                        Add(counters.dropped, 1);
+                    else if (const auto session = findOrCreateSession(address, port); session)
+                        forwardUp(session, 0, n);
+                    else
+                        Add(counters.dropped, 1);
+                }
+#endif
+            }
+
+#ifdef Q_OS_LINUX
+            void flushUp(Session *session, mmsghdr *messages, int count)
+            {
+                const auto sent = sendBatch(session->upstream.fd, messages, count);
+                quint64 bytes = 0;
+                for (auto i = 0; i < sent; i++)
+                {
+                    const auto &v = *messages[i].msg_hdr.msg_iov;
+                    bytes += v.iov_len - UnwrappedOffset(QByteArrayView(static_cast<const char *>(v.iov_base), v.iov_len));
+                }
+                Add(counters.datagramsUp, sent);
+                Add(counters.bytesUp, bytes);
+            }
+#endif
+
+            void onUpstreamReadyRead(Session *session)
+            {
+                session->lastActive.restart();
+#ifdef Q_OS_LINUX
+                mmsghdr in[BatchSize], out[BatchSize];
+                iovec inVectors[BatchSize], outVectors[BatchSize];
+                while (true)
+                {
+                    std::memset(in, 0, sizeof(in));
+                    for (auto i = 0; i < BatchSize; i++)
+                    {
+                        inVectors[i] = { buffer(i), size_t(SlotSize) };
+                        in[i].msg_hdr.msg_iov = &inVectors[i];
+                        in[i].msg_hdr.msg_iovlen = 1;
+                    }
+                    const auto n = ::recvmmsg(session->upstream.fd, in, BatchSize, MSG_DONTWAIT, nullptr);
+                    if (n <= 0)
+                        break;
+                    Add(counters.receiveCalls, 1);
+
+                    int count = 0;
+                    quint64 bytes = 0;
+                    qsizetype payloads[BatchSize];
+                    std::memset(out, 0, sizeof(out));
+                    for (auto i = 0; i < n; i++)
+                    {
+                        const auto offset = UnwrappedOffset(QByteArrayView(buffer(i), in[i].msg_len));
+                        if (offset == 0 || (in[i].msg_hdr.msg_flags & MSG_TRUNC))
+                        {
+                            Add(counters.dropped, 1);
+                            continue;
+                        }
+                        payloads[count] = in[i].msg_len - offset;
+                        const auto skipped = keepsHeaders() ? 0 : offset;
+                        outVectors[count] = { buffer(i) + skipped, size_t(in[i].msg_len - skipped) };
+                        out[count].msg_hdr.msg_iov = &outVectors[count];
+                        out[count].msg_hdr.msg_iovlen = 1;
+                        out[count].msg_hdr.msg_name = &session->clientSockaddr;
+                        out[count].msg_hdr.msg_namelen = session->clientSockaddrLength;
+                        count++;
+                    }
+                    const auto sent = sendBatch(local.fd, out, count);
+                    for (auto i = 0; i < sent; i++)
+                        bytes += payloads[i];
+                    Add(counters.datagramsDown, sent);
+                    Add(counters.bytesDown, bytes);
+                    if (n < BatchSize)
+                        break;
+                }
+#else
+                while (session->upstream.socket->hasPendingDatagrams())
+                {
+                    const auto n = session->upstream.socket->readDatagram(buffer(0), SlotSize);
+                    if (n < 0)
+                        break;
+                    const auto offset = UnwrappedOffset(QByteArrayView(buffer(0), n));
+                    const auto skipped = keepsHeaders() ? 0 : offset;
+                    if (offset == 0 || local.socket->writeDatagram(buffer(0) + skipped, n - skipped, session->clientAddress, session->clientPort) < 0)
+                    {
+                        Add(counters.dropped, 1);
+                        continue;
+                    }
+                    Add(counters.datagramsDown, 1);
+                    Add(counters.bytesDown, n - offset);
+                }
+#endif
+            }
+
+            void expireSessions()
+            {
+                QList<Session *> expired;
+                for (const auto session : std::as_const(sessions))
+                    if (session->lastActive.hasExpired(idleTimeout))
+                        expired.append(session);
+                for (const auto session : expired)
+                    closeSession(session);
+            }
+
+          private:
+            Endpoint local;
+            QNetworkProxy proxy;
+            // RSV RSV FRAG and the fixed target put in front of every local datagram, empty when they carry their own.
+            QByteArray header;
+            // BatchSize receive buffers of SlotSize bytes, reused by every batch.
+            QByteArray buffers;
+            QHash<QPair<QHostAddress, quint16>, Session *> sessions;
+            QTimer sweepTimer;
+            Counters counters;
+            int idleTimeout = 60 * 1000;
+            int maxSessions = 1024;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <QList>
+#include <QNetworkProxy>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Spreads the proxied connections of a HttpProxy over several upstream SOCKS5 endpoints, e.g. one per
+         * kernel instance. Shared by all the workers and safe to use from any thread, the endpoint set itself is
+         * immutable: a new one means a new balancer, see HttpProxy::reconfigure.
+         * Health is tracked passively: after maxFailures consecutive connect failures an endpoint is ejected for
+         * ejectTime milliseconds, then tried again, and ejected again by its next failure until one succeeds.
+         * When every endpoint is ejected, the one coming back first is used anyway.
+         */
+        class UpstreamBalancer
+        {
+          public:
+            enum Strategy
+            {
+                // The endpoint with the fewest connections in use relative to its weight.
+                LeastConnections,
+                // The same target host always goes to the same endpoint while it is healthy.
+                ConsistentHash
+            };
+
+            struct Endpoint
+            {
+                QString host;
+                quint16 port = 0;
+                int weight = 1;
+            };
+
+            struct EndpointStatistics
+            {
+                QString host;
+                quint16 port = 0;
+                int weight = 0;
+                // Connections in use, those idling in an UpstreamPool are not counted.
+                int active = 0;
+                quint64 connections = 0;
+                quint64 failures = 0;
+                quint64 ejections = 0;
+                bool ejected = false;
+            };
+
+            // Points of every weight unit on the hash ring.
+            static constexpr int VirtualNodes = 64;
+
+            UpstreamBalancer(const QList<Endpoint> &endpoints, Strategy strategy) : endpoints(endpoints), strategy(strategy), states(new State[endpoints.size()])
+            {
+                for (auto &e : this->endpoints)
+                    e.weight = qMax(1, e.weight);
+                if (strategy != ConsistentHash)
+                    return;
+                for (int i = 0; i < this->endpoints.size(); i++)
+                {
+                    const auto &e = this->endpoints[i];
+                    for (int v = 0; v < e.weight * VirtualNodes; v++)
+                        ring.push_back({ Hash(QStringLiteral("%1:%2#%3").arg(e.host).arg(e.port).arg(v)), i });
+                }
+                std::sort(ring.begin(), ring.end());
+            }
+
+            UpstreamBalancer(const UpstreamBalancer &) = delete;
+
+            void setHealthPolicy(int maxFailures, int ejectTimeMsec)
+            {
+                this->maxFailures.store(qMax(1, maxFailures), std::memory_order_relaxed);
+                this->ejectTime.store(qMax(0, ejectTimeMsec), std::memory_order_relaxed);
+            }
+
+            int size() const
+            {
+                return endpoints.size();
+            }
+
+            QNetworkProxy proxy(int index) const
+            {
+                const auto &e = endpoints[index];
+                return QNetworkProxy(QNetworkProxy::Socks5Proxy, e.host, e.port);
+            }
+
+            /*
+             * The slot a connection holds on its endpoint, given back when the lease is destroyed. A connection idling
+             * in an UpstreamPool suspends its lease, so that LeastConnections only weighs the connections in use.
+             */
+            class Lease
+            {
+              public:
+                // Takes over the slot of an endpoint returned by acquire.
+                Lease(std::shared_ptr<UpstreamBalancer> balancer, int index) : balancer(std::move(balancer)), index(index){};
+
+                Lease(const Lease &) = delete;
+
+                ~Lease()
+                {
+                    suspend();
+                }
+
+                void suspend()
+                {
+                    if (held)
+                        held = false, balancer->release(index);
+                }
+
+                void resume()
+                {
+                    if (!held)
+                        held = true, balancer->states[index].active.fetch_add(1, std::memory_order_relaxed);
+                }
+
+              private:
+                const std::shared_ptr<UpstreamBalancer> balancer;
+                const int index;
+                bool held = true;
+            };
+
+            // Picks the endpoint of a new connection to targetHost, which must be given back with release.
+            int acquire(const QString &targetHost)
+            {
+                const auto now = Now();
+                const int index = strategy == ConsistentHash ? selectByHash(targetHost, now) : selectLeastConnections(now);
+                states[index].active.fetch_add(1, std::memory_order_relaxed);
+                states[index].connections.fetch_add(1, std::memory_order_relaxed);
+                return index;
+            }
+
+            void release(int index)
+            {
+                states[index].active.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // The endpoint answered, whatever it answered.
+            void reportSuccess(int index)
+            {
+                states[index].consecutiveFailures.store(0, std::memory_order_relaxed);
+            }
+
+            // The endpoint could not be reached, or did not speak SOCKS5.
+            void reportFailure(int index)
+            {
+                auto &s = states[index];
+                s.failures.fetch_add(1, std::memory_order_relaxed);
+                if (s.consecutiveFailures.fetch_add(1, std::memory_order_relaxed) + 1 < maxFailures.load(std::memory_order_relaxed))
+                    return;
+                s.ejectedUntil.store(Now() + ejectTime.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                s.ejections.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            QList<EndpointStatistics> statistics() const
+            {
+                const auto now = Now();
+                QList<EndpointStatistics> result;
+                result.reserve(endpoints.size());
+                for (int i = 0; i < endpoints.size(); i++)
+                {
+                    const auto &s = states[i];
+                    result.append({ endpoints[i].host, endpoints[i].port, endpoints[i].weight, s.active.load(std::memory_order_relaxed),
+                                    s.connections.load(std::memory_order_relaxed), s.failures.load(std::memory_order_relaxed),
+                                    s.ejections.load(std::memory_order_relaxed), !isHealthy(i, now) });
+                }
+                return result;
+            }
+
+          private:
+            struct State
+            {
+                std::atomic<int> active{ 0 };
+                std::atomic<quint64> connections{ 0 };
+                std::atomic<quint64> failures{ 0 };
+                std::atomic<quint64> ejections{ 0 };
+                std::atomic<int> consecutiveFailures{ 0 };
+                std::atomic<qint64> ejectedUntil{ 0 };
+            };
+
+            static qint64 Now()
+            {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            // FNV-1a, stable across processes unlike qHash, followed by a mixer spreading it over the ring.
+            static quint64 Hash(const QString &s)
+            {
+                quint64 h = 0xcbf29ce484222325ULL;
+                for (const auto c : s.toUtf8())
+                    h = (h ^ quint8(c)) * 0x100000001b3ULL;
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                return h;
+            }
+
+            bool isHealthy(int index, qint64 now) const
+            {
+                return states[index].ejectedUntil.load(std::memory_order_relaxed) <= now;
+            }
+
+            // Everything is ejected, use the endpoint coming back first.
+            int leastEjected() const
+            {
+                int best = 0;
+                for (int i = 1; i < endpoints.size(); i++)
+                    if (states[i].ejectedUntil.load(std::memory_order_relaxed) < states[best].ejectedUntil.load(std::memory_order_relaxed))
+                        best = i;
+                return best;
+            }
+
+            int selectLeastConnections(qint64 now)
+            {
+                // Ties are broken from a rotating start, so that idle endpoints share the first connections.
+                const int n = endpoints.size();
+                const int start = int(nextStart.fetch_add(1, std::memory_order_relaxed) % quint32(n));
+                int best = -1;
+                qint64 bestActive = 0;
+                for (int k = 0; k < n; k++)
+                {
+                    const int i = (start + k) % n;
+                    if (!isHealthy(i, now))
+                        continue;
+                    const qint64 active = states[i].active.load(std::memory_order_relaxed);
+                    // active / weight < bestActive / bestWeight, without divisions.
+                    if (best < 0 || active * endpoints[best].weight < bestActive * endpoints[i].weight)
+                    {
+                        best = i;
+                        bestActive = active;
+                    }
+                }
+                return best < 0 ? leastEjected() : best;
+            }
+
+            int selectByHash(const QString &targetHost, qint64 now) const
+            {
+                const auto h = Hash(targetHost);
+                auto it = std::lower_bound(ring.begin(), ring.end(), std::pair<quint64, int>{ h, 0 });
+                // Walk clockwise past ejected endpoints, their hosts move to the next ones and come back later.
+                for (size_t k = 0; k < ring.size(); k++, it++)
+                {
+                    if (it == ring.end())
+                        it = ring.begin();
+                    if (isHealthy(it->second, now))
+                        return it->second;
+                }
+                return leastEjected();
+            }
+
+          private:
+            QList<Endpoint> endpoints;
+            const Strategy strategy;
+            std::unique_ptr<State[]> states;
+            std::vector<std::pair<quint64, int>> ring;
+            std::atomic<int> maxFailures{ 3 };
+            std::atomic<int> ejectTime{ 30 * 1000 };
+            std::atomic<quint32> nextStart{ 0 };
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QTcpSocket>
+#include <QTimer>
+#include <atomic>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+namespace Qv2rayPlugin
+{
+    namespace Utils
+    {
+        /*
+         * Idle upstream connections shared by all clients of a HttpProxyWorker, keyed by "host:port".
+         * A connection is checked in once the response to its last request has been fully relayed, and handed out
+         * again to the next request for the same origin, so that it skips the TCP and SOCKS5 handshakes.
+         */
+        class UpstreamPool : public QObject
+        {
+            Q_OBJECT
+          public:
+            struct Statistics
+            {
+                quint64 hits = 0;
+                quint64 misses = 0;
+                // Connections dropped because they were closed, expired, or failed the checkout health check.
+                quint64 evicted = 0;
+                // Connections closed at checkin because the pool was full.
+                quint64 rejected = 0;
+                int idle = 0;
+            };
+
+            explicit UpstreamPool(QObject *parent = nullptr) : QObject(parent), sweepTimer(this)
+            {
+                sweepTimer.setInterval(1000);
+                connect(&sweepTimer, &QTimer::timeout, this, &UpstreamPool::sweep);
+            }
+
+            UpstreamPool(const UpstreamPool &) = delete;
+
+            void setIdleTimeout(int msec)
+            {
+                idleTimeout = msec;
+            }
+
+            void setMaxIdlePerKey(int count)
+            {
+                maxIdlePerKey = count;
+            }
+
+            void setMaxIdle(int count)
+            {
+                maxIdle = count;
+            }
+
+            /*
+             * Returns a healthy idle connection for the key re-parented to newParent, or nullptr.
+             * The caller gets a connected socket without any signal connected to it.
+             */
+            QTcpSocket *checkout(const QString &key, QObject *newParent)
+            {
+                auto it = idle.find(key);
+                while (it != idle.end() && !it->isEmpty())
+                {
+                    // Most recently used first, its congestion window is the warmest.
+                    const auto entry = it->takeLast();
+                    idleCount--, counters.idle.store(idleCount, std::memory_order_relaxed);
+                    entry.socket->disconnect(this);
+                    if (isHealthy(entry))
+                    {
+                        if (it->isEmpty())
+                            idle.erase(it);
+                        counters.hits.fetch_add(1, std::memory_order_relaxed);
+                        entry.socket->setParent(newParent);
+                        return entry.socket;
+                    }
+                    counters.evicted.fetch_add(1, std::memory_order_relaxed);
+                    entry.socket->abort();
+                    entry.socket->deleteLater();
+                }
+                if (it != idle.end())
+                    idle.erase(it);
+                counters.misses.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            /*
+             * Takes ownership of a connected socket whose last response has been completely read.
+             * The caller must have disconnected its own signal connections first.
+             */
+            void checkin(const QString &key, QTcpSocket *socket)
+            {
+                auto &list = idle[key];
+                if (socket->state() != QAbstractSocket::ConnectedState || socket->bytesAvailable() > 0 || list.size() >= maxIdlePerKey || idleCount >= maxIdle)
+                {
+                    counters.rejected.fetch_add(1, std::memory_order_relaxed);
+                    if (list.isEmpty())
+                        idle.remove(key);
+                    socket->abort();
+                    socket->deleteLater();
+                    return;
+                }
+
+                socket->setParent(this);
+                // An idle connection must not receive anything, if it does (or gets closed), it is useless.
+                connect(socket, &QTcpSocket::readyRead, this, &UpstreamPool::onIdleSocketActivity);
+                connect(socket, &QTcpSocket::disconnected, this, &UpstreamPool::onIdleSocketActivity);
+                connect(socket, &QAbstractSocket::errorOccurred, this, &UpstreamPool::onIdleSocketActivity);
+                Entry entry{ socket, {} };
+                entry.idleSince.start();
+                list.append(entry);
+                idleCount++, counters.idle.store(idleCount, std::memory_order_relaxed);
+                if (!sweepTimer.isActive())
+                    sweepTimer.start();
+            }
+
+            // Safe to call from any thread, the counters are only loosely consistent with each other.
+            Statistics statistics() const
+            {
+                Statistics s;
+                s.hits = counters.hits.load(std::memory_order_relaxed);
+                s.misses = counters.misses.load(std::memory_order_relaxed);
+                s.evicted = counters.evicted.load(std::memory_order_relaxed);
+                s.rejected = counters.rejected.load(std::memory_order_relaxed);
+                s.idle = counters.idle.load(std::memory_order_relaxed);
+                return s;
+            }
+
+            void clear()
+            {
+                for (auto &list : idle)
+                    for (const auto &entry : list)
+                        entry.socket->disconnect(this), entry.socket->abort(), entry.socket->deleteLater();
+                idle.clear();
+                idleCount = 0, counters.idle.store(0, std::memory_order_relaxed);
+                sweepTimer.stop();
+            }
+
+          private:
+            struct Counters
+            {
+                std::atomic<quint64> hits{ 0 };
+                std::atomic<quint64> misses{ 0 };
+                std::atomic<quint64> evicted{ 0 };
+                std::atomic<quint64> rejected{ 0 };
+                std::atomic<int> idle{ 0 };
+            };
+
+            struct Entry
+            {
+                QTcpSocket *socket;
+                QElapsedTimer idleSince;
+            };
+
+            bool isHealthy(const Entry &entry) const
+            {
+                if (entry.idleSince.hasExpired(idleTimeout) || entry.socket->state() != QAbstractSocket::ConnectedState || entry.socket->bytesAvailable() > 0)
+                    return false;
+#ifdef Q_OS_UNIX
+                // The event loop may not have noticed a FIN, a RST or stray data yet, ask the kernel directly.
+                char c;
+                const auto n = ::recv(int(entry.socket->socketDescriptor()), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    return false;
+#endif
+                return true;
+            }
+
+            void removeSocket(QTcpSocket *socket)
+            {
+                for (auto it = idle.begin(); it != idle.end(); ++it)
+                {
+                    for (auto i = 0; i < it->size(); i++)
+                    {
+                        if (it->at(i).socket != socket)
+                            continue;
+                        it->removeAt(i);
+                        if (it->isEmpty())
+                            idle.erase(it);
+                        idleCount--, counters.idle.store(idleCount, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+            }
+
+          private slots:
+            void onIdleSocketActivity()
+            {
+                const auto socket = qobject_cast<QTcpSocket *>(sender());
+                socket->disconnect(this);
+                removeSocket(socket);
+                counters.evicted.fetch_add(1, std::memory_order_relaxed);
+                socket->abort();
+                socket->deleteLater();
+            }
+
+            void sweep()
+            {
+                for (auto it = idle.begin(); it != idle.end();)
+                {
+                    // Entries are appended in checkin order, the expired ones are at the front.
+                    while (!it->isEmpty() && it->first().idleSince.hasExpired(idleTimeout))
+                    {
+                        const auto socket = it->takeFirst().socket;
+                        socket->disconnect(this);
+                        socket->abort();
+                        socket->deleteLater();
+                        idleCount--, counters.idle.store(idleCount, std::memory_order_relaxed);
+                        counters.evicted.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    it = it->isEmpty() ? idle.erase(it) : std::next(it);
+                }
+                if (idleCount == 0)
+                    sweepTimer.stop();
+            }
+
+          private:
+            QHash<QString, QList<Entry>> idle;
+            QTimer sweepTimer;
+            Counters counters;
+            int idleCount = 0;
+            int idleTimeout = 30 * 1000;
+            int maxIdlePerKey = 8;
+            int maxIdle = 256;
+        };
+    } // namespace Utils
+} // namespace Qv2rayPlugin
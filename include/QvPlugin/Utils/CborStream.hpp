@@ -0,0 +1,171 @@
+#pragma once
+
+#include <QByteArray>
+#include <QCborStreamReader>
+#include <QCborStreamWriter>
+#include <QCborValue>
+#include <QHash>
+#include <QJsonValue>
+#include <QString>
+#include <QStringList>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * The binary form of QJS_JSON types, see JsonStructHelper::ToCbor. A document is the self-describe tag and a header
+ * array of the format version, the schema version given by the application and the key table, followed by the value
+ * as a second CBOR item. Members of QJS_JSON types are maps from indices in the key table to their values, so each
+ * name is stored once per document. Everything else is kept as toJson keeps it.
+ */
+class CborWriter
+{
+  public:
+    static constexpr quint64 FormatVersion = 1;
+
+    CborWriter() : writer(&body)
+    {
+    }
+
+    QCborStreamWriter &stream()
+    {
+        return writer;
+    }
+
+    // The indices of the keys of a table in the key table, appended to it the first time the table is written.
+    const std::vector<quint64> &keyIds(const void *table, const QStringList &keys)
+    {
+        auto &ids = tableIds[table];
+        if (ids.empty())
+        {
+            for (const auto &key : keys)
+            {
+                const auto it = keyIndex.constFind(key);
+                if (it != keyIndex.cend())
+                    ids.push_back(*it);
+                else
+                {
+                    ids.push_back(quint64(keyTable.size()));
+                    keyIndex.insert(key, ids.back());
+                    keyTable.append(key);
+                }
+            }
+        }
+        return ids;
+    }
+
+    // The whole document, once the value has been written.
+    QByteArray finish(qint64 schema)
+    {
+        QByteArray document;
+        {
+            QCborStreamWriter header(&document);
+            header.append(QCborKnownTags::Signature);
+            header.startArray(3);
+            header.append(FormatVersion);
+            header.append(schema);
+            header.startArray(quint64(keyTable.size()));
+            for (const auto &key : keyTable)
+                header.append(key);
+            header.endArray();
+            header.endArray();
+        }
+        return document + body;
+    }
+
+  private:
+    QByteArray body;
+    QCborStreamWriter writer;
+    QStringList keyTable;
+    QHash<QString, quint64> keyIndex;
+    std::unordered_map<const void *, std::vector<quint64>> tableIds;
+};
+
+class CborReader
+{
+  public:
+    explicit CborReader(const QByteArray &data) : reader(data)
+    {
+    }
+
+    // Whether data starts as a document written by CborWriter does.
+    static bool IsDocument(const QByteArray &data)
+    {
+        return data.startsWith("\xd9\xd9\xf7");
+    }
+
+    QCborStreamReader &stream()
+    {
+        return reader;
+    }
+
+    // Reads the header up to the value, false if it is not one CborWriter writes.
+    bool begin(qint64 &schema)
+    {
+        if (!reader.isTag() || reader.toTag() != QCborTag(QCborKnownTags::Signature))
+            return false;
+        reader.next();
+        if (!reader.isArray() || !reader.enterContainer())
+            return false;
+        if (!reader.isUnsignedInteger() || reader.toUnsignedInteger() != CborWriter::FormatVersion)
+            return false;
+        reader.next();
+        if (!reader.isInteger())
+            return false;
+        schema = reader.toInteger();
+        reader.next();
+        if (!reader.isArray() || !reader.enterContainer())
+            return false;
+        while (reader.lastError() == QCborError::NoError && reader.hasNext())
+        {
+            if (!reader.isString())
+                return false;
+            keyTable.append(readString());
+        }
+        return reader.leaveContainer() && reader.leaveContainer();
+    }
+
+    // For each index in the key table, the position of that key among the sorted keys of a table, -1 if it has none.
+    const std::vector<int> &positions(const void *table, const QStringList &keys)
+    {
+        auto &indices = tablePositions[table];
+        if (indices.empty())
+        {
+            for (const auto &key : keyTable)
+            {
+                const auto it = std::lower_bound(keys.cbegin(), keys.cend(), key);
+                indices.push_back(it != keys.cend() && *it == key ? int(it - keys.cbegin()) : -1);
+            }
+        }
+        return indices;
+    }
+
+    // The next item if it is a text string, an empty string otherwise.
+    QString readString()
+    {
+        QString s;
+        if (!reader.isString())
+        {
+            reader.next();
+            return s;
+        }
+        auto chunk = reader.readString();
+        while (chunk.status == QCborStreamReader::Ok)
+        {
+            s += chunk.data;
+            chunk = reader.readString();
+        }
+        return s;
+    }
+
+    // The next item, as toJson would have stored it.
+    QJsonValue readValue()
+    {
+        return QCborValue::fromCbor(reader).toJsonValue();
+    }
+
+  private:
+    QCborStreamReader reader;
+    QStringList keyTable;
+    std::unordered_map<const void *, std::vector<int>> tablePositions;
+};
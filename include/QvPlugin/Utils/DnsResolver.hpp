@@ -0,0 +1,438 @@
+#pragma once
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+
+#include <QDeadlineTimer>
+#include <QDnsLookup>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QPointer>
+#include <QRegularExpression>
+#include <QTimer>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <optional>
+
+namespace Qv2rayPlugin::Utils
+{
+    /*
+     * Asynchronous name resolution configured from a BasicDNSObject, for plugins that must not block on the system
+     * resolver. Names are answered from the hosts map first, then from a cache honoring the record TTLs (failures
+     * are cached too, for negativeTtl), and only then with A and AAAA queries sent to every configured server at
+     * once, the first answer of each type wins. Concurrent requests for a name share the same queries.
+     * Servers that are not plain IP addresses (DoH URLs, "localhost", fakedns) are skipped, and so are servers on a port
+     * other than 53 before Qt 6.6, without any usable one the system resolver configuration is queried.
+     * A DnsResolver must only be used from the thread it lives in, statistics() excepted.
+     */
+    class DnsResolver : public QObject
+    {
+        Q_OBJECT
+      public:
+        using Callback = std::function<void(const QList<QHostAddress> &)>;
+
+        // Upper bounds in milliseconds of the latency histogram buckets, the last bucket has no bound.
+        static constexpr int LatencyBuckets[] = { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500 };
+        static constexpr int LatencyBucketCount = std::size(LatencyBuckets) + 1;
+
+        struct Statistics
+        {
+            quint64 requests = 0;
+            // Answered by the hosts map or by an IP literal.
+            quint64 hostsHits = 0;
+            quint64 cacheHits = 0;
+            // Cache hits on a cached failure, included in cacheHits.
+            quint64 negativeHits = 0;
+            // Requests that joined the queries of an identical pending request.
+            quint64 coalesced = 0;
+            quint64 lookups = 0;
+            quint64 failures = 0;
+            // Time to resolve with queries, per bucket of LatencyBuckets.
+            quint64 latency[LatencyBucketCount] = {};
+            double cacheHitRatio() const
+            {
+                return requests == 0 ? 0 : double(hostsHits + cacheHits) / double(requests);
+            }
+        };
+
+        explicit DnsResolver(const BasicDNSObject &dns = {}, QObject *parent = nullptr) : QObject(parent)
+        {
+            setConfiguration(dns);
+        }
+
+        DnsResolver(const DnsResolver &) = delete;
+
+        // Replaces the servers and hosts, and forgets everything cached. Pending requests complete as they are.
+        void setConfiguration(const BasicDNSObject &dns)
+        {
+            servers.clear();
+            for (const auto &server : dns.servers)
+            {
+                const QHostAddress address(server.address);
+                if (address.isNull())
+                    continue;
+#if QT_VERSION < QT_VERSION_CHECK(6, 6, 0)
+                if (server.port != 53)
+                {
+                    qWarning("DNS server %s:%d skipped, QDnsLookup only queries port 53 before Qt 6.6", qUtf8Printable(server.address), server.port);
+                    continue;
+                }
+#endif
+                servers.append({ address, quint16(server.port) });
+            }
+
+            hostsExact.clear();
+            hostsPatterns.clear();
+            for (auto it = dns.hosts.cbegin(); it != dns.hosts.cend(); ++it)
+                addHost(it.key(), it.value());
+            cache.clear();
+        }
+
+        // Seconds a failed resolution is remembered, and bounds applied to the TTL of successful ones.
+        void setCacheTtl(int negativeTtl, int minTtl = 0, int maxTtl = 24 * 3600)
+        {
+            this->negativeTtl = negativeTtl;
+            this->minTtl = minTtl;
+            this->maxTtl = maxTtl;
+        }
+
+        void setMaxCacheEntries(int count)
+        {
+            maxCacheEntries = count;
+        }
+
+        // Time given to the servers before whatever has been received so far is taken as the answer.
+        void setQueryTimeout(int msec)
+        {
+            queryTimeout = msec;
+        }
+
+        /*
+         * Resolves name and calls callback with its addresses, IPv4 first, or with an empty list if it cannot be
+         * resolved. The callback is always called later from the event loop, never from within resolve, and not
+         * at all if context has been destroyed by then.
+         */
+        void resolve(const QString &name, QObject *context, Callback callback)
+        {
+            QList<QHostAddress> addresses;
+            if (lookupCached(name, addresses))
+            {
+                QMetaObject::invokeMethod(context, [callback = std::move(callback), addresses]() { callback(addresses); }, Qt::QueuedConnection);
+                return;
+            }
+
+            const auto key = CanonicalName(hostsAlias(name).value_or(name));
+            if (const auto it = pending.find(key); it != pending.end())
+            {
+                Count(stats.coalesced);
+                it->waiters.append({ context, std::move(callback) });
+                return;
+            }
+            startQueries(key, { context, std::move(callback) });
+        }
+
+        // Answers from the hosts map and the cache only, returns false if queries would be needed. Counts as a request.
+        bool lookupCached(const QString &name, QList<QHostAddress> &addresses)
+        {
+            Count(stats.requests);
+            if (const QHostAddress literal(name); !literal.isNull())
+            {
+                addresses = { literal };
+                Count(stats.hostsHits);
+                return true;
+            }
+
+            const auto alias = hostsAlias(name);
+            if (alias)
+            {
+                if (const QHostAddress mapped(*alias); !mapped.isNull())
+                {
+                    addresses = { mapped };
+                    Count(stats.hostsHits);
+                    return true;
+                }
+            }
+
+            const auto it = cache.constFind(CanonicalName(alias.value_or(name)));
+            if (it == cache.cend() || it->expiry.hasExpired())
+                return false;
+            addresses = it->addresses;
+            Count(stats.cacheHits);
+            if (addresses.isEmpty())
+                Count(stats.negativeHits);
+            return true;
+        }
+
+        // Safe to call from any thread.
+        Statistics statistics() const
+        {
+            Statistics s;
+            s.requests = stats.requests.load(std::memory_order_relaxed);
+            s.hostsHits = stats.hostsHits.load(std::memory_order_relaxed);
+            s.cacheHits = stats.cacheHits.load(std::memory_order_relaxed);
+            s.negativeHits = stats.negativeHits.load(std::memory_order_relaxed);
+            s.coalesced = stats.coalesced.load(std::memory_order_relaxed);
+            s.lookups = stats.lookups.load(std::memory_order_relaxed);
+            s.failures = stats.failures.load(std::memory_order_relaxed);
+            for (auto i = 0; i < LatencyBucketCount; i++)
+                s.latency[i] = stats.latency[i].load(std::memory_order_relaxed);
+            return s;
+        }
+
+      private:
+        struct Server
+        {
+            QHostAddress address;
+            quint16 port;
+        };
+
+        enum PatternKind
+        {
+            Suffix,
+            Subdomain,
+            Keyword,
+            Regexp
+        };
+
+        struct HostPattern
+        {
+            PatternKind kind;
+            QString value;
+            QRegularExpression regexp;
+            QString target;
+        };
+
+        struct Waiter
+        {
+            QPointer<QObject> context;
+            Callback callback;
+        };
+
+        struct Pending
+        {
+            QList<Waiter> waiters;
+            QList<QDnsLookup *> lookups;
+            QList<QHostAddress> ipv4;
+            QList<QHostAddress> ipv6;
+            // Lookups of each type still running, and whether one of them has answered already.
+            int runningA = 0;
+            int runningAAAA = 0;
+            bool answeredA = false;
+            bool answeredAAAA = false;
+            quint32 ttl = UINT32_MAX;
+            QElapsedTimer elapsed;
+            QTimer *timeout = nullptr;
+        };
+
+        struct CacheEntry
+        {
+            QList<QHostAddress> addresses;
+            QDeadlineTimer expiry;
+        };
+
+        struct Counters
+        {
+            std::atomic<quint64> requests{ 0 };
+            std::atomic<quint64> hostsHits{ 0 };
+            std::atomic<quint64> cacheHits{ 0 };
+            std::atomic<quint64> negativeHits{ 0 };
+            std::atomic<quint64> coalesced{ 0 };
+            std::atomic<quint64> lookups{ 0 };
+            std::atomic<quint64> failures{ 0 };
+            std::atomic<quint64> latency[LatencyBucketCount] = {};
+        };
+
+        static void Count(std::atomic<quint64> &counter)
+        {
+            counter.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static QString CanonicalName(const QString &name)
+        {
+            auto canonical = name.toLower();
+            if (canonical.endsWith(u'.'))
+                canonical.chop(1);
+            return canonical;
+        }
+
+        void addHost(const QString &entry, const QString &target)
+        {
+            const auto split = entry.indexOf(u':');
+            const auto prefix = split < 0 ? QString() : entry.left(split);
+            const auto value = CanonicalName(entry.mid(split + 1));
+            if (entry.startsWith(QStringLiteral("*.")))
+                hostsPatterns.append({ Subdomain, CanonicalName(entry.mid(2)), {}, target });
+            else if (split < 0 || prefix == QStringLiteral("full"))
+                hostsExact.insert(value, target);
+            else if (prefix == QStringLiteral("domain"))
+                hostsPatterns.append({ Suffix, value, {}, target });
+            else if (prefix == QStringLiteral("keyword"))
+                hostsPatterns.append({ Keyword, value, {}, target });
+            else if (prefix == QStringLiteral("regexp"))
+                hostsPatterns.append({ Regexp, {}, QRegularExpression(entry.mid(split + 1)), target });
+            // geosite: lists are not available here.
+        }
+
+        // The target of name in the hosts map, an address or another name.
+        std::optional<QString> hostsAlias(const QString &name) const
+        {
+            if (hostsExact.isEmpty() && hostsPatterns.isEmpty())
+                return std::nullopt;
+            const auto canonical = CanonicalName(name);
+            if (const auto it = hostsExact.constFind(canonical); it != hostsExact.cend())
+                return *it;
+
+            // Patterns are tried in the order of the map.
+            for (const auto &p : hostsPatterns)
+            {
+                const bool subdomain = canonical.endsWith(p.value) && canonical.size() > p.value.size() &&
+                                       canonical[canonical.size() - p.value.size() - 1] == u'.';
+                bool matched = false;
+                switch (p.kind)
+                {
+                    case Subdomain: matched = subdomain; break;
+                    case Suffix: matched = subdomain || canonical == p.value; break;
+                    case Keyword: matched = canonical.contains(p.value); break;
+                    case Regexp: matched = p.regexp.match(canonical).hasMatch(); break;
+                }
+                if (matched)
+                    return p.target;
+            }
+            return std::nullopt;
+        }
+
+        void startQueries(const QString &name, Waiter waiter)
+        {
+            Count(stats.lookups);
+            auto &p = pending[name];
+            p.waiters.append(std::move(waiter));
+            p.elapsed.start();
+
+            const auto query = [this, &p, name](QDnsLookup::Type type, const Server *server) {
+                const auto lookup = server ? new QDnsLookup(type, name, server->address, this) : new QDnsLookup(type, name, this);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 6, 0)
+                if (server)
+                    lookup->setNameserverPort(server->port);
+#endif
+                connect(lookup, &QDnsLookup::finished, this, [this, name, lookup]() { onLookupFinished(name, lookup); });
+                p.lookups.append(lookup);
+                (type == QDnsLookup::A ? p.runningA : p.runningAAAA)++;
+            };
+            for (const auto type : { QDnsLookup::A, QDnsLookup::AAAA })
+            {
+                if (servers.isEmpty())
+                    query(type, nullptr);
+                for (const auto &server : std::as_const(servers))
+                    query(type, &server);
+            }
+
+            p.timeout = new QTimer(this);
+            p.timeout->setSingleShot(true);
+            connect(p.timeout, &QTimer::timeout, this, [this, name]() { complete(name); });
+            p.timeout->start(queryTimeout);
+            // Started last, a lookup that fails right away must find the pending entry complete.
+            const auto lookups = p.lookups;
+            for (const auto lookup : lookups)
+            {
+                if (!pending.contains(name))
+                    break;
+                lookup->lookup();
+            }
+        }
+
+        void onLookupFinished(const QString &name, QDnsLookup *lookup)
+        {
+            const auto it = pending.find(name);
+            if (it == pending.end())
+                return;
+            auto &p = *it;
+            const bool isA = lookup->type() == QDnsLookup::A;
+            (isA ? p.runningA : p.runningAAAA)--;
+
+            // NXDOMAIN is an answer as well, only errors of the server itself leave the question to the others.
+            const auto error = lookup->error();
+            if (error == QDnsLookup::NoError || error == QDnsLookup::NotFoundError)
+            {
+                auto &answered = isA ? p.answeredA : p.answeredAAAA;
+                if (!answered)
+                {
+                    answered = true;
+                    for (const auto &record : lookup->hostAddressRecords())
+                    {
+                        (isA ? p.ipv4 : p.ipv6).append(record.value());
+                        p.ttl = qMin(p.ttl, record.timeToLive());
+                    }
+                }
+            }
+
+            const bool doneA = p.answeredA || p.runningA == 0;
+            const bool doneAAAA = p.answeredAAAA || p.runningAAAA == 0;
+            if (doneA && doneAAAA)
+                complete(name);
+        }
+
+        void complete(const QString &name)
+        {
+            // A stray timeout or lookup signal may still arrive for a query that is already complete.
+            if (!pending.contains(name))
+                return;
+            auto p = pending.take(name);
+            for (const auto lookup : std::as_const(p.lookups))
+            {
+                lookup->disconnect(this);
+                lookup->abort();
+                lookup->deleteLater();
+            }
+            // complete may be running from the timeout itself, stop it so it cannot fire for a later query of the name.
+            p.timeout->stop();
+            p.timeout->deleteLater();
+
+            const auto addresses = p.ipv4 + p.ipv6;
+            const auto ttl = addresses.isEmpty() ? negativeTtl : qBound<qint64>(minTtl, p.ttl, maxTtl);
+            if (addresses.isEmpty())
+                Count(stats.failures);
+            recordLatency(p.elapsed.elapsed());
+            store(name, addresses, ttl);
+
+            for (const auto &waiter : std::as_const(p.waiters))
+                if (waiter.context)
+                    waiter.callback(addresses);
+        }
+
+        void store(const QString &name, const QList<QHostAddress> &addresses, qint64 ttl)
+        {
+            if (ttl <= 0 || maxCacheEntries <= 0)
+                return;
+            if (cache.size() >= maxCacheEntries && !cache.contains(name))
+            {
+                // Drop what has expired, and if that is not enough, an arbitrary entry.
+                cache.removeIf([](const auto &it) { return it->expiry.hasExpired(); });
+                if (cache.size() >= maxCacheEntries)
+                    cache.erase(cache.begin());
+            }
+            cache.insert(name, { addresses, QDeadlineTimer(ttl * 1000) });
+        }
+
+        void recordLatency(qint64 msec)
+        {
+            auto bucket = 0;
+            while (bucket < LatencyBucketCount - 1 && msec >= LatencyBuckets[bucket])
+                bucket++;
+            Count(stats.latency[bucket]);
+        }
+
+      private:
+        QList<Server> servers;
+        QHash<QString, QString> hostsExact;
+        QList<HostPattern> hostsPatterns;
+        QHash<QString, CacheEntry> cache;
+        QHash<QString, Pending> pending;
+        int negativeTtl = 30;
+        int minTtl = 0;
+        int maxTtl = 24 * 3600;
+        int maxCacheEntries = 4096;
+        int queryTimeout = 5000;
+        Counters stats;
+    };
+} // namespace Qv2rayPlugin::Utils
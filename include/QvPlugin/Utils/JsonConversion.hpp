@@ -1,12 +1,20 @@
 #pragma once
+#include "CborStream.hpp"
 #include "ForEachMacros.hpp"
+#include "JsonReader.hpp"
+#include "JsonWriter.hpp"
 
+#include <QCborValue>
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QList>
 #include <QVariant>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
 #include <type_traits>
+#include <vector>
 
 template<typename T>
 struct Bindable;
@@ -20,11 +28,20 @@ struct Bindable;
 
 #define __FROMJSON_B(name) name::loadJson(json);
 
+#ifdef QJS_LEGACY_LOADJSON
+// One lookup per declared field, the decoder before the field tables, kept to benchmark them against.
 #define __FROMJSON_F(name)                                                                                                                                               \
     if (json.toObject().contains(u"" #name##_qs))                                                                                                                        \
         ::JsonStructHelper::Deserialize(this->name, json.toObject()[u"" #name##_qs]);
+#define __FIELDS_F(name)
+#else
+#define __FROMJSON_F(name)
+#define __FIELDS_F(name) { u"" #name##_qs, [](_Self &self, const QJsonValue &value) { ::JsonStructHelper::Deserialize(self.name, value); } },
+#endif
 
 #define __FROMJSON_P(name) __FROMJSON_F(name)
+#define __FIELDS_B(name)
+#define __FIELDS_P(name) __FIELDS_F(name)
 
 #define __TOJSON_B(base) ::JsonStructHelper::MergeJson(json, base::toJson());
 #define __TOJSON_F(name)                                                                                                                                                 \
@@ -38,12 +55,52 @@ struct Bindable;
     if (!this->name.isDefault())                                                                                                                                         \
     __TOJSON_F(name)
 
+#define __WRITERS_F(name) { u"" #name##_qs, [](const _Self &self, ::JsonWriter &writer, const QString &key) { ::JsonStructHelper::WriteMember(writer, key, self.name); } },
+#define __WRITERS_B(name)
+#define __WRITERS_P(name)                                                                                                                                                \
+    { u"" #name##_qs, [](const _Self &self, ::JsonWriter &writer, const QString &key) {                                                                                  \
+         if (!self.name.isDefault())                                                                                                                                     \
+             ::JsonStructHelper::WriteMember(writer, key, self.name);                                                                                                    \
+     } },
+#define __INHERIT_F(name)
+#define __INHERIT_B(base) _table.inherit(this->base::jsonWriters());
+#define __INHERIT_P(name)
+
+#define __READERS_F(name) { u"" #name##_qs, [](_Self &self, ::JsonReader &reader) { ::JsonStructHelper::Read(reader, self.name); } },
+#define __READERS_B(name)
+#define __READERS_P(name) __READERS_F(name)
+#define __INHERIT_READERS_F(name)
+#define __INHERIT_READERS_B(base) _table.inherit(this->base::jsonReaders());
+#define __INHERIT_READERS_P(name)
+
+#define __CBOR_F(name)                                                                                                                                                   \
+    { u"" #name##_qs, [](const _Self &self, ::CborWriter &writer, quint64 id) { ::JsonStructHelper::EncodeMember(writer, id, self.name); },                              \
+      [](_Self &self, ::CborReader &reader) { ::JsonStructHelper::Decode(reader, self.name); } },
+#define __CBOR_B(name)
+#define __CBOR_P(name)                                                                                                                                                   \
+    { u"" #name##_qs,                                                                                                                                                    \
+      [](const _Self &self, ::CborWriter &writer, quint64 id) {                                                                                                          \
+          if (!self.name.isDefault())                                                                                                                                    \
+              ::JsonStructHelper::EncodeMember(writer, id, self.name);                                                                                                   \
+      },                                                                                                                                                                 \
+      [](_Self &self, ::CborReader &reader) { ::JsonStructHelper::Decode(reader, self.name); } },
+#define __INHERIT_CBOR_F(name)
+#define __INHERIT_CBOR_B(base) _table.inherit(this->base::cborMembers());
+#define __INHERIT_CBOR_P(name)
+
 // ============================================================================================
 // Load JSON Wrapper
 #define _QJS_FROM_JSON_F(...) FOR_EACH_2(__FROMJSON_F, __VA_ARGS__)
 #define _QJS_FROM_JSON_B(...) FOR_EACH_2(__FROMJSON_B, __VA_ARGS__)
 #define _QJS_FROM_JSON_P(...) FOR_EACH_2(__FROMJSON_P, __VA_ARGS__)
 #define _QJS_FROM_JSON_BF(option) _QJS_FROM_JSON_##option
+
+// ============================================================================================
+// Field Table Wrapper
+#define _QJS_FIELDS_F(...) FOR_EACH_2(__FIELDS_F, __VA_ARGS__)
+#define _QJS_FIELDS_B(...) FOR_EACH_2(__FIELDS_B, __VA_ARGS__)
+#define _QJS_FIELDS_P(...) FOR_EACH_2(__FIELDS_P, __VA_ARGS__)
+#define _QJS_FIELDS_BF(option) _QJS_FIELDS_##option
 // clang-format on
 
 // clang-format off
@@ -54,6 +111,39 @@ struct Bindable;
 #define _QJS_TO_JSON_P(...) FOR_EACH_2(__TOJSON_P, __VA_ARGS__)
 #define _QJS_TO_JSON_BF(option) _QJS_TO_JSON_##option
 
+// ============================================================================================
+// Writer Table Wrapper
+#define _QJS_WRITERS_F(...) FOR_EACH_2(__WRITERS_F, __VA_ARGS__)
+#define _QJS_WRITERS_B(...) FOR_EACH_2(__WRITERS_B, __VA_ARGS__)
+#define _QJS_WRITERS_P(...) FOR_EACH_2(__WRITERS_P, __VA_ARGS__)
+#define _QJS_WRITERS_BF(option) _QJS_WRITERS_##option
+#define _QJS_INHERIT_F(...) FOR_EACH_2(__INHERIT_F, __VA_ARGS__)
+#define _QJS_INHERIT_B(...) FOR_EACH_2(__INHERIT_B, __VA_ARGS__)
+#define _QJS_INHERIT_P(...) FOR_EACH_2(__INHERIT_P, __VA_ARGS__)
+#define _QJS_INHERIT_BF(option) _QJS_INHERIT_##option
+
+// ============================================================================================
+// Reader Table Wrapper
+#define _QJS_READERS_F(...) FOR_EACH_2(__READERS_F, __VA_ARGS__)
+#define _QJS_READERS_B(...) FOR_EACH_2(__READERS_B, __VA_ARGS__)
+#define _QJS_READERS_P(...) FOR_EACH_2(__READERS_P, __VA_ARGS__)
+#define _QJS_READERS_BF(option) _QJS_READERS_##option
+#define _QJS_INHERIT_READERS_F(...) FOR_EACH_2(__INHERIT_READERS_F, __VA_ARGS__)
+#define _QJS_INHERIT_READERS_B(...) FOR_EACH_2(__INHERIT_READERS_B, __VA_ARGS__)
+#define _QJS_INHERIT_READERS_P(...) FOR_EACH_2(__INHERIT_READERS_P, __VA_ARGS__)
+#define _QJS_INHERIT_READERS_BF(option) _QJS_INHERIT_READERS_##option
+
+// ============================================================================================
+// CBOR Table Wrapper
+#define _QJS_CBOR_F(...) FOR_EACH_2(__CBOR_F, __VA_ARGS__)
+#define _QJS_CBOR_B(...) FOR_EACH_2(__CBOR_B, __VA_ARGS__)
+#define _QJS_CBOR_P(...) FOR_EACH_2(__CBOR_P, __VA_ARGS__)
+#define _QJS_CBOR_BF(option) _QJS_CBOR_##option
+#define _QJS_INHERIT_CBOR_F(...) FOR_EACH_2(__INHERIT_CBOR_F, __VA_ARGS__)
+#define _QJS_INHERIT_CBOR_B(...) FOR_EACH_2(__INHERIT_CBOR_B, __VA_ARGS__)
+#define _QJS_INHERIT_CBOR_P(...) FOR_EACH_2(__INHERIT_CBOR_P, __VA_ARGS__)
+#define _QJS_INHERIT_CBOR_BF(option) _QJS_INHERIT_CBOR_##option
+
 // ============================================================================================
 // QJsonStruct main macro
 #define QJS_JSON(...)                                                                                                                                                    \
@@ -65,7 +155,67 @@ struct Bindable;
     }                                                                                                                                                                    \
     void loadJson(const QJsonValue &json)                                                                                                                                \
     {                                                                                                                                                                    \
+        using _Self = std::remove_reference_t<decltype(*this)>;                                                                                                          \
+        static const ::JsonStructHelper::FieldTable<_Self> _fields{ FOR_EACH(_QJS_FIELDS_BF, __VA_ARGS__) };                                                             \
         FOR_EACH(_QJS_FROM_JSON_BF, __VA_ARGS__);                                                                                                                        \
+        _fields.load(*this, json);                                                                                                                                       \
+    }                                                                                                                                                                    \
+    const auto &jsonWriters() const                                                                                                                                      \
+    {                                                                                                                                                                    \
+        using _Self = std::remove_cv_t<std::remove_reference_t<decltype(*this)>>;                                                                                        \
+        static const auto _writers = [this]() {                                                                                                                          \
+            ::JsonStructHelper::WriterTable<_Self> _table{ FOR_EACH(_QJS_WRITERS_BF, __VA_ARGS__) };                                                                     \
+            FOR_EACH(_QJS_INHERIT_BF, __VA_ARGS__);                                                                                                                      \
+            _table.sort();                                                                                                                                               \
+            return _table;                                                                                                                                               \
+        }();                                                                                                                                                             \
+        return _writers;                                                                                                                                                 \
+    }                                                                                                                                                                    \
+    void writeJson(::JsonWriter &writer) const                                                                                                                           \
+    {                                                                                                                                                                    \
+        jsonWriters().write(*this, writer);                                                                                                                              \
+    }                                                                                                                                                                    \
+    const auto &jsonReaders() const                                                                                                                                      \
+    {                                                                                                                                                                    \
+        using _Self = std::remove_cv_t<std::remove_reference_t<decltype(*this)>>;                                                                                        \
+        static const auto _readers = [this]() {                                                                                                                          \
+            ::JsonStructHelper::ReaderTable<_Self> _table{ FOR_EACH(_QJS_READERS_BF, __VA_ARGS__) };                                                                     \
+            FOR_EACH(_QJS_INHERIT_READERS_BF, __VA_ARGS__);                                                                                                              \
+            _table.sort();                                                                                                                                               \
+            return _table;                                                                                                                                               \
+        }();                                                                                                                                                             \
+        return _readers;                                                                                                                                                 \
+    }                                                                                                                                                                    \
+    void readJson(::JsonReader &reader)                                                                                                                                  \
+    {                                                                                                                                                                    \
+        jsonReaders().read(*this, reader);                                                                                                                               \
+    }                                                                                                                                                                    \
+    const auto &cborMembers() const                                                                                                                                      \
+    {                                                                                                                                                                    \
+        using _Self = std::remove_cv_t<std::remove_reference_t<decltype(*this)>>;                                                                                        \
+        static const auto _members = [this]() {                                                                                                                          \
+            ::JsonStructHelper::CborTable<_Self> _table{ FOR_EACH(_QJS_CBOR_BF, __VA_ARGS__) };                                                                          \
+            FOR_EACH(_QJS_INHERIT_CBOR_BF, __VA_ARGS__);                                                                                                                 \
+            _table.sort();                                                                                                                                               \
+            return _table;                                                                                                                                               \
+        }();                                                                                                                                                             \
+        return _members;                                                                                                                                                 \
+    }                                                                                                                                                                    \
+    void writeCbor(::CborWriter &writer) const                                                                                                                           \
+    {                                                                                                                                                                    \
+        cborMembers().write(*this, writer);                                                                                                                              \
+    }                                                                                                                                                                    \
+    void readCbor(::CborReader &reader)                                                                                                                                  \
+    {                                                                                                                                                                    \
+        cborMembers().read(*this, reader);                                                                                                                               \
+    }                                                                                                                                                                    \
+    QByteArray toCbor(qint64 schema = 0) const                                                                                                                           \
+    {                                                                                                                                                                    \
+        return ::JsonStructHelper::ToCbor(*this, schema);                                                                                                                \
+    }                                                                                                                                                                    \
+    bool loadCbor(const QByteArray &data, qint64 *schema = nullptr)                                                                                                      \
+    {                                                                                                                                                                    \
+        return ::JsonStructHelper::FromCbor(data, *this, schema);                                                                                                        \
     }
 
 template<typename T>
@@ -83,6 +233,18 @@ struct JsonStructHelper
     
     template<typename, typename = void> struct has_loadJson : public std::false_type {};
     template<typename C> struct has_loadJson<C, typename std::enable_if_t<std::is_void_v<decltype(std::declval<C>().loadJson(std::declval<const QJsonValue&>()))>>> : public std::true_type {};
+
+    template<typename, typename = void> struct has_writeJson : public std::false_type {};
+    template<typename C> struct has_writeJson<C, typename std::enable_if_t<std::is_void_v<decltype(std::declval<const C&>().writeJson(std::declval<JsonWriter&>()))>>> : public std::true_type {};
+
+    template<typename, typename = void> struct has_readJson : public std::false_type {};
+    template<typename C> struct has_readJson<C, typename std::enable_if_t<std::is_void_v<decltype(std::declval<C>().readJson(std::declval<JsonReader&>()))>>> : public std::true_type {};
+
+    template<typename, typename = void> struct has_writeCbor : public std::false_type {};
+    template<typename C> struct has_writeCbor<C, typename std::enable_if_t<std::is_void_v<decltype(std::declval<const C&>().writeCbor(std::declval<CborWriter&>()))>>> : public std::true_type {};
+
+    template<typename, typename = void> struct has_readCbor : public std::false_type {};
+    template<typename C> struct has_readCbor<C, typename std::enable_if_t<std::is_void_v<decltype(std::declval<C>().readCbor(std::declval<CborReader&>()))>>> : public std::true_type {};
     
     template <class T, std::size_t = sizeof(T)>
     static std::true_type is_complete_impl(T *);
@@ -133,6 +295,48 @@ struct JsonStructHelper
         }
     }
 
+    /*
+     * The fields QJS_JSON declares for T, built once per type, sorted by key. Loading walks the source object
+     * once and hands each of its keys to the field of that name, unknown keys are skipped.
+     */
+    template<typename T>
+    class FieldTable
+    {
+      public:
+        struct Field
+        {
+            QString key;
+            void (*load)(T &, const QJsonValue &);
+        };
+
+        FieldTable(std::initializer_list<Field> list = {}) : fields(list)
+        {
+            std::sort(fields.begin(), fields.end(), [](const Field &a, const Field &b) { return QAnyStringView::compare(a.key, b.key) < 0; });
+        }
+
+        void load(T &t, const QJsonValue &json) const
+        {
+            if (fields.empty())
+                return;
+            const auto object = json.toObject();
+            for (auto it = object.constBegin(); it != object.constEnd(); ++it)
+            {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 4, 0)
+                // A view of the stored key, no QString is built for it.
+                const auto key = it.keyView();
+#else
+                const auto key = it.key();
+#endif
+                const auto field = std::lower_bound(fields.cbegin(), fields.cend(), key, [](const Field &f, QAnyStringView k) { return QAnyStringView::compare(f.key, k) < 0; });
+                if (field != fields.cend() && QAnyStringView::compare(field->key, key) == 0)
+                    field->load(t, it.value());
+            }
+        }
+
+      private:
+        std::vector<Field> fields;
+    };
+
     // =========================== Deserialize ===========================
 
     // clang-format off
@@ -298,4 +502,557 @@ struct JsonStructHelper
         assert(false);
         return {};
     }
+
+    // =========================== Write ===========================
+
+    /*
+     * The members QJS_JSON declares for T and its bases, built once per type and sorted by key like a QJsonObject.
+     * Should a base declare a key T declares too, toJson merges their values, and T is written through it instead.
+     */
+    template<typename T>
+    class WriterTable
+    {
+      public:
+        struct Member
+        {
+            QString key;
+            std::function<void(const T &, JsonWriter &, const QString &)> write;
+        };
+
+        WriterTable(std::initializer_list<Member> list = {}) : members(list)
+        {
+        }
+
+        template<typename Base>
+        void inherit(const WriterTable<Base> &base)
+        {
+            for (const auto &m : base.members)
+                members.push_back({ m.key, m.write });
+            merged = merged || base.merged;
+        }
+
+        void sort()
+        {
+            std::sort(members.begin(), members.end(), [](const Member &a, const Member &b) { return a.key < b.key; });
+            const auto duplicate = std::adjacent_find(members.cbegin(), members.cend(), [](const Member &a, const Member &b) { return a.key == b.key; });
+            merged = merged || duplicate != members.cend();
+        }
+
+        void write(const T &t, JsonWriter &writer) const
+        {
+            if (!merged)
+            {
+                for (const auto &m : members)
+                    m.write(t, writer, m.key);
+                return;
+            }
+            const auto json = t.toJson();
+            for (auto it = json.constBegin(); it != json.constEnd(); ++it)
+            {
+                writer.member(it.key());
+                writer.value(it.value());
+            }
+        }
+
+      private:
+        template<typename>
+        friend class WriterTable;
+
+        std::vector<Member> members;
+        bool merged = false;
+    };
+
+    // t as QJsonDocument(Serialize(t)).toJson(format) gives it, t being a QJS_JSON type, a list or a QJsonObject.
+    template<typename T>
+    static QByteArray WriteJson(const T &t, QJsonDocument::JsonFormat format = QJsonDocument::Indented)
+    {
+        JsonWriter writer(format);
+        Write(writer, t);
+        return writer.take();
+    }
+
+    template<typename T>
+    static bool WriteJson(QIODevice *device, const T &t, QJsonDocument::JsonFormat format = QJsonDocument::Indented)
+    {
+        JsonWriter writer(device, format);
+        Write(writer, t);
+        return writer.finish();
+    }
+
+    template<typename T>
+    static void WriteMember(JsonWriter &writer, const QString &key, const T &t)
+    {
+        writer.member(key);
+        Write(writer, t);
+    }
+
+    // clang-format off
+    static void Write(JsonWriter &writer, const QString &t) { writer.string(t); }
+    static void Write(JsonWriter &writer, bool t) { writer.boolean(t); }
+    static void Write(JsonWriter &writer, int t) { writer.integer(t); }
+    static void Write(JsonWriter &writer, long long t) { writer.integer(t); }
+    static void Write(JsonWriter &writer, double t) { writer.number(t); }
+    static void Write(JsonWriter &writer, float t) { writer.number(t); }
+    // clang-format on
+
+    template<typename T>
+    static void Write(JsonWriter &writer, const QSet<T> &t)
+    {
+        writer.beginArray();
+        for (const auto &item : t)
+            Write(writer, item);
+        writer.endArray();
+    }
+
+    template<typename T>
+    static void Write(JsonWriter &writer, const QList<T> &t)
+    {
+        writer.beginArray();
+        for (const auto &item : t)
+            Write(writer, item);
+        writer.endArray();
+    }
+
+    template<typename T>
+    static void Write(JsonWriter &writer, const T &t)
+    {
+        using _T = std::remove_cv_t<std::remove_reference_t<T>>;
+        if constexpr (has_writeJson<_T>::value)
+        {
+            writer.beginObject();
+            t.writeJson(writer);
+            writer.endObject();
+        }
+        else if constexpr (is_bindable_template<_T>::value)
+            Write(writer, *t);
+        else
+            writer.value(Serialize(t));
+    }
+
+    // =========================== Read ===========================
+
+    /*
+     * The fields QJS_JSON declares for T and its bases, built once per type and sorted by key. Reading walks the
+     * members of the source object as they come, unknown members are skipped without being stored.
+     * Should a base declare a key T declares too, loadJson hands the value to both, and T is read through it instead.
+     */
+    template<typename T>
+    class ReaderTable
+    {
+      public:
+        struct Member
+        {
+            QString key;
+            std::function<void(T &, JsonReader &)> read;
+        };
+
+        ReaderTable(std::initializer_list<Member> list = {}) : members(list)
+        {
+        }
+
+        template<typename Base>
+        void inherit(const ReaderTable<Base> &base)
+        {
+            for (const auto &m : base.members)
+                members.push_back({ m.key, m.read });
+            merged = merged || base.merged;
+        }
+
+        void sort()
+        {
+            std::sort(members.begin(), members.end(), [](const Member &a, const Member &b) { return QAnyStringView::compare(a.key, b.key) < 0; });
+            const auto duplicate = std::adjacent_find(members.cbegin(), members.cend(), [](const Member &a, const Member &b) { return a.key == b.key; });
+            merged = merged || duplicate != members.cend();
+        }
+
+        void read(T &t, JsonReader &reader) const
+        {
+            if (merged)
+            {
+                t.loadJson(reader.readValue());
+                return;
+            }
+            if (!reader.beginObject())
+                return;
+            while (reader.nextMember())
+            {
+                const auto key = reader.key();
+                const auto m = std::lower_bound(members.cbegin(), members.cend(), key, [](const Member &member, QAnyStringView k) { return QAnyStringView::compare(member.key, k) < 0; });
+                if (m != members.cend() && QAnyStringView::compare(m->key, key) == 0)
+                    m->read(t, reader);
+                else
+                    reader.skipValue();
+            }
+        }
+
+      private:
+        template<typename>
+        friend class ReaderTable;
+
+        std::vector<Member> members;
+        bool merged = false;
+    };
+
+    // Loads t from JSON text as Deserialize(t, QJsonDocument::fromJson(json).object()) would, t being a QJS_JSON type
+    // or a container. On a parse error, t is left with whatever was read before it.
+    template<typename T>
+    static bool ReadJson(const QByteArray &json, T &t, QJsonParseError *error = nullptr)
+    {
+        JsonReader reader(json);
+        return ReadJson(reader, t, error);
+    }
+
+    template<typename T>
+    static bool ReadJson(QIODevice *device, T &t, QJsonParseError *error = nullptr)
+    {
+        JsonReader reader(device);
+        return ReadJson(reader, t, error);
+    }
+
+    template<typename T>
+    static bool ReadJson(JsonReader &reader, T &t, QJsonParseError *error = nullptr)
+    {
+        Read(reader, t);
+        const auto ok = reader.finish();
+        if (error)
+            *error = reader.error();
+        return ok;
+    }
+
+    static void Read(JsonReader &reader, QString &t)
+    {
+        t = reader.readString();
+    }
+
+    template<typename T>
+    static void Read(JsonReader &reader, QSet<T> &t)
+    {
+        t.clear();
+        if (!reader.beginArray())
+            return;
+        while (reader.nextElement())
+        {
+            T data;
+            Read(reader, data);
+            t.insert(data);
+        }
+    }
+
+    template<typename T>
+    static void Read(JsonReader &reader, QList<T> &t)
+    {
+        t.clear();
+        if (!reader.beginArray())
+            return;
+        while (reader.nextElement())
+        {
+            T data;
+            Read(reader, data);
+            t.push_back(data);
+        }
+    }
+
+    template<typename TKey, typename TValue>
+    static void Read(JsonReader &reader, QMap<TKey, TValue> &t)
+    {
+        t.clear();
+        if (!reader.beginObject())
+            return;
+        TKey keyVal;
+        TValue valueVal;
+        while (reader.nextMember())
+        {
+            Deserialize(keyVal, reader.key().toString());
+            Read(reader, valueVal);
+            t.insert(keyVal, valueVal);
+        }
+    }
+
+    template<typename T>
+    static void Read(JsonReader &reader, T &t)
+    {
+        using _T = std::remove_cv_t<std::remove_reference_t<T>>;
+        if constexpr (is_bindable_template<_T>::value)
+        {
+            Read(reader, *t);
+            t.EmitNotify();
+        }
+        else if constexpr (has_readJson<_T>::value)
+            t.readJson(reader);
+        else
+            Deserialize(t, reader.readValue());
+    }
+
+    // =========================== CBOR ===========================
+
+    /*
+     * The members QJS_JSON declares for T and its bases, sorted by key, written as a map from key table indices to
+     * their values, see CborWriter. Should a base declare a key T declares too, T is stored as its toJson instead.
+     */
+    template<typename T>
+    class CborTable
+    {
+      public:
+        struct Member
+        {
+            QString key;
+            std::function<void(const T &, CborWriter &, quint64)> write;
+            std::function<void(T &, CborReader &)> read;
+        };
+
+        CborTable(std::initializer_list<Member> list = {}) : members(list)
+        {
+        }
+
+        template<typename Base>
+        void inherit(const CborTable<Base> &base)
+        {
+            for (const auto &m : base.members)
+                members.push_back({ m.key, m.write, m.read });
+            merged = merged || base.merged;
+        }
+
+        void sort()
+        {
+            std::sort(members.begin(), members.end(), [](const Member &a, const Member &b) { return a.key < b.key; });
+            const auto duplicate = std::adjacent_find(members.cbegin(), members.cend(), [](const Member &a, const Member &b) { return a.key == b.key; });
+            merged = merged || duplicate != members.cend();
+            keys.clear();
+            for (const auto &m : members)
+                keys << m.key;
+        }
+
+        void write(const T &t, CborWriter &writer) const
+        {
+            if (merged)
+            {
+                QCborValue::fromJsonValue(t.toJson()).toCbor(writer.stream());
+                return;
+            }
+            const auto &ids = writer.keyIds(this, keys);
+            writer.stream().startMap();
+            for (size_t i = 0; i < members.size(); i++)
+                members[i].write(t, writer, ids[i]);
+            writer.stream().endMap();
+        }
+
+        void read(T &t, CborReader &reader) const
+        {
+            if (merged)
+            {
+                t.loadJson(reader.readValue());
+                return;
+            }
+            auto &stream = reader.stream();
+            if (!stream.isMap())
+            {
+                stream.next();
+                return;
+            }
+            const auto &positions = reader.positions(this, keys);
+            stream.enterContainer();
+            while (stream.lastError() == QCborError::NoError && stream.hasNext())
+            {
+                auto position = -1;
+                if (stream.isUnsignedInteger() && stream.toUnsignedInteger() < positions.size())
+                    position = positions[stream.toUnsignedInteger()];
+                stream.next();
+                if (position >= 0)
+                    members[position].read(t, reader);
+                else
+                    stream.next();
+            }
+            stream.leaveContainer();
+        }
+
+      private:
+        template<typename>
+        friend class CborTable;
+
+        std::vector<Member> members;
+        QStringList keys;
+        bool merged = false;
+    };
+
+    // t as a CBOR document of its own, schema being the version of the application's data.
+    template<typename T>
+    static QByteArray ToCbor(const T &t, qint64 schema = 0)
+    {
+        CborWriter writer;
+        Encode(writer, t);
+        return writer.finish(schema);
+    }
+
+    // Loads t from a document ToCbor wrote, or from JSON text saved before it, whose schema is 0.
+    template<typename T>
+    static bool FromCbor(const QByteArray &data, T &t, qint64 *schema = nullptr)
+    {
+        qint64 version = 0;
+        auto ok = false;
+        if (!CborReader::IsDocument(data))
+            ok = ReadJson(data, t);
+        else
+        {
+            CborReader reader(data);
+            ok = reader.begin(version);
+            if (ok)
+            {
+                Decode(reader, t);
+                ok = reader.stream().lastError() == QCborError::NoError;
+            }
+        }
+        if (schema)
+            *schema = version;
+        return ok;
+    }
+
+    // A member with its key, left out when toJson would leave it out for being undefined.
+    template<typename T>
+    static void EncodeMember(CborWriter &writer, quint64 id, const T &t)
+    {
+        using _T = std::remove_cv_t<std::remove_reference_t<T>>;
+        if constexpr (is_bindable_template<_T>::value)
+            EncodeMember(writer, id, *t);
+        else if constexpr (has_writeCbor<_T>::value || std::is_arithmetic_v<_T> || std::is_same_v<_T, QString> || is_instance<_T, QList>::value || is_instance<_T, QSet>::value)
+        {
+            writer.stream().append(id);
+            Encode(writer, t);
+        }
+        else
+        {
+            const auto json = Serialize(t);
+            if (json.isUndefined())
+                return;
+            writer.stream().append(id);
+            QCborValue::fromJsonValue(json).toCbor(writer.stream());
+        }
+    }
+
+    static void Encode(CborWriter &writer, const QString &t)
+    {
+        writer.stream().append(t);
+    }
+
+    template<typename T>
+    static void Encode(CborWriter &writer, const QSet<T> &t)
+    {
+        writer.stream().startArray(quint64(t.size()));
+        for (const auto &item : t)
+            Encode(writer, item);
+        writer.stream().endArray();
+    }
+
+    template<typename T>
+    static void Encode(CborWriter &writer, const QList<T> &t)
+    {
+        writer.stream().startArray(quint64(t.size()));
+        for (const auto &item : t)
+            Encode(writer, item);
+        writer.stream().endArray();
+    }
+
+    template<typename T>
+    static void Encode(CborWriter &writer, const T &t)
+    {
+        using _T = std::remove_cv_t<std::remove_reference_t<T>>;
+        if constexpr (is_bindable_template<_T>::value)
+            Encode(writer, *t);
+        else if constexpr (has_writeCbor<_T>::value)
+            t.writeCbor(writer);
+        else if constexpr (std::is_same_v<_T, bool>)
+            writer.stream().append(t);
+        else if constexpr (std::is_integral_v<_T> && std::is_signed_v<_T>)
+            writer.stream().append(qint64(t));
+        else if constexpr (std::is_integral_v<_T>)
+            writer.stream().append(quint64(t));
+        else if constexpr (std::is_floating_point_v<_T>)
+            writer.stream().append(double(t));
+        else
+            QCborValue::fromJsonValue(Serialize(t)).toCbor(writer.stream());
+    }
+
+    static void Decode(CborReader &reader, QString &t)
+    {
+        t = reader.readString();
+    }
+
+    template<typename T>
+    static void Decode(CborReader &reader, QSet<T> &t)
+    {
+        t.clear();
+        auto &stream = reader.stream();
+        if (!stream.isArray())
+        {
+            stream.next();
+            return;
+        }
+        stream.enterContainer();
+        while (stream.lastError() == QCborError::NoError && stream.hasNext())
+        {
+            T data;
+            Decode(reader, data);
+            t.insert(data);
+        }
+        stream.leaveContainer();
+    }
+
+    template<typename T>
+    static void Decode(CborReader &reader, QList<T> &t)
+    {
+        t.clear();
+        auto &stream = reader.stream();
+        if (!stream.isArray())
+        {
+            stream.next();
+            return;
+        }
+        if (stream.isLengthKnown())
+            t.reserve(qsizetype(stream.length()));
+        stream.enterContainer();
+        while (stream.lastError() == QCborError::NoError && stream.hasNext())
+        {
+            T data;
+            Decode(reader, data);
+            t.push_back(data);
+        }
+        stream.leaveContainer();
+    }
+
+    // Scalars of the expected type are taken as they are, anything else goes through Deserialize as toJson stored it.
+    template<typename T>
+    static void Decode(CborReader &reader, T &t)
+    {
+        using _T = std::remove_cv_t<std::remove_reference_t<T>>;
+        auto &stream = reader.stream();
+        if constexpr (is_bindable_template<_T>::value)
+        {
+            Decode(reader, *t);
+            t.EmitNotify();
+        }
+        else if constexpr (has_readCbor<_T>::value)
+            t.readCbor(reader);
+        else if constexpr (std::is_same_v<_T, bool>)
+        {
+            if (!stream.isBool())
+                return Deserialize(t, reader.readValue());
+            t = stream.toBool();
+            stream.next();
+        }
+        else if constexpr (std::is_integral_v<_T>)
+        {
+            if (!stream.isInteger())
+                return Deserialize(t, reader.readValue());
+            t = stream.isUnsignedInteger() ? _T(stream.toUnsignedInteger()) : _T(stream.toInteger());
+            stream.next();
+        }
+        else if constexpr (std::is_floating_point_v<_T>)
+        {
+            if (!stream.isDouble())
+                return Deserialize(t, reader.readValue());
+            t = _T(stream.toDouble());
+            stream.next();
+        }
+        else
+            Deserialize(t, reader.readValue());
+    }
 };
@@ -0,0 +1,525 @@
+#pragma once
+#include "JsonScanner.hpp"
+
+#include <QAnyStringView>
+#include <QByteArray>
+#include <QIODevice>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QJsonValue>
+#include <QUtf8StringView>
+#include <vector>
+
+/*
+ * Pulls JSON text token by token, from a byte array or from a device read in chunks, so that values can be stored
+ * where they belong without a QJsonDocument in between. QJS_JSON types read themselves through readJson, see
+ * JsonStructHelper::ReadJson.
+ * Containers are walked with beginObject / nextMember and beginArray / nextElement, each member or element must
+ * then be consumed by one of the read functions or skipValue. Once an error is hit, nothing more is read and all
+ * walks end. Strings read are checked to be UTF-8 as QJsonDocument does, skipped ones only for where they end.
+ */
+class JsonReader
+{
+  public:
+    static constexpr qsizetype ChunkSize = 64 * 1024;
+    static constexpr int MaxDepth = 1024;
+
+    explicit JsonReader(const QByteArray &json) : buffer(json), data(buffer.constData())
+    {
+    }
+
+    explicit JsonReader(QIODevice *device) : device(device)
+    {
+    }
+
+    // The type of the next value, Undefined at the end of the text or after an error.
+    QJsonValue::Type peek()
+    {
+        switch (peekChar())
+        {
+            case '{': return QJsonValue::Object;
+            case '[': return QJsonValue::Array;
+            case '"': return QJsonValue::String;
+            case 't':
+            case 'f': return QJsonValue::Bool;
+            case 'n': return QJsonValue::Null;
+            case '-':
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9': return QJsonValue::Double;
+            default: return QJsonValue::Undefined;
+        }
+    }
+
+    // Enters the next value if it is an object, skips it otherwise.
+    bool beginObject()
+    {
+        return begin(QJsonValue::Object);
+    }
+
+    // Moves to the next member of the current object, false once the object is closed.
+    bool nextMember()
+    {
+        if (failed || untouched.empty())
+            return false;
+        auto c = peekChar();
+        if (c == '}')
+        {
+            pos++;
+            untouched.pop_back();
+            return false;
+        }
+        if (!untouched.back())
+        {
+            if (c != ',')
+                return fail(c ? QJsonParseError::MissingValueSeparator : QJsonParseError::UnterminatedObject);
+            pos++;
+            c = peekChar();
+        }
+        untouched.back() = false;
+        if (c != '"')
+            return fail(c ? QJsonParseError::IllegalValue : QJsonParseError::UnterminatedObject);
+        pos++;
+        if (!parseKey())
+            return false;
+        if (peekChar() != ':')
+            return fail(QJsonParseError::MissingNameSeparator);
+        pos++;
+        return true;
+    }
+
+    // The key of the current member, valid until the next call to nextMember.
+    QAnyStringView key() const
+    {
+        return currentKey;
+    }
+
+    // Enters the next value if it is an array, skips it otherwise.
+    bool beginArray()
+    {
+        return begin(QJsonValue::Array);
+    }
+
+    // Moves to the next element of the current array, false once the array is closed.
+    bool nextElement()
+    {
+        if (failed || untouched.empty())
+            return false;
+        auto c = peekChar();
+        if (c == ']')
+        {
+            pos++;
+            untouched.pop_back();
+            return false;
+        }
+        if (!c)
+            return fail(QJsonParseError::UnterminatedArray);
+        if (!untouched.back())
+        {
+            if (c != ',')
+                return fail(QJsonParseError::MissingValueSeparator);
+            pos++;
+        }
+        untouched.back() = false;
+        return true;
+    }
+
+    // The next value if it is a string, an empty string otherwise.
+    QString readString()
+    {
+        QString s;
+        if (peek() != QJsonValue::String)
+            skipValue();
+        else
+        {
+            pos++;
+            parseString(s);
+        }
+        return s;
+    }
+
+    // The next value, containers built as a whole.
+    QJsonValue readValue()
+    {
+        switch (peek())
+        {
+            case QJsonValue::Object:
+            {
+                QJsonObject object;
+                beginObject();
+                while (nextMember())
+                {
+                    const auto name = currentKey.toString();
+                    object.insert(name, readValue());
+                }
+                return object;
+            }
+            case QJsonValue::Array:
+            {
+                QJsonArray array;
+                beginArray();
+                while (nextElement())
+                    array.append(readValue());
+                return array;
+            }
+            case QJsonValue::String: return readString();
+            case QJsonValue::Double: return parseNumber(true);
+            case QJsonValue::Bool:
+            {
+                const auto value = peekChar() == 't';
+                literal(value ? "true" : "false");
+                return value;
+            }
+            case QJsonValue::Null: return literal("null") ? QJsonValue(QJsonValue::Null) : QJsonValue(QJsonValue::Undefined);
+            default: fail(QJsonParseError::IllegalValue); return QJsonValue(QJsonValue::Undefined);
+        }
+    }
+
+    // Steps over the next value without storing any of it.
+    void skipValue()
+    {
+        switch (peek())
+        {
+            case QJsonValue::Object:
+            {
+                beginObject();
+                while (nextMember())
+                    skipValue();
+                break;
+            }
+            case QJsonValue::Array:
+            {
+                beginArray();
+                while (nextElement())
+                    skipValue();
+                break;
+            }
+            case QJsonValue::String:
+            {
+                pos++;
+                skipString();
+                break;
+            }
+            case QJsonValue::Double: parseNumber(false); break;
+            case QJsonValue::Bool: literal(peekChar() == 't' ? "true" : "false"); break;
+            case QJsonValue::Null: literal("null"); break;
+            default: fail(QJsonParseError::IllegalValue); break;
+        }
+    }
+
+    // Checks that only whitespace follows the value read, false if the text was not valid JSON.
+    bool finish()
+    {
+        if (!failed && peekChar())
+            fail(QJsonParseError::GarbageAtEnd);
+        return !failed;
+    }
+
+    QJsonParseError error() const
+    {
+        return { int(errorOffset), errorCode };
+    }
+
+  private:
+    bool fail(QJsonParseError::ParseError code)
+    {
+        if (!failed)
+        {
+            failed = true;
+            errorCode = code;
+            errorOffset = base + pos;
+            untouched.clear();
+        }
+        return false;
+    }
+
+    // Makes sure there is a byte at pos, reading the next chunk from the device when needed.
+    bool fill()
+    {
+        if (pos < buffer.size())
+            return true;
+        if (!device || failed)
+            return false;
+        // The key may point into the chunk about to be replaced.
+        if (keyInBuffer)
+        {
+            keyString = currentKey.toString();
+            currentKey = keyString;
+            keyInBuffer = false;
+        }
+        base += buffer.size();
+        buffer = device->read(ChunkSize);
+        if (buffer.isEmpty() && device->isSequential() && device->waitForReadyRead(-1))
+            buffer = device->read(ChunkSize);
+        data = buffer.constData();
+        pos = 0;
+        return !buffer.isEmpty();
+    }
+
+    // The next byte that is not whitespace, 0 at the end of the text or after an error.
+    char peekChar()
+    {
+        while (!failed && fill())
+        {
+            const auto c = data[pos];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+                return c;
+            pos += JsonScanner::Whitespace(data + pos, buffer.size() - pos);
+        }
+        return 0;
+    }
+
+    bool begin(QJsonValue::Type type)
+    {
+        if (peek() != type)
+        {
+            skipValue();
+            return false;
+        }
+        if (untouched.size() >= MaxDepth)
+            return fail(QJsonParseError::DeepNesting);
+        pos++;
+        untouched.push_back(true);
+        return true;
+    }
+
+    bool literal(const char *word)
+    {
+        for (; *word; word++)
+        {
+            if (!fill() || data[pos] != *word)
+                return fail(QJsonParseError::IllegalValue);
+            pos++;
+        }
+        return true;
+    }
+
+    // The number at pos, an integer when it has no fraction or exponent and fits, as QJsonDocument keeps it.
+    QJsonValue parseNumber(bool convert)
+    {
+        number.resize(0);
+        while (fill())
+        {
+            const auto c = data[pos];
+            if ((c < '0' || c > '9') && c != '-' && c != '+' && c != '.' && c != 'e' && c != 'E')
+                break;
+            number += c;
+            pos++;
+        }
+        if (!IsNumber(number))
+        {
+            fail(QJsonParseError::IllegalNumber);
+            return QJsonValue(QJsonValue::Undefined);
+        }
+        if (!convert)
+            return {};
+        bool ok = false;
+        if (!number.contains('.') && !number.contains('e') && !number.contains('E'))
+        {
+            const auto n = number.toLongLong(&ok);
+            if (ok)
+                return n;
+        }
+        const auto d = number.toDouble(&ok);
+        if (!ok)
+        {
+            fail(QJsonParseError::IllegalNumber);
+            return QJsonValue(QJsonValue::Undefined);
+        }
+        return d;
+    }
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    static bool IsNumber(const QByteArray &s)
+    {
+        qsizetype i = 0;
+        const auto digits = [&]() {
+            const auto from = i;
+            while (i < s.size() && s[i] >= '0' && s[i] <= '9')
+                i++;
+            return i - from;
+        };
+        if (i < s.size() && s[i] == '-')
+            i++;
+        const auto start = i;
+        const auto whole = digits();
+        if (whole == 0 || (whole > 1 && s[start] == '0'))
+            return false;
+        if (i < s.size() && s[i] == '.')
+        {
+            i++;
+            if (digits() == 0)
+                return false;
+        }
+        if (i < s.size() && (s[i] == 'e' || s[i] == 'E'))
+        {
+            i++;
+            if (i < s.size() && (s[i] == '+' || s[i] == '-'))
+                i++;
+            if (digits() == 0)
+                return false;
+        }
+        return i == s.size();
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // The length of the plain run of a string starting at pos: no escapes, no control characters, no end of chunk.
+    qsizetype plainRun() const
+    {
+        return JsonScanner::PlainRun(data + pos, buffer.size() - pos);
+    }
+
+    // A key, pointing into the chunk when it is plain and complete there.
+    bool parseKey()
+    {
+        const auto run = plainRun();
+        if (pos + run < buffer.size() && data[pos + run] == '"')
+        {
+            if (!JsonScanner::IsUtf8(data + pos, run))
+                return fail(QJsonParseError::IllegalUTF8String);
+            currentKey = QUtf8StringView(data + pos, run);
+            keyInBuffer = true;
+            pos += run + 1;
+            return true;
+        }
+        keyInBuffer = false;
+        keyString.resize(0);
+        if (!parseString(keyString))
+            return false;
+        currentKey = keyString;
+        return true;
+    }
+
+    // The rest of a string after its opening quote.
+    bool parseString(QString &out)
+    {
+        const auto run = plainRun();
+        if (pos + run < buffer.size() && data[pos + run] == '"')
+        {
+            if (!JsonScanner::IsUtf8(data + pos, run))
+                return fail(QJsonParseError::IllegalUTF8String);
+            out += QString::fromUtf8(data + pos, run);
+            pos += run + 1;
+            return true;
+        }
+
+        // Raw UTF-8 collects here and is decoded whenever an escape sequence or the closing quote is reached.
+        text.resize(0);
+        const auto flush = [&]() {
+            if (!JsonScanner::IsUtf8(text.constData(), text.size()))
+                return fail(QJsonParseError::IllegalUTF8String);
+            out += QString::fromUtf8(text);
+            text.resize(0);
+            return true;
+        };
+        while (true)
+        {
+            if (!fill())
+                return fail(QJsonParseError::UnterminatedString);
+            const auto run = plainRun();
+            text.append(data + pos, run);
+            pos += run;
+            // The chunk ended inside a plain run.
+            if (pos == buffer.size())
+                continue;
+            const auto c = data[pos++];
+            if (c == '"')
+                break;
+            if (c != '\\')
+                return fail(QJsonParseError::IllegalValue);
+            if (!fill())
+                return fail(QJsonParseError::UnterminatedString);
+            const auto e = data[pos++];
+            switch (e)
+            {
+                case '"':
+                case '\\':
+                case '/': text += e; break;
+                case 'b': text += '\b'; break;
+                case 'f': text += '\f'; break;
+                case 'n': text += '\n'; break;
+                case 'r': text += '\r'; break;
+                case 't': text += '\t'; break;
+                case 'u':
+                {
+                    char16_t u = 0;
+                    for (int i = 0; i < 4; i++)
+                    {
+                        if (!fill())
+                            return fail(QJsonParseError::UnterminatedString);
+                        const auto digit = HexDigit(data[pos++]);
+                        if (digit < 0)
+                            return fail(QJsonParseError::IllegalEscapeSequence);
+                        u = char16_t(u * 16 + digit);
+                    }
+                    // Surrogates are appended one by one, a pair of them ends up as one character.
+                    if (!flush())
+                        return false;
+                    out += QChar(u);
+                    break;
+                }
+                default: return fail(QJsonParseError::IllegalEscapeSequence);
+            }
+        }
+        return flush();
+    }
+
+    // The rest of a string after its opening quote, only checked for where it ends.
+    bool skipString()
+    {
+        while (true)
+        {
+            if (!fill())
+                return fail(QJsonParseError::UnterminatedString);
+            pos += plainRun();
+            // The chunk ended inside a plain run.
+            if (pos == buffer.size())
+                continue;
+            const auto c = data[pos++];
+            if (c == '"')
+                return true;
+            if (c != '\\')
+                return fail(QJsonParseError::IllegalValue);
+            if (!fill())
+                return fail(QJsonParseError::UnterminatedString);
+            pos++;
+        }
+    }
+
+    QIODevice *device = nullptr;
+    QByteArray buffer;
+    const char *data = nullptr;
+    qsizetype pos = 0;
+    // Offset of the current chunk in the whole text.
+    qint64 base = 0;
+
+    // Per open container, whether none of its members or elements was reached yet.
+    std::vector<bool> untouched;
+    QAnyStringView currentKey;
+    QString keyString;
+    bool keyInBuffer = false;
+    QByteArray text;
+    QByteArray number;
+
+    bool failed = false;
+    QJsonParseError::ParseError errorCode = QJsonParseError::NoError;
+    qint64 errorOffset = 0;
+};
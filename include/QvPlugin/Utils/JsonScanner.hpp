@@ -0,0 +1,285 @@
+#pragma once
+
+#include <QtAlgorithms>
+#include <QtGlobal>
+
+#if !defined(QJS_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define QJS_SCANNER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define QJS_SCANNER_TARGET(isa)
+#else
+#define QJS_SCANNER_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+/*
+ * The byte loops of JsonReader: stepping over whitespace, finding where the plain run of a string ends and checking
+ * strings are UTF-8 as QJsonDocument does. On x86 they look at 32 bytes at a time with AVX2 or 16 with SSE4.2,
+ * whichever the CPU has, picked on first use. Elsewhere, or with QJS_NO_SIMD defined, one byte at a time.
+ */
+class JsonScanner
+{
+  public:
+    enum Level
+    {
+        Scalar,
+        SSE42,
+        AVX2
+    };
+
+    static Level Supported()
+    {
+#ifdef QJS_SCANNER_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        const auto ids = info[0];
+        __cpuid(info, 1);
+        const bool sse42 = info[2] & (1 << 20);
+        // AVX2 also needs the OS to save the YMM registers.
+        const bool ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        bool avx2 = false;
+        if (ids >= 7 && ymm)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = info[1] & (1 << 5);
+        }
+#else
+        __builtin_cpu_init();
+        const bool sse42 = __builtin_cpu_supports("sse4.2");
+        const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        if (avx2)
+            return AVX2;
+        if (sse42)
+            return SSE42;
+#endif
+        return Scalar;
+    }
+
+    static Level Current()
+    {
+        return Active().level;
+    }
+
+    // Switches to a lower level than the CPU supports, for comparing them. Not to be called while reading.
+    static void Use(Level level)
+    {
+        Active() = For(qMin(level, Supported()));
+    }
+
+    // The length of the whitespace at p.
+    static qsizetype Whitespace(const char *p, qsizetype size)
+    {
+        return Active().whitespace(p, size);
+    }
+
+    // The length of the bytes at p that a string holds as they are: up to a quote, a backslash or a control character.
+    static qsizetype PlainRun(const char *p, qsizetype size)
+    {
+        return Active().plainRun(p, size);
+    }
+
+    // Whether p is well-formed UTF-8: no overlong forms, no surrogates, nothing above U+10FFFF.
+    static bool IsUtf8(const char *p, qsizetype size)
+    {
+        const auto ascii = Active().ascii;
+        qsizetype i = 0;
+        while (true)
+        {
+            i += ascii(p + i, size - i);
+            if (i == size)
+                return true;
+            const auto n = Utf8Sequence(reinterpret_cast<const uchar *>(p + i), size - i);
+            if (n == 0)
+                return false;
+            i += n;
+        }
+    }
+
+  private:
+    struct Functions
+    {
+        Level level;
+        qsizetype (*whitespace)(const char *, qsizetype);
+        qsizetype (*plainRun)(const char *, qsizetype);
+        qsizetype (*ascii)(const char *, qsizetype);
+    };
+
+    static Functions &Active()
+    {
+        static Functions functions = For(Supported());
+        return functions;
+    }
+
+    static Functions For(Level level)
+    {
+#ifdef QJS_SCANNER_X86
+        switch (level)
+        {
+            case AVX2: return { AVX2, WhitespaceAVX2, PlainRunAVX2, AsciiAVX2 };
+            case SSE42: return { SSE42, WhitespaceSSE42, PlainRunSSE42, AsciiSSE42 };
+            default: break;
+        }
+#else
+        Q_UNUSED(level);
+#endif
+        return { Scalar, WhitespaceScalar, PlainRunScalar, AsciiScalar };
+    }
+
+    // The length of the multi-byte sequence at p, 0 if it is not a valid one.
+    static qsizetype Utf8Sequence(const uchar *p, qsizetype size)
+    {
+        const auto lead = p[0];
+        qsizetype length = 0;
+        uchar low = 0x80, high = 0xbf;
+        if (lead >= 0xc2 && lead <= 0xdf)
+            length = 2;
+        else if (lead >= 0xe0 && lead <= 0xef)
+        {
+            length = 3;
+            if (lead == 0xe0)
+                low = 0xa0;
+            else if (lead == 0xed)
+                high = 0x9f;
+        }
+        else if (lead >= 0xf0 && lead <= 0xf4)
+        {
+            length = 4;
+            if (lead == 0xf0)
+                low = 0x90;
+            else if (lead == 0xf4)
+                high = 0x8f;
+        }
+        if (length == 0 || size < length || p[1] < low || p[1] > high)
+            return 0;
+        for (qsizetype i = 2; i < length; i++)
+        {
+            if ((p[i] & 0xc0) != 0x80)
+                return 0;
+        }
+        return length;
+    }
+
+    static bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool IsPlain(char c)
+    {
+        return c != '"' && c != '\\' && uchar(c) >= 0x20;
+    }
+
+    static qsizetype WhitespaceScalar(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        while (i < size && IsSpace(p[i]))
+            i++;
+        return i;
+    }
+
+    static qsizetype PlainRunScalar(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        while (i < size && IsPlain(p[i]))
+            i++;
+        return i;
+    }
+
+    static qsizetype AsciiScalar(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        while (i < size && uchar(p[i]) < 0x80)
+            i++;
+        return i;
+    }
+
+#ifdef QJS_SCANNER_X86
+    // PCMPESTRI with explicit lengths, so that a NUL byte is just another byte.
+    QJS_SCANNER_TARGET("sse4.2") static qsizetype WhitespaceSSE42(const char *p, qsizetype size)
+    {
+        const auto set = _mm_setr_epi8(' ', '\t', '\n', '\r', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        qsizetype i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            const auto index = _mm_cmpestri(set, 4, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+            if (index < 16)
+                return i + index;
+        }
+        return i + WhitespaceScalar(p + i, size - i);
+    }
+
+    QJS_SCANNER_TARGET("sse4.2") static qsizetype PlainRunSSE42(const char *p, qsizetype size)
+    {
+        const auto ranges = _mm_setr_epi8(0, 0x1f, '"', '"', '\\', '\\', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        qsizetype i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            const auto index = _mm_cmpestri(ranges, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+            if (index < 16)
+                return i + index;
+        }
+        return i + PlainRunScalar(p + i, size - i);
+    }
+
+    QJS_SCANNER_TARGET("sse4.2") static qsizetype AsciiSSE42(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            const auto mask = quint32(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i))));
+            if (mask)
+                return i + qCountTrailingZeroBits(mask);
+        }
+        return i + AsciiScalar(p + i, size - i);
+    }
+
+    QJS_SCANNER_TARGET("avx2") static qsizetype WhitespaceAVX2(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+            const auto spaces = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')));
+            const auto breaks = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r')));
+            const auto mask = ~quint32(_mm256_movemask_epi8(_mm256_or_si256(spaces, breaks)));
+            if (mask)
+                return i + qCountTrailingZeroBits(mask);
+        }
+        return i + WhitespaceScalar(p + i, size - i);
+    }
+
+    QJS_SCANNER_TARGET("avx2") static qsizetype PlainRunAVX2(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+            const auto quotes = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\')));
+            // A byte is below 0x20 when its unsigned maximum with 0x1f is 0x1f.
+            const auto controls = _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, _mm256_set1_epi8(0x1f)), _mm256_set1_epi8(0x1f));
+            const auto mask = quint32(_mm256_movemask_epi8(_mm256_or_si256(quotes, controls)));
+            if (mask)
+                return i + qCountTrailingZeroBits(mask);
+        }
+        return i + PlainRunScalar(p + i, size - i);
+    }
+
+    QJS_SCANNER_TARGET("avx2") static qsizetype AsciiAVX2(const char *p, qsizetype size)
+    {
+        qsizetype i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            const auto mask = quint32(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i))));
+            if (mask)
+                return i + qCountTrailingZeroBits(mask);
+        }
+        return i + AsciiScalar(p + i, size - i);
+    }
+#endif
+};
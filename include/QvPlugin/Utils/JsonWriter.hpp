@@ -0,0 +1,357 @@
+#pragma once
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QLocale>
+#include <QVariant>
+#include <QtNumeric>
+#include <vector>
+
+/*
+ * Writes JSON text byte for byte as QJsonDocument::toJson does, without building the document first. QJS_JSON
+ * types write themselves through writeJson, see JsonStructHelper::WriteJson.
+ * Members must come in key order, the order QJsonObject keeps them in. A member whose value turns out to be
+ * undefined, an empty array or an empty object is taken back, as toJson leaves such fields out.
+ * The text is kept in a byte array, or written to a device in chunks whenever no member is left pending.
+ */
+class JsonWriter
+{
+  public:
+    static constexpr qsizetype FlushSize = 64 * 1024;
+
+    explicit JsonWriter(QJsonDocument::JsonFormat format = QJsonDocument::Indented) : indented(format == QJsonDocument::Indented)
+    {
+    }
+
+    JsonWriter(QIODevice *device, QJsonDocument::JsonFormat format = QJsonDocument::Indented) : device(device), indented(format == QJsonDocument::Indented)
+    {
+    }
+
+    // The next value is the member key of the current object.
+    void member(const QString &key)
+    {
+        auto &frame = frames.back();
+        frame.memberMark = buffer.size();
+        separate(frame);
+        buffer += '"';
+        Escape(key, buffer);
+        buffer += indented ? "\": " : "\":";
+        pendingMember = true;
+    }
+
+    void beginObject()
+    {
+        begin('{');
+    }
+
+    void endObject()
+    {
+        end('}');
+    }
+
+    void beginArray()
+    {
+        begin('[');
+    }
+
+    void endArray()
+    {
+        end(']');
+    }
+
+    void value(const QJsonValue &v)
+    {
+        if (pendingMember && (v.isUndefined() || (v.isArray() && v.toArray().isEmpty()) || (v.isObject() && v.toObject().isEmpty())))
+        {
+            pendingMember = false;
+            buffer.truncate(frames.back().memberMark);
+            return;
+        }
+        startValue();
+        commitParent();
+        writeValue(v, int(frames.size()));
+        if (frames.empty() && indented && (v.isArray() || v.isObject()))
+            buffer += '\n';
+        flushIfIdle();
+    }
+
+    void string(const QString &s)
+    {
+        startValue();
+        commitParent();
+        buffer += '"';
+        Escape(s, buffer);
+        buffer += '"';
+        flushIfIdle();
+    }
+
+    void boolean(bool b)
+    {
+        startValue();
+        commitParent();
+        buffer += b ? "true" : "false";
+        flushIfIdle();
+    }
+
+    void integer(qint64 n)
+    {
+        startValue();
+        commitParent();
+        buffer += QByteArray::number(n);
+        flushIfIdle();
+    }
+
+    void number(double d)
+    {
+        startValue();
+        commitParent();
+        writeDouble(d);
+        flushIfIdle();
+    }
+
+    // Writes out what is left for the device, false if it failed at any point.
+    bool finish()
+    {
+        if (device)
+            flush();
+        return !failed;
+    }
+
+    QByteArray take()
+    {
+        return std::move(buffer);
+    }
+
+  private:
+    struct Frame
+    {
+        int count = 0;
+        // Where the member holding this container starts, -1 for array elements and the document itself.
+        qsizetype mark = -1;
+        // Where the last member key written into this object starts.
+        qsizetype memberMark = -1;
+    };
+
+    static void Escape(QStringView s, QByteArray &out)
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        const auto escapeUnit = [&](char16_t u) {
+            out += "\\u";
+            out += hex[(u >> 12) & 0xf];
+            out += hex[(u >> 8) & 0xf];
+            out += hex[(u >> 4) & 0xf];
+            out += hex[u & 0xf];
+        };
+        for (qsizetype i = 0; i < s.size(); i++)
+        {
+            const char16_t u = s[i].unicode();
+            if (u >= 0x20 && u < 0x80 && u != '"' && u != '\\')
+            {
+                out += char(u);
+                continue;
+            }
+            switch (u)
+            {
+                case '"': out += "\\\""; continue;
+                case '\\': out += "\\\\"; continue;
+                case '\b': out += "\\b"; continue;
+                case '\f': out += "\\f"; continue;
+                case '\n': out += "\\n"; continue;
+                case '\r': out += "\\r"; continue;
+                case '\t': out += "\\t"; continue;
+                default: break;
+            }
+            if (u < 0x20)
+                escapeUnit(u);
+            else if (u < 0x800)
+            {
+                out += char(0xc0 | (u >> 6));
+                out += char(0x80 | (u & 0x3f));
+            }
+            else if (QChar::isHighSurrogate(u) && i + 1 < s.size() && QChar::isLowSurrogate(s[i + 1].unicode()))
+            {
+                const auto c = QChar::surrogateToUcs4(u, s[++i].unicode());
+                out += char(0xf0 | (c >> 18));
+                out += char(0x80 | ((c >> 12) & 0x3f));
+                out += char(0x80 | ((c >> 6) & 0x3f));
+                out += char(0x80 | (c & 0x3f));
+            }
+            // A lone surrogate has no UTF-8 form, QJsonDocument escapes it.
+            else if (QChar::isSurrogate(u))
+                escapeUnit(u);
+            else
+            {
+                out += char(0xe0 | (u >> 12));
+                out += char(0x80 | ((u >> 6) & 0x3f));
+                out += char(0x80 | (u & 0x3f));
+            }
+        }
+    }
+
+    void indent(qsizetype level)
+    {
+        if (indented)
+            buffer.append(4 * level, ' ');
+    }
+
+    void separate(const Frame &frame)
+    {
+        if (frame.count > 0)
+            buffer += indented ? ",\n" : ",";
+        indent(qsizetype(frames.size()));
+    }
+
+    // Before a value: the separator of an array element, or the start of the member the value belongs to.
+    qsizetype startValue()
+    {
+        if (pendingMember)
+        {
+            pendingMember = false;
+            return frames.back().memberMark;
+        }
+        if (!frames.empty())
+            separate(frames.back());
+        return -1;
+    }
+
+    void commitParent()
+    {
+        if (frames.empty())
+            return;
+        auto &frame = frames.back();
+        if (frame.count++ == 0 && frame.mark >= 0)
+            uncertain--;
+    }
+
+    void begin(char open)
+    {
+        const auto mark = startValue();
+        // An element counts at once, a member once it is known not to be empty.
+        if (mark < 0)
+            commitParent();
+        buffer += open;
+        if (indented)
+            buffer += '\n';
+        frames.push_back({ 0, mark, -1 });
+        if (mark >= 0)
+            uncertain++;
+    }
+
+    void end(char close)
+    {
+        const auto frame = frames.back();
+        frames.pop_back();
+        if (frame.mark >= 0 && frame.count == 0)
+        {
+            uncertain--;
+            buffer.truncate(frame.mark);
+            return;
+        }
+        if (indented && frame.count > 0)
+            buffer += '\n';
+        indent(qsizetype(frames.size()));
+        buffer += close;
+        if (frame.mark >= 0)
+            commitParent();
+        if (frames.empty() && indented)
+            buffer += '\n';
+        flushIfIdle();
+    }
+
+    void writeDouble(double d)
+    {
+        if (qIsFinite(d))
+            buffer += QByteArray::number(d, 'g', QLocale::FloatingPointShortest);
+        else
+            buffer += "null";
+    }
+
+    // A complete value at the given nesting level, the way QJsonDocument writes it.
+    void writeValue(const QJsonValue &v, int level)
+    {
+        switch (v.type())
+        {
+            case QJsonValue::Bool: buffer += v.toBool() ? "true" : "false"; break;
+            case QJsonValue::String:
+            {
+                buffer += '"';
+                Escape(v.toString(), buffer);
+                buffer += '"';
+                break;
+            }
+            case QJsonValue::Double:
+            {
+                // Integers are kept as such in a QJsonValue, and written without going through a double.
+                if (v.toVariant().typeId() == QMetaType::LongLong)
+                    buffer += QByteArray::number(v.toInteger());
+                else
+                    writeDouble(v.toDouble());
+                break;
+            }
+            case QJsonValue::Array:
+            {
+                const auto array = v.toArray();
+                buffer += indented ? "[\n" : "[";
+                for (qsizetype i = 0; i < array.size(); i++)
+                {
+                    if (i > 0)
+                        buffer += indented ? ",\n" : ",";
+                    indent(level + 1);
+                    writeValue(array.at(i), level + 1);
+                }
+                if (indented && !array.isEmpty())
+                    buffer += '\n';
+                indent(level);
+                buffer += ']';
+                break;
+            }
+            case QJsonValue::Object:
+            {
+                const auto object = v.toObject();
+                buffer += indented ? "{\n" : "{";
+                for (auto it = object.constBegin(); it != object.constEnd(); ++it)
+                {
+                    if (it != object.constBegin())
+                        buffer += indented ? ",\n" : ",";
+                    indent(level + 1);
+                    buffer += '"';
+                    Escape(it.key(), buffer);
+                    buffer += indented ? "\": " : "\":";
+                    writeValue(it.value(), level + 1);
+                }
+                if (indented && !object.isEmpty())
+                    buffer += '\n';
+                indent(level);
+                buffer += '}';
+                break;
+            }
+            default: buffer += "null"; break;
+        }
+    }
+
+    void flushIfIdle()
+    {
+        if (device && uncertain == 0 && !pendingMember && buffer.size() >= FlushSize)
+            flush();
+    }
+
+    void flush()
+    {
+        if (device->write(buffer) != buffer.size())
+            failed = true;
+        buffer.resize(0);
+    }
+
+    QIODevice *device = nullptr;
+    const bool indented;
+    QByteArray buffer;
+    std::vector<Frame> frames;
+    // Containers that are members and still empty, anything after the first of them might be taken back.
+    int uncertain = 0;
+    bool pendingMember = false;
+    bool failed = false;
+};
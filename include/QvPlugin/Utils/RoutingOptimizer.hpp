@@ -0,0 +1,486 @@
+#pragma once
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+#include "QvPlugin/Utils/RuleSetFile.hpp"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QSet>
+#include <QtAlgorithms>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+namespace Qv2rayPlugin::Utils
+{
+    /*
+     * Shrinks the rules of a RoutingObject before it is handed to a kernel, e.g. in PluginKernel::SetProfileContent,
+     * without changing the outbound of any connection: first matching rule wins before and after. It
+     *   - drops the disabled rules,
+     *   - removes duplicate and covered entries within a rule: names under a domain: suffix, names containing a
+     *     keyword, keywords containing a shorter one, repeated tags, networks, protocols and processes,
+     *   - aggregates the CIDRs of targetIPs and sourceAddresses into the fewest subnets of the same addresses,
+     *   - removes the entries, and whole rules, that an earlier rule always catches first,
+     *   - merges adjacent rules with the same outbound that differ in a single condition.
+     * Entries it cannot reason about (regexp:, geosite:, geoip:, ext:, ruleset:) are only deduplicated. Rules with
+     * options or extraSettings are merged only with identical ones and never prune the rules after them.
+     */
+    class RoutingOptimizer
+    {
+      public:
+        struct Report
+        {
+            int rulesBefore = 0;
+            int rulesAfter = 0;
+            int entriesBefore = 0;
+            int entriesAfter = 0;
+            // Size of the routing object as compact JSON.
+            qsizetype bytesBefore = 0;
+            qsizetype bytesAfter = 0;
+            int disabledRules = 0;
+            int dominatedRules = 0;
+            int mergedRules = 0;
+
+            QString toString() const
+            {
+                return QStringLiteral("rules %1 -> %2, entries %3 -> %4, %5 -> %6 bytes")
+                    .arg(rulesBefore)
+                    .arg(rulesAfter)
+                    .arg(entriesBefore)
+                    .arg(entriesAfter)
+                    .arg(bytesBefore)
+                    .arg(bytesAfter);
+            }
+        };
+
+        static Report Optimize(RoutingObject &routing)
+        {
+            Report report;
+            report.rulesBefore = routing.rules.size();
+            report.entriesBefore = CountEntries(routing);
+            report.bytesBefore = JsonSize(routing);
+
+            QList<RuleObject> rules;
+            std::vector<Conditions> conditions;
+            for (auto rule : std::as_const(routing.rules))
+            {
+                if (!rule.enabled)
+                {
+                    report.disabledRules++;
+                    continue;
+                }
+                Normalize(rule);
+                if (Prune(rule, conditions))
+                {
+                    report.dominatedRules++;
+                    continue;
+                }
+                if (!rules.isEmpty() && Merge(rules.last(), rule))
+                {
+                    Normalize(rules.last());
+                    conditions.back() = Conditions(rules.last());
+                    report.mergedRules++;
+                    continue;
+                }
+                conditions.emplace_back(rule);
+                rules.append(rule);
+            }
+            routing.rules = rules;
+
+            report.rulesAfter = routing.rules.size();
+            report.entriesAfter = CountEntries(routing);
+            report.bytesAfter = JsonSize(routing);
+            return report;
+        }
+
+      private:
+        using V6 = RuleSetFile::V6;
+
+        // The conditions of a rule, cheapest to compare first.
+        enum Field
+        {
+            InboundTags,
+            Networks,
+            Protocols,
+            Processes,
+            TargetPort,
+            SourcePort,
+            TargetIPs,
+            SourceAddresses,
+            TargetDomains,
+            FieldCount
+        };
+
+        // The targetDomains entries of a rule, by kind.
+        struct DomainSet
+        {
+            enum Kind
+            {
+                Keyword,
+                Suffix,
+                Full,
+                // Compared as is.
+                Opaque
+            };
+
+            explicit DomainSet(const QStringList &entries)
+            {
+                for (const auto &entry : entries)
+                {
+                    const auto [kind, value] = Parse(entry);
+                    if (kind == Keyword)
+                        keywords.append(value);
+                    else if (kind == Suffix)
+                        suffixes.insert(value);
+                    else if (kind == Full)
+                        fulls.insert(value);
+                    else
+                        opaque.insert(value);
+                }
+                keywords.removeDuplicates();
+            }
+
+            static std::pair<Kind, QString> Parse(const QString &entry)
+            {
+                const auto split = entry.indexOf(u':');
+                const auto prefix = split < 0 ? QString() : entry.left(split);
+                const auto value = entry.mid(split + 1);
+                if (value.isEmpty() || value.startsWith(u'.') || value.endsWith(u'.'))
+                    return { Opaque, entry };
+                if (split < 0 || prefix == QStringLiteral("keyword"))
+                    return { Keyword, value };
+                if (prefix == QStringLiteral("domain"))
+                    return { Suffix, value };
+                if (prefix == QStringLiteral("full"))
+                    return { Full, value };
+                return { Opaque, entry };
+            }
+
+            // Whether every name entry matches is matched by the set too, by another entry than itself if strictly.
+            bool covers(const QString &entry, bool strictly) const
+            {
+                const auto [kind, value] = Parse(entry);
+                if (kind == Opaque)
+                    return !strictly && opaque.contains(value);
+                for (const auto &keyword : keywords)
+                    if (value.contains(keyword) && !(strictly && kind == Keyword && keyword == value))
+                        return true;
+                if (kind == Keyword)
+                    return false;
+                if (kind == Full && !strictly && fulls.contains(value))
+                    return true;
+                if ((kind == Full || !strictly) && suffixes.contains(value))
+                    return true;
+                for (auto dot = value.indexOf(u'.'); dot >= 0; dot = value.indexOf(u'.', dot + 1))
+                    if (suffixes.contains(value.mid(dot + 1)))
+                        return true;
+                return false;
+            }
+
+            QSet<QString> suffixes;
+            QSet<QString> fulls;
+            QStringList keywords;
+            QSet<QString> opaque;
+        };
+
+        // The targetIPs or sourceAddresses entries of a rule, CIDRs as merged ranges.
+        struct AddressSet
+        {
+            explicit AddressSet(const QStringList &entries)
+            {
+                for (const auto &entry : entries)
+                {
+                    const auto subnet = Subnet(entry);
+                    if (subnet.first.isNull())
+                        opaque.insert(entry);
+                    else
+                        RuleSetFile::AddSubnet(subnet, v4, v6);
+                }
+                RuleSetFile::MergeRanges(v4);
+                RuleSetFile::MergeRanges(v6);
+            }
+
+            bool covers(const QString &entry) const
+            {
+                const auto subnet = Subnet(entry);
+                if (subnet.first.isNull())
+                    return opaque.contains(entry);
+                std::vector<RuleSetFile::V4Range> a;
+                std::vector<RuleSetFile::V6Range> b;
+                RuleSetFile::AddSubnet(subnet, a, b);
+                return a.empty() ? Contains(v6, b.front()) : Contains(v4, a.front());
+            }
+
+            std::vector<RuleSetFile::V4Range> v4;
+            std::vector<RuleSetFile::V6Range> v6;
+            QSet<QString> opaque;
+        };
+
+        struct Conditions
+        {
+            explicit Conditions(const RuleObject &rule)
+                : prunes(rule.options.isEmpty() && rule.extraSettings.isEmpty()), ports{ rule.targetPort, rule.sourcePort },
+                  addresses{ AddressSet(rule.targetIPs), AddressSet(rule.sourceAddresses) }, domains(rule.targetDomains)
+            {
+                for (int f = 0; f < FieldCount; f++)
+                    any[f] = IsPort(f) ? !IsSet(Port(rule, f)) : List(rule, f).isEmpty();
+                for (int f = InboundTags; f <= Processes; f++)
+                    names[f] = QSet<QString>(List(rule, f).cbegin(), List(rule, f).cend());
+            }
+
+            // Whether every connection the field of a later rule matches is matched by this field too.
+            bool covers(int field, const RuleObject &rule) const
+            {
+                if (any[field])
+                    return true;
+                if (IsPort(field))
+                {
+                    const auto &own = ports[field - TargetPort];
+                    const auto &port = Port(rule, field);
+                    return IsSet(port) && own.from <= port.from && port.to <= own.to;
+                }
+                const auto &entries = List(rule, field);
+                return !entries.isEmpty() && std::all_of(entries.cbegin(), entries.cend(), [&](const QString &e) { return covers(field, e); });
+            }
+
+            bool covers(int field, const QString &entry) const
+            {
+                if (field == TargetDomains)
+                    return domains.covers(entry, false);
+                if (field == TargetIPs || field == SourceAddresses)
+                    return addresses[field - TargetIPs].covers(entry);
+                return names[field].contains(entry);
+            }
+
+            // Whether the rule has no conditions besides the fields, so that it can prune the later rules.
+            bool prunes;
+            std::array<bool, FieldCount> any{};
+            std::array<QSet<QString>, Processes + 1> names;
+            std::array<PortRange, 2> ports;
+            std::array<AddressSet, 2> addresses;
+            DomainSet domains;
+        };
+
+        static bool IsPort(int field)
+        {
+            return field == TargetPort || field == SourcePort;
+        }
+
+        static bool IsSet(const PortRange &port)
+        {
+            return port.from != 0 || port.to != 0;
+        }
+
+        template<typename Rule>
+        static auto &Port(Rule &rule, int field)
+        {
+            return field == TargetPort ? rule.targetPort : rule.sourcePort;
+        }
+
+        template<typename Rule>
+        static auto &List(Rule &rule, int field)
+        {
+            switch (field)
+            {
+                case InboundTags: return rule.inboundTags;
+                case Networks: return rule.networks;
+                case Protocols: return rule.protocols;
+                case Processes: return rule.processes;
+                case TargetIPs: return rule.targetIPs;
+                case SourceAddresses: return rule.sourceAddresses;
+                default: return rule.targetDomains;
+            }
+        }
+
+        static QPair<QHostAddress, int> Subnet(const QString &entry)
+        {
+            return QHostAddress::parseSubnet(entry.contains(u'/') ? entry : entry + (entry.contains(u':') ? QStringLiteral("/128") : QStringLiteral("/32")));
+        }
+
+        // Whether range lies in one of the sorted disjoint ranges.
+        template<typename Range>
+        static bool Contains(const std::vector<Range> &ranges, const Range &range)
+        {
+            const auto after = std::upper_bound(ranges.cbegin(), ranges.cend(), range.first, [](const auto &v, const Range &r) { return v < r.first; });
+            return after != ranges.cbegin() && !(std::prev(after)->second < range.second);
+        }
+
+        static int CountEntries(const RoutingObject &routing)
+        {
+            int count = 0;
+            for (const auto &rule : routing.rules)
+                for (int f = 0; f < FieldCount; f++)
+                    count += IsPort(f) ? IsSet(Port(rule, f)) : List(rule, f).size();
+            return count;
+        }
+
+        static qsizetype JsonSize(const RoutingObject &routing)
+        {
+            return QJsonDocument(routing.toJson()).toJson(QJsonDocument::Compact).size();
+        }
+
+        static void Normalize(RuleObject &rule)
+        {
+            for (int f = InboundTags; f <= Processes; f++)
+                List(rule, f).removeDuplicates();
+            rule.targetIPs = AggregateAddresses(rule.targetIPs);
+            rule.sourceAddresses = AggregateAddresses(rule.sourceAddresses);
+            rule.targetDomains = PruneDomains(rule.targetDomains);
+        }
+
+        static QStringList PruneDomains(const QStringList &entries)
+        {
+            // "keyword:x" and "x" are the same entry.
+            QStringList unique;
+            QSet<std::pair<int, QString>> seen;
+            for (const auto &entry : entries)
+            {
+                const auto parsed = DomainSet::Parse(entry);
+                if (seen.contains(parsed))
+                    continue;
+                seen.insert(parsed);
+                unique.append(entry);
+            }
+            const DomainSet set(unique);
+            unique.erase(std::remove_if(unique.begin(), unique.end(), [&](const QString &e) { return set.covers(e, true); }), unique.end());
+            return unique;
+        }
+
+        static QStringList AggregateAddresses(const QStringList &entries)
+        {
+            const AddressSet set(entries);
+            QStringList result;
+            for (const auto &[first, last] : set.v4)
+                AppendSubnets({ 0, first }, { 0, last }, 32, result);
+            for (const auto &[first, last] : set.v6)
+                AppendSubnets(first, last, 128, result);
+            for (const auto &entry : entries)
+                if (set.opaque.contains(entry))
+                    result.append(entry);
+            result.removeDuplicates();
+            return result;
+        }
+
+        // Splits the range [first, last] of a family of width bits into the fewest aligned subnets.
+        static void AppendSubnets(V6 first, const V6 &last, int width, QStringList &out)
+        {
+            while (true)
+            {
+                auto hostBits = first.second != 0 ? int(qCountTrailingZeroBits(first.second)) : 64 + int(qCountTrailingZeroBits(first.first));
+                hostBits = qMin(hostBits, width);
+                while (last < LastOf(first, hostBits))
+                    hostBits--;
+                out.append(Format(first, width - hostBits, width));
+                const auto end = LastOf(first, hostBits);
+                if (end == last)
+                    return;
+                first = RuleSetFile::Next(end);
+            }
+        }
+
+        static V6 LastOf(const V6 &first, int hostBits)
+        {
+            if (hostBits >= 64)
+                return { first.first | (hostBits == 128 ? ~quint64(0) : (quint64(1) << (hostBits - 64)) - 1), ~quint64(0) };
+            return { first.first, first.second | ((quint64(1) << hostBits) - 1) };
+        }
+
+        static QString Format(const V6 &address, int length, int width)
+        {
+            QHostAddress host;
+            if (width == 32)
+                host.setAddress(quint32(address.second));
+            else
+            {
+                Q_IPV6ADDR bytes;
+                for (int i = 0; i < 8; i++)
+                {
+                    bytes[i] = quint8(address.first >> (56 - 8 * i));
+                    bytes[i + 8] = quint8(address.second >> (56 - 8 * i));
+                }
+                host.setAddress(bytes);
+            }
+            return length == width ? host.toString() : host.toString() + u'/' + QString::number(length);
+        }
+
+        // Drops what the earlier rules always catch first, true when nothing of rule is left.
+        static bool Prune(RuleObject &rule, const std::vector<Conditions> &earlier)
+        {
+            for (const auto &e : earlier)
+            {
+                if (!e.prunes)
+                    continue;
+                int uncovered = -1;
+                int count = 0;
+                for (int f = 0; f < FieldCount && count < 2; f++)
+                {
+                    if (e.covers(f, rule))
+                        continue;
+                    uncovered = f;
+                    count++;
+                }
+                if (count == 0)
+                    return true;
+                // With every other condition covered, the entries of the last one that e matches never reach rule.
+                if (count > 1 || IsPort(uncovered) || List(rule, uncovered).isEmpty())
+                    continue;
+                auto &entries = List(rule, uncovered);
+                entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const QString &entry) { return e.covers(uncovered, entry); }), entries.end());
+                if (entries.isEmpty())
+                    return true;
+            }
+            return false;
+        }
+
+        static bool Equal(const RuleObject &a, const RuleObject &b, int field)
+        {
+            if (IsPort(field))
+                return Port(a, field) == Port(b, field);
+            const auto &x = List(a, field);
+            const auto &y = List(b, field);
+            return x.size() == y.size() && QSet<QString>(x.cbegin(), x.cend()) == QSet<QString>(y.cbegin(), y.cend());
+        }
+
+        // Folds rule into the one right before it when both go to the same outbound and differ in one condition.
+        static bool Merge(RuleObject &previous, const RuleObject &rule)
+        {
+            if (previous.outboundTag != rule.outboundTag || previous.options != rule.options || previous.extraSettings.raw() != rule.extraSettings.raw())
+                return false;
+            int different = -1;
+            for (int f = 0; f < FieldCount; f++)
+            {
+                if (Equal(previous, rule, f))
+                    continue;
+                if (different >= 0)
+                    return false;
+                different = f;
+            }
+            if (different < 0)
+                return true;
+
+            if (IsPort(different))
+            {
+                auto &port = Port(previous, different);
+                const auto &other = Port(rule, different);
+                if (!IsSet(port) || !IsSet(other))
+                {
+                    port = PortRange();
+                    return true;
+                }
+                // Only overlapping or adjacent ranges make a range.
+                if (qMax(port.from, other.from) > qMin(port.to, other.to) + 1)
+                    return false;
+                port.from = qMin(port.from, other.from);
+                port.to = qMax(port.to, other.to);
+                return true;
+            }
+            auto &entries = List(previous, different);
+            const auto &other = List(rule, different);
+            if (entries.isEmpty() || other.isEmpty())
+                entries.clear();
+            else
+                entries.append(other);
+            return true;
+        }
+    };
+} // namespace Qv2rayPlugin::Utils
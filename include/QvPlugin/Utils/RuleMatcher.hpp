@@ -0,0 +1,656 @@
+#pragma once
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+#include "QvPlugin/Utils/RuleSetFile.hpp"
+
+#include <QHash>
+#include <QHostAddress>
+#include <QRegularExpression>
+#include <QtAlgorithms>
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <vector>
+
+namespace Qv2rayPlugin::Utils
+{
+    /*
+     * The rules of a RoutingObject compiled for fast evaluation, first matching rule wins as in the core.
+     * Every condition of every rule goes into an index shared by all rules: a suffix trie of reversed labels for
+     * domain: and full: entries, an Aho-Corasick automaton for keywords, path-compressed radix trees for the target
+     * and source CIDRs, sorted intervals for the port ranges and hash tables for networks, inbound tags, protocols
+     * and processes. A lookup collects the rules hit in each index into bitmaps and returns the first rule set in
+     * all of them, so its cost depends on the number of rules and hits, not on the size of the entry lists.
+     * Regular expressions and "ruleset:<path>" entries, which refer to a RuleSetFile, are still tried one by one.
+     * Entries that cannot be evaluated without the core (geosite:, geoip: lists except geoip:private, ext:) and
+     * fields the caller marks as unknown make a rule a possible match only, reported with certain = false. So do
+     * rules carrying options or extraSettings, whose meaning is up to the core.
+     * Immutable once built, safe to share between threads.
+     */
+    class RuleMatcher
+    {
+      public:
+        enum Field
+        {
+            NoField = 0,
+            TargetDomain = 1 << 0,
+            TargetIP = 1 << 1,
+            TargetPort = 1 << 2,
+            SourceIP = 1 << 3,
+            SourcePort = 1 << 4,
+            Network = 1 << 5,
+            InboundTag = 1 << 6,
+            Protocol = 1 << 7,
+            Process = 1 << 8,
+        };
+
+        /*
+         * What is known about a connection. An empty domain, a null address, a port of 0 or an empty string fails
+         * every condition on that field, like a connection to an IP address fails the domain rules in the core.
+         */
+        struct Query
+        {
+            QString domain;
+            QHostAddress targetAddress;
+            quint16 targetPort = 0;
+            QHostAddress sourceAddress;
+            quint16 sourcePort = 0;
+            QString network = QStringLiteral("tcp");
+            QString inboundTag;
+            QString protocol;
+            QString process;
+            // Fields that cannot be told, conditions on them might hold, a combination of Field values.
+            int unknownFields = NoField;
+        };
+
+        struct Result
+        {
+            // Index of the rule in RoutingObject::rules, -1 when no rule matches.
+            int rule = -1;
+            // False when the rule matches only if some of its unknown conditions hold.
+            bool certain = true;
+            QString outboundTag;
+        };
+
+        RuleMatcher() = default;
+
+        explicit RuleMatcher(const RoutingObject &routing)
+        {
+            for (int i = 0; i < routing.rules.size(); i++)
+            {
+                if (!routing.rules[i].enabled)
+                    continue;
+                ruleIndices.push_back(i);
+                outboundTags.append(routing.rules[i].outboundTag);
+            }
+
+            ruleCount = int(ruleIndices.size());
+            words = (ruleCount + 63) / 64;
+            opaque.assign(words, 0);
+            for (auto &d : dimensions)
+            {
+                d.constrained.assign(words, 0);
+                d.unevaluable.assign(words, 0);
+            }
+
+            domainNodes.push_back({});
+            keywordStates.push_back({});
+            ipTrees[0].push_back({});
+            ipTrees[1].push_back({});
+            for (int r = 0; r < ruleCount; r++)
+                compile(r, routing.rules[ruleIndices[r]]);
+            buildKeywordLinks();
+            buildPortIntervals(0);
+            buildPortIntervals(1);
+        }
+
+        int size() const
+        {
+            return ruleCount;
+        }
+
+        Result match(const Query &query) const
+        {
+            // Hits of the current lookup, kept per thread so that lookups do not allocate.
+            thread_local std::array<std::vector<int>, DimensionCount> hitLists;
+            thread_local std::vector<quint64> hitBits;
+            for (auto &list : hitLists)
+                list.clear();
+            hitBits.resize(size_t(DimensionCount) * size_t(words));
+
+            std::array<bool, DimensionCount> present{};
+            present[TargetDomainDim] = !query.domain.isEmpty();
+            present[TargetIPDim] = !query.targetAddress.isNull();
+            present[TargetPortDim] = query.targetPort != 0;
+            present[SourceIPDim] = !query.sourceAddress.isNull();
+            present[SourcePortDim] = query.sourcePort != 0;
+            present[NetworkDim] = !query.network.isEmpty();
+            present[InboundTagDim] = !query.inboundTag.isEmpty();
+            present[ProtocolDim] = !query.protocol.isEmpty();
+            present[ProcessDim] = !query.process.isEmpty();
+
+            const auto isKnown = [&](int d) { return !(query.unknownFields & (1 << d)); };
+            if (present[TargetDomainDim] && isKnown(TargetDomainDim))
+                collectDomain(query.domain, hitLists[TargetDomainDim]);
+            if (present[TargetIPDim] && isKnown(TargetIPDim))
+                collectAddress(0, query.targetAddress, hitLists[TargetIPDim]);
+            if (present[TargetPortDim] && isKnown(TargetPortDim))
+                collectPort(0, query.targetPort, hitLists[TargetPortDim]);
+            if (present[SourceIPDim] && isKnown(SourceIPDim))
+                collectAddress(1, query.sourceAddress, hitLists[SourceIPDim]);
+            if (present[SourcePortDim] && isKnown(SourcePortDim))
+                collectPort(1, query.sourcePort, hitLists[SourcePortDim]);
+            if (present[NetworkDim] && isKnown(NetworkDim))
+                Append(hitLists[NetworkDim], networkRules.value(query.network.toLower()));
+            if (present[InboundTagDim] && isKnown(InboundTagDim))
+                Append(hitLists[InboundTagDim], inboundRules.value(query.inboundTag));
+            if (present[ProtocolDim] && isKnown(ProtocolDim))
+                Append(hitLists[ProtocolDim], protocolRules.value(query.protocol));
+            if (present[ProcessDim] && isKnown(ProcessDim))
+                Append(hitLists[ProcessDim], processRules.value(query.process));
+
+            for (int d = 0; d < DimensionCount; d++)
+                for (const auto r : hitLists[d])
+                    hitBits[size_t(d) * words + r / 64] |= quint64(1) << (r % 64);
+
+            Result result;
+            for (int w = 0; w < words && result.rule < 0; w++)
+            {
+                // Rules that can still match, and those that match whatever the unknown parts turn out to be.
+                quint64 may = w == words - 1 && ruleCount % 64 ? (quint64(1) << (ruleCount % 64)) - 1 : ~quint64(0);
+                quint64 sure = may & ~opaque[w];
+                for (int d = 0; d < DimensionCount && may; d++)
+                {
+                    const auto unconstrained = ~dimensions[d].constrained[w];
+                    if (!isKnown(d))
+                        sure &= unconstrained;
+                    else if (!present[d])
+                    {
+                        may &= unconstrained;
+                        sure &= unconstrained;
+                    }
+                    else
+                    {
+                        const auto hits = hitBits[size_t(d) * words + w];
+                        may &= unconstrained | hits | dimensions[d].unevaluable[w];
+                        sure &= unconstrained | hits;
+                    }
+                }
+                if (!may)
+                    continue;
+                const auto bit = qCountTrailingZeroBits(may);
+                const auto r = w * 64 + int(bit);
+                result = { ruleIndices[r], bool((sure >> bit) & 1), outboundTags[r] };
+            }
+
+            for (int d = 0; d < DimensionCount; d++)
+                for (const auto r : hitLists[d])
+                    hitBits[size_t(d) * words + r / 64] = 0;
+            return result;
+        }
+
+      private:
+        enum Dimension
+        {
+            TargetDomainDim,
+            TargetIPDim,
+            TargetPortDim,
+            SourceIPDim,
+            SourcePortDim,
+            NetworkDim,
+            InboundTagDim,
+            ProtocolDim,
+            ProcessDim,
+            DimensionCount
+        };
+
+        struct DimensionBits
+        {
+            // Rules with a condition on the field, and rules with entries that cannot be evaluated here.
+            std::vector<quint64> constrained;
+            std::vector<quint64> unevaluable;
+        };
+
+        struct DomainNode
+        {
+            int parent = -1;
+            QString label;
+            // domain: entries ending here, matching this name and its subdomains, and full: entries.
+            QList<int> suffixRules;
+            QList<int> fullRules;
+        };
+
+        struct KeywordState
+        {
+            QList<QPair<char16_t, int>> next;
+            int fail = 0;
+            // The next state along the failure links with rules of its own, -1 if none.
+            int output = -1;
+            QList<int> rules;
+        };
+
+        // IPv4 addresses are stored as IPv4-mapped IPv6 ones.
+        struct IPKey
+        {
+            quint64 hi = 0;
+            quint64 lo = 0;
+        };
+
+        struct IPNode
+        {
+            IPKey prefix;
+            int length = 0;
+            int child[2] = { -1, -1 };
+            QList<int> rules;
+        };
+
+        struct PortIntervals
+        {
+            QList<QPair<int, int>> ranges;
+            QList<int> rangeRules;
+            // Interval i covers [bounds[i], bounds[i + 1]).
+            std::vector<int> bounds;
+            std::vector<QList<int>> rules;
+        };
+
+        static void Set(std::vector<quint64> &bits, int r)
+        {
+            bits[r / 64] |= quint64(1) << (r % 64);
+        }
+
+        static void Append(std::vector<int> &hits, const QList<int> &rules)
+        {
+            hits.insert(hits.end(), rules.cbegin(), rules.cend());
+        }
+
+        void compile(int r, const RuleObject &rule)
+        {
+            if (!rule.options.isEmpty() || !rule.extraSettings.isEmpty())
+                Set(opaque, r);
+
+            if (!rule.targetDomains.isEmpty())
+                Set(dimensions[TargetDomainDim].constrained, r);
+            for (const auto &entry : rule.targetDomains)
+                compileDomain(r, entry);
+
+            compileAddresses(r, rule.targetIPs, TargetIPDim, 0);
+            compileAddresses(r, rule.sourceAddresses, SourceIPDim, 1);
+
+            for (const auto &[dim, range] : { qMakePair(TargetPortDim, rule.targetPort), qMakePair(SourcePortDim, rule.sourcePort) })
+            {
+                if (range.from == 0 && range.to == 0)
+                    continue;
+                Set(dimensions[dim].constrained, r);
+                auto &ports = portIntervals[dim == TargetPortDim ? 0 : 1];
+                ports.ranges.append({ qMin(range.from, range.to), qMax(range.from, range.to) });
+                ports.rangeRules.append(r);
+            }
+
+            if (!rule.networks.isEmpty())
+                Set(dimensions[NetworkDim].constrained, r);
+            for (const auto &entry : rule.networks)
+                for (const auto &network : entry.split(u',', Qt::SkipEmptyParts))
+                    networkRules[network.trimmed().toLower()].append(r);
+
+            for (const auto &[dim, values, index] : { std::tuple{ InboundTagDim, &rule.inboundTags, &inboundRules },
+                                                      std::tuple{ ProtocolDim, &rule.protocols, &protocolRules },
+                                                      std::tuple{ ProcessDim, &rule.processes, &processRules } })
+            {
+                if (!values->isEmpty())
+                    Set(dimensions[dim].constrained, r);
+                for (const auto &value : *values)
+                    (*index)[value].append(r);
+            }
+        }
+
+        void compileDomain(int r, const QString &entry)
+        {
+            const auto split = entry.indexOf(u':');
+            const auto prefix = split < 0 ? QString() : entry.left(split);
+            const auto value = entry.mid(split + 1).toLower();
+            if (split < 0 || prefix == QStringLiteral("keyword"))
+                addKeyword(r, value);
+            else if (prefix == QStringLiteral("domain"))
+                domainNodes[addDomain(value)].suffixRules.append(r);
+            else if (prefix == QStringLiteral("full"))
+                domainNodes[addDomain(value)].fullRules.append(r);
+            else if (prefix == QStringLiteral("regexp"))
+                regexps.append({ QRegularExpression(entry.mid(split + 1)), r });
+            else if (const auto set = prefix == QStringLiteral("ruleset") ? RuleSetFile::Open(entry.mid(split + 1)) : nullptr; set)
+                domainSets.append({ set, r });
+            else
+                // geosite:, ext:, missing rule sets and anything newer.
+                Set(dimensions[TargetDomainDim].unevaluable, r);
+        }
+
+        void compileAddresses(int r, const QStringList &entries, Dimension dim, int which)
+        {
+            auto &tree = ipTrees[which];
+            if (!entries.isEmpty())
+                Set(dimensions[dim].constrained, r);
+            for (const auto &entry : entries)
+            {
+                if (entry == QStringLiteral("geoip:private"))
+                {
+                    for (const auto subnet : RuleSetFile::PrivateSubnets)
+                        InsertSubnet(tree, QHostAddress::parseSubnet(QString::fromLatin1(subnet)), r);
+                    continue;
+                }
+                if (entry.startsWith(QStringLiteral("ruleset:")))
+                {
+                    if (const auto set = RuleSetFile::Open(entry.mid(8)); set)
+                        addressSets[which].append({ set, r });
+                    else
+                        Set(dimensions[dim].unevaluable, r);
+                    continue;
+                }
+                // A single address is a subnet of its full length.
+                const auto subnet = QHostAddress::parseSubnet(entry.contains(u'/') ? entry : entry + (entry.contains(u':') ? QStringLiteral("/128") : QStringLiteral("/32")));
+                if (subnet.first.isNull())
+                    Set(dimensions[dim].unevaluable, r);
+                else
+                    InsertSubnet(tree, subnet, r);
+            }
+        }
+
+        // Domain suffix trie, edges are found by hashing the parent and the label, with linear probing.
+
+        static size_t EdgeKey(int parent, QStringView label)
+        {
+            return qHashMulti(0, parent, label);
+        }
+
+        int findChild(int parent, QStringView label) const
+        {
+            for (auto key = EdgeKey(parent, label);; key++)
+            {
+                const auto it = domainEdges.constFind(key);
+                if (it == domainEdges.cend())
+                    return -1;
+                if (domainNodes[*it].parent == parent && domainNodes[*it].label == label)
+                    return *it;
+            }
+        }
+
+        int addDomain(const QString &domain)
+        {
+            int node = 0;
+            for (auto end = domain.size(); end > 0;)
+            {
+                const auto start = domain.lastIndexOf(u'.', end - 1) + 1;
+                const auto label = QStringView(domain).sliced(start, end - start);
+                end = start - 1;
+                if (label.isEmpty())
+                    continue;
+                auto child = findChild(node, label);
+                if (child < 0)
+                {
+                    child = int(domainNodes.size());
+                    auto key = EdgeKey(node, label);
+                    while (domainEdges.contains(key))
+                        key++;
+                    domainEdges.insert(key, child);
+                    domainNodes.push_back({ node, label.toString(), {}, {} });
+                }
+                node = child;
+            }
+            return node;
+        }
+
+        void collectDomain(const QString &name, std::vector<int> &hits) const
+        {
+            auto domain = name.toLower();
+            if (domain.endsWith(u'.'))
+                domain.chop(1);
+
+            // Walk the labels from the top-level one down.
+            int node = 0;
+            for (auto end = domain.size(); end > 0;)
+            {
+                const auto start = domain.lastIndexOf(u'.', end - 1) + 1;
+                node = findChild(node, QStringView(domain).sliced(start, end - start));
+                if (node < 0)
+                    break;
+                Append(hits, domainNodes[node].suffixRules);
+                if (start == 0)
+                    Append(hits, domainNodes[node].fullRules);
+                end = start - 1;
+            }
+
+            int state = 0;
+            for (const auto c : domain)
+            {
+                state = nextKeywordState(state, c.unicode());
+                for (auto s = keywordStates[state].rules.isEmpty() ? keywordStates[state].output : state; s > 0; s = keywordStates[s].output)
+                    Append(hits, keywordStates[s].rules);
+            }
+            Append(hits, keywordStates[0].rules);
+
+            for (const auto &[regexp, r] : regexps)
+                if (regexp.match(domain).hasMatch())
+                    hits.push_back(r);
+            for (const auto &[set, r] : domainSets)
+                if (set->matchDomain(domain))
+                    hits.push_back(r);
+        }
+
+        // Keyword automaton
+
+        int keywordChild(int state, char16_t c) const
+        {
+            for (const auto &[label, next] : keywordStates[state].next)
+                if (label == c)
+                    return next;
+            return -1;
+        }
+
+        void addKeyword(int r, const QString &keyword)
+        {
+            int state = 0;
+            for (const auto c : keyword)
+            {
+                auto next = keywordChild(state, c.unicode());
+                if (next < 0)
+                {
+                    next = int(keywordStates.size());
+                    keywordStates[state].next.append({ c.unicode(), next });
+                    keywordStates.push_back({});
+                }
+                state = next;
+            }
+            // The empty keyword is kept by the root and matches every domain.
+            keywordStates[state].rules.append(r);
+        }
+
+        void buildKeywordLinks()
+        {
+            std::vector<int> queue;
+            for (const auto &[c, s] : keywordStates[0].next)
+                queue.push_back(s);
+            for (size_t i = 0; i < queue.size(); i++)
+            {
+                const auto state = queue[i];
+                for (const auto &[c, next] : keywordStates[state].next)
+                {
+                    auto fail = keywordStates[state].fail;
+                    while (fail > 0 && keywordChild(fail, c) < 0)
+                        fail = keywordStates[fail].fail;
+                    const auto target = keywordChild(fail, c);
+                    keywordStates[next].fail = target < 0 ? 0 : target;
+                    const auto &f = keywordStates[keywordStates[next].fail];
+                    keywordStates[next].output = !f.rules.isEmpty() && keywordStates[next].fail > 0 ? keywordStates[next].fail : f.output;
+                    queue.push_back(next);
+                }
+            }
+        }
+
+        int nextKeywordState(int state, char16_t c) const
+        {
+            while (true)
+            {
+                if (const auto next = keywordChild(state, c); next >= 0)
+                    return next;
+                if (state == 0)
+                    return 0;
+                state = keywordStates[state].fail;
+            }
+        }
+
+        // Radix trees
+
+        static IPKey Key(const QHostAddress &address)
+        {
+            bool isV4 = false;
+            const auto v4 = address.toIPv4Address(&isV4);
+            IPKey key;
+            if (isV4)
+            {
+                key.lo = 0xffff00000000ULL | v4;
+                return key;
+            }
+            const auto v6 = address.toIPv6Address();
+            for (int i = 0; i < 8; i++)
+            {
+                key.hi = key.hi << 8 | v6[i];
+                key.lo = key.lo << 8 | v6[i + 8];
+            }
+            return key;
+        }
+
+        static int Bit(const IPKey &key, int i)
+        {
+            return i < 64 ? int(key.hi >> (63 - i)) & 1 : int(key.lo >> (127 - i)) & 1;
+        }
+
+        static IPKey Masked(IPKey key, int length)
+        {
+            key.hi = length >= 64 ? key.hi : length == 0 ? 0 : key.hi & (~quint64(0) << (64 - length));
+            key.lo = length >= 128 ? key.lo : length <= 64 ? 0 : key.lo & (~quint64(0) << (128 - length));
+            return key;
+        }
+
+        // Length of the common prefix of a and b, at most limit bits.
+        static int CommonLength(const IPKey &a, const IPKey &b, int limit)
+        {
+            int length;
+            if (const auto hi = a.hi ^ b.hi; hi)
+                length = int(qCountLeadingZeroBits(hi));
+            else if (const auto lo = a.lo ^ b.lo; lo)
+                length = 64 + int(qCountLeadingZeroBits(lo));
+            else
+                length = 128;
+            return qMin(length, limit);
+        }
+
+        static void InsertSubnet(std::vector<IPNode> &tree, const QPair<QHostAddress, int> &subnet, int r)
+        {
+            const auto isV4 = subnet.first.protocol() == QAbstractSocket::IPv4Protocol;
+            const auto length = isV4 ? 96 + subnet.second : subnet.second;
+            const auto key = Masked(Key(subnet.first), length);
+
+            int node = 0;
+            while (true)
+            {
+                if (tree[node].length == length)
+                    return tree[node].rules.append(r);
+
+                const auto bit = Bit(key, tree[node].length);
+                const auto child = tree[node].child[bit];
+                if (child < 0)
+                {
+                    tree[node].child[bit] = int(tree.size());
+                    tree.push_back({ key, length, { -1, -1 }, { r } });
+                    return;
+                }
+
+                const auto common = CommonLength(key, tree[child].prefix, qMin(length, tree[child].length));
+                if (common == tree[child].length)
+                {
+                    node = child;
+                    continue;
+                }
+
+                // Split the edge at the first differing bit.
+                const auto middle = int(tree.size());
+                tree.push_back({ Masked(key, common), common, { -1, -1 }, {} });
+                tree[middle].child[Bit(tree[child].prefix, common)] = child;
+                tree[node].child[bit] = middle;
+                if (common == length)
+                    return tree[middle].rules.append(r);
+                tree[middle].child[Bit(key, common)] = int(tree.size());
+                tree.push_back({ key, length, { -1, -1 }, { r } });
+                return;
+            }
+        }
+
+        void collectAddress(int which, const QHostAddress &address, std::vector<int> &hits) const
+        {
+            const auto &tree = ipTrees[which];
+            const auto key = Key(address);
+            for (int node = 0; node >= 0;)
+            {
+                const auto &n = tree[node];
+                if (CommonLength(key, n.prefix, n.length) < n.length)
+                    break;
+                Append(hits, n.rules);
+                node = n.length < 128 ? n.child[Bit(key, n.length)] : -1;
+            }
+            for (const auto &[set, r] : addressSets[which])
+                if (set->matchAddress(address))
+                    hits.push_back(r);
+        }
+
+        // Port ranges
+
+        void buildPortIntervals(int which)
+        {
+            auto &ports = portIntervals[which];
+            ports.bounds = { 0, 65536 };
+            for (const auto &[from, to] : std::as_const(ports.ranges))
+            {
+                ports.bounds.push_back(from);
+                ports.bounds.push_back(to + 1);
+            }
+            std::sort(ports.bounds.begin(), ports.bounds.end());
+            ports.bounds.erase(std::unique(ports.bounds.begin(), ports.bounds.end()), ports.bounds.end());
+            ports.rules.assign(ports.bounds.size(), {});
+            for (int i = 0; i < ports.ranges.size(); i++)
+            {
+                const auto first = std::lower_bound(ports.bounds.begin(), ports.bounds.end(), ports.ranges[i].first) - ports.bounds.begin();
+                for (auto k = first; ports.bounds[k] <= ports.ranges[i].second; k++)
+                    ports.rules[k].append(ports.rangeRules[i]);
+            }
+            ports.ranges.clear();
+            ports.rangeRules.clear();
+        }
+
+        void collectPort(int which, quint16 port, std::vector<int> &hits) const
+        {
+            const auto &ports = portIntervals[which];
+            const auto k = std::upper_bound(ports.bounds.begin(), ports.bounds.end(), int(port)) - ports.bounds.begin() - 1;
+            Append(hits, ports.rules[k]);
+        }
+
+      private:
+        int ruleCount = 0;
+        int words = 0;
+        std::vector<int> ruleIndices;
+        QStringList outboundTags;
+        std::array<DimensionBits, DimensionCount> dimensions;
+        // Rules with options or extraSettings, which may add conditions unknown here.
+        std::vector<quint64> opaque;
+
+        std::vector<DomainNode> domainNodes;
+        QHash<size_t, int> domainEdges;
+        std::vector<KeywordState> keywordStates;
+        QList<QPair<QRegularExpression, int>> regexps;
+        QList<QPair<std::shared_ptr<const RuleSetFile>, int>> domainSets;
+        std::array<std::vector<IPNode>, 2> ipTrees;
+        std::array<QList<QPair<std::shared_ptr<const RuleSetFile>, int>>, 2> addressSets;
+        std::array<PortIntervals, 2> portIntervals;
+        QHash<QString, QList<int>> networkRules;
+        QHash<QString, QList<int>> inboundRules;
+        QHash<QString, QList<int>> protocolRules;
+        QHash<QString, QList<int>> processRules;
+    };
+} // namespace Qv2rayPlugin::Utils
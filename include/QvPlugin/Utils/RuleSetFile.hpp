@@ -0,0 +1,461 @@
+#pragma once
+
+#include "QvPlugin/Common/CommonTypes.hpp"
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QHostAddress>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSet>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace Qv2rayPlugin::Utils
+{
+    /*
+     * A large domain and IP list stored in a compact binary file, memory-mapped and queried in place.
+     * A rule refers to one with a "ruleset:<path>" entry in targetDomains, targetIPs or sourceAddresses, which
+     * RuleMatcher evaluates against the file instead of inline entries. Write or Convert creates the files.
+     *
+     * Layout, little-endian:
+     *   Header
+     *   suffix index  (suffixCount + 1) x u32  domain: entries, labels reversed ("com.example"), sorted
+     *   full index    (fullCount + 1) x u32    full: entries, same form
+     *   keyword index (keywordCount + 1) x u32 keyword: entries, as is
+     *   IPv4 ranges   v4Count x 2 x u32        first and last address, sorted, disjoint
+     *   IPv6 ranges   v6Count x 4 x u64        high and low halves of the first and last address, likewise
+     *   string pool   poolSize bytes           UTF-8, entry i of an index spans [index[i], index[i + 1])
+     *
+     * Only the pages touched by a lookup are read, a domain costs one binary search per label, an address one
+     * binary search, keywords are scanned. Files are shared between all the users of the same path.
+     */
+    class RuleSetFile
+    {
+      public:
+        static constexpr quint32 Magic = 0x53525651; // "QVRS"
+        static constexpr quint32 Version = 1;
+
+        // What geoip:private stands for.
+        static constexpr const char *PrivateSubnets[] = {
+            "0.0.0.0/8",      "10.0.0.0/8",    "100.64.0.0/10", "127.0.0.0/8", "169.254.0.0/16", "172.16.0.0/12", "192.0.0.0/24",
+            "192.168.0.0/16", "198.18.0.0/15", "224.0.0.0/4",   "::1/128",     "fc00::/7",       "fe80::/10",     "ff00::/8",
+        };
+
+        // Inclusive address ranges, IPv6 addresses as their high and low halves.
+        using V4Range = std::pair<quint32, quint32>;
+        using V6 = std::pair<quint64, quint64>;
+        using V6Range = std::pair<V6, V6>;
+
+        RuleSetFile(const RuleSetFile &) = delete;
+
+        /*
+         * Writes domains (domain:, full:, keyword: or plain keyword entries of targetDomains) and ips (addresses
+         * and CIDRs of targetIPs, geoip:private included) to path. Entries that cannot be stored (regexp:,
+         * geosite:, other geoip: lists, anything unparsable) are appended to unsupported.
+         */
+        static bool Write(const QString &path, const QStringList &domains, const QStringList &ips, QStringList *unsupported = nullptr)
+        {
+            QList<QByteArray> suffixes, fulls, keywords;
+            for (const auto &entry : domains)
+            {
+                const auto split = entry.indexOf(u':');
+                const auto prefix = split < 0 ? QString() : entry.left(split);
+                const auto value = entry.mid(split + 1).toLower();
+                if (split < 0 || prefix == QStringLiteral("keyword"))
+                    keywords.append(value.toUtf8());
+                else if (prefix == QStringLiteral("domain") && !ReversedName(value).isEmpty())
+                    suffixes.append(ReversedName(value));
+                else if (prefix == QStringLiteral("full") && !ReversedName(value).isEmpty())
+                    fulls.append(ReversedName(value));
+                else if (unsupported)
+                    unsupported->append(entry);
+            }
+
+            std::vector<V4Range> v4;
+            std::vector<V6Range> v6;
+            for (const auto &entry : ips)
+            {
+                if (entry == QStringLiteral("geoip:private"))
+                {
+                    for (const auto subnet : PrivateSubnets)
+                        AddSubnet(QHostAddress::parseSubnet(QString::fromLatin1(subnet)), v4, v6);
+                    continue;
+                }
+                const auto subnet = QHostAddress::parseSubnet(entry.contains(u'/') ? entry : entry + (entry.contains(u':') ? QStringLiteral("/128") : QStringLiteral("/32")));
+                if (!subnet.first.isNull())
+                    AddSubnet(subnet, v4, v6);
+                else if (unsupported)
+                    unsupported->append(entry);
+            }
+
+            // A suffix makes the longer suffixes and full names below it redundant.
+            std::sort(suffixes.begin(), suffixes.end());
+            suffixes.erase(std::unique(suffixes.begin(), suffixes.end()), suffixes.end());
+            QSet<QByteArray> kept;
+            QList<QByteArray> prunedSuffixes;
+            for (const auto &name : std::as_const(suffixes))
+            {
+                if (!HasSuffixIn(name, kept, false))
+                    prunedSuffixes.append(name);
+                kept.insert(name);
+            }
+            fulls.erase(std::remove_if(fulls.begin(), fulls.end(), [&](const QByteArray &name) { return HasSuffixIn(name, kept, true); }), fulls.end());
+            std::sort(fulls.begin(), fulls.end());
+            fulls.erase(std::unique(fulls.begin(), fulls.end()), fulls.end());
+            std::sort(keywords.begin(), keywords.end());
+            keywords.erase(std::unique(keywords.begin(), keywords.end()), keywords.end());
+            MergeRanges(v4);
+            MergeRanges(v6);
+
+            QByteArray out;
+            QByteArray pool;
+            const auto appendIndex = [&](const QList<QByteArray> &strings) {
+                for (const auto &s : strings)
+                {
+                    Append<quint32>(out, quint32(pool.size()));
+                    pool.append(s);
+                }
+                Append<quint32>(out, quint32(pool.size()));
+            };
+
+            Append<quint32>(out, Magic);
+            Append<quint32>(out, Version);
+            for (const auto count : { prunedSuffixes.size(), fulls.size(), keywords.size(), qsizetype(v4.size()), qsizetype(v6.size()), qsizetype(0) })
+                Append<quint32>(out, quint32(count));
+            const auto poolOffsetAt = out.size();
+            Append<quint64>(out, 0);
+            Append<quint64>(out, 0);
+            appendIndex(prunedSuffixes);
+            appendIndex(fulls);
+            appendIndex(keywords);
+            for (const auto &[first, last] : v4)
+            {
+                Append<quint32>(out, first);
+                Append<quint32>(out, last);
+            }
+            for (const auto &[first, last] : v6)
+            {
+                Append<quint64>(out, first.first);
+                Append<quint64>(out, first.second);
+                Append<quint64>(out, last.first);
+                Append<quint64>(out, last.second);
+            }
+            qToLittleEndian<quint64>(quint64(out.size()), out.data() + poolOffsetAt);
+            qToLittleEndian<quint64>(quint64(pool.size()), out.data() + poolOffsetAt + 8);
+            out.append(pool);
+
+            // A file in use stays mapped by its readers, it is replaced, never overwritten.
+            QSaveFile file(path);
+            if (!file.open(QIODevice::WriteOnly) || file.write(out) != out.size() || !file.commit())
+            {
+                qWarning("Cannot write rule set %s: %s", qUtf8Printable(path), qUtf8Printable(file.errorString()));
+                return false;
+            }
+            return true;
+        }
+
+        /*
+         * Moves the targetDomains and targetIPs entries of rule that a rule set can hold into a file at path, and
+         * replaces them by a reference to it. The other entries stay inline.
+         */
+        static bool Convert(RuleObject &rule, const QString &path)
+        {
+            QStringList unsupported;
+            if (!Write(path, rule.targetDomains, rule.targetIPs, &unsupported))
+                return false;
+            const auto reference = QStringLiteral("ruleset:") + path;
+            const auto keep = [&](QStringList &entries) {
+                if (entries.isEmpty())
+                    return;
+                entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const QString &e) { return !unsupported.contains(e); }), entries.end());
+                entries.append(reference);
+            };
+            keep(rule.targetDomains);
+            keep(rule.targetIPs);
+            return true;
+        }
+
+        // The mapped rule set at path, shared with the other users of the same file, nullptr if it is not valid.
+        static std::shared_ptr<const RuleSetFile> Open(const QString &path)
+        {
+            static QMutex lock;
+            static QHash<QString, std::weak_ptr<const RuleSetFile>> opened;
+
+            const QFileInfo info(path);
+            const auto key = info.absoluteFilePath();
+            const QMutexLocker locker(&lock);
+            if (const auto existing = opened.value(key).lock(); existing && existing->modified == info.lastModified())
+                return existing;
+
+            std::shared_ptr<RuleSetFile> set(new RuleSetFile(key));
+            if (!set->map())
+                return nullptr;
+            set->modified = info.lastModified();
+            opened.insert(key, set);
+            return set;
+        }
+
+        // domain: and full: entries by name, keyword: ones by substring.
+        bool matchDomain(const QString &domain) const
+        {
+            auto name = domain.toLower();
+            if (name.endsWith(u'.'))
+                name.chop(1);
+            if (name.isEmpty())
+                return false;
+
+            const auto reversed = ReversedName(name);
+            if (find(fullIndex, counts.full, reversed))
+                return true;
+            for (qsizetype end = 0; end <= reversed.size(); end++)
+                if ((end == reversed.size() || reversed[end] == '.') && find(suffixIndex, counts.suffix, QByteArrayView(reversed).first(end)))
+                    return true;
+
+            const auto utf8 = name.toUtf8();
+            for (quint32 i = 0; i < counts.keyword; i++)
+                if (utf8.contains(string(keywordIndex, i)))
+                    return true;
+            return false;
+        }
+
+        bool matchAddress(const QHostAddress &address) const
+        {
+            bool isV4 = false;
+            const auto ip4 = address.toIPv4Address(&isV4);
+            if (isV4)
+            {
+                const auto at = [this](quint32 i, int k) { return qFromLittleEndian<quint32>(v4Ranges + (2 * i + k) * 4); };
+                return Contains(counts.v4, ip4, at);
+            }
+            const auto ip6 = address.toIPv6Address();
+            V6 key{ 0, 0 };
+            for (int i = 0; i < 8; i++)
+            {
+                key.first = key.first << 8 | ip6[i];
+                key.second = key.second << 8 | ip6[i + 8];
+            }
+            const auto at = [this](quint32 i, int k) {
+                const auto p = v6Ranges + (4 * i + 2 * k) * 8;
+                return V6{ qFromLittleEndian<quint64>(p), qFromLittleEndian<quint64>(p + 8) };
+            };
+            return Contains(counts.v6, key, at);
+        }
+
+        qsizetype domainCount() const
+        {
+            return qsizetype(counts.suffix) + counts.full + counts.keyword;
+        }
+
+        qsizetype rangeCount() const
+        {
+            return qsizetype(counts.v4) + counts.v6;
+        }
+
+        static void AddSubnet(const QPair<QHostAddress, int> &subnet, std::vector<V4Range> &v4, std::vector<V6Range> &v6)
+        {
+            if (subnet.first.protocol() == QAbstractSocket::IPv4Protocol)
+            {
+                const auto mask = subnet.second == 0 ? 0 : ~quint32(0) << (32 - subnet.second);
+                const auto first = subnet.first.toIPv4Address() & mask;
+                v4.push_back({ first, first | ~mask });
+                return;
+            }
+            const auto ip6 = subnet.first.toIPv6Address();
+            V6 first{ 0, 0 };
+            for (int i = 0; i < 8; i++)
+            {
+                first.first = first.first << 8 | ip6[i];
+                first.second = first.second << 8 | ip6[i + 8];
+            }
+            const auto length = subnet.second;
+            const quint64 hiMask = length >= 64 ? ~quint64(0) : length == 0 ? 0 : ~quint64(0) << (64 - length);
+            const quint64 loMask = length >= 128 ? ~quint64(0) : length <= 64 ? 0 : ~quint64(0) << (128 - length);
+            first.first &= hiMask;
+            first.second &= loMask;
+            v6.push_back({ first, { first.first | ~hiMask, first.second | ~loMask } });
+        }
+
+        // Sorts ranges and merges the overlapping and adjacent ones.
+        template<typename Range>
+        static void MergeRanges(std::vector<Range> &ranges)
+        {
+            std::sort(ranges.begin(), ranges.end());
+            std::vector<Range> merged;
+            for (const auto &range : ranges)
+            {
+                // Checked for the maximum first, Next would wrap around.
+                if (!merged.empty() && (merged.back().second == Max(range.second) || !(Next(merged.back().second) < range.first)))
+                    merged.back().second = std::max(merged.back().second, range.second);
+                else
+                    merged.push_back(range);
+            }
+            ranges = std::move(merged);
+        }
+
+        static quint32 Next(quint32 v)
+        {
+            return v + 1;
+        }
+
+        static V6 Next(V6 v)
+        {
+            return v.second == ~quint64(0) ? V6{ v.first + 1, 0 } : V6{ v.first, v.second + 1 };
+        }
+
+        static quint32 Max(quint32)
+        {
+            return ~quint32(0);
+        }
+
+        static V6 Max(const V6 &)
+        {
+            return { ~quint64(0), ~quint64(0) };
+        }
+
+      private:
+        struct Counts
+        {
+            quint32 suffix = 0;
+            quint32 full = 0;
+            quint32 keyword = 0;
+            quint32 v4 = 0;
+            quint32 v6 = 0;
+        };
+
+        static constexpr qint64 HeaderSize = 8 * sizeof(quint32) + 2 * sizeof(quint64);
+
+        explicit RuleSetFile(const QString &path) : file(path)
+        {
+        }
+
+        bool map()
+        {
+            if (!file.open(QIODevice::ReadOnly) || file.size() < HeaderSize)
+                return false;
+            data = file.map(0, file.size());
+            // The mapping outlives the descriptor, it is released with the QFile.
+            file.close();
+            if (!data)
+                return false;
+
+            const auto header = [this](int i) { return qFromLittleEndian<quint32>(data + 4 * i); };
+            if (header(0) != Magic || header(1) != Version)
+            {
+                qWarning("%s is not a rule set of version %u", qUtf8Printable(file.fileName()), Version);
+                return false;
+            }
+            counts = { header(2), header(3), header(4), header(5), header(6) };
+            const auto poolOffset = qFromLittleEndian<quint64>(data + 8 * 4);
+            poolSize = qFromLittleEndian<quint64>(data + 8 * 4 + 8);
+
+            // All in 64 bits, no count read from the file can overflow them.
+            quint64 offset = HeaderSize;
+            suffixIndex = data + offset;
+            offset += (quint64(counts.suffix) + 1) * 4;
+            fullIndex = data + qMin<quint64>(offset, file.size());
+            offset += (quint64(counts.full) + 1) * 4;
+            keywordIndex = data + qMin<quint64>(offset, file.size());
+            offset += (quint64(counts.keyword) + 1) * 4;
+            v4Ranges = data + qMin<quint64>(offset, file.size());
+            offset += quint64(counts.v4) * 8;
+            v6Ranges = data + qMin<quint64>(offset, file.size());
+            offset += quint64(counts.v6) * 32;
+            if (offset != poolOffset || poolOffset + poolSize != quint64(file.size()))
+            {
+                qWarning("Rule set %s is truncated or corrupted", qUtf8Printable(file.fileName()));
+                return false;
+            }
+            pool = data + poolOffset;
+            return true;
+        }
+
+        // Entry i of index, empty if its offsets are out of the pool.
+        QByteArrayView string(const uchar *index, quint32 i) const
+        {
+            const auto begin = qFromLittleEndian<quint32>(index + 4 * i);
+            const auto end = qFromLittleEndian<quint32>(index + 4 * (i + 1));
+            if (begin > end || end > poolSize)
+                return {};
+            return QByteArrayView(pool + begin, end - begin);
+        }
+
+        bool find(const uchar *index, quint32 count, QByteArrayView key) const
+        {
+            quint32 low = 0, high = count;
+            while (low < high)
+            {
+                const auto middle = low + (high - low) / 2;
+                const auto entry = string(index, middle);
+                const auto common = std::memcmp(entry.data(), key.data(), size_t(qMin(entry.size(), key.size())));
+                const auto order = common != 0 ? common : entry.size() < key.size() ? -1 : entry.size() > key.size() ? 1 : 0;
+                if (order == 0)
+                    return true;
+                if (order < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            return false;
+        }
+
+        // Whether key is in one of the count sorted disjoint ranges, at(i, 0) and at(i, 1) being the bounds of range i.
+        template<typename T, typename At>
+        static bool Contains(quint32 count, const T &key, const At &at)
+        {
+            // The last range starting at or before key.
+            quint32 low = 0, high = count;
+            while (low < high)
+            {
+                const auto middle = low + (high - low) / 2;
+                if (key < at(middle, 0))
+                    high = middle;
+                else
+                    low = middle + 1;
+            }
+            return low > 0 && !(at(low - 1, 1) < key);
+        }
+
+        // "www.example.com" as "com.example.www", so that the names of a domain share a prefix.
+        static QByteArray ReversedName(const QString &name)
+        {
+            auto labels = name.split(u'.', Qt::SkipEmptyParts);
+            std::reverse(labels.begin(), labels.end());
+            return labels.join(u'.').toUtf8();
+        }
+
+        static bool HasSuffixIn(const QByteArray &reversed, const QSet<QByteArray> &suffixes, bool includingItself)
+        {
+            for (qsizetype end = 0; end <= reversed.size(); end++)
+                if ((end == reversed.size() ? includingItself : reversed[end] == '.') && suffixes.contains(reversed.first(end)))
+                    return true;
+            return false;
+        }
+
+        template<typename T>
+        static void Append(QByteArray &out, T value)
+        {
+            char bytes[sizeof(T)];
+            qToLittleEndian<T>(value, bytes);
+            out.append(bytes, sizeof(T));
+        }
+
+      private:
+        QFile file;
+        QDateTime modified;
+        const uchar *data = nullptr;
+        Counts counts;
+        quint64 poolSize = 0;
+        const uchar *suffixIndex = nullptr;
+        const uchar *fullIndex = nullptr;
+        const uchar *keywordIndex = nullptr;
+        const uchar *v4Ranges = nullptr;
+        const uchar *v6Ranges = nullptr;
+        const uchar *pool = nullptr;
+    };
+} // namespace Qv2rayPlugin::Utils
@@ -0,0 +1,248 @@
+/*
+ * A loopback check of HttpProxy CONNECT tunnels, everything runs in this process.
+ *
+ *   clients --HTTP CONNECT--> HttpProxy (worker threads) --SOCKS5--> Socks5StandIn --TCP--> EchoServer
+ *
+ * The same tunnels are run with the connections handed to worker threads, with the workers sharding the listener
+ * with SO_REUSEPORT, and with the tunnels relayed by the io_uring of their worker thread. The last one is skipped
+ * where io_uring is unavailable. Every client must get its CONNECT answered and its payload echoed back intact.
+ */
+
+#include "QvPlugin/Socksify/HttpProxy.hpp"
+#include "QvPlugin/Socksify/SocketStream.hpp"
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QTimer>
+#include <QtEndian>
+#include <algorithm>
+#include <memory>
+
+using namespace Qv2rayPlugin::Utils;
+
+constexpr int Clients = 8;
+constexpr int Workers = 2;
+constexpr qint64 PayloadSize = 1024 * 1024;
+
+// Byte i of the payload of a client, so that lost, reordered or crossed data is noticed.
+static char PatternAt(int client, qint64 i)
+{
+    return char((i + client * 7) % 251);
+}
+
+// Writes back everything it receives, the target of the tunnels.
+class EchoServer : public QTcpServer
+{
+    Q_OBJECT
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket]() { socket->write(socket->readAll()); });
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+    }
+};
+
+// The smallest SOCKS5 server HttpProxy can talk to: no authentication, CONNECT only, IPv4 destinations only.
+class Socks5StandIn : public QTcpServer
+{
+    Q_OBJECT
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        const auto buffer = std::make_shared<QByteArray>();
+        connect(socket, &QTcpSocket::disconnected, socket, &QTcpSocket::deleteLater);
+        connect(socket, &QTcpSocket::readyRead, socket, [socket, buffer]() {
+            buffer->append(socket->readAll());
+            // Greeting: 05 01 00, then the request: 05 01 00 01 ADDR PORT
+            if (buffer->size() < 3 + 10)
+                return;
+            const auto request = QByteArrayView(*buffer).sliced(3);
+            if (request[1] != '\x01' || request[3] != '\x01')
+                return socket->abort();
+
+            const QHostAddress host(qFromBigEndian<quint32>(request.data() + 4));
+            const auto port = qFromBigEndian<quint16>(request.data() + 8);
+            // Whatever follows the request has been pipelined by the client and belongs to the target.
+            const auto payload = request.sliced(10).toByteArray();
+            buffer->clear();
+            QObject::disconnect(socket, &QTcpSocket::readyRead, nullptr, nullptr);
+
+            const auto target = new QTcpSocket(socket);
+            connect(target, &QTcpSocket::connected, socket, [socket, target, payload]() {
+                socket->write("\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                target->write(payload);
+                const auto stream = new SocketStream(socket, target, socket);
+                connect(stream, &SocketStream::finished, socket, &QTcpSocket::deleteLater);
+            });
+            connect(target, &QAbstractSocket::errorOccurred, socket, [socket]() {
+                socket->write("\x05\x05\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                socket->disconnectFromHost();
+            });
+            target->connectToHost(host, port);
+        });
+    }
+};
+
+// Opens a tunnel to the echo server, sends PayloadSize bytes through it and checks what comes back.
+class TunnelClient : public QObject
+{
+    Q_OBJECT
+  public:
+    TunnelClient(int index, quint16 proxyPort, quint16 targetPort, QObject *parent) : QObject(parent), index(index)
+    {
+        connect(&socket, &QTcpSocket::connected, this, [this, targetPort]() {
+            const auto target = "127.0.0.1:" + QByteArray::number(targetPort);
+            socket.write("CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n");
+        });
+        connect(&socket, &QTcpSocket::readyRead, this, &TunnelClient::onReadyRead);
+        connect(&socket, &QAbstractSocket::errorOccurred, this, [this]() { finish(QStringLiteral("socket error: ") + socket.errorString()); });
+        socket.connectToHost(QHostAddress::LocalHost, proxyPort);
+    }
+
+    bool isDone() const
+    {
+        return done;
+    }
+
+    // Empty when the tunnel worked.
+    QString failure() const
+    {
+        return done ? error : QStringLiteral("%1 of %2 bytes echoed").arg(received).arg(PayloadSize);
+    }
+
+  signals:
+    void finished();
+
+  private:
+    void onReadyRead()
+    {
+        auto data = socket.readAll();
+        if (!established)
+        {
+            head.append(data);
+            const auto end = head.indexOf("\r\n\r\n");
+            if (end < 0)
+                return;
+            if (!head.startsWith("HTTP/1.1 200"))
+                return finish(QStringLiteral("CONNECT answered with ") + QString::fromLatin1(head.left(head.indexOf("\r\n"))));
+            established = true;
+            data = head.mid(end + 4);
+            head.clear();
+
+            QByteArray payload(PayloadSize, Qt::Uninitialized);
+            for (qint64 i = 0; i < PayloadSize; i++)
+                payload[i] = PatternAt(index, i);
+            socket.write(payload);
+        }
+
+        for (qsizetype i = 0; i < data.size(); i++)
+        {
+            if (received + i >= PayloadSize || data[i] != PatternAt(index, received + i))
+                return finish(QStringLiteral("byte %1 differs").arg(received + i));
+        }
+        received += data.size();
+        if (received == PayloadSize)
+            finish({});
+    }
+
+    void finish(const QString &result)
+    {
+        if (done)
+            return;
+        done = true;
+        error = result;
+        socket.disconnect(this);
+        socket.abort();
+        emit finished();
+    }
+
+  private:
+    const int index;
+    QTcpSocket socket;
+    QByteArray head;
+    qint64 received = 0;
+    bool established = false;
+    bool done = false;
+    QString error;
+};
+
+// Runs Clients tunnels through a new HttpProxy, returns false and reports on err when one of them fails.
+static bool RunTunnels(const QString &name, bool reusePort, bool ioUring, quint16 socksPort, quint16 echoPort, QTextStream &out, QTextStream &err)
+{
+    const QHostAddress loopback(QHostAddress::LocalHost);
+    HttpProxy proxy;
+    proxy.setWorkerThreads(Workers, HttpProxy::LeastLoaded, reusePort);
+    proxy.setStatisticsInterval(0);
+    proxy.setIoUringRelay(ioUring);
+    if (!proxy.httpListen(loopback, 0, socksPort))
+    {
+        err << name << ": cannot listen on loopback\n";
+        return false;
+    }
+
+    QEventLoop loop;
+    QList<TunnelClient *> clients;
+    for (auto i = 0; i < Clients; i++)
+    {
+        const auto client = new TunnelClient(i, proxy.serverPort(), echoPort, &loop);
+        clients.append(client);
+        QObject::connect(client, &TunnelClient::finished, &loop, [&]() {
+            if (std::all_of(clients.cbegin(), clients.cend(), [](const TunnelClient *c) { return c->isDone(); }))
+                loop.quit();
+        });
+    }
+    QTimer::singleShot(30000, &loop, &QEventLoop::quit);
+    loop.exec();
+
+    auto passed = true;
+    for (auto i = 0; i < Clients; i++)
+    {
+        const auto failure = clients[i]->failure();
+        if (failure.isEmpty())
+            continue;
+        err << name << ": client " << i << ": " << failure << "\n";
+        passed = false;
+    }
+    out << name << ": " << (passed ? "passed" : "failed") << "\n";
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout), err(stderr);
+
+    EchoServer echo;
+    Socks5StandIn socks;
+    if (!echo.listen(QHostAddress::LocalHost) || !socks.listen(QHostAddress::LocalHost))
+    {
+        err << "Cannot listen on loopback\n";
+        return 1;
+    }
+
+    auto passed = RunTunnels(QStringLiteral("worker threads"), false, false, socks.serverPort(), echo.serverPort(), out, err);
+#ifdef Q_OS_LINUX
+    passed &= RunTunnels(QStringLiteral("SO_REUSEPORT shards"), true, false, socks.serverPort(), echo.serverPort(), out, err);
+#endif
+
+#ifdef QVPLUGIN_HAS_IO_URING
+    const auto ioUringAvailable = IoUringRing::ForCurrentThread() != nullptr;
+#else
+    const auto ioUringAvailable = false;
+#endif
+    if (ioUringAvailable)
+        passed &= RunTunnels(QStringLiteral("io_uring relay"), false, true, socks.serverPort(), echo.serverPort(), out, err);
+    else
+        out << "io_uring relay: skipped, io_uring is unavailable\n";
+
+    return passed ? 0 : 1;
+}
+
+#include "HttpProxyTunnelTest.moc"
@@ -0,0 +1,78 @@
+/*
+ * Checks of the decisions RoutingMatcher takes for a HttpProxy, on small hand-written RoutingObjects.
+ *
+ * A rule carrying options or extraSettings may hold conditions only the core knows about. A hit on it must be
+ * reported as uncertain and send the request to the upstream, while a miss must not hide the rules after it.
+ */
+
+#include "QvPlugin/Socksify/RoutingMatcher.hpp"
+
+#include <QCoreApplication>
+#include <QTextStream>
+
+using namespace Qv2rayPlugin;
+using namespace Qv2rayPlugin::Utils;
+
+static RuleObject DomainRule(const QString &domain, const QString &outboundTag)
+{
+    RuleObject rule;
+    rule.targetDomains = QStringList{ QStringLiteral("domain:") + domain };
+    rule.outboundTag = outboundTag;
+    return rule;
+}
+
+static RoutingObject Routing(const QList<RuleObject> &rules)
+{
+    RoutingObject routing;
+    routing.rules = rules;
+    return routing;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream err(stderr);
+    const auto direct = QStringLiteral("direct");
+    const auto proxy = QStringLiteral("proxy");
+    auto failures = 0;
+
+    const auto check = [&](const char *name, const RoutingObject &routing, const QString &host, RoutingMatcher::Decision expected, int expectedRule,
+                           bool expectedCertain) {
+        const auto decision = RoutingMatcher(routing, direct).match(host, 443);
+        RuleMatcher::Query query;
+        query.domain = host;
+        query.targetPort = 443;
+        const auto result = RuleMatcher(routing).match(query);
+        if (decision == expected && result.rule == expectedRule && result.certain == expectedCertain)
+            return;
+        err << name << ": got " << (decision == RoutingMatcher::Direct ? "direct" : "proxy") << ", rule " << result.rule << ", certain " << result.certain
+            << "\n";
+        failures++;
+    };
+
+    const auto plain = DomainRule(QStringLiteral("example.com"), direct);
+    check("plain rule", Routing({ plain }), QStringLiteral("www.example.com"), RoutingMatcher::Direct, 0, true);
+
+    auto withExtraSettings = plain;
+    withExtraSettings.extraSettings.insert(QStringLiteral("attrs"), QStringLiteral("attrs[':method'] == 'GET'"));
+    check("extraSettings", Routing({ withExtraSettings }), QStringLiteral("www.example.com"), RoutingMatcher::Proxy, 0, false);
+
+    auto withOptions = plain;
+    withOptions.options.insert(QStringLiteral("balancerTag"), QStringLiteral("b"));
+    check("options", Routing({ withOptions }), QStringLiteral("www.example.com"), RoutingMatcher::Proxy, 0, false);
+
+    // The first rule may take the request, the direct rule after it must not decide.
+    auto opaqueProxy = DomainRule(QStringLiteral("example.com"), proxy);
+    opaqueProxy.extraSettings.insert(QStringLiteral("attrs"), QStringLiteral("attrs[':path'].startswith('/api')"));
+    check("opaque rule first", Routing({ opaqueProxy, plain }), QStringLiteral("www.example.com"), RoutingMatcher::Proxy, 0, false);
+
+    // An opaque rule that is not hit leaves the request to the rules after it.
+    check("opaque rule missed", Routing({ opaqueProxy, plain }), QStringLiteral("www.example.org"), RoutingMatcher::Proxy, -1, true);
+    auto opaqueOther = DomainRule(QStringLiteral("example.org"), proxy);
+    opaqueOther.extraSettings = opaqueProxy.extraSettings;
+    check("opaque rule elsewhere", Routing({ opaqueOther, plain }), QStringLiteral("www.example.com"), RoutingMatcher::Direct, 1, true);
+
+    if (failures == 0)
+        QTextStream(stdout) << "passed\n";
+    return failures == 0 ? 0 : 1;
+}
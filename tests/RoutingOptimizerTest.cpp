@@ -0,0 +1,211 @@
+/*
+ * Checks that RoutingOptimizer keeps first-match semantics: random RoutingObjects are compiled into RuleMatchers
+ * before and after optimization, and every query of a random set must reach the same outbound in both.
+ *
+ * Rules are drawn from small pools of overlapping domains, subnets, port ranges, networks and tags, and often
+ * repeat an earlier rule with one condition changed, so that pruning, CIDR aggregation and adjacent merges all
+ * happen. Some rules carry extraSettings or options, or are disabled. The run fails if one of the three
+ * rewrites never took place, since the comparison would then prove nothing about it.
+ */
+
+#include "QvPlugin/Utils/RoutingOptimizer.hpp"
+#include "QvPlugin/Utils/RuleMatcher.hpp"
+
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QRandomGenerator>
+#include <QTextStream>
+
+using namespace Qv2rayPlugin;
+using namespace Qv2rayPlugin::Utils;
+
+constexpr int Trials = 2000;
+constexpr int QueriesPerTrial = 200;
+
+static const QStringList DomainEntries{
+    QStringLiteral("domain:example.com"), QStringLiteral("domain:a.example.com"), QStringLiteral("full:www.example.com"), QStringLiteral("keyword:exam"),
+    QStringLiteral("example"),            QStringLiteral("domain:test.org"),      QStringLiteral("full:test.org"),        QStringLiteral("keyword:test"),
+    QStringLiteral("regexp:^api\\."),
+};
+static const QStringList QueryDomains{
+    QStringLiteral("example.com"), QStringLiteral("www.example.com"), QStringLiteral("a.example.com"), QStringLiteral("b.a.example.com"), QStringLiteral("test.org"),
+    QStringLiteral("www.test.org"), QStringLiteral("api.test.org"),   QStringLiteral("other.net"),     QStringLiteral("exam.net"),
+};
+
+// Adjacent subnets, so that aggregation has something to join, and addresses and subnets inside others.
+static const QStringList AddressEntries{
+    QStringLiteral("10.0.0.0/25"), QStringLiteral("10.0.0.128/25"),  QStringLiteral("10.0.1.0/24"),    QStringLiteral("10.0.0.5"),
+    QStringLiteral("::1"),         QStringLiteral("192.168.0.0/16"), QStringLiteral("192.168.1.0/24"), QStringLiteral("fd00::/9"),
+    QStringLiteral("fd80::/9"),
+};
+static const QStringList QueryAddresses{
+    QStringLiteral("10.0.0.5"), QStringLiteral("10.0.0.200"), QStringLiteral("10.0.1.7"), QStringLiteral("10.0.2.1"), QStringLiteral("192.168.1.1"),
+    QStringLiteral("192.168.2.1"), QStringLiteral("::1"),     QStringLiteral("fd00::1"),  QStringLiteral("fdff::1"),  QStringLiteral("8.8.8.8"),
+};
+
+static const QStringList SourceEntries{ QStringLiteral("127.0.0.1"), QStringLiteral("10.0.0.0/8"), QStringLiteral("10.1.0.0/16") };
+static const QStringList QuerySources{ QStringLiteral("127.0.0.1"), QStringLiteral("10.1.2.3"), QStringLiteral("10.2.0.1"), QStringLiteral("172.16.0.1") };
+
+static const QList<QPair<int, int>> PortEntries{ { 80, 80 }, { 443, 443 }, { 1, 1024 }, { 1000, 2000 }, { 2001, 3000 }, { 8080, 8090 } };
+static const QList<quint16> QueryPorts{ 22, 80, 443, 1500, 2500, 8085, 9000 };
+
+static const QStringList NetworkEntries{ QStringLiteral("tcp"), QStringLiteral("udp"), QStringLiteral("tcp,udp") };
+static const QStringList TagEntries{ QStringLiteral("in-a"), QStringLiteral("in-b") };
+static const QStringList QueryTags{ QStringLiteral("in-a"), QStringLiteral("in-b"), QStringLiteral("in-c") };
+static const QStringList Outbounds{ QStringLiteral("direct"), QStringLiteral("proxy"), QStringLiteral("block") };
+
+// One to three entries of pool, repeats included, they must be deduplicated.
+static QStringList Pick(QRandomGenerator &random, const QStringList &pool)
+{
+    QStringList entries;
+    for (auto n = 1 + random.bounded(3); n > 0; n--)
+        entries.append(pool[random.bounded(pool.size())]);
+    return entries;
+}
+
+static PortRange PickPort(QRandomGenerator &random)
+{
+    const auto &[from, to] = PortEntries[random.bounded(PortEntries.size())];
+    PortRange range;
+    range.from = from, range.to = to;
+    return range;
+}
+
+// Changes or sets one condition of rule.
+static void Vary(QRandomGenerator &random, RuleObject &rule)
+{
+    switch (random.bounded(7))
+    {
+        case 0: rule.targetDomains = Pick(random, DomainEntries); break;
+        case 1: rule.targetIPs = Pick(random, AddressEntries); break;
+        case 2: rule.targetPort = PickPort(random); break;
+        case 3: rule.networks = Pick(random, NetworkEntries); break;
+        case 4: rule.inboundTags = Pick(random, TagEntries); break;
+        case 5: rule.sourceAddresses = Pick(random, SourceEntries); break;
+        case 6: rule.sourcePort = PickPort(random); break;
+    }
+}
+
+static RoutingObject MakeRouting(QRandomGenerator &random)
+{
+    RoutingObject routing;
+    for (auto n = 2 + random.bounded(9); n > 0; n--)
+    {
+        RuleObject rule;
+        const auto roll = random.bounded(10);
+        if (!routing.rules.isEmpty() && roll < 3)
+        {
+            // The previous rule with another value of one condition: a candidate for a merge.
+            rule = routing.rules.last();
+            Vary(random, rule);
+        }
+        else if (!routing.rules.isEmpty() && roll < 5)
+        {
+            // An earlier rule with one condition set or changed, possibly to another outbound: a candidate for pruning.
+            rule = routing.rules[random.bounded(routing.rules.size())];
+            Vary(random, rule);
+            rule.outboundTag = Outbounds[random.bounded(Outbounds.size())];
+        }
+        else
+        {
+            for (auto conditions = 1 + random.bounded(3); conditions > 0; conditions--)
+                Vary(random, rule);
+            rule.outboundTag = Outbounds[random.bounded(Outbounds.size())];
+        }
+
+        const auto extra = random.bounded(20);
+        if (extra == 0)
+            rule.extraSettings.insert(QStringLiteral("attrs"), QStringLiteral("attrs[':method'] == 'GET'"));
+        else if (extra == 1)
+            rule.options.insert(QStringLiteral("balancerTag"), QStringLiteral("b"));
+        else if (extra == 2)
+            rule.enabled = false;
+        routing.rules.append(rule);
+    }
+    return routing;
+}
+
+static RuleMatcher::Query MakeQuery(QRandomGenerator &random)
+{
+    RuleMatcher::Query query;
+    // A name only, an address only, or both as after sniffing.
+    const auto kind = random.bounded(5);
+    if (kind < 4)
+        query.domain = QueryDomains[random.bounded(QueryDomains.size())];
+    if (kind >= 2)
+        query.targetAddress = QHostAddress(QueryAddresses[random.bounded(QueryAddresses.size())]);
+    query.targetPort = QueryPorts[random.bounded(QueryPorts.size())];
+    query.sourceAddress = QHostAddress(QuerySources[random.bounded(QuerySources.size())]);
+    query.sourcePort = QueryPorts[random.bounded(QueryPorts.size())];
+    query.network = random.bounded(2) ? QStringLiteral("tcp") : QStringLiteral("udp");
+    query.inboundTag = QueryTags[random.bounded(QueryTags.size())];
+    return query;
+}
+
+static QString Describe(const RuleMatcher::Query &query)
+{
+    return QStringLiteral("%1 [%2]:%3 from [%4]:%5 %6 on %7")
+        .arg(query.domain, query.targetAddress.toString())
+        .arg(query.targetPort)
+        .arg(query.sourceAddress.toString())
+        .arg(query.sourcePort)
+        .arg(query.network, query.inboundTag);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout), err(stderr);
+
+    // The aggregation the optimizer must do, checked directly once.
+    {
+        RoutingObject routing;
+        RuleObject rule;
+        rule.targetIPs = QStringList{ QStringLiteral("10.0.0.128/25"), QStringLiteral("10.0.0.0/25"), QStringLiteral("10.0.0.7") };
+        rule.outboundTag = QStringLiteral("direct");
+        routing.rules.append(rule);
+        RoutingOptimizer::Optimize(routing);
+        if (routing.rules.size() != 1 || routing.rules[0].targetIPs != QStringList{ QStringLiteral("10.0.0.0/24") })
+        {
+            err << "10.0.0.0/25, 10.0.0.128/25 and 10.0.0.7 were not aggregated into 10.0.0.0/24\n";
+            return 1;
+        }
+    }
+
+    QRandomGenerator random(20);
+    int dominated = 0, merged = 0, aggregated = 0;
+    for (auto trial = 0; trial < Trials; trial++)
+    {
+        const auto original = MakeRouting(random);
+        auto optimized = original;
+        const auto report = RoutingOptimizer::Optimize(optimized);
+        dominated += report.dominatedRules;
+        merged += report.mergedRules;
+        for (const auto &rule : std::as_const(optimized.rules))
+            for (const auto &entry : rule.targetIPs)
+                // Only a join of adjacent subnets yields one that is not in the pool.
+                aggregated += !AddressEntries.contains(entry);
+
+        const RuleMatcher before(original), after(optimized);
+        for (auto q = 0; q < QueriesPerTrial; q++)
+        {
+            const auto query = MakeQuery(random);
+            const auto expected = before.match(query), actual = after.match(query);
+            if (expected.outboundTag == actual.outboundTag && expected.certain == actual.certain)
+                continue;
+            err << "Trial " << trial << ": " << Describe(query) << " goes to '" << expected.outboundTag << "' (certain " << expected.certain << "), after optimization to '"
+                << actual.outboundTag << "' (certain " << actual.certain << ")\n";
+            err << "Original: " << QJsonDocument(original.toJson()).toJson() << "\nOptimized: " << QJsonDocument(optimized.toJson()).toJson() << "\n";
+            return 1;
+        }
+    }
+
+    out << Trials << " routing objects, " << Trials * QueriesPerTrial << " queries, " << dominated << " rules pruned, " << merged << " merged, " << aggregated
+        << " aggregated subnets\n";
+    if (dominated == 0 || merged == 0 || aggregated == 0)
+    {
+        err << "Pruning, merging or aggregation never happened\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * A loopback check of SocketStream flow control, everything runs in this process.
+ *
+ *   writer --TCP--> SocketStream(a, b) --TCP--> reader
+ *
+ * The writer pushes as fast as the kernel takes it, the reader drains a little every few milliseconds. While the
+ * stream relays, the bytes it holds for A to B must stay below highWatermark plus one read chunk, reading from A
+ * must be paused and resumed, and the reader must get every byte in order.
+ */
+
+#include "QvPlugin/Socksify/SocketStream.hpp"
+
+#include <QCoreApplication>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QTimer>
+
+using namespace Qv2rayPlugin::Utils;
+
+constexpr qint64 HighWatermark = 256 * 1024;
+constexpr qint64 Total = 32 * 1024 * 1024;
+constexpr qint64 WriterBacklog = 1024 * 1024;
+constexpr qint64 ReadPerTick = 64 * 1024;
+constexpr qint64 SocketBufferSize = 64 * 1024;
+
+// Byte i of the stream, so that lost or reordered data is noticed.
+static char PatternAt(qint64 i)
+{
+    return char(i % 251);
+}
+
+// Connects a client socket to a one-shot loopback server, returns the accepted end.
+static QTcpSocket *ConnectPair(QTcpSocket &client, QObject *parent)
+{
+    QTcpServer server;
+    if (!server.listen(QHostAddress::LocalHost))
+        return nullptr;
+    client.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    if (!client.waitForConnected(5000) || !server.waitForNewConnection(5000))
+        return nullptr;
+    const auto accepted = server.nextPendingConnection();
+    accepted->setParent(parent);
+    return accepted;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream err(stderr);
+
+    QTcpSocket writer, b;
+    const auto a = ConnectPair(writer, &app);
+    const auto reader = a ? ConnectPair(b, &app) : nullptr;
+    if (!reader)
+    {
+        err << "Cannot connect on loopback\n";
+        return 1;
+    }
+
+    // Small kernel buffers on the slow side, so that it pushes back on the stream within a few hundred KiB.
+    b.setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, SocketBufferSize);
+    reader->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, SocketBufferSize);
+    reader->setReadBufferSize(ReadPerTick);
+
+    SocketStream stream(a, &b);
+    stream.setFlowControl(HighWatermark);
+    const auto bound = HighWatermark + BufferPool::ChunkSize;
+
+    qint64 written = 0;
+    const auto fill = [&]() {
+        while (written < Total && writer.bytesToWrite() < WriterBacklog)
+        {
+            QByteArray data(qMin<qint64>(BufferPool::ChunkSize, Total - written), Qt::Uninitialized);
+            for (qsizetype i = 0; i < data.size(); i++)
+                data[i] = PatternAt(written + i);
+            written += writer.write(data);
+        }
+    };
+    QObject::connect(&writer, &QTcpSocket::bytesWritten, fill);
+    fill();
+
+    auto failed = false;
+    qint64 received = 0, peakSeen = 0;
+    const auto check = [&]() {
+        const auto stats = stream.bufferStatistics();
+        peakSeen = qMax(peakSeen, stats.pendingAtoB);
+        if (stats.pendingAtoB > bound || stats.peakPendingAtoB > bound)
+        {
+            err << "A to B holds " << qMax(stats.pendingAtoB, stats.peakPendingAtoB) << " bytes, more than " << bound << "\n";
+            failed = true;
+            app.exit(1);
+        }
+    };
+
+    QTimer sampler;
+    QObject::connect(&sampler, &QTimer::timeout, check);
+    sampler.start(1);
+
+    QTimer drain;
+    QObject::connect(&drain, &QTimer::timeout, [&]() {
+        const auto data = reader->read(ReadPerTick);
+        for (qsizetype i = 0; i < data.size(); i++)
+        {
+            if (data[i] != PatternAt(received + i))
+            {
+                err << "Byte " << received + i << " differs\n";
+                failed = true;
+                return app.exit(1);
+            }
+        }
+        received += data.size();
+        if (received == Total)
+            app.exit(0);
+    });
+    drain.start(2);
+
+    QTimer::singleShot(60000, &app, [&]() {
+        err << "Timed out after " << received << " of " << Total << " bytes\n";
+        failed = true;
+        app.exit(1);
+    });
+
+    if (app.exec() != 0 || failed)
+        return 1;
+    check();
+    if (failed)
+        return 1;
+
+    const auto stats = stream.bufferStatistics();
+    QTextStream out(stdout);
+    out << "relayed:        " << received << " bytes\n";
+    out << "peak A to B:    " << stats.peakPendingAtoB << " bytes (bound " << bound << ", sampled " << peakSeen << ")\n";
+    out << "paused:         " << stats.pausedAtoB << "\n";
+    out << "resumed:        " << stats.resumedAtoB << "\n";
+    if (stats.pausedAtoB == 0 || stats.resumedAtoB == 0)
+    {
+        err << "Reading from A was never paused and resumed\n";
+        return 1;
+    }
+    return 0;
+}
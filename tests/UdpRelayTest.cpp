@@ -0,0 +1,237 @@
+/*
+ * A loopback round trip through UdpRelay, everything runs in this process.
+ *
+ *   client --UDP--> UdpRelay --UDP--> Socks5UdpStandIn --UDP--> echo servers A and B
+ *
+ * One relay takes SOCKS5 UDP headers from the client, which alternates between both echo servers in the same
+ * association, the other forwards plain datagrams to A only. Each sends one datagram, waits for its reply while
+ * the association is set up, then a burst, so that the batched paths are taken. Every reply must come back, from
+ * the server it was sent to.
+ */
+
+#include "QvPlugin/Socksify/UdpRelay.hpp"
+
+#include <QCoreApplication>
+#include <QTcpServer>
+#include <QTextStream>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QtEndian>
+#include <functional>
+#include <memory>
+
+using namespace Qv2rayPlugin::Utils;
+
+constexpr int Burst = 100;
+
+// RSV RSV FRAG ATYP DST.ADDR DST.PORT for an IPv4 address.
+static QByteArray UdpHeader(const QHostAddress &address, quint16 port)
+{
+    return QByteArray(3, '\0') + Socks5Client::EncodeAddress(address.toString(), port);
+}
+
+// Answers every datagram with its name in front of it.
+class EchoServer : public QUdpSocket
+{
+    Q_OBJECT
+  public:
+    explicit EchoServer(const QByteArray &name) : name(name)
+    {
+        bind(QHostAddress::LocalHost, 0);
+        connect(this, &QUdpSocket::readyRead, this, [this]() {
+            while (hasPendingDatagrams())
+            {
+                const auto datagram = receiveDatagram();
+                writeDatagram(this->name + datagram.data(), datagram.senderAddress(), datagram.senderPort());
+            }
+        });
+    }
+
+  private:
+    const QByteArray name;
+};
+
+// The smallest SOCKS5 server UdpRelay can talk to: no authentication, UDP ASSOCIATE only, IPv4 destinations only.
+class Socks5UdpStandIn : public QTcpServer
+{
+    Q_OBJECT
+  protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        const auto control = new QTcpSocket(this);
+        control->setSocketDescriptor(socketDescriptor);
+        connect(control, &QTcpSocket::disconnected, control, &QTcpSocket::deleteLater);
+        connect(control, &QTcpSocket::readyRead, control, [control]() {
+            // Greeting: 05 01 00, then the request: 05 03 00 01 0.0.0.0:0
+            if (control->bytesAvailable() < 3 + 10)
+                return;
+            const auto request = control->readAll();
+            if (!request.startsWith(QByteArray("\x05\x01\x00\x05\x03", 5)))
+                return control->abort();
+
+            // The relay endpoint faces the client, the outside socket the targets.
+            const auto relay = new QUdpSocket(control);
+            const auto outside = new QUdpSocket(control);
+            relay->bind(QHostAddress::LocalHost, 0);
+            outside->bind(QHostAddress::LocalHost, 0);
+            const auto client = std::make_shared<QPair<QHostAddress, quint16>>();
+
+            connect(relay, &QUdpSocket::readyRead, relay, [relay, outside, client]() {
+                while (relay->hasPendingDatagrams())
+                {
+                    const auto datagram = relay->receiveDatagram();
+                    *client = { datagram.senderAddress(), quint16(datagram.senderPort()) };
+                    const auto data = datagram.data();
+                    if (data.size() < 10 || data[2] != '\0' || data[3] != '\x01')
+                        continue;
+                    const QHostAddress target(qFromBigEndian<quint32>(data.constData() + 4));
+                    outside->writeDatagram(data.mid(10), target, qFromBigEndian<quint16>(data.constData() + 8));
+                }
+            });
+            connect(outside, &QUdpSocket::readyRead, outside, [relay, outside, client]() {
+                while (outside->hasPendingDatagrams())
+                {
+                    const auto datagram = outside->receiveDatagram();
+                    relay->writeDatagram(UdpHeader(datagram.senderAddress(), datagram.senderPort()) + datagram.data(), client->first, client->second);
+                }
+            });
+
+            QByteArray reply("\x05\x00\x05\x00\x00\x01\x7f\x00\x00\x01", 10);
+            const auto port = qToBigEndian(relay->localPort());
+            reply.append(reinterpret_cast<const char *>(&port), sizeof(port));
+            control->write(reply);
+        });
+    }
+};
+
+// Sends one datagram and waits for its reply, then Burst more, and counts the replies that match.
+class RoundTrip : public QObject
+{
+    Q_OBJECT
+  public:
+    // Builds the datagram with sequence number i, and the reply expected for it.
+    using Exchange = std::function<QPair<QByteArray, QByteArray>(int i)>;
+
+    RoundTrip(const QString &name, quint16 relayPort, Exchange exchange) : name(name), relayPort(relayPort), exchange(exchange)
+    {
+        socket.bind(QHostAddress::LocalHost, 0);
+        connect(&socket, &QUdpSocket::readyRead, this, &RoundTrip::onReadyRead);
+        send(0);
+    }
+
+    bool isDone() const
+    {
+        return received == Burst + 1;
+    }
+
+    bool isClean() const
+    {
+        return isDone() && wrong == 0;
+    }
+
+    QString report() const
+    {
+        return QStringLiteral("%1: %2 of %3 replies, %4 wrong").arg(name).arg(received).arg(Burst + 1).arg(wrong);
+    }
+
+  signals:
+    void done();
+
+  private:
+    void send(int i)
+    {
+        socket.writeDatagram(exchange(i).first, QHostAddress::LocalHost, relayPort);
+    }
+
+    void onReadyRead()
+    {
+        while (socket.hasPendingDatagrams())
+        {
+            const auto data = socket.receiveDatagram().data();
+            // Replies may be reordered, any expected one counts once.
+            auto matched = false;
+            for (auto i = 0; i <= Burst && !matched; i++)
+            {
+                if (!seen.contains(i) && exchange(i).second == data)
+                    matched = true, seen.insert(i);
+            }
+            if (!matched)
+            {
+                wrong++;
+                continue;
+            }
+            if (++received == 1)
+            {
+                for (auto i = 1; i <= Burst; i++)
+                    send(i);
+            }
+            if (isDone())
+                emit done();
+        }
+    }
+
+  private:
+    const QString name;
+    const quint16 relayPort;
+    const Exchange exchange;
+    QUdpSocket socket;
+    QSet<int> seen;
+    int received = 0;
+    int wrong = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream err(stderr);
+
+    EchoServer echoA("A:"), echoB("B:");
+    Socks5UdpStandIn socks;
+    if (!socks.listen(QHostAddress::LocalHost))
+    {
+        err << "Cannot listen on loopback\n";
+        return 1;
+    }
+    const QNetworkProxy proxy(QNetworkProxy::Socks5Proxy, QStringLiteral("127.0.0.1"), socks.serverPort());
+    const QHostAddress loopback(QHostAddress::LocalHost);
+
+    UdpRelay headerRelay, fixedRelay;
+    if (!headerRelay.listen(loopback, 0, proxy) || !fixedRelay.listen(loopback, 0, proxy, loopback.toString(), echoA.localPort()))
+    {
+        err << "Cannot bind the relays\n";
+        return 1;
+    }
+
+    // Even datagrams go to A, odd ones to B, and their replies name the server they come from.
+    RoundTrip perDatagram(QStringLiteral("per-datagram destinations"), headerRelay.localPort(), [&](int i) {
+        const auto &echo = i % 2 ? echoB : echoA;
+        const auto payload = "ping " + QByteArray::number(i);
+        const auto header = UdpHeader(loopback, echo.localPort());
+        return qMakePair(header + payload, header + (i % 2 ? "B:" : "A:") + payload);
+    });
+    RoundTrip fixedTarget(QStringLiteral("fixed target"), fixedRelay.localPort(), [](int i) {
+        const auto payload = "ping " + QByteArray::number(i);
+        return qMakePair(payload, "A:" + payload);
+    });
+
+    const auto finishIfDone = [&]() {
+        if (perDatagram.isDone() && fixedTarget.isDone())
+            app.exit(0);
+    };
+    QObject::connect(&perDatagram, &RoundTrip::done, finishIfDone);
+    QObject::connect(&fixedTarget, &RoundTrip::done, finishIfDone);
+    QTimer::singleShot(10000, &app, [&]() { app.exit(1); });
+
+    const auto result = app.exec();
+    QTextStream out(stdout);
+    for (const auto relay : { &headerRelay, &fixedRelay })
+    {
+        const auto stats = relay->statistics();
+        out << "relay:          " << stats.datagramsUp << " up, " << stats.datagramsDown << " down, " << stats.dropped << " dropped, "
+            << double(stats.datagramsUp + stats.datagramsDown) / qMax<quint64>(1, stats.receiveCalls) << " per receive call\n";
+    }
+    out << perDatagram.report() << "\n" << fixedTarget.report() << "\n";
+    return result == 0 && perDatagram.isClean() && fixedTarget.isClean() ? 0 : 1;
+}
+
+#include "UdpRelayTest.moc"